@@ -58,4 +58,23 @@ exportProcs:
 writeFiles("bindings/generated", "obiwan")
 include generated/internal
 
+# Views and caller-owned buffers behind obiwan_ext.hpp, written by hand so
+# they stay when the files above are regenerated
+proc obiwan_response_meta_view*(response: Response,
+    length: ptr csize_t): cstring {.raises: [], cdecl, exportc, dynlib.} =
+  if not length.isNil:
+    length[] = response.meta.len.csize_t
+  response.meta.cstring
+
+proc obiwan_response_read_body*(response: Response, buffer: pointer,
+    capacity: csize_t): int64 {.raises: [], cdecl, exportc, dynlib.} =
+  try:
+    readBody(response, buffer, capacity.int).int64
+  except ObiwanError as e:
+    lastError = e
+    -1
+  except:
+    lastError = newException(ObiwanError, getCurrentExceptionMsg())
+    -1
+
 {.pop.}
@@ -53,9 +53,13 @@ int main(void) {
     // Only try to read the body if the status is 20 (Success)
     if (status == OBIWAN_SUCCESS) {
         printf("\nFetching body content...\n");
-        const char* body = getResponseBody(response);
+        // Borrowed from the response until destroyResponse(), no copy
+        size_t length = 0;
+        const char* body = getResponseBodyView(response, &length);
         if (body != NULL) {
-            printf("\n--- CONTENT ---\n%s\n--- END OF CONTENT ---\n", body);
+            printf("\n--- CONTENT ---\n");
+            fwrite(body, 1, length, stdout);
+            printf("\n--- END OF CONTENT ---\n");
         } else {
             printf("\nNo body content available\n");
             if (hasError()) {
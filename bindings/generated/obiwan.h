@@ -5,6 +5,7 @@
 #define OBIWAN_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -33,6 +34,23 @@ extern "C" {
 typedef void* ObiwanClientHandle;
 typedef void* ObiwanServerHandle;
 typedef void* ObiwanResponseHandle;
+typedef void* ObiwanAsyncClientHandle;
+typedef void* ObiwanRequestHandle;
+
+/*
+ * Called when a request made with requestUrlAsync() completes.
+ * response is NULL if the request failed, see getLastError(). Otherwise it
+ * arrives with its body read and is destroyed with destroyResponse().
+ */
+typedef void (*ObiwanResponseCallback)(ObiwanResponseHandle response, void* userData);
+
+/*
+ * Called for each request served by serveServer(), on one of its worker
+ * threads. The request handle is valid until the handler returns. A
+ * response the handler left open is ended for it, and requests it sent no
+ * header for are answered with 50.
+ */
+typedef void (*ObiwanRequestHandler)(ObiwanRequestHandle request, void* userData);
 
 /*
  * Status Codes
@@ -106,7 +124,7 @@ OBIWAN_FUNC(bool, hasError, (void));
 /**
  * Get the error message from the last operation that failed.
  * This clears the error state.
- * @return Error message or NULL if no error
+ * @return Error message or NULL if no error. Valid until the next call.
  */
 OBIWAN_FUNC(const char*, getLastError, (void));
 
@@ -163,18 +181,83 @@ OBIWAN_FUNC(int, getResponseStatus, (ObiwanResponseHandle response));
  * Get the meta information from a response.
  * 
  * @param response Response handle
- * @return Meta string or NULL on error
+ * @return Meta string, owned by the response and valid until
+ *         destroyResponse(), or NULL on error
  */
 OBIWAN_FUNC(const char*, getResponseMeta, (ObiwanResponseHandle response));
 
 /**
  * Get the body content from a response.
  * 
+ * Reads the whole body on the first call. See getResponseBodyView() for
+ * bodies that may contain NUL bytes.
+ * 
  * @param response Response handle
- * @return Body content or NULL if not available or on error
+ * @return Body content, owned by the response and valid until
+ *         destroyResponse(), or NULL if not available or on error
  */
 OBIWAN_FUNC(const char*, getResponseBody, (ObiwanResponseHandle response));
 
+/**
+ * Get the meta information from a response without copying it.
+ * 
+ * @param response Response handle
+ * @param length Receives the length of the meta in bytes (may be NULL)
+ * @return Meta string, owned by the response and valid until
+ *         destroyResponse(), or NULL on error
+ */
+OBIWAN_FUNC(const char*, getResponseMetaView, (ObiwanResponseHandle response, size_t* length));
+
+/**
+ * Copy the meta information of a response into a caller-owned buffer.
+ * 
+ * At most capacity - 1 bytes are copied and the result is always
+ * NUL-terminated. A return value of capacity or more means the meta was
+ * truncated.
+ * 
+ * @param response Response handle
+ * @param buffer Buffer to copy into
+ * @param capacity Size of the buffer in bytes
+ * @return Length of the whole meta in bytes, or -1 on error
+ */
+OBIWAN_FUNC(long long, copyResponseMeta, (ObiwanResponseHandle response, char* buffer, size_t capacity));
+
+/**
+ * Get the body content from a response without copying it.
+ * 
+ * Reads the whole body on the first call, like getResponseBody(). The body
+ * may contain NUL bytes, its length is returned separately.
+ * 
+ * @param response Response handle
+ * @param length Receives the length of the body in bytes (may be NULL)
+ * @return Body content, owned by the response and valid until
+ *         destroyResponse(), or NULL if not available or on error
+ */
+OBIWAN_FUNC(const char*, getResponseBodyView, (ObiwanResponseHandle response, size_t* length));
+
+/**
+ * Read the next part of the body of a response into a caller-owned buffer.
+ * 
+ * Unlike getResponseBody(), nothing is held in memory past the call. Call it
+ * until it returns 0 to stream a large body. Bodies already read, by
+ * getResponseBody() or for requestUrlAsync(), are handed out from memory.
+ * 
+ * @param response Response handle
+ * @param buffer Buffer to receive into
+ * @param capacity Size of the buffer in bytes
+ * @return Number of bytes read, 0 at the end of the body, or -1 on error
+ */
+OBIWAN_FUNC(int, readResponseBody, (ObiwanResponseHandle response, char* buffer, int capacity));
+
+/**
+ * Write the body of a response straight to a file.
+ * 
+ * @param response Response handle
+ * @param path File to create or replace
+ * @return Number of bytes written, or -1 on error
+ */
+OBIWAN_FUNC(long long, downloadResponseBody, (ObiwanResponseHandle response, const char* path));
+
 /**
  * Check if the server provided a certificate.
  * 
@@ -199,6 +282,67 @@ OBIWAN_FUNC(bool, responseIsVerified, (ObiwanResponseHandle response));
  */
 OBIWAN_FUNC(bool, responseIsSelfSigned, (ObiwanResponseHandle response));
 
+/*
+ * Async Client API
+ *
+ * Requests run on the calling thread's event loop, which the caller drives
+ * from its own (epoll, libuv, ...): wait for getPollFd() to become readable,
+ * or for the timeout pollObiwan() returned, then call pollObiwan(0). Use a
+ * thread's async clients and responses only from that thread.
+ */
+
+/**
+ * Create a new non-blocking Gemini client.
+ * 
+ * One client runs any number of requests at once, sharing its TLS settings
+ * and session cache.
+ * 
+ * @param maxRedirects Maximum number of redirects to follow (recommended: 5)
+ * @param certFile Path to client certificate file (may be empty)
+ * @param keyFile Path to client key file (may be empty)
+ * @return Client handle or NULL on error
+ */
+OBIWAN_FUNC(ObiwanAsyncClientHandle, createAsyncClient, (int maxRedirects, const char* certFile, const char* keyFile));
+
+/**
+ * Destroy an async client. Requests in flight still complete.
+ * 
+ * @param client Client handle to destroy
+ */
+OBIWAN_FUNC(void, destroyAsyncClient, (ObiwanAsyncClientHandle client));
+
+/**
+ * Start a request to a Gemini server without waiting for it.
+ * 
+ * Returns at once, the request runs in later pollObiwan() calls, which also
+ * call the callback. It is never called from within requestUrlAsync().
+ * 
+ * @param client Client handle
+ * @param url Gemini URL to request (must start with gemini://)
+ * @param callback Function to call with the response
+ * @param userData Passed to the callback as it is
+ * @return true if the request was started, false on error
+ */
+OBIWAN_FUNC(bool, requestUrlAsync, (ObiwanAsyncClientHandle client, const char* url, ObiwanResponseCallback callback, void* userData));
+
+/**
+ * Get the file descriptor that becomes readable when pollObiwan() has work.
+ * 
+ * @return The calling thread's poll fd, or -1 on error
+ */
+OBIWAN_FUNC(int, getPollFd, (void));
+
+/**
+ * Run the I/O, timers and callbacks of the calling thread's event loop
+ * that are ready, waiting up to timeoutMs for some to be.
+ * 
+ * @param timeoutMs Milliseconds to wait, 0 to only run what is ready
+ * @return Milliseconds until pollObiwan() must run again even if the
+ *         poll fd stays quiet, -1 if only once it is readable, or -2 on
+ *         error
+ */
+OBIWAN_FUNC(int, pollObiwan, (int timeoutMs));
+
 /*
  * Server API
  */
@@ -222,6 +366,97 @@ OBIWAN_FUNC(ObiwanServerHandle, createServer, (bool reuseAddr, bool reusePort, c
  */
 OBIWAN_FUNC(void, destroyServer, (ObiwanServerHandle server));
 
+/**
+ * Serve requests with a native handler. Blocks until the process exits,
+ * unless the server cannot bind.
+ * 
+ * Connections are accepted on the calling thread and handed to a pool of
+ * threads, which do the TLS handshake and run the handler, so slow handlers
+ * hold up only their own worker. Connections waiting for a free worker are
+ * queued, up to 64, later ones are answered with 41.
+ * 
+ * @param server Server handle
+ * @param port Port to listen on (standard Gemini port is 1965)
+ * @param address Address to bind to, NULL or "" for all IPv4 addresses, "::" for IPv6
+ * @param threads Worker threads, 0 to handle connections one at a time on the calling thread
+ * @param handler Function to call for each request
+ * @param userData Passed to the handler as it is, from all workers at once
+ * @return false if the server could not be started, see getLastError()
+ */
+OBIWAN_FUNC(bool, serveServer, (ObiwanServerHandle server, int port, const char* address, int threads, ObiwanRequestHandler handler, void* userData));
+
+/*
+ * Request API
+ *
+ * For use within an ObiwanRequestHandler, on the request passed to it.
+ * Errors are reported per thread, call getLastError() from the handler.
+ */
+
+/**
+ * Get the URL a client requested.
+ * 
+ * @param request Request handle
+ * @return URL, valid until the handler returns, or NULL on error
+ */
+OBIWAN_FUNC(const char*, getRequestUrl, (ObiwanRequestHandle request));
+
+/**
+ * Get the SHA-256 fingerprint of the client's certificate.
+ * 
+ * @param request Request handle
+ * @return Colon-separated hexadecimal fingerprint, valid until the handler
+ *         returns, or NULL if the client sent no certificate or on error
+ */
+OBIWAN_FUNC(const char*, getRequestFingerprint, (ObiwanRequestHandle request));
+
+/**
+ * Check if the client provided a certificate.
+ * 
+ * @param request Request handle
+ * @return true if certificate is present, false otherwise
+ */
+OBIWAN_FUNC(bool, requestHasCertificate, (ObiwanRequestHandle request));
+
+/**
+ * Check if the client certificate is verified against a trusted root.
+ * 
+ * @param request Request handle
+ * @return true if certificate is verified, false otherwise
+ */
+OBIWAN_FUNC(bool, requestIsVerified, (ObiwanRequestHandle request));
+
+/**
+ * Set the response header, `<status> <meta>`. It is sent along with the
+ * first body chunk, or by respondEnd().
+ * 
+ * @param request Request handle
+ * @param status Status code (see ObiwanStatus)
+ * @param meta MIME type, prompt, redirect target or error message (max 1024 bytes)
+ * @return true on success, false if a header was already set or on error
+ */
+OBIWAN_FUNC(bool, respondHeader, (ObiwanRequestHandle request, int status, const char* meta));
+
+/**
+ * Send the next part of the body of a 20 response.
+ * 
+ * Chunks are written to the connection as they come, the response uses no
+ * memory for the body as a whole.
+ * 
+ * @param request Request handle
+ * @param data Bytes to send
+ * @param length Number of bytes at data
+ * @return true on success, false on error (the client may have left)
+ */
+OBIWAN_FUNC(bool, respondChunk, (ObiwanRequestHandle request, const void* data, size_t length));
+
+/**
+ * End the response, sending whatever is still held back.
+ * 
+ * @param request Request handle
+ * @return true on success, false on error
+ */
+OBIWAN_FUNC(bool, respondEnd, (ObiwanRequestHandle request));
+
 #ifdef __cplusplus
 }
 #endif
@@ -4,7 +4,7 @@
 import ctypes
 import os
 import platform
-from ctypes import c_int, c_char_p, c_bool, c_void_p, Structure, POINTER, byref
+from ctypes import c_int, c_longlong, c_char_p, c_bool, c_void_p, Structure, POINTER, byref, create_string_buffer
 
 # Determine library name based on platform
 if platform.system() == "Windows":
@@ -89,6 +89,12 @@ _lib.getResponseMeta.restype = c_char_p
 _lib.getResponseBody.argtypes = [c_void_p]
 _lib.getResponseBody.restype = c_char_p
 
+_lib.readResponseBody.argtypes = [c_void_p, c_char_p, c_int]
+_lib.readResponseBody.restype = c_int
+
+_lib.downloadResponseBody.argtypes = [c_void_p, c_char_p]
+_lib.downloadResponseBody.restype = c_longlong
+
 # Certificate functions
 _lib.responseHasCertificate.argtypes = [c_void_p]
 _lib.responseHasCertificate.restype = c_bool
@@ -161,6 +167,28 @@ class Response:
                 self._body_cached = ""
         return self._body_cached
     
+    def body_chunks(self, chunk_size=16384):
+        """Yield the response body as bytes, chunk by chunk, without keeping it whole"""
+        if not self._handle or self.status != Status.SUCCESS:
+            return
+        buffer = create_string_buffer(chunk_size)
+        while True:
+            count = _lib.readResponseBody(self._handle, buffer, chunk_size)
+            if count < 0:
+                raise RuntimeError(f"Reading body failed: {takeError()}")
+            if count == 0:
+                return
+            yield buffer.raw[:count]
+    
+    def download_to(self, path):
+        """Write the response body straight to a file, returning the bytes written"""
+        if not self._handle or self.status != Status.SUCCESS:
+            return 0
+        count = _lib.downloadResponseBody(self._handle, path.encode('utf-8'))
+        if count < 0:
+            raise RuntimeError(f"Reading body failed: {takeError()}")
+        return count
+    
     def hasCertificate(self):
         """Check if the server provided a certificate"""
         if self._handle:
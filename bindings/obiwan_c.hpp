@@ -0,0 +1,268 @@
+#ifndef INCLUDE_OBIWAN_C_HPP
+#define INCLUDE_OBIWAN_C_HPP
+
+// C++ wrappers of the C API of libobiwan.so (generated/obiwan_c.h, built
+// from wrapper.nim), written by hand. Only that library is used: don't mix
+// these with the genny bindings of generated/obiwan.hpp, which are a
+// separately built library with a runtime of their own.
+//
+// Server runs native handlers on the library's worker threads. AsyncClient
+// requests run on the calling thread's event loop: add pollFd() to your own
+// loop and call poll() whenever it is readable or the timeout the last
+// poll() returned has passed.
+
+#include <stddef.h>
+#include <functional>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#if __cplusplus >= 202002L && __has_include(<coroutine>)
+#include <coroutine>
+#define OBIWAN_COROUTINES 1
+#endif
+#include "generated/obiwan_c.h"
+
+namespace obiwan {
+
+/**
+ * A completed response of AsyncClient, body included. Copies share the
+ * response, which is destroyed with the last of them; the views stay valid
+ * until then.
+ */
+class AsyncResponse {
+public:
+  explicit AsyncResponse(ObiwanResponseHandle response)
+    : handle(response, destroyResponse) {}
+
+  int status() const { return getResponseStatus(handle.get()); }
+
+  std::string_view meta() const {
+    size_t length = 0;
+    const char* data = getResponseMetaView(handle.get(), &length);
+    return data ? std::string_view(data, length) : std::string_view();
+  }
+
+  std::string_view body() const {
+    size_t length = 0;
+    const char* data = getResponseBodyView(handle.get(), &length);
+    return data ? std::string_view(data, length) : std::string_view();
+  }
+
+  bool hasCertificate() const { return responseHasCertificate(handle.get()); }
+  bool isVerified() const { return responseIsVerified(handle.get()); }
+  bool isSelfSigned() const { return responseIsSelfSigned(handle.get()); }
+
+private:
+  std::shared_ptr<void> handle;
+};
+
+/**
+ * Error of a failed AsyncClient request, with getLastError()'s message.
+ */
+class RequestError : public std::runtime_error {
+public:
+  RequestError() : std::runtime_error(lastError()) {}
+
+private:
+  static std::string lastError() {
+    const char* error = getLastError();
+    return error ? error : "Request failed";
+  }
+};
+
+/**
+ * Non-blocking Gemini client. Any number of requests may be in flight at
+ * once, on the thread that started them.
+ * 
+ * Example:
+ *   obiwan::AsyncClient client;
+ *   auto page = client.request("gemini://example.com/");
+ *   while (page.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+ *     obiwan::AsyncClient::poll(100);
+ *   std::cout << page.get().body();
+ */
+class AsyncClient {
+public:
+  explicit AsyncClient(int maxRedirects = 5, const char* certFile = "",
+                       const char* keyFile = "")
+    : handle(createAsyncClient(maxRedirects, certFile, keyFile)) {
+    if (!handle) throw RequestError();
+  }
+  ~AsyncClient() { destroyAsyncClient(handle); }
+  AsyncClient(const AsyncClient&) = delete;
+  AsyncClient& operator=(const AsyncClient&) = delete;
+
+  /**
+   * Starts a request, the future is ready once poll() has completed it.
+   * Don't block on it on the thread that runs poll().
+   */
+  std::future<AsyncResponse> request(const char* url) {
+    auto promise = new std::promise<AsyncResponse>();
+    auto future = promise->get_future();
+    if (!requestUrlAsync(handle, url, &AsyncClient::fulfil, promise)) {
+      promise->set_exception(std::make_exception_ptr(RequestError()));
+      delete promise;
+    }
+    return future;
+  }
+
+#ifdef OBIWAN_COROUTINES
+  /**
+   * Awaitable request for C++20 coroutines, resumed from poll():
+   *   AsyncResponse page = co_await client.fetch("gemini://example.com/");
+   */
+  struct Fetch {
+    ObiwanAsyncClientHandle client;
+    std::string url;
+    ObiwanResponseHandle response = nullptr;
+    std::string error;
+    std::coroutine_handle<> waiting;
+
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> coroutine) {
+      waiting = coroutine;
+      if (requestUrlAsync(client, url.c_str(), &Fetch::done, this)) return true;
+      error = RequestError().what();
+      return false; // Resume right away with the error
+    }
+
+    AsyncResponse await_resume() {
+      if (!response) throw std::runtime_error(error);
+      return AsyncResponse(response);
+    }
+
+    static void done(ObiwanResponseHandle response, void* userData) {
+      auto fetch = static_cast<Fetch*>(userData);
+      fetch->response = response;
+      if (!response) fetch->error = RequestError().what();
+      fetch->waiting.resume();
+    }
+  };
+
+  Fetch fetch(std::string url) { return Fetch{handle, std::move(url)}; }
+#endif
+
+  /** The fd that becomes readable when poll() has work, see getPollFd() */
+  static int pollFd() { return getPollFd(); }
+
+  /**
+   * Runs what is ready on this thread's event loop, waiting up to
+   * timeoutMs. Returns the milliseconds until it must run again if the
+   * poll fd stays quiet, or -1. Throws RequestError on errors.
+   */
+  static int poll(int timeoutMs = 0) {
+    int next = pollObiwan(timeoutMs);
+    if (next == -2) throw RequestError();
+    return next;
+  }
+
+private:
+  ObiwanAsyncClientHandle handle;
+
+  static void fulfil(ObiwanResponseHandle response, void* userData) {
+    auto promise = static_cast<std::promise<AsyncResponse>*>(userData);
+    if (response) promise->set_value(AsyncResponse(response));
+    else promise->set_exception(std::make_exception_ptr(RequestError()));
+    delete promise;
+  }
+};
+
+/**
+ * A request being handled by Server::serve(), on one of its workers. Valid
+ * only within the handler it is passed to.
+ */
+class ServerRequest {
+public:
+  explicit ServerRequest(ObiwanRequestHandle request) : handle(request) {}
+
+  std::string_view url() const {
+    const char* url = getRequestUrl(handle);
+    return url ? std::string_view(url) : std::string_view();
+  }
+
+  /** SHA-256 fingerprint of the client certificate, empty without one */
+  std::string_view fingerprint() const {
+    const char* fingerprint = getRequestFingerprint(handle);
+    return fingerprint ? std::string_view(fingerprint) : std::string_view();
+  }
+
+  bool hasCertificate() const { return requestHasCertificate(handle); }
+  bool isVerified() const { return requestIsVerified(handle); }
+
+  /** Sets the `<status> <meta>` header, sent with the first chunk */
+  void header(int status, const std::string& meta) {
+    if (!respondHeader(handle, status, meta.c_str())) throw RequestError();
+  }
+
+  /** Sends the next part of the body of a 20 response */
+  void write(std::string_view chunk) {
+    if (!respondChunk(handle, chunk.data(), chunk.size())) throw RequestError();
+  }
+
+  /** Ends the response, done for the handler if it returns without */
+  void end() {
+    if (!respondEnd(handle)) throw RequestError();
+  }
+
+private:
+  ObiwanRequestHandle handle;
+};
+
+/**
+ * Gemini server calling a native handler for each request, on a pool of
+ * worker threads that also do the TLS handshakes.
+ * 
+ * Example:
+ *   obiwan::Server server("server.crt", "server.key");
+ *   server.serve(1965, [](obiwan::ServerRequest& request) {
+ *     request.header(OBIWAN_SUCCESS, "text/gemini");
+ *     request.write("# Hello from C++\n");
+ *   }, 8);
+ */
+class Server {
+public:
+  using Handler = std::function<void(ServerRequest&)>;
+
+  Server(const std::string& certFile, const std::string& keyFile,
+         const std::string& sessionId = "", bool reuseAddr = true,
+         bool reusePort = false)
+    : handle(createServer(reuseAddr, reusePort, certFile.c_str(),
+                          keyFile.c_str(), sessionId.c_str()), destroyServer) {
+    if (!handle) throw RequestError();
+  }
+
+  /**
+   * Serves requests until the process exits. The handler is called from
+   * all workers at once. If it throws before setting a header, the client
+   * gets a 50 response. Throws RequestError if the server cannot bind, or
+   * if threads > 0 and the library's mbedTLS lacks MBEDTLS_THREADING_C.
+   */
+  void serve(int port, Handler handler, int threads = 0,
+             const std::string& address = "") {
+    this->handler = std::move(handler);
+    if (!serveServer(handle.get(), port, address.c_str(), threads,
+                     &Server::dispatch, this))
+      throw RequestError();
+  }
+
+private:
+  std::shared_ptr<void> handle;
+  Handler handler;
+
+  static void dispatch(ObiwanRequestHandle request, void* userData) {
+    ServerRequest wrapped(request);
+    try {
+      static_cast<Server*>(userData)->handler(wrapped);
+    } catch (...) {
+      // Exceptions must not cross into the library. Without a header the
+      // library answers 50 itself, otherwise the response just ends.
+    }
+  }
+};
+
+} // namespace obiwan
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef INCLUDE_OBIWAN_EXT_HPP
+#define INCLUDE_OBIWAN_EXT_HPP
+
+// Additions to the genny-generated C++ Response (generated/obiwan.hpp),
+// written by hand. They live in their own header because bindings.nim
+// rewrites generated/obiwan.hpp on every build. Backed by the exports at the
+// end of bindings.nim, in the same library.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string_view>
+#if __cplusplus >= 202002L
+#include <span>
+#endif
+#include "generated/obiwan.hpp"
+
+extern "C" {
+
+const char* obiwan_response_meta_view(Response response, size_t* length);
+
+int64_t obiwan_response_read_body(Response response, char* buffer, size_t capacity);
+
+}
+
+namespace obiwan {
+
+/**
+ * The meta string of a response, without a copy. The view is valid until
+ * response.free().
+ */
+inline std::string_view metaView(Response response) {
+  size_t length = 0;
+  const char* data = obiwan_response_meta_view(response, &length);
+  return data ? std::string_view(data, length) : std::string_view();
+}
+
+/**
+ * Receives the next bytes of a successful response's body into a
+ * caller-owned buffer. Nothing is held in memory past the call: call it
+ * until it returns 0 to stream a large body.
+ * 
+ * Returns:
+ *   The number of bytes received, 0 at the end of the body, or -1 on
+ *   error (see checkError())
+ */
+inline int64_t readBody(Response response, char* buffer, size_t capacity) {
+  return obiwan_response_read_body(response, buffer, capacity);
+}
+
+#if __cplusplus >= 202002L
+inline int64_t readBody(Response response, std::span<char> buffer) {
+  return obiwan_response_read_body(response, buffer.data(), buffer.size());
+}
+#endif
+
+} // namespace obiwan
+
+#endif
@@ -1,5 +1,7 @@
+import std/[asyncdispatch, deques, heapqueue, monotimes, posix, selectors, times]
 import ../src/obiwan
 import ../src/obiwan/common
+from ../src/obiwan/tls/socket import sendAll, cork, flush
 
 {.push raises: [].}
 
@@ -8,6 +10,14 @@ type
   ObiwanClientHandle* = pointer
   ObiwanServerHandle* = pointer
   ObiwanResponseHandle* = pointer
+  ObiwanAsyncClientHandle* = pointer
+  ObiwanRequestHandle* = pointer
+
+  ObiwanResponseCallback* = proc (response: ObiwanResponseHandle,
+                                  userData: pointer) {.cdecl, raises: [], gcsafe.}
+
+  ObiwanRequestHandler* = proc (request: ObiwanRequestHandle,
+                                userData: pointer) {.cdecl, raises: [], gcsafe.}
 
   ObiwanResponseData* = object
     status*: cint
@@ -18,33 +28,54 @@ type
     isVerified*: bool
     isSelfSigned*: bool
 
-# Error handling
-var lastError: string = ""
+  # What a response handle points to. Strings handed out for the response
+  # live here, so they stay valid until destroyResponse.
+  ResponseBox = ref object
+    response: Response
+    body: string
+    bodyLoaded: bool # Read from the connection into body, by getResponseBody or requestUrlAsync
+    bodyRead: int    # Part of body readResponseBody has handed out
+
+  # What a request handle points to. It lives on the stack of the worker
+  # running the handler, so handles are only valid until the handler returns.
+  RequestView = object
+    request: Request
+    url: string
+    fingerprint: string
+    header: string # Sent along with the first chunk, so small responses take one record
+    headerSet: bool
+    ended: bool
+
+# Error handling, per thread since server handlers run on the worker threads
+var lastError {.threadvar.}: string
+var takenError {.threadvar.}: string # Returned by getLastError, valid until its next call
 
 proc setError(msg: string) =
   lastError = msg
 
-# String handling helper
-var stringCache: seq[string] = @[]
+proc unbox(response: ObiwanResponseHandle): Response {.inline.} =
+  cast[ResponseBox](response).response
 
-proc cacheString(s: string): cstring =
-  stringCache.add(s)
-  return stringCache[^1].cstring
+template loadBody(box: ResponseBox) =
+  ## Reads the whole body into the box once, for the functions lending it out
+  if not box.bodyLoaded:
+    box.body = box.response.body()
+    box.bodyLoaded = true
 
 # Client API
 proc initObiwan*() {.exportc: "initObiwan", dynlib.} =
   echo "Initializing ObiWAN"
-  stringCache = @[]
   lastError = ""
+  takenError = ""
 
 proc hasError*(): bool {.exportc: "hasError", dynlib.} =
   return lastError.len > 0
 
 proc getLastError*(): cstring {.exportc: "getLastError", dynlib.} =
   if lastError.len > 0:
-    let error = lastError
+    takenError = move(lastError)
     lastError = ""
-    return cacheString(error)
+    return takenError.cstring
   return nil
 
 proc createClient*(maxRedirects: cint, certFile,
@@ -82,9 +113,9 @@ proc requestUrl*(client: ObiwanClientHandle,
       return nil
 
     let obiwanClient = cast[ObiwanClient](client)
-    let resp = obiwanClient.request($url)
-    GC_ref(resp) # Add a reference to prevent GC
-    return cast[ObiwanResponseHandle](resp)
+    let box = ResponseBox(response: obiwanClient.request($url))
+    GC_ref(box) # Add a reference to prevent GC
+    return cast[ObiwanResponseHandle](box)
   except ObiwanError as e:
     setError("ObiwanError: " & e.msg)
     return nil
@@ -99,8 +130,8 @@ proc destroyResponse*(response: ObiwanResponseHandle) {.exportc: "destroyRespons
   try:
     if response.isNil:
       return
-    let resp = cast[Response](response)
-    GC_unref(resp) # Remove the reference
+    let box = cast[ResponseBox](response)
+    GC_unref(box) # Remove the reference, and with it everything lent out
   except:
     setError("Error destroying response")
 
@@ -109,7 +140,7 @@ proc getResponseStatus*(response: ObiwanResponseHandle): cint {.exportc: "getRes
     if response.isNil:
       setError("Response is nil")
       return -1
-    let resp = cast[Response](response)
+    let resp = unbox(response)
     return cint(resp.status.int)
   except:
     setError("Error getting response status")
@@ -120,34 +151,154 @@ proc getResponseMeta*(response: ObiwanResponseHandle): cstring {.exportc: "getRe
     if response.isNil:
       setError("Response is nil")
       return nil
-    let resp = cast[Response](response)
-    return cacheString(resp.meta)
+    return unbox(response).meta.cstring
   except:
     setError("Error getting response meta")
     return nil
 
+proc getResponseMetaView*(response: ObiwanResponseHandle,
+    length: ptr csize_t): cstring {.exportc: "getResponseMetaView", dynlib.} =
+  try:
+    if response.isNil:
+      setError("Response is nil")
+      return nil
+    let resp = unbox(response)
+    if not length.isNil:
+      length[] = resp.meta.len.csize_t
+    return resp.meta.cstring
+  except:
+    setError("Error getting response meta")
+    return nil
+
+proc copyResponseMeta*(response: ObiwanResponseHandle, buffer: cstring,
+    capacity: csize_t): int64 {.exportc: "copyResponseMeta", dynlib.} =
+  try:
+    if response.isNil:
+      setError("Response is nil")
+      return -1
+    let meta = unbox(response).meta
+    if not buffer.isNil and capacity > 0:
+      # Truncated to fit, and always terminated
+      let count = min(meta.len, capacity.int - 1)
+      if count > 0:
+        copyMem(buffer, unsafeAddr meta[0], count)
+      cast[ptr UncheckedArray[char]](buffer)[count] = '\0'
+    return meta.len.int64
+  except:
+    setError("Error copying response meta")
+    return -1
+
 proc getResponseBody*(response: ObiwanResponseHandle): cstring {.exportc: "getResponseBody", dynlib.} =
   try:
     if response.isNil:
       setError("Response is nil")
       return nil
-    let resp = cast[Response](response)
-    if resp.status == Status.Success:
-      return cacheString(resp.body())
+    let box = cast[ResponseBox](response)
+    if box.response.status != Status.Success:
+      return nil
+    box.loadBody()
+    return box.body.cstring
+  except ObiwanError as e:
+    setError("ObiwanError: " & e.msg)
     return nil
+  except:
+    setError("Error getting response body")
+    return nil
+
+proc getResponseBodyView*(response: ObiwanResponseHandle,
+    length: ptr csize_t): cstring {.exportc: "getResponseBodyView", dynlib.} =
+  try:
+    if not length.isNil:
+      length[] = 0
+    if response.isNil:
+      setError("Response is nil")
+      return nil
+    let box = cast[ResponseBox](response)
+    if box.response.status != Status.Success:
+      return nil
+    box.loadBody()
+    if not length.isNil:
+      length[] = box.body.len.csize_t
+    return box.body.cstring
   except ObiwanError as e:
     setError("ObiwanError: " & e.msg)
     return nil
+  except MbedtlsError as e:
+    setError("MbedtlsError: " & e.msg)
+    return nil
   except:
     setError("Error getting response body")
     return nil
 
+proc readResponseBody*(response: ObiwanResponseHandle, buffer: cstring,
+    capacity: cint): cint {.exportc: "readResponseBody", dynlib.} =
+  try:
+    if response.isNil:
+      setError("Response is nil")
+      return -1
+    if buffer.isNil or capacity <= 0:
+      setError("Buffer is empty")
+      return -1
+    let box = cast[ResponseBox](response)
+    if box.response.status != Status.Success:
+      return 0
+    if box.bodyLoaded:
+      let count = min(capacity.int, box.body.len - box.bodyRead)
+      if count > 0:
+        copyMem(buffer, addr box.body[box.bodyRead], count)
+        box.bodyRead += count
+      return count.cint
+    return cint(box.response.readBody(cast[pointer](buffer), capacity.int))
+  except ObiwanError as e:
+    setError("ObiwanError: " & e.msg)
+    return -1
+  except MbedtlsError as e:
+    setError("MbedtlsError: " & e.msg)
+    return -1
+  except:
+    setError("Error reading response body")
+    return -1
+
+proc downloadResponseBody*(response: ObiwanResponseHandle,
+    path: cstring): int64 {.exportc: "downloadResponseBody", dynlib.} =
+  try:
+    if response.isNil:
+      setError("Response is nil")
+      return -1
+    let box = cast[ResponseBox](response)
+    if box.response.status != Status.Success:
+      return 0
+    if box.bodyLoaded:
+      let remaining = box.body.len - box.bodyRead
+      var file = open($path, fmWrite)
+      try:
+        if remaining > 0 and
+            file.writeBuffer(addr box.body[box.bodyRead], remaining) != remaining:
+          raise newException(IOError, "Failed to write " & $path)
+      finally:
+        file.close()
+      box.bodyRead = box.body.len
+      return remaining.int64
+    return box.response.downloadTo($path)
+  except IOError as e:
+    setError("IOError: " & e.msg)
+    return -1
+  except ObiwanError as e:
+    setError("ObiwanError: " & e.msg)
+    return -1
+  except MbedtlsError as e:
+    setError("MbedtlsError: " & e.msg)
+    return -1
+  except:
+    setError("Error downloading response body")
+    return -1
+
 proc responseHasCertificate*(response: ObiwanResponseHandle): bool {.exportc: "responseHasCertificate", dynlib.} =
   try:
     if response.isNil:
       setError("Response is nil")
       return false
-    let resp = cast[Response](response)
+    let resp = unbox(response)
     return resp.hasCertificate()
   except:
     setError("Error checking certificate presence")
@@ -158,7 +309,7 @@ proc responseIsVerified*(response: ObiwanResponseHandle): bool {.exportc: "respo
     if response.isNil:
       setError("Response is nil")
       return false
-    let resp = cast[Response](response)
+    let resp = unbox(response)
     return resp.isVerified()
   except:
     setError("Error checking certificate verification")
@@ -169,12 +320,140 @@ proc responseIsSelfSigned*(response: ObiwanResponseHandle): bool {.exportc: "res
     if response.isNil:
       setError("Response is nil")
       return false
-    let resp = cast[Response](response)
+    let resp = unbox(response)
     return resp.isSelfSigned()
   except:
     setError("Error checking if certificate is self-signed")
     return false
 
+# Async client API, driven by the caller's event loop through pollObiwan()
+proc createAsyncClient*(maxRedirects: cint, certFile,
+    keyFile: cstring): ObiwanAsyncClientHandle {.exportc: "createAsyncClient", dynlib.} =
+  try:
+    let client = newAsyncObiwanClient(int(maxRedirects), $certFile, $keyFile)
+    GC_ref(client) # Add a reference to prevent GC
+    return cast[ObiwanAsyncClientHandle](client)
+  except ObiwanError as e:
+    setError("ObiwanError: " & e.msg)
+    return nil
+  except MbedtlsError as e:
+    setError("MbedtlsError: " & e.msg)
+    return nil
+  except:
+    setError("Unknown error during client creation")
+    return nil
+
+proc destroyAsyncClient*(client: ObiwanAsyncClientHandle) {.exportc: "destroyAsyncClient", dynlib.} =
+  try:
+    if client.isNil:
+      return
+    # Requests in flight keep what they need of the client
+    GC_unref(cast[AsyncObiwanClient](client))
+  except:
+    setError("Error destroying client")
+
+{.pop.}
+
+var wakeFds {.threadvar.}: array[2, cint]
+var wakeOpen {.threadvar.}: bool
+
+proc wake() =
+  ## Makes the poll fd readable, so the caller's loop runs pollObiwan().
+  ## Through a pipe registered with the dispatcher, created on first use.
+  if not wakeOpen:
+    if posix.pipe(wakeFds) != 0:
+      return
+    for fd in wakeFds:
+      discard fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) or O_NONBLOCK)
+    register(AsyncFD(wakeFds[0]))
+    addRead(AsyncFD(wakeFds[0]), proc (fd: AsyncFD): bool =
+      var drained: array[64, byte]
+      while posix.read(wakeFds[0], addr drained[0], drained.len) > 0:
+        discard
+      false)
+    wakeOpen = true
+  var signal = 1'u8
+  discard posix.write(wakeFds[1], addr signal, 1)
+
+proc nextTimeout(): cint =
+  ## Milliseconds until pollObiwan() has work even if the fd stays quiet,
+  ## -1 if it only has once the fd is readable
+  let dispatcher = getGlobalDispatcher()
+  if dispatcher.callbacks.len > 0:
+    return 0
+  if dispatcher.timers.len > 0:
+    let left = (dispatcher.timers[0].finishAt - getMonoTime()).inMilliseconds
+    return cint(clamp(left + 1, 0, int32.high.int64))
+  return -1
+
+proc fetchAsync(client: AsyncObiwanClient; url: string;
+                callback: ObiwanResponseCallback; userData: pointer) {.async.} =
+  ## Runs one requestUrlAsync() request and hands the response, body
+  ## included, to its callback
+  # A client of its own only for the socket, the TLS context is shared
+  let fetcher = AsyncObiwanClient(maxRedirects: client.maxRedirects,
+                                  sslContext: client.sslContext)
+  var box: ResponseBox
+  try:
+    let response = await fetcher.request(url)
+    var body = ""
+    if response.status == Status.Success:
+      body = await response.body()
+    box = ResponseBox(response: Response(status: response.status, meta: response.meta,
+                                         certificate: response.certificate,
+                                         verification: response.verification),
+                      body: move(body), bodyLoaded: true)
+  except ObiwanError as e:
+    setError("ObiwanError: " & e.msg)
+  except MbedtlsError as e:
+    setError("MbedtlsError: " & e.msg)
+  except CatchableError as e:
+    setError("Error during request: " & e.msg)
+  fetcher.close()
+  if box.isNil:
+    callback(nil, userData)
+  else:
+    GC_ref(box) # Until destroyResponse
+    callback(cast[ObiwanResponseHandle](box), userData)
+
+{.push raises: [].}
+
+proc requestUrlAsync*(client: ObiwanAsyncClientHandle, url: cstring,
+    callback: ObiwanResponseCallback, userData: pointer): bool {.exportc: "requestUrlAsync", dynlib.} =
+  try:
+    if client.isNil or url.isNil or callback.isNil:
+      setError("Client, URL and callback are required")
+      return false
+    let obiwanClient = cast[AsyncObiwanClient](client)
+    let target = $url
+    # Started by the next pollObiwan(), so the callback never runs in here
+    callSoon(proc () = asyncCheck fetchAsync(obiwanClient, target, callback, userData))
+    wake()
+    return true
+  except:
+    setError("Error starting request: " & getCurrentExceptionMsg())
+    return false
+
+proc getPollFd*(): cint {.exportc: "getPollFd", dynlib.} =
+  try:
+    when defined(windows):
+      setError("No pollable fd on Windows")
+      return -1
+    else:
+      return getGlobalDispatcher().getIoHandler().getFd().cint
+  except:
+    setError("Error getting the poll fd")
+    return -1
+
+proc pollObiwan*(timeoutMs: cint): cint {.exportc: "pollObiwan", dynlib.} =
+  try:
+    if hasPendingOperations():
+      poll(timeoutMs.int)
+    return nextTimeout()
+  except:
+    setError("Error in event loop: " & getCurrentExceptionMsg())
+    return -2
+
 # Server API
 proc createServer*(reuseAddr: bool, reusePort: bool, certFile, keyFile,
     sessionId: cstring): ObiwanServerHandle {.exportc: "createServer", dynlib.} =
@@ -201,4 +480,148 @@ proc destroyServer*(server: ObiwanServerHandle) {.exportc: "destroyServer", dynl
   except:
     setError("Error destroying server")
 
+# Request handling, on the server's worker threads
+proc requestView(request: ObiwanRequestHandle): ptr RequestView {.inline.} =
+  cast[ptr RequestView](request)
+
+proc sendHeld(view: ptr RequestView; data: pointer;
+              length: int) {.raises: [CatchableError].} =
+  ## Sends the held back header, followed by `length` bytes at `data`
+  let client = view.request.client
+  let headerLen = view.header.len
+  if headerLen > 0 and headerLen + length <= StreamChunkSize:
+    view.header.setLen(headerLen + length)
+    if length > 0:
+      copyMem(addr view.header[headerLen], data, length)
+    client.sendAll(view.header)
+  else:
+    if headerLen > 0:
+      client.sendAll(view.header)
+    if length > 0:
+      client.sendAll(data, length)
+  view.request.bytesSent += headerLen + length
+  view.header = ""
+
+proc endResponse(view: ptr RequestView) {.raises: [CatchableError].} =
+  ## Sends whatever is still held back and uncorks the connection
+  if not view.ended:
+    view.ended = true
+    view.sendHeld(nil, 0)
+    view.request.client.flush()
+
+proc getRequestUrl*(request: ObiwanRequestHandle): cstring {.exportc: "getRequestUrl", dynlib.} =
+  if request.isNil:
+    setError("Request is nil")
+    return nil
+  return requestView(request).url.cstring
+
+proc getRequestFingerprint*(request: ObiwanRequestHandle): cstring {.exportc: "getRequestFingerprint", dynlib.} =
+  try:
+    if request.isNil:
+      setError("Request is nil")
+      return nil
+    let view = requestView(request)
+    if not view.request.hasCertificate():
+      return nil
+    if view.fingerprint.len == 0:
+      view.fingerprint = view.request.certificate.fingerprint()
+    return view.fingerprint.cstring
+  except:
+    setError("Error getting certificate fingerprint: " & getCurrentExceptionMsg())
+    return nil
+
+proc requestHasCertificate*(request: ObiwanRequestHandle): bool {.exportc: "requestHasCertificate", dynlib.} =
+  if request.isNil:
+    setError("Request is nil")
+    return false
+  return requestView(request).request.hasCertificate()
+
+proc requestIsVerified*(request: ObiwanRequestHandle): bool {.exportc: "requestIsVerified", dynlib.} =
+  if request.isNil:
+    setError("Request is nil")
+    return false
+  return requestView(request).request.isVerified()
+
+proc respondHeader*(request: ObiwanRequestHandle, status: cint,
+    meta: cstring): bool {.exportc: "respondHeader", dynlib.} =
+  if request.isNil or meta.isNil:
+    setError("Request and meta are required")
+    return false
+  let view = requestView(request)
+  if view.headerSet:
+    setError("Response header already sent")
+    return false
+  if status < 10 or status > 69 or meta.len > 1024:
+    setError("Invalid status or meta longer than 1024 bytes")
+    return false
+  view.headerSet = true
+  view.request.status = status.int
+  view.header = $status & " " & $meta & "\r\n"
+  return true
+
+proc respondChunk*(request: ObiwanRequestHandle, data: pointer,
+    length: csize_t): bool {.exportc: "respondChunk", dynlib.} =
+  try:
+    if request.isNil or (data.isNil and length > 0):
+      setError("Request and data are required")
+      return false
+    let view = requestView(request)
+    if view.request.status != Status.Success.int or view.ended:
+      setError("Body chunks need an open 20 response")
+      return false
+    # Responses of several records leave in full segments, see flush()
+    view.request.client.cork()
+    view.sendHeld(data, length.int)
+    return true
+  except:
+    setError("Error sending response: " & getCurrentExceptionMsg())
+    return false
+
+proc respondEnd*(request: ObiwanRequestHandle): bool {.exportc: "respondEnd", dynlib.} =
+  try:
+    if request.isNil:
+      setError("Request is nil")
+      return false
+    let view = requestView(request)
+    if not view.headerSet:
+      setError("No response header to end")
+      return false
+    view.endResponse()
+    return true
+  except:
+    setError("Error sending response: " & getCurrentExceptionMsg())
+    return false
+
+proc runHandler(request: Request; handler: ObiwanRequestHandler;
+                userData: pointer) {.raises: [CatchableError].} =
+  ## Calls a native handler with a view of `request`, then completes
+  ## whatever response it left open
+  var view = RequestView(request: request, url: $request.url)
+  handler(cast[ObiwanRequestHandle](addr view), userData)
+  if not view.headerSet:
+    request.respond(Status.Error, "Handler sent no response")
+    return
+  endResponse(addr view)
+
+proc serveServer*(server: ObiwanServerHandle, port: cint, address: cstring,
+    threads: cint, handler: ObiwanRequestHandler,
+    userData: pointer): bool {.exportc: "serveServer", dynlib.} =
+  try:
+    if server.isNil or handler.isNil:
+      setError("Server and handler are required")
+      return false
+    let obiwanServer = cast[ObiwanServer](server)
+    obiwanServer.threads = max(threads.int, 0)
+    let bindAddress = if address.isNil: "" else: $address
+    # Blocks for good, unless binding fails
+    obiwanServer.serve(port.int, proc (request: Request) {.raises: [CatchableError].} =
+      runHandler(request, handler, userData), bindAddress)
+    return true
+  except ObiwanError as e:
+    setError("ObiwanError: " & e.msg)
+    return false
+  except:
+    setError("Unknown error while serving: " & getCurrentExceptionMsg())
+    return false
+
 {.pop.}
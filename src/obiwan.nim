@@ -6,10 +6,13 @@ import asyncnet
 import random
 import nimcrypto
 import strutils
-import streams
+import tables
+import deques
 import net
 import posix
 import os # For fileExists
+import std/monotimes
+from std/times import Duration, inMilliseconds
 
 # URL handling
 import obiwan/url
@@ -17,11 +20,16 @@ import obiwan/url
 # Core components
 import obiwan/common
 import obiwan/debug
+import obiwan/pool
+import obiwan/accesslog
+import obiwan/metrics
 
 # TLS implementation
 import obiwan/tls/mbedtls as mbedtls
 import obiwan/tls/socket as tlsSocket
 import obiwan/tls/async_socket as tlsAsyncSocket
+import obiwan/tls/uring
+import obiwan/tls/tickets
 
 # Note: We've moved the platform-specific key file parsing directly into the
 # loadIdentityFile function for better clarity and to avoid pointer manipulation issues.
@@ -73,6 +81,13 @@ type
     ## Asynchronous response from a Gemini server.
     ## Contains status, meta information, and certificate details.
 
+  FetchResult* = object
+    ## Outcome of one URL of a fetchMany() batch.
+    url*: string ## URL as it was passed to fetchMany()
+    response*: AsyncResponse ## Response received, nil if the request failed
+    body*: string ## Body of a successful response, "" otherwise
+    error*: string ## Why the request failed, "" if it didn't
+
   ## Server types
   ObiwanServer* = ObiwanServerBase[MbedtlsSocket]
     ## Synchronous Gemini protocol server.
@@ -91,17 +106,32 @@ type
     ## Asynchronous request received by a Gemini server.
     ## Contains URL, client certificate, and verification information.
 
+const
+  StreamChunkSize* = 16 * 1024
+    ## Size of the buffer used by respondFile() to stream file bodies (16KB).
+  BodyChunkSize* = 16 * 1024
+    ## Size of the buffer client body readers receive into (16KB).
+  DefaultFetchConcurrency* = 32
+    ## Default number of requests a fetchMany() batch runs at once.
+  DefaultFetchPerHost* = 2
+    ## Default number of requests a fetchMany() batch runs at once per host.
+
 # Export public types and functions
 export common
 export debug
+export accesslog
+export metrics
 # Export certificate handling functions
 export tlsSocket.`$`
 export tlsSocket.commonName
 export tlsSocket.fingerprint
-export tlsAsyncSocket.newMbedtlsAsyncSocket
+export tlsSocket.CipherSuite, tlsSocket.parseCipherSuites,
+       tlsSocket.defaultCipherSuites, tlsSocket.hasHardwareAes
+export tlsAsyncSocket.newMbedtlsAsyncSocket, tlsAsyncSocket.connectionMemory
 export tlsSocket.handshakeAsClient, tlsSocket.handshakeAsServer
 export tlsAsyncSocket.handshakeAsClient, tlsAsyncSocket.handshakeAsServer
-export debug.debug, debug.debugf, debug.withDebug, debug.debugEnabled
+export debug.debug, debug.debugf, debug.withDebug, debug.debugEnabled,
+       debug.logEnabled, debug.obiwanLogLevel
 
 # Export config module
 import obiwan/config
@@ -142,61 +172,104 @@ proc loadIdentityFile*(client: ObiwanClient | AsyncObiwanClient; certFile,
     error("Key file not found: " & keyFile)
     return false
 
-  # Initialize SSL config (should be done already, but let's make sure)
-  debug("Making sure SSL config is properly initialized")
-
   # Configure auth mode first - in mbedTLS this needs to be done before cert setup
   debug("Setting auth mode to MBEDTLS_SSL_VERIFY_OPTIONAL")
   mbedtls.mbedtls_ssl_conf_authmode(addr ctx.config,
       mbedtls.MBEDTLS_SSL_VERIFY_OPTIONAL)
 
-  # Parse the certificate - direct approach, avoiding pointer manipulation
-  debug("Parsing certificate file: " & certFile)
-  let ret1 = mbedtls.mbedtls_x509_crt_parse_file(addr ctx.cert, certFile)
-  if ret1 != 0:
-    # Get a more detailed error message
-    var errorStr = newString(100)
-    mbedtls.mbedtls_strerror(ret1, cast[cstring](addr errorStr[0]), 100)
-    error("Failed to parse certificate file: " & errorStr & " (code: " & $ret1 & ")")
+  # Parsed once per process, clients using the same files share it
+  try:
+    ctx.useIdentity(certFile, keyFile)
+  except MbedtlsError as e:
+    error("Failed to load client certificate: " & e.msg)
     return false
 
-  debug("Certificate parsed successfully")
+  # Double-check client certificate configuration
+  debug("Client certificate configuration complete")
+  debug("Client certificate should now be ready for TLS handshake")
+  return true
 
-  # Parse the key - direct approach
-  debug("Loading private key from: " & keyFile)
 
-  let ret2 =
-    mbedtls.mbedtls_pk_parse_keyfile(
-      addr ctx.key, keyFile, nil,
-      mbedtls.mbedtls_ctr_drbg_random, addr ctx.ctr_drbg)
+proc `recordSize=`*(endpoint: ObiwanClient | AsyncObiwanClient | ObiwanServer |
+    AsyncObiwanServer; size: int) =
+  ## Sets the plaintext size of the TLS records a client or server sends.
+  ##
+  ## Small records can be decrypted as soon as they arrive, full 16KB ones
+  ## cost less per byte. By default (0) each connection starts with records
+  ## of about one TCP segment and moves to 16KB records after its first
+  ## 64KB. Clients also ask servers to send records no larger than `size`,
+  ## rounded down to 512, 1024, 2048 or 4096 bytes; larger sizes let servers
+  ## choose. Applies to connections opened or accepted afterwards.
+  ##
+  ## Parameters:
+  ##   endpoint: The client or server to configure
+  ##   size: Bytes per record between 512 and 16384, or 0 for adaptive
+  ##
+  ## Raises:
+  ##   ObiwanError: If the size is out of range
+  ##
+  ## Example:
+  ##   ```nim
+  ##   server.recordSize = 16384 # Bulk downloads only
+  ##   ```
+  try:
+    MbedtlsSslContext(endpoint.sslContext).setRecordSize(size)
+  except MbedtlsError as e:
+    raise newException(ObiwanError, e.msg)
 
-  if ret2 != 0:
-    # Get a more detailed error message
-    var errorStr = newString(100)
-    mbedtls.mbedtls_strerror(ret2, cast[cstring](addr errorStr[0]), 100)
-    error("Failed to parse key file: " & errorStr & " (code: " & $ret2 & ")")
-    return false
+proc recordSize*(endpoint: ObiwanClient | AsyncObiwanClient | ObiwanServer |
+    AsyncObiwanServer): int =
+  ## Plaintext bytes per TLS record the endpoint sends, 0 if adaptive
+  MbedtlsSslContext(endpoint.sslContext).recordSize
 
-  debug("Private key parsed successfully")
+proc `cipherSuites=`*(endpoint: ObiwanClient | AsyncObiwanClient | ObiwanServer |
+    AsyncObiwanServer; suites: openArray[CipherSuite]) =
+  ## Sets the TLS 1.3 cipher suites a client or server offers, most
+  ## preferred first. Suites this build of mbedTLS lacks are skipped.
+  ##
+  ## By default AES-GCM comes first on CPUs with AES instructions and
+  ## ChaCha20-Poly1305 everywhere else. With mbedTLS the client's order
+  ## decides which suite is used, so on servers this only selects the suites
+  ## that are allowed. Applies to connections opened or accepted afterwards.
+  ##
+  ## Parameters:
+  ##   endpoint: The client or server to configure
+  ##   suites: The suites to offer, e.g. from parseCipherSuites()
+  ##
+  ## Raises:
+  ##   ObiwanError: If the build supports none of the suites
+  ##
+  ## Example:
+  ##   ```nim
+  ##   client.cipherSuites = [csChaCha20]
+  ##   ```
+  try:
+    MbedtlsSslContext(endpoint.sslContext).setCipherSuites(suites)
+  except MbedtlsError as e:
+    raise newException(ObiwanError, e.msg)
 
-  # Configure certificate in SSL context
-  debug("Setting up client certificate for SSL/TLS with mbedtls_ssl_conf_own_cert")
-  let ret3 = mbedtls.mbedtls_ssl_conf_own_cert(addr ctx.config,
-                                          addr ctx.cert,
-                                          addr ctx.key)
-  if ret3 != 0:
-    # Get a more detailed error message
-    var errorStr = newString(100)
-    mbedtls.mbedtls_strerror(ret3, cast[cstring](addr errorStr[0]), 100)
-    error("Failed to configure client certificate: " & errorStr & " (code: " &
-        $ret3 & ")")
-    return false
+proc cipherSuites*(endpoint: ObiwanClient | AsyncObiwanClient | ObiwanServer |
+    AsyncObiwanServer): seq[CipherSuite] =
+  ## The cipher suites the endpoint offers, in order of preference
+  MbedtlsSslContext(endpoint.sslContext).cipherSuites
 
-  # Double-check client certificate configuration
-  debug("Client certificate configuration complete")
-  debug("Client certificate should now be ready for TLS handshake")
-  return true
+proc `ktls=`*(server: ObiwanServer | AsyncObiwanServer; enabled: bool) =
+  ## Sends files with kernel TLS (Linux only).
+  ##
+  ## respondFile() then hands the connection's traffic keys to the kernel
+  ## after the response header and sends the file with sendfile(), without
+  ## copying it through userspace. Connections whose kernel or cipher suite
+  ## doesn't support kTLS carry on with mbedTLS. Applies to connections
+  ## accepted afterwards.
+  ##
+  ## Parameters:
+  ##   server: The server to configure
+  ##   enabled: Whether to try kTLS for files
+  MbedtlsSslContext(server.sslContext).ktls = enabled and defined(linux)
 
+proc ktls*(server: ObiwanServer | AsyncObiwanServer): bool =
+  ## Whether the server tries to send files with kernel TLS
+  MbedtlsSslContext(server.sslContext).ktls
 
 proc newObiwanClient*(maxRedirects = 5; certFile = "";
     keyFile = ""): ObiwanClient =
@@ -226,21 +299,12 @@ proc newObiwanClient*(maxRedirects = 5; certFile = "";
   ##     echo content
   ##   ```
   result = ObiwanClient(maxRedirects: maxRedirects)
-  result.bodyStreamVariant = (isFutureStream: false)
-  result.bodyStreamSync = newStringStream()
 
-  # Create TLS context
+  # Create TLS context, cheap since the crypto state is shared
   var actualContext = tlsSocket.newContext()
   # Store concrete context directly
   result.sslContext = actualContext
 
-  # Configure for client mode
-  discard mbedtls.mbedtls_ssl_config_defaults(
-    addr actualContext.config,
-    mbedtls.MBEDTLS_SSL_IS_CLIENT,
-    mbedtls.MBEDTLS_SSL_TRANSPORT_STREAM,
-    mbedtls.MBEDTLS_SSL_PRESET_DEFAULT)
-
   # Set custom verify to allow self-signed certificates
   tlsSocket.setCustomVerify(actualContext)
 
@@ -249,6 +313,9 @@ proc newObiwanClient*(maxRedirects = 5; certFile = "";
   mbedtls.mbedtls_ssl_conf_authmode(addr actualContext.config,
       mbedtls.MBEDTLS_SSL_VERIFY_NONE)
 
+  # Keep session tickets so repeat visits to a host skip the full handshake
+  tlsSocket.enableSessionResumption(actualContext)
+
   # Load client certificate if provided
   if certFile != "" or keyFile != "":
     # Both must be provided or neither
@@ -294,21 +361,12 @@ proc newAsyncObiwanClient*(maxRedirects = 5; certFile = "";
   ##   waitFor main()
   ##   ```
   result = AsyncObiwanClient(maxRedirects: maxRedirects)
-  result.bodyStreamVariant = (isFutureStream: true)
-  result.bodyStreamAsync = newFutureStream[string]("newAsyncObiwanClient")
 
-  # Create TLS context
+  # Create TLS context, cheap since the crypto state is shared
   var actualContext = tlsSocket.newContext()
   # Store concrete context directly
   result.sslContext = actualContext
 
-  # Configure for client mode
-  discard mbedtls.mbedtls_ssl_config_defaults(
-    addr actualContext.config,
-    mbedtls.MBEDTLS_SSL_IS_CLIENT,
-    mbedtls.MBEDTLS_SSL_TRANSPORT_STREAM,
-    mbedtls.MBEDTLS_SSL_PRESET_DEFAULT)
-
   # Set custom verify to allow self-signed certificates
   tlsSocket.setCustomVerify(actualContext)
 
@@ -317,6 +375,9 @@ proc newAsyncObiwanClient*(maxRedirects = 5; certFile = "";
   mbedtls.mbedtls_ssl_conf_authmode(addr actualContext.config,
       mbedtls.MBEDTLS_SSL_VERIFY_NONE)
 
+  # Keep session tickets so repeat visits to a host skip the full handshake
+  tlsSocket.enableSessionResumption(actualContext)
+
   # Load client certificate if provided
   if certFile != "" or keyFile != "":
     # Both must be provided or neither
@@ -348,6 +409,7 @@ proc loadUrl(client: ObiwanClient | AsyncObiwanClient; url: string): Future[
   when client is AsyncObiwanClient:
     result = AsyncResponse(client: client)
     client.socket = await tlsAsyncSocket.dial(hostname, port)
+    client.socket.sessionKey = hostname & ":" & $port
     await tlsAsyncSocket.wrapConnectedSocket(ctx, client.socket,
         tlsAsyncSocket.handshakeAsClient, hostname)
     # send data now to force TLS handshake to complete
@@ -355,10 +417,11 @@ proc loadUrl(client: ObiwanClient | AsyncObiwanClient; url: string): Future[
   else:
     result = Response(client: client)
     client.socket = tlsSocket.dial(hostname, port)
+    client.socket.sessionKey = hostname & ":" & $port
     tlsSocket.wrapConnectedSocket(ctx, client.socket,
         tlsSocket.handshakeAsClient, hostname)
     # send data now to force TLS handshake to complete
-    discard client.socket.send(url & "\r\n")
+    tlsSocket.sendAll(client.socket, url & "\r\n")
 
   # Get peer certificate
   let sslCtx = client.socket.getSslHandle()
@@ -383,7 +446,8 @@ proc request*(client: ObiwanClient | AsyncObiwanClient; url: string): Future[
   ## - Sending the URL request
   ## - Parsing the server's response status and meta information
   ## - Obtaining the server's certificate and verification status
-  ## - Automatically following redirects up to client.maxRedirects
+  ## - Automatically following redirects up to client.maxRedirects; a client
+  ##   with maxRedirects = 0 gets redirects back as responses
   ##
   ## The connection remains open if the request was successful (Status.Success),
   ## allowing the body content to be retrieved separately using the response.body() method.
@@ -411,16 +475,52 @@ proc request*(client: ObiwanClient | AsyncObiwanClient; url: string): Future[
   ##   ```
   var url = url
   result = await client.loadUrl(url)
+  result.url = url
   for i in 1..client.maxRedirects:
     if result.status == Status.Redirect or result.status == Status.TempRedirect:
       let baseUrl = parseUrl(url)
       let targetUrl = parseUrl(result.meta)
       url = $combineUrl(baseUrl, targetUrl)
       result = await client.loadUrl(url)
+      result.url = url
     else:
       return
-  client.socket.close()
-  raise newException(ObiwanError, "too many redirects")
+  if client.maxRedirects > 0 and
+      (result.status == Status.Redirect or result.status == Status.TempRedirect):
+    client.socket.close()
+    raise newException(ObiwanError, "too many redirects")
+
+proc readBody*(response: Response | AsyncResponse; data: pointer;
+    size: int): Future[int] {.multisync.} =
+  ## Receives the next bytes of a successful response's body into a
+  ## caller-owned buffer.
+  ##
+  ## This is the primitive the other body readers are built on. Once the
+  ## whole body has been read the connection is closed and 0 is returned.
+  ##
+  ## Parameters:
+  ##   response: The Response or AsyncResponse from a previous request call
+  ##   data: Pointer to the buffer to receive into
+  ##   size: Maximum number of bytes to receive
+  ##
+  ## Returns:
+  ##   The number of bytes received, 0 at the end of the body
+  ##
+  ## Note:
+  ##   For asynchronous clients the buffer must stay valid until the returned
+  ##   Future completes.
+  let client = response.client
+  when response is AsyncResponse:
+    if client.socket.isNil or tlsAsyncSocket.isClosed(client.socket):
+      return 0
+  else:
+    if client.socket.isNil or tlsSocket.isClosed2(client.socket):
+      return 0
+  let bytesRead = await client.socket.recv(data, size)
+  if bytesRead <= 0:
+    client.socket.close()
+    return 0
+  return bytesRead
 
 proc body*(response: Response | AsyncResponse): Future[string] {.multisync.} =
   ## Retrieves the body content associated with a successful response.
@@ -436,6 +536,9 @@ proc body*(response: Response | AsyncResponse): Future[string] {.multisync.} =
   ## Returns:
   ##   The complete body content as a string
   ##
+  ## See bodyChunks(), nextChunk() and downloadTo() to process large bodies
+  ## without holding them in memory.
+  ##
   ## Raises:
   ##   Various network-related exceptions may be raised during body retrieval
   ##
@@ -457,30 +560,116 @@ proc body*(response: Response | AsyncResponse): Future[string] {.multisync.} =
   ##     let content = await response.body()
   ##     echo content
   ##   ```
-  let client = response.client
+  var content = ""
+  var size = 0
+  while true:
+    # Grow geometrically and read straight into the result
+    if content.len - size < BodyChunkSize:
+      content.setLen(max(content.len * 2, BodyChunkSize))
+    let bytesRead = await response.readBody(addr content[size], content.len - size)
+    if bytesRead == 0:
+      break
+    size += bytesRead
+  content.setLen(size)
+  return content
+
+iterator bodyChunks*(response: Response; chunkSize = BodyChunkSize): lent string =
+  ## Yields the body of a successful response piece by piece as it arrives.
+  ##
+  ## Unlike body(), the content is never held in memory as a whole: every
+  ## chunk is received into the same buffer, so the string yielded is only
+  ## valid until the next iteration. The connection is closed once the body
+  ## has been read.
+  ##
+  ## Parameters:
+  ##   response: The Response from a previous request call
+  ##   chunkSize: Largest number of bytes yielded at once
+  ##
+  ## Example:
+  ##   ```nim
+  ##   for chunk in response.bodyChunks():
+  ##     stdout.write(chunk)
+  ##   ```
+  var buffer = newString(chunkSize)
+  while true:
+    buffer.setLen(chunkSize)
+    let bytesRead = response.readBody(addr buffer[0], chunkSize)
+    if bytesRead == 0:
+      break
+    buffer.setLen(bytesRead)
+    yield buffer
 
-  when response is AsyncResponse:
-    # Async path
-    while not tlsAsyncSocket.isClosed(client.socket):
-      let data = await client.socket.recv(net.BufferSize)
-      if data == "":
-        client.socket.close()
-        break # We've been disconnected.
-      await client.bodyStreamAsync.write(data)
-    client.bodyStreamAsync.complete()
-    return await client.bodyStreamAsync.readAll()
-  else:
-    # Sync path
-    var buffer = newString(net.BufferSize)
-    while not tlsSocket.isClosed2(client.socket):
-      let bytesRead = client.socket.recv(addr buffer[0], buffer.len)
-      if bytesRead <= 0:
-        client.socket.close()
-        break # We've been disconnected.
-      let data = buffer[0..<bytesRead]
-      client.bodyStreamSync.write(data)
-    client.bodyStreamSync.setPosition(0)
-    return client.bodyStreamSync.readAll()
+proc nextChunk*(response: Response | AsyncResponse;
+    chunkSize = BodyChunkSize): Future[string] {.multisync.} =
+  ## Receives the next piece of a successful response's body.
+  ##
+  ## This is the async counterpart of the bodyChunks() iterator: call it
+  ## until it returns an empty string, which means the whole body has been
+  ## read and the connection is closed.
+  ##
+  ## Parameters:
+  ##   response: The Response or AsyncResponse from a previous request call
+  ##   chunkSize: Largest number of bytes returned at once
+  ##
+  ## Returns:
+  ##   Up to `chunkSize` bytes of the body, or "" at its end
+  ##
+  ## Example:
+  ##   ```nim
+  ##   while true:
+  ##     let chunk = await response.nextChunk()
+  ##     if chunk.len == 0:
+  ##       break
+  ##     process(chunk)
+  ##   ```
+  var chunk = newString(chunkSize)
+  let bytesRead = await response.readBody(addr chunk[0], chunkSize)
+  chunk.setLen(bytesRead)
+  return chunk
+
+proc downloadTo*(response: Response | AsyncResponse; path: string): Future[
+    int64] {.multisync.} =
+  ## Writes the body of a successful response straight to a file.
+  ##
+  ## The body goes through a single reused BodyChunkSize buffer, so memory
+  ## use stays flat no matter how large the download is. An existing file at
+  ## `path` is replaced. The connection is closed once the body has been read,
+  ## or when writing the file fails.
+  ##
+  ## Parameters:
+  ##   response: The Response or AsyncResponse from a previous request call
+  ##   path: Filesystem path to write the body to
+  ##
+  ## Returns:
+  ##   The number of bytes written
+  ##
+  ## Raises:
+  ##   IOError: If the file cannot be opened or written
+  ##
+  ## Example:
+  ##   ```nim
+  ##   let response = client.request("gemini://example.com/image.png")
+  ##   if response.status == Status.Success:
+  ##     echo response.downloadTo("image.png"), " bytes saved"
+  ##   ```
+  var file: File
+  if not open(file, path, fmWrite):
+    response.client.close()
+    raise newException(IOError, "Cannot open " & path & " for writing")
+  var written: int64 = 0
+  try:
+    var buffer = newString(BodyChunkSize)
+    while true:
+      let bytesRead = await response.readBody(addr buffer[0], BodyChunkSize)
+      if bytesRead == 0:
+        break
+      if file.writeBuffer(addr buffer[0], bytesRead) != bytesRead:
+        raise newException(IOError, "Failed to write " & path)
+      written += bytesRead
+  finally:
+    file.close()
+    response.client.close()
+  return written
 
 proc close*(client: ObiwanClient | AsyncObiwanClient) =
   ## Manually closes the client's connection to the server.
@@ -503,7 +692,170 @@ proc close*(client: ObiwanClient | AsyncObiwanClient) =
   if not client.socket.isNil():
     client.socket.close()
 
+proc fetchMany*(client: AsyncObiwanClient; urls: seq[string];
+    concurrency = DefaultFetchConcurrency;
+    perHost = DefaultFetchPerHost): FutureStream[FetchResult] =
+  ## Requests many URLs at once and returns their results as they complete.
+  ##
+  ## An AsyncObiwanClient only has one connection, so a batch used to need a
+  ## client, and a TLS context, per request in flight. fetchMany() runs up to
+  ## `concurrency` requests at once, and no more than `perHost` of them to
+  ## the same host, all sharing the TLS context, client certificate and
+  ## session cache of `client`. Host names are resolved once thanks to the
+  ## address cache of dial(), on a thread so the batch keeps going
+  ## meanwhile. Bodies of successful responses are read into their result.
+  ##
+  ## `client` itself is left untouched and stays usable for other requests.
+  ##
+  ## Parameters:
+  ##   client: The client whose settings the requests use
+  ##   urls: The Gemini URLs to request
+  ##   concurrency: Most requests running at the same time
+  ##   perHost: Most requests running at the same time to a single host
+  ##
+  ## Returns:
+  ##   A stream with one FetchResult per URL, in completion order, that is
+  ##   completed once every URL has been handled
+  ##
+  ## Example:
+  ##   ```nim
+  ##   let results = client.fetchMany(feedUrls, concurrency = 64)
+  ##   while true:
+  ##     let (hasResult, item) = await results.read()
+  ##     if not hasResult:
+  ##       break
+  ##     if item.error.len > 0:
+  ##       echo item.url, ": ", item.error
+  ##     else:
+  ##       echo item.url, ": ", item.response.status, " ", item.body.len, " bytes"
+  ##   ```
+  assert concurrency > 0 and perHost > 0
+  let results = newFutureStream[FetchResult]("fetchMany")
+  var hosts = newSeq[string](urls.len)
+  for index, url in urls:
+    hosts[index] = parseUrl(url).hostname
+  var pending = initDeque[int]()
+  for index in 0 ..< urls.len:
+    pending.addLast(index)
+  var active: CountTable[string]
+  var running = 0
+  var done = false
+  var schedule: proc () {.closure, gcsafe.}
+
+  proc fetchOne(index: int) {.async.} =
+    # A client of its own only for the socket, the TLS context is shared
+    let fetcher = AsyncObiwanClient(maxRedirects: client.maxRedirects,
+                                    sslContext: client.sslContext)
+    var item = FetchResult(url: urls[index])
+    try:
+      item.response = await fetcher.request(urls[index])
+      if item.response.status == Status.Success:
+        item.body = await item.response.body()
+    except CatchableError as e:
+      item.error = e.msg
+      item.response = nil
+    fetcher.close()
+    await results.write(item)
+
+    dec running
+    active.inc(hosts[index], -1)
+    if active[hosts[index]] == 0:
+      active.del(hosts[index])
+    # Not from here, a request failing at once would re-enter schedule()
+    callSoon(schedule)
+
+  schedule = proc () =
+    # Start whatever the limits allow, keeping URLs of busy hosts queued
+    var waiting: seq[int]
+    while running < concurrency and pending.len > 0:
+      let index = pending.popFirst()
+      if active[hosts[index]] >= perHost:
+        waiting.add(index)
+        continue
+      active.inc(hosts[index])
+      inc running
+      asyncCheck fetchOne(index)
+    for i in countdown(waiting.high, 0):
+      pending.addFirst(waiting[i])
+    if running == 0 and pending.len == 0 and not done:
+      done = true
+      results.complete()
+
+  schedule()
+  return results
+
 # Server API
+const HeaderOverhead = 5 ## Status digits, space and CR LF around a response's meta
+
+proc addHeader(message: var string; status: Status; meta: string) {.inline.} =
+  ## Appends the `<status> <meta>\r\n` response header to `message`
+  message.addInt(status.int)
+  message.add(' ')
+  message.add(meta)
+  message.add("\r\n")
+
+proc recordPayload(client: MbedtlsSocket | MbedtlsAsyncSocket): int =
+  ## Most plaintext bytes the next TLS record of `client` carries
+  let size = if client.sslHandle.isNil: 0.cint # kTLS took over
+             else: mbedtls.mbedtls_ssl_get_max_out_record_payload(client.sslHandle)
+  let limit = recordLimit(client.recordSize, client.bytesWritten)
+  if size > 0: min(size.int, limit) else: min(StreamChunkSize, limit)
+
+proc respond*(req: Request | AsyncRequest; status: Status; meta: string;
+    body: pointer; bodyLen: int) {.multisync.} =
+  ## Sends a response whose body is `bodyLen` bytes at `body`.
+  ##
+  ## Works like respond() with a string body, for bodies that already sit
+  ## in memory elsewhere, such as a mapped content pack, so they are sent
+  ## without being copied into a string first. The memory must stay valid
+  ## until the response has been sent.
+  ##
+  ## Parameters:
+  ##   req: The Request or AsyncRequest to respond to
+  ##   status: The status code to send (see Status enum)
+  ##   meta: The meta information string (max 1024 characters)
+  ##   body: Start of the body (only sent for Status.Success)
+  ##   bodyLen: Length of the body in bytes
+  let sendStart = getMonoTime()
+  try:
+    assert meta.len <= 1024
+    req.status = status.int
+    let bodyLen = if status == Status.Success: bodyLen else: 0
+    let headerLen = meta.len + HeaderOverhead
+
+    # The header shares one buffer with the start of the body, so a small
+    # response leaves in a single TLS record instead of a tiny header record
+    # followed by the body
+    let data = cast[ptr UncheckedArray[byte]](body)
+    let first = min(bodyLen, max(StreamChunkSize - headerLen, 0))
+    var message = newStringOfCap(headerLen + first)
+    message.addHeader(status, meta)
+    if first > 0:
+      message.setLen(headerLen + first)
+      copyMem(addr message[headerLen], body, first)
+
+    # Records written one after another are packed into full segments
+    if headerLen + bodyLen > recordPayload(req.client):
+      req.client.cork()
+    when req is AsyncRequest:
+      await req.client.send(message)
+      if first < bodyLen:
+        await req.client.send(addr data[first], bodyLen - first)
+    else:
+      tlsSocket.sendAll(req.client, message)
+      if first < bodyLen:
+        tlsSocket.sendAll(req.client, addr data[first], bodyLen - first)
+    req.bytesSent += headerLen + bodyLen
+  except CatchableError:
+    echo getCurrentExceptionMsg()
+    req.status = Status.Error.int
+    when req is AsyncRequest:
+      await req.client.send($Status.Error.int & " INTERNAL ERROR\r\n")
+    else:
+      discard req.client.send($Status.Error.int & " INTERNAL ERROR\r\n")
+  req.client.flush()
+  req.sendTime += getMonoTime() - sendStart
+
 proc respond*(req: Request | AsyncRequest; status: Status; meta: string;
     body: string = "") {.multisync.} =
   ## Sends a response to a client according to the Gemini protocol specification.
@@ -526,6 +878,11 @@ proc respond*(req: Request | AsyncRequest; status: Status; meta: string;
   ##   meta: The meta information string (max 1024 characters)
   ##   body: Optional body content (only sent for Status.Success)
   ##
+  ## The header and up to StreamChunkSize bytes of the body are written from
+  ## one buffer, and responses spanning several TLS records are sent with the
+  ## connection corked (see flush()), so they leave in as few packets as
+  ## possible.
+  ##
   ## Raises:
   ##   AssertionDefect: If meta exceeds 1024 characters
   ##   Various exceptions may be caught internally and result in an error response
@@ -541,22 +898,310 @@ proc respond*(req: Request | AsyncRequest; status: Status; meta: string;
   ##   # Redirect
   ##   req.respond(Status.Redirect, "gemini://example.com/new-location")
   ##   ```
-  try:
-    assert meta.len <= 1024
+  let data: pointer = if body.len > 0: unsafeAddr body[0] else: nil
+  when req is AsyncRequest:
+    await req.respond(status, meta, data, body.len)
+  else:
+    req.respond(status, meta, data, body.len)
+
+proc respondFile*(req: Request | AsyncRequest; mimeType, path: string) {.multisync.} =
+  ## Streams a file from disk to the client as a successful Gemini response.
+  ##
+  ## Unlike respond(), the body is never held in memory as a whole. The file
+  ## is copied to the TLS connection in StreamChunkSize pieces through a
+  ## single reused buffer, the first one carrying the `20 <mimeType>` header
+  ## as well, so memory per connection stays flat no matter how large the
+  ## file is. Files spanning several TLS records are sent corked. On servers
+  ## with `ktls` enabled, larger files are sent with sendfile() once the
+  ## kernel has taken over encryption, falling back to the buffer when it
+  ## can't.
+  ##
+  ## Parameters:
+  ##   req: The Request or AsyncRequest to respond to
+  ##   mimeType: The MIME type to send in the response header
+  ##   path: Filesystem path of the file to stream
+  ##
+  ## Note:
+  ##   If the file cannot be opened, a `51 File not found` response is sent
+  ##   instead. Errors after the header has been sent simply end the stream,
+  ##   since the status can no longer be changed.
+  ##
+  ## Example:
+  ##   ```nim
+  ##   req.respondFile("audio/mpeg", "/srv/gemini/podcast/episode1.mp3")
+  ##   ```
+  assert mimeType.len <= 1024
+  var file: File
+  if not open(file, path, fmRead):
+    debug("Could not open file for streaming: " & path)
     when req is AsyncRequest:
-      await req.client.send($status.int & ' ' & meta & "\r\n")
-      if status == Status.Success:
-        await req.client.send(body)
+      await req.respond(Status.NotFound, "File not found")
     else:
-      discard req.client.send($status.int & ' ' & meta & "\r\n")
-      if status == Status.Success:
-        discard req.client.send(body)
+      req.respond(Status.NotFound, "File not found")
+    return
+
+  let sendStart = getMonoTime()
+  try:
+    req.status = Status.Success.int
+
+    # One buffer per response, reused for every chunk. The header is
+    # written at its front so that it leaves with the first chunk.
+    var buffer = newStringOfCap(StreamChunkSize)
+    buffer.addHeader(Status.Success, mimeType)
+    var pending = buffer.len
+    let fileSize = file.getFileSize()
+
+    # With kTLS, mbedTLS sends the header on its own, along with any session
+    # tickets still pending, and the kernel encrypts the body as sendfile()
+    # reads it from the page cache
+    if req.client.sslContext.ktls and fileSize > StreamChunkSize:
+      req.client.cork()
+      when req is AsyncRequest:
+        await req.client.send(addr buffer[0], pending)
+        await req.client.drain()
+      else:
+        tlsSocket.sendAll(req.client, addr buffer[0], pending)
+      req.bytesSent += pending
+      pending = 0
+      if req.client.startKtls():
+        when req is AsyncRequest:
+          await req.client.sendFile(file, 0, fileSize)
+        else:
+          req.client.sendFile(file, 0, fileSize)
+        req.bytesSent += fileSize.int
+        return
+
+    buffer.setLen(StreamChunkSize)
+    if pending + fileSize.int > recordPayload(req.client):
+      req.client.cork()
+    while true:
+      let room = StreamChunkSize - pending
+      let bytesRead = file.readBuffer(addr buffer[pending], room)
+      pending += max(bytesRead, 0)
+      if pending > 0:
+        when req is AsyncRequest:
+          await req.client.send(addr buffer[0], pending)
+        else:
+          tlsSocket.sendAll(req.client, addr buffer[0], pending)
+        req.bytesSent += pending
+        pending = 0
+      if bytesRead < room:
+        break
   except CatchableError:
-    echo getCurrentExceptionMsg()
-    when req is AsyncRequest:
-      await req.client.send($Status.Error.int & " INTERNAL ERROR\r\n")
+    # Once the header is on the wire, all we can do is stop streaming
+    debug("Error while streaming " & path & ": " & getCurrentExceptionMsg())
+  finally:
+    file.close()
+    req.client.flush()
+    req.sendTime += getMonoTime() - sendStart
+
+proc flush*(req: Request | AsyncRequest) =
+  ## Sends the part of a response held back by TCP corking right away.
+  ##
+  ## respond() and respondFile() cork the connection while they write a
+  ## response spanning several TLS records and flush it when they return,
+  ## so handlers using them never need this. Handlers writing a response
+  ## piece by piece through `req.client` can cork it themselves and call
+  ## flush() whenever the client should see what was sent so far.
+  ##
+  ## Parameters:
+  ##   req: The Request or AsyncRequest whose connection to flush
+  ##
+  ## Example:
+  ##   ```nim
+  ##   req.client.cork()
+  ##   await req.client.send("20 text/gemini\r\n# Progress\n")
+  ##   req.flush()
+  ##   ```
+  req.client.flush()
+
+const
+  BusyTimeout = 2 ## Seconds a rejected client may take to handshake and send its request
+  SlowDownSeconds = 1 ## Wait asked of clients over the per-address connection limit
+  RejectBacklog = 64 ## Over-limit connections answered at once, later ones are closed unanswered
+  DefaultMaxRequestLength* = 1024 ## Longest request URL allowed by the Gemini specification
+  DefaultHandshakeTimeoutMs* = 10_000 ## Default time a client has to complete the TLS handshake
+  DefaultRequestTimeoutMs* = 10_000 ## Default time a client has to send its request line
+  DefaultMaxConnections* = 1024 ## Default limit of open connections of the async server
+  DefaultMaxPerIp* = 32 ## Default limit of open connections per client address of the async server
+  DefaultDrainTimeoutMs* = 60_000 ## Default time the async server gives open connections when it stops accepting
+  DrainPollMs = 100 ## Interval at which a draining server checks for connections left
+
+proc lineLimit(server: ObiwanServer | AsyncObiwanServer): int {.inline.} =
+  ## Longest request URL parseRequestLine() should accept for `server`
+  if server.maxRequestLength > 0: server.maxRequestLength else: high(int)
+
+proc rejection(status: RequestLineStatus): string =
+  ## Response to a request line parseRequestLine() didn't accept
+  case status
+  of rlNotGemini: $Status.ProxyRefused.int & " PROXY REQUEST REFUSED\r\n"
+  of rlTooLong: $Status.MalformedRequest.int & " REQUEST TOO LONG\r\n"
+  else: $Status.MalformedRequest.int & " MALFORMED REQUEST\r\n"
+
+proc logRequest(server: ObiwanServer | AsyncObiwanServer; fd: cint; line: string;
+                request: Request | AsyncRequest; acceptedAt: MonoTime;
+                handshake: Duration) =
+  ## Adds a finished request to the server's access log
+  var entry = AccessLogEntry(peer: peerAddress(fd), url: line,
+                             handshake: handshake,
+                             total: getMonoTime() - acceptedAt)
+  if not request.isNil:
+    entry.status = request.status
+    entry.bytesSent = request.bytesSent
+    if request.hasCertificate():
+      try:
+        entry.fingerprint = tlsSocket.fingerprint(request.certificate)
+      except CatchableError:
+        discard
+  server.accessLog.log(entry)
+
+proc recordHandshakeFailure(metrics: Metrics) =
+  ## Counts the handshake failure that is being handled, by reason
+  if metrics.isNil:
+    return
+  let e = getCurrentException()
+  let code = if e of MbedtlsError: (ref MbedtlsError)(e).code
+             elif e of OSError: (ref OSError)(e).errorCode.int
+             else: 0
+  metrics.handshakeFailed(handshakeFailureReason(code))
+
+proc finishConnection(server: ObiwanServer | AsyncObiwanServer; fd: cint;
+                      line: string; request: Request | AsyncRequest;
+                      acceptedAt: MonoTime; handshake: Duration) =
+  ## Records a connection that is about to be closed in the server's
+  ## metrics and access log
+  let metrics = server.metrics
+  if line.len > 0:
+    if request.isNil:
+      metrics.requestServed(0, line.len + 2, 0)
     else:
-      discard req.client.send($Status.Error.int & " INTERNAL ERROR\r\n")
+      metrics.requestServed(request.status, line.len + 2, request.bytesSent)
+      metrics.observe(phSend, request.sendTime)
+    if not server.accessLog.isNil:
+      server.logRequest(fd, line, request, acceptedAt, handshake)
+  metrics.connectionClosed(acceptedAt)
+
+proc handleSyncClient(server: ObiwanServer; fd: cint;
+                      callback: proc(request: Request);
+                      acceptedAt: MonoTime) =
+  ## Serves one accepted connection of the synchronous server: performs the
+  ## handshake, reads the request, runs the callback and closes the socket.
+  ##
+  ## This runs on pool threads when the server has worker threads, so it
+  ## must not change the reference count of anything owned by the server.
+  ##
+  ## The handshake and request timeouts are deadlines for the whole phase,
+  ## like the async server's, enforced by the socket (see setDeadline).
+  ## Sending the response has none.
+  let metrics = server.metrics
+  metrics.connectionOpened()
+  var phaseStart = getMonoTime()
+  metrics.observe(phQueue, phaseStart - acceptedAt)
+
+  var handshakeTime: Duration
+  var handshakeDone = false
+  var line = ""
+  var request: Request = nil
+  var clientSocket = MbedtlsSocket(fd: fd)
+  try:
+    # Get the SSL context from the server
+    let ctx {.cursor.} = MbedtlsSslContext(server.sslContext)
+
+    # Initialize SSL on the client connection
+    debug("Initializing SSL for client connection")
+    clientSocket.setDeadline(server.handshakeTimeoutMs)
+    tlsSocket.wrapConnectedSocket(ctx, clientSocket,
+        tlsSocket.handshakeAsServer, "")
+    handshakeDone = true
+    handshakeTime = getMonoTime() - phaseStart
+    metrics.observe(phHandshake, handshakeTime)
+
+    # Read the request line
+    debug("Reading request line")
+    phaseStart = getMonoTime()
+    clientSocket.setDeadline(server.requestTimeoutMs)
+    try:
+      line = clientSocket.recvLine(server.maxRequestLength)
+    except LineTooLongError:
+      debug("Request line too long, rejecting")
+      discard clientSocket.send($Status.MalformedRequest.int & " REQUEST TOO LONG\r\n")
+      return
+    clientSocket.setDeadline(0)
+    metrics.observe(phRequest, getMonoTime() - phaseStart)
+
+    if line.len == 0:
+      debug("Empty request, closing connection")
+      return
+
+    debug("Received request: " & line)
+
+    # Parse the request (Gemini URL)
+    var target: RequestTarget
+    let parsed = parseRequestLine(line, target, lineLimit(server))
+    if parsed != rlValid:
+      debug("Rejecting request line: " & $parsed)
+      discard clientSocket.send(rejection(parsed))
+      return
+    let url = target.toUrl(line)
+
+    # Get client certificate if available
+    let sslCtx = clientSocket.getSslHandle()
+    let clientCert = mbedtls.mbedtls_ssl_get_peer_cert(sslCtx)
+    let verification = mbedtls.mbedtls_ssl_get_verify_result(sslCtx).int
+
+    # Create request object
+    request = Request(
+      url: url,
+      rawQuery: line[target.query],
+      certificate: clientCert,
+      verification: verification,
+      client: clientSocket
+    )
+
+    # Call the callback
+    phaseStart = getMonoTime()
+    try:
+      debug("Calling request handler")
+      callback(request)
+    except:
+      let errMsg = getCurrentExceptionMsg()
+      debug("Exception in request handler: " & errMsg)
+      # Try to send an error response
+      request.status = Status.Error.int
+      discard clientSocket.send($Status.Error.int & " INTERNAL SERVER ERROR\r\n")
+    metrics.observe(phHandler, getMonoTime() - phaseStart)
+
+  except:
+    let errMsg = getCurrentExceptionMsg()
+    debug("Error handling connection: " & errMsg)
+    if not handshakeDone:
+      metrics.recordHandshakeFailure()
+  finally:
+    server.finishConnection(fd, line, request, acceptedAt, handshakeTime)
+    # Close connection after handling request (or on error)
+    debug("Closing connection")
+    clientSocket.close()
+
+proc rejectSyncClient(server: ObiwanServer; fd: cint) =
+  ## Answers `41 SERVER UNAVAILABLE` on a connection there's no worker for.
+  ##
+  ## This runs on the server's rejection thread, never in the accept loop.
+  ## A slow client gets BusyTimeout seconds for the whole exchange, and the
+  ## rejection queue bounds how many wait.
+  server.metrics.connectionRejected()
+  var clientSocket = MbedtlsSocket(fd: fd)
+  clientSocket.setDeadline(BusyTimeout * 1000)
+  try:
+    let ctx {.cursor.} = MbedtlsSslContext(server.sslContext)
+    tlsSocket.wrapConnectedSocket(ctx, clientSocket,
+        tlsSocket.handshakeAsServer, "")
+    # Read the request first, closing with unread data would reset the connection
+    discard clientSocket.recvLine(server.maxRequestLength)
+    discard clientSocket.send($Status.ServerUnavailable.int & " SERVER UNAVAILABLE\r\n")
+  except:
+    debug("Error rejecting connection: " & getCurrentExceptionMsg())
+  finally:
+    clientSocket.close()
 
 # Method to accept connections for synchronous server
 proc serve*(server: ObiwanServer; port: int; callback: proc(request: Request);
@@ -568,8 +1213,16 @@ proc serve*(server: ObiwanServer; port: int; callback: proc(request: Request);
   ## the provided callback function with a Request object. The callback is responsible
   ## for calling respond() to send a response.
   ##
-  ## Note that this is a blocking operation that runs indefinitely until the process
-  ## is terminated.
+  ## Note that this is a blocking operation that runs until stopAccepting() is
+  ## called or the process is terminated. Once stopped, it finishes the
+  ## connections being handled and queued before returning.
+  ##
+  ## If the server was created with worker threads, connections are handed to a
+  ## pool and handled concurrently, and `callback` runs on the pool threads.
+  ## When `queueDepth` connections are already waiting for a worker, new ones
+  ## are answered with `41 SERVER UNAVAILABLE` by a separate thread, and
+  ## past RejectBacklog of those they're closed unanswered. Without worker threads each
+  ## connection is handled inline before the next one is accepted.
   ##
   ## Parameters:
   ##   server: The ObiwanServer instance created with newObiwanServer()
@@ -579,7 +1232,9 @@ proc serve*(server: ObiwanServer; port: int; callback: proc(request: Request);
   ##            possible dual-stack support (IPv4+IPv6) if supported by the operating system.
   ##
   ## Raises:
-  ##   ObiwanError: If the server fails to bind to the specified port
+  ##   ObiwanError: If the server fails to bind to the specified port, or has
+  ##                worker threads while mbedTLS was built without
+  ##                MBEDTLS_THREADING_C
   ##
   ## Example:
   ##   ```nim
@@ -591,6 +1246,12 @@ proc serve*(server: ObiwanServer; port: int; callback: proc(request: Request);
   ##   ```
   debug("Starting synchronous server on port " & $port)
 
+  # The worker threads share the TLS config, identity and ticket keys, which
+  # is only safe with mbedTLS's own locking
+  if server.threads > 0 and not mbedtls.threadingSupported():
+    raise newException(ObiwanError, "Worker threads need mbedTLS built with " &
+                       "MBEDTLS_THREADING_C (OBIWAN_TLS_PROFILE=minimal or hwaes)")
+
   # Create server socket
   var serverSocket: mbedtls.mbedtls_net_context
   mbedtls.mbedtls_net_init(addr serverSocket)
@@ -627,8 +1288,24 @@ proc serve*(server: ObiwanServer; port: int; callback: proc(request: Request);
   if obiwan.debug.getVerbosityLevel() > 0:
     echo "Server listening on " & bindAddr & ":" & portStr & " using " & socketTypeMsg
 
-  # Accept loop
-  while true:
+  # Hand connections to worker threads if the server has any
+  var workerPool: ConnectionPool = nil
+  var rejectPool: ConnectionPool = nil
+  if server.threads > 0:
+    debug("Starting " & $server.threads & " worker threads")
+    workerPool = newConnectionPool(server.threads, server.queueDepth,
+      proc (fd: cint; acceptedAt: MonoTime) {.gcsafe.} =
+        {.cast(gcsafe).}:
+          handleSyncClient(server, fd, callback, acceptedAt))
+    # Refusing a connection takes a handshake, which a slow client can drag
+    # out; it gets a thread of its own so the accept loop never waits on it
+    rejectPool = newConnectionPool(1, RejectBacklog,
+      proc (fd: cint; acceptedAt: MonoTime) {.gcsafe.} =
+        {.cast(gcsafe).}:
+          rejectSyncClient(server, fd))
+
+  # Accept loop, until stopAccepting() is called
+  while not server.draining:
     debug("Waiting for connection...")
 
     # Accept client connection
@@ -645,71 +1322,72 @@ proc serve*(server: ObiwanServer; port: int; callback: proc(request: Request);
       continue
 
     debug("Connection accepted, fd=" & $clientContext.fd)
-
-    try:
-      # Create socket wrapper
-      var clientSocket = MbedtlsSocket(fd: clientContext.fd)
-
-      # Get the SSL context from the server
-      let ctx = MbedtlsSslContext(server.sslContext)
-
-      # Initialize SSL on the client connection
-      debug("Initializing SSL for client connection")
-      tlsSocket.wrapConnectedSocket(ctx, clientSocket,
-          tlsSocket.handshakeAsServer, "")
-
-      # Read the request line
-      debug("Reading request line")
-      let line = clientSocket.recvLine()
-
-      if line.len == 0:
-        debug("Empty request, closing connection")
-        clientSocket.close()
-        continue
-
-      debug("Received request: " & line)
-
-      # Parse the request (Gemini URL)
-      let url = parseUrl(line)
-
-      # Get client certificate if available
-      let sslCtx = clientSocket.getSslHandle()
-      let clientCert = mbedtls.mbedtls_ssl_get_peer_cert(sslCtx)
-      let verification = mbedtls.mbedtls_ssl_get_verify_result(sslCtx).int
-
-      # Create request object
-      let request = Request(
-        url: url,
-        certificate: clientCert,
-        verification: verification,
-        client: clientSocket
-      )
-
-      # Call the callback
-      try:
-        debug("Calling request handler")
-        callback(request)
-      except:
-        let errMsg = getCurrentExceptionMsg()
-        debug("Exception in request handler: " & errMsg)
-        # Try to send an error response
-        discard clientSocket.send($Status.Error.int & " INTERNAL SERVER ERROR\r\n")
-
-      # Close connection after handling request
-      debug("Closing connection after handling request")
-      clientSocket.close()
-
-    except:
-      let errMsg = getCurrentExceptionMsg()
-      debug("Error handling connection: " & errMsg)
-      # Ensure we close the socket on error
-      if clientContext.fd >= 0:
-        mbedtls.mbedtls_net_free(addr clientContext)
-
-# Forward declaration
-proc handleAsyncClient(server: AsyncObiwanServer; clientSocket: AsyncSocket;
+    let acceptedAt = getMonoTime()
+
+    if workerPool.isNil:
+      handleSyncClient(server, clientContext.fd, callback, acceptedAt)
+    elif not workerPool.submit(clientContext.fd, acceptedAt):
+      debug("Worker queue full, rejecting connection")
+      if not rejectPool.submit(clientContext.fd, acceptedAt):
+        debug("Too many connections being rejected, closing connection")
+        server.metrics.connectionRejected()
+        discard posix.close(clientContext.fd)
+
+  # Stopped: the pools return once their queued connections are done
+  debug("Stopped accepting, finishing the connections being handled")
+  mbedtls.mbedtls_net_free(addr serverSocket)
+  if not workerPool.isNil:
+    workerPool.stop()
+    rejectPool.stop()
+
+# Forward declarations
+proc handleAsyncClient(server: AsyncObiwanServer; socket: MbedtlsAsyncSocket;
                       callback: proc(request: AsyncRequest): Future[
-                          void]): Future[void] {.async.}
+                          void]; acceptedAt: MonoTime;
+                      peer: string): Future[void] {.async.}
+proc rejectAsyncClient(server: AsyncObiwanServer; socket: MbedtlsAsyncSocket;
+                       status: Status): Future[void] {.async.}
+proc adoptAsyncSocket(clientSocket: AsyncSocket): MbedtlsAsyncSocket
+proc adoptUringSocket(ring: Uring; fd: cint): MbedtlsAsyncSocket
+
+proc listenerDomain(fd: cint): Domain =
+  ## The address family of a listening socket
+  var address: Sockaddr_storage
+  var length = sizeof(address).SockLen
+  if getsockname(SocketHandle(fd), cast[ptr SockAddr](addr address), addr length) == 0 and
+      address.ss_family.cint == posix.AF_INET6:
+    Domain.AF_INET6
+  else:
+    Domain.AF_INET
+
+proc wakeOnAccept[T](server: AsyncObiwanServer; accepting: Future[T]): Future[void] =
+  ## A future completing once `accepting` does, or stopAccepting() is
+  ## called. A new one each time, so that waiting doesn't pile callbacks on
+  ## a future that may never complete.
+  let wake = newFuture[void]("serve.accept")
+  server.acceptWaiter = wake
+  accepting.addCallback(proc () =
+    if not wake.finished:
+      wake.complete())
+  wake
+
+proc dispatchAsyncClient(server: AsyncObiwanServer; socket: MbedtlsAsyncSocket;
+                         callback: proc(request: AsyncRequest): Future[void];
+                         acceptedAt: MonoTime) =
+  ## Starts serving an accepted connection, or refusing it when the server
+  ## is over its limits
+  # Refuse connections over the limits rather than letting them queue up
+  let peer = if server.maxPerIp > 0: peerAddress(socket.fd)
+             else: ""
+  if server.maxConnections > 0 and server.connections >= server.maxConnections:
+    debug("Connection limit reached, rejecting connection")
+    asyncCheck rejectAsyncClient(server, socket, ServerUnavailable)
+  elif peer.len > 0 and server.peerConnections[peer] >= server.maxPerIp:
+    debug("Too many connections from " & peer & ", rejecting connection")
+    asyncCheck rejectAsyncClient(server, socket, Slowdown)
+  else:
+    # Process the connection in a separate async task
+    asyncCheck handleAsyncClient(server, socket, callback, acceptedAt, peer)
 
 # Method to accept connections for asynchronous server
 proc serve*(server: AsyncObiwanServer; port: int; callback: proc(
@@ -722,8 +1400,24 @@ proc serve*(server: AsyncObiwanServer; port: int; callback: proc(
   ## reads the request, and calls the provided async callback function with an AsyncRequest object.
   ## The callback is responsible for calling respond() to send a response.
   ##
-  ## Although this function runs asynchronously, it still runs indefinitely until the Future
-  ## is cancelled or the process is terminated.
+  ## Although this function runs asynchronously, it still runs indefinitely until
+  ## stopAccepting() is called or the process is terminated.
+  ##
+  ## Connections over the server's `maxConnections` are answered with
+  ## `41 SERVER UNAVAILABLE`, and those over `maxPerIp` from one address with
+  ## `44 SLOW DOWN`. Clients that don't finish the handshake within
+  ## `handshakeTimeoutMs`, or don't send their request within
+  ## `requestTimeoutMs` after it, are disconnected.
+  ##
+  ## With `ioUring` set on Linux, connections are accepted and served
+  ## through the thread's io_uring (see uring.nim) instead of asyncdispatch,
+  ## falling back to asyncdispatch where the kernel or build lacks it.
+  ##
+  ## With `listenFd` set, the server accepts on that listening socket, for
+  ## example one inherited from the process it replaces, and ignores `port`
+  ## and `address`. After stopAccepting(), it closes its listening socket,
+  ## waits up to `drainTimeoutMs` for the open connections to finish and
+  ## returns.
   ##
   ## Parameters:
   ##   server: The AsyncObiwanServer instance created with newAsyncObiwanServer()
@@ -733,7 +1427,7 @@ proc serve*(server: AsyncObiwanServer; port: int; callback: proc(
   ##            possible dual-stack support (IPv4+IPv6) if supported by the operating system.
   ##
   ## Returns:
-  ##   A Future that completes when the server stops running (which is normally never)
+  ##   A Future that completes once the server drained after stopAccepting()
   ##
   ## Example:
   ##   ```nim
@@ -748,108 +1442,249 @@ proc serve*(server: AsyncObiwanServer; port: int; callback: proc(
   ##   ```
   debug("Starting asynchronous server on port " & $port)
 
-  # Create an async server socket
-  var serverSocket = newAsyncSocket()
-
-  # Configure socket options
-  if server.reuseAddr:
-    serverSocket.setSockOpt(OptReuseAddr, true)
-  if server.reusePort:
-    serverSocket.setSockOpt(OptReusePort, true)
-
-  # Determine whether to use IPv6, and whether to attempt dual-stack mode
-  let useIPv6 = address == "::" or (address.contains('[') or address.count(':') > 1)
-
-  if useIPv6:
-    debug("Creating IPv6 socket")
-    # Create IPv6 socket
-    serverSocket = newAsyncSocket(Domain.AF_INET6)
-
-    # Attempt to disable IPV6_V6ONLY for dual-stack mode
-    # This is platform-specific and may not always work
-    debug("Trying to enable dual-stack mode (IPv4+IPv6)")
-
-    # We'll be more conservative and skip dual-stack configuration
-    # This mode is OS-specific anyway, and some systems enable it by default
-    # while others don't support it at all
-    #
-    # Users who need specific socket configurations should use their own
-    # socket setup and pass it to the library
-
-  # Determine binding address
-  let bindAddr = if address == "" or address == "0.0.0.0":
-                   if useIPv6: "::" else: "0.0.0.0"
-                 else:
-                   address
-
-  debug("Binding async server to " & bindAddr & ":" & $port)
-  serverSocket.bindAddr(Port(port), bindAddr)
-  serverSocket.listen()
-
-  # Determine what type of socket we're using for the user message
-  let socketTypeMsg = if useIPv6:
-    "IPv6" # Simple message - dual-stack support depends on OS configuration
+  var serverSocket: AsyncSocket
+  if server.listenFd >= 0:
+    # A listening socket handed over by the process that served before
+    # this one, which may still be accepting on it (see upgrade.nim)
+    let fd = AsyncFD(server.listenFd)
+    register(fd)
+    serverSocket = newAsyncSocket(fd, listenerDomain(server.listenFd))
+    debug("Serving on inherited listening socket " & $server.listenFd)
+    if obiwan.debug.getVerbosityLevel() > 0:
+      echo "Async server listening on inherited socket " & $server.listenFd
   else:
-    "IPv4"
-
-  debug("Server listening on " & (if address == "" or address ==
-      "0.0.0.0": "*" else: address) & ":" & $port & " using " & socketTypeMsg)
-  # Only show server listening message if verbose level is 1 or higher
-  if obiwan.debug.getVerbosityLevel() > 0:
-    echo "Async server listening on " & (if address == "" or address ==
-        "0.0.0.0": "*" else: address) & ":" & $port & " using " & socketTypeMsg
-
-  # Accept loop
-  while true:
+    # Determine whether to use IPv6, and whether to attempt dual-stack mode
+    let useIPv6 = address == "::" or (address.contains('[') or address.count(':') > 1)
+
+    # Create an async server socket
+    if useIPv6:
+      debug("Creating IPv6 socket")
+      # Create IPv6 socket
+      serverSocket = newAsyncSocket(Domain.AF_INET6)
+    else:
+      serverSocket = newAsyncSocket()
+
+    # Configure socket options before binding. SO_REUSEPORT lets several
+    # worker processes listen on the same port.
+    if server.reuseAddr:
+      serverSocket.setSockOpt(OptReuseAddr, true)
+    if server.reusePort:
+      serverSocket.setSockOpt(OptReusePort, true)
+
+    if useIPv6:
+
+      # Attempt to disable IPV6_V6ONLY for dual-stack mode
+      # This is platform-specific and may not always work
+      debug("Trying to enable dual-stack mode (IPv4+IPv6)")
+
+      # We'll be more conservative and skip dual-stack configuration
+      # This mode is OS-specific anyway, and some systems enable it by default
+      # while others don't support it at all
+      #
+      # Users who need specific socket configurations should use their own
+      # socket setup and pass it to the library
+
+    # Determine binding address
+    let bindAddr = if address == "" or address == "0.0.0.0":
+                     if useIPv6: "::" else: "0.0.0.0"
+                   else:
+                     address
+
+    debug("Binding async server to " & bindAddr & ":" & $port)
+    serverSocket.bindAddr(Port(port), bindAddr)
+    serverSocket.listen()
+
+    # Determine what type of socket we're using for the user message
+    let socketTypeMsg = if useIPv6:
+      "IPv6" # Simple message - dual-stack support depends on OS configuration
+    else:
+      "IPv4"
+
+    debug("Server listening on " & (if address == "" or address ==
+        "0.0.0.0": "*" else: address) & ":" & $port & " using " & socketTypeMsg)
+    # Only show server listening message if verbose level is 1 or higher
+    if obiwan.debug.getVerbosityLevel() > 0:
+      echo "Async server listening on " & (if address == "" or address ==
+          "0.0.0.0": "*" else: address) & ":" & $port & " using " & socketTypeMsg
+
+  server.listenFd = serverSocket.getFd().cint
+
+  # With io_uring, one multishot accept feeds the loop
+  let ring = if server.ioUring: threadRing() else: nil
+  if server.ioUring and ring.isNil:
+    echo "io_uring not available, using asyncdispatch"
+  var acceptor = if ring.isNil: nil
+                 else: ring.newAcceptor(serverSocket.getFd().cint)
+
+  # Accept loop, until stopAccepting() is called
+  while not server.draining:
     # Wait for a new connection
     debug("Waiting for async connection...")
 
     # Accept incoming connection
-    var clientSocket: AsyncSocket
+    var socket: MbedtlsAsyncSocket
     try:
-      clientSocket = await serverSocket.accept()
-      debug("Connection accepted, socket=" & $int(clientSocket.getFd()))
+      if acceptor.isNil:
+        let accepting = serverSocket.accept()
+        await server.wakeOnAccept(accepting)
+        if not accepting.finished:
+          continue # Woken by stopAccepting()
+        socket = adoptAsyncSocket(accepting.read())
+      else:
+        let accepting = acceptor.accept()
+        await server.wakeOnAccept(accepting)
+        if not accepting.finished:
+          continue
+        socket = adoptUringSocket(ring, accepting.read())
+      debug("Connection accepted, socket=" & $socket.fd)
     except:
       let errMsg = getCurrentExceptionMsg()
       debug("Error accepting connection: " & errMsg)
+      if not acceptor.isNil and acceptor.unsupported:
+        echo "Multishot accept not supported by the kernel, using asyncdispatch"
+        acceptor = nil
+        continue
       await sleepAsync(500) # Wait a bit before trying again
       continue
 
-    # Process the connection in a separate async task
-    asyncCheck handleAsyncClient(server, clientSocket, callback)
+    server.dispatchAsyncClient(socket, callback, getMonoTime())
+
+  # Draining. Only this process's copy of the listening socket is closed, a
+  # process it was handed to keeps accepting on it.
+  debug("Stopped accepting, draining " & $server.connections & " connections")
+  if not acceptor.isNil:
+    for fd in acceptor.stop():
+      server.dispatchAsyncClient(adoptUringSocket(ring, fd), callback, getMonoTime())
+  serverSocket.close()
+  server.listenFd = -1
+
+  let drainStart = getMonoTime()
+  while server.connections > 0 or server.rejecting > 0:
+    if server.drainTimeoutMs > 0 and
+        (getMonoTime() - drainStart).inMilliseconds >= server.drainTimeoutMs:
+      debug("Drain timeout, leaving " & $server.connections & " connections")
+      break
+    await sleepAsync(DrainPollMs)
+
+proc adoptAsyncSocket(clientSocket: AsyncSocket): MbedtlsAsyncSocket =
+  ## Wraps an accepted socket for TLS. The wrapper closes the descriptor.
+  result = newMbedtlsAsyncSocket()
+  result.fd = clientSocket.getFd().cint
+  result.sock = clientSocket.getFd().int
+  result.domain = if clientSocket.isSsl: posix.AF_INET else: 2 # Default to AF_INET
+
+proc adoptUringSocket(ring: Uring; fd: cint): MbedtlsAsyncSocket =
+  ## Wraps a connection accepted on the ring, whose I/O stays on the ring.
+  ## It isn't registered with the async dispatcher.
+  result = newMbedtlsAsyncSocket()
+  result.fd = fd
+  result.uring = ring.newConn(fd)
+
+proc withDeadline(fut: Future[void]; ms: int; what: string) {.async.} =
+  ## Waits for `fut`, failing when it takes longer than `ms` milliseconds
+  ## (0 = no limit). The error code classifies the failure as a timeout.
+  ##
+  ## `fut` is still pending then. The caller closes the socket, which fails
+  ## the wait `fut` is parked on (see MbedtlsAsyncSocket.close), so it
+  ## finishes with an error nobody reads instead of leaking.
+  if ms > 0 and not (await withTimeout(fut, ms)):
+    raise (ref OSError)(msg: what & " timed out",
+                        errorCode: mbedtls.MBEDTLS_ERR_SSL_TIMEOUT.int32)
+  await fut
+
+proc withDeadline(fut: Future[string]; ms: int; what: string): Future[string] {.async.} =
+  ## Waits for `fut`, failing when it takes longer than `ms` milliseconds,
+  ## see withDeadline() above
+  if ms > 0 and not (await withTimeout(fut, ms)):
+    raise (ref OSError)(msg: what & " timed out",
+                        errorCode: mbedtls.MBEDTLS_ERR_SSL_TIMEOUT.int32)
+  return await fut
+
+proc rejectAsyncClient(server: AsyncObiwanServer; socket: MbedtlsAsyncSocket;
+                       status: Status) {.async.} =
+  ## Answers `status` on a connection over the server's limits. The client
+  ## gets BusyTimeout seconds for the handshake and the request, and once
+  ## RejectBacklog connections are being refused new ones are just closed.
+  server.metrics.connectionRejected()
+  if server.rejecting >= RejectBacklog:
+    debug("Too many connections being rejected, closing connection")
+    socket.close()
+    return
+
+  inc server.rejecting
+  try:
+    let ctx = MbedtlsSslContext(server.sslContext)
+    await withDeadline(tlsAsyncSocket.wrapConnectedSocket(ctx, socket,
+        tlsAsyncSocket.handshakeAsServer, ""), BusyTimeout * 1000, "Handshake")
+    # Read the request first, closing with unread data would reset the connection
+    discard await withDeadline(socket.recvLine(server.maxRequestLength),
+                               BusyTimeout * 1000, "Request line")
+    let meta = if status == Slowdown: $SlowDownSeconds else: "SERVER UNAVAILABLE"
+    await socket.send($status.int & " " & meta & "\r\n")
+  except:
+    debug("Error rejecting async connection: " & getCurrentExceptionMsg())
+  finally:
+    dec server.rejecting
+    socket.close()
 
 # Helper proc to handle async client in a separate task
-proc handleAsyncClient(server: AsyncObiwanServer; clientSocket: AsyncSocket;
+proc handleAsyncClient(server: AsyncObiwanServer; socket: MbedtlsAsyncSocket;
                        callback: proc(request: AsyncRequest): Future[
-                           void]): Future[void] {.async.} =
-  # Build socket wrapper
-  var socket = newMbedtlsAsyncSocket()
-  socket.fd = clientSocket.getFd().cint
-  socket.sock = clientSocket.getFd().int
-  socket.domain = if clientSocket.isSsl: posix.AF_INET else: 2 # Default to AF_INET
-
+                           void]; acceptedAt: MonoTime;
+                       peer: string): Future[void] {.async.} =
+  # Counted before the first await, so the accept loop sees it right away
+  inc server.connections
+  if peer.len > 0:
+    server.peerConnections.inc(peer)
+
+  let metrics = server.metrics
+  metrics.connectionOpened()
+  var phaseStart = getMonoTime()
+  metrics.observe(phQueue, phaseStart - acceptedAt)
+
+  var handshakeTime: Duration
+  var handshakeDone = false
+  var line = ""
+  var request: AsyncRequest = nil
   try:
     # Get the SSL context from the server
     let ctx = MbedtlsSslContext(server.sslContext)
 
     # Initialize SSL on the client connection
     debug("Initializing SSL for async client connection")
-    await tlsAsyncSocket.wrapConnectedSocket(ctx, socket,
-        tlsAsyncSocket.handshakeAsServer, "")
+    await withDeadline(tlsAsyncSocket.wrapConnectedSocket(ctx, socket,
+        tlsAsyncSocket.handshakeAsServer, ""), server.handshakeTimeoutMs,
+        "Handshake")
+    handshakeDone = true
+    handshakeTime = getMonoTime() - phaseStart
+    metrics.observe(phHandshake, handshakeTime)
 
     # Read the request line
     debug("Reading async request line")
-    let line = await socket.recvLine()
+    phaseStart = getMonoTime()
+    try:
+      line = await withDeadline(socket.recvLine(server.maxRequestLength),
+                                server.requestTimeoutMs, "Request line")
+    except LineTooLongError:
+      debug("Async request line too long, rejecting")
+      await socket.send($Status.MalformedRequest.int & " REQUEST TOO LONG\r\n")
+      return
+    metrics.observe(phRequest, getMonoTime() - phaseStart)
 
     if line.len == 0:
       debug("Empty async request, closing connection")
-      socket.close()
       return
 
     debug("Received async request: " & line)
 
     # Parse the request (Gemini URL)
-    let url = parseUrl(line)
+    var target: RequestTarget
+    let parsed = parseRequestLine(line, target, lineLimit(server))
+    if parsed != rlValid:
+      debug("Rejecting async request line: " & $parsed)
+      await socket.send(rejection(parsed))
+      return
+    let url = target.toUrl(line)
 
     # Get client certificate if available
     let sslCtx = socket.getSslHandle()
@@ -857,14 +1692,16 @@ proc handleAsyncClient(server: AsyncObiwanServer; clientSocket: AsyncSocket;
     let verification = mbedtls.mbedtls_ssl_get_verify_result(sslCtx).int
 
     # Create request object
-    let request = AsyncRequest(
+    request = AsyncRequest(
       url: url,
+      rawQuery: line[target.query],
       certificate: clientCert,
       verification: verification,
       client: socket
     )
 
     # Call the callback
+    phaseStart = getMonoTime()
     try:
       debug("Calling async request handler")
       await callback(request)
@@ -872,20 +1709,50 @@ proc handleAsyncClient(server: AsyncObiwanServer; clientSocket: AsyncSocket;
       let errMsg = getCurrentExceptionMsg()
       debug("Exception in async request handler: " & errMsg)
       # Try to send an error response
+      request.status = Status.Error.int
       await socket.send($Status.Error.int & " INTERNAL SERVER ERROR\r\n")
-
-    # Close connection after handling request
-    debug("Closing async connection after handling request")
-    socket.close()
+    metrics.observe(phHandler, getMonoTime() - phaseStart)
   except:
     let errMsg = getCurrentExceptionMsg()
     debug("Error handling async connection: " & errMsg)
-    # Ensure we close the socket on error
+    if not handshakeDone:
+      metrics.recordHandshakeFailure()
+  finally:
+    server.finishConnection(socket.fd, line, request, acceptedAt, handshakeTime)
+    # Close connection after handling request (or on error)
+    debug("Closing async connection")
     socket.close()
+    dec server.connections
+    if peer.len > 0:
+      let left = server.peerConnections[peer] - 1
+      if left > 0:
+        server.peerConnections[peer] = left
+      else:
+        server.peerConnections.del(peer)
 
 # Server creation
+proc newServerContext(certFile, keyFile: string): MbedtlsSslContext =
+  ## A server TLS context presenting the certificate and key of the files
+  result = tlsSocket.newContext(isServer = true)
+
+  # Load certificate and key, parsed once per process however many servers
+  # use them
+  if certFile != "" and keyFile != "":
+    try:
+      result.useIdentity(certFile, keyFile)
+    except MbedtlsError as e:
+      raise newException(ObiwanError, e.msg)
+
+  # Set custom verify to allow self-signed client certificates
+  tlsSocket.setCustomVerify(result)
+
+  # Set authentication mode to OPTIONAL - we don't want to require client certificates
+  mbedtls.mbedtls_ssl_conf_authmode(addr result.config,
+      mbedtls.MBEDTLS_SSL_VERIFY_OPTIONAL)
+
 proc newObiwanServer*(reuseAddr = true; reusePort = false; certFile = "";
-    keyFile = ""; sessionId = ""): ObiwanServer =
+    keyFile = ""; sessionId = ""; threads = 0; queueDepth = 64;
+    ticketRotation = DefaultTicketRotation): ObiwanServer =
   ## Creates a new synchronous Gemini protocol server.
   ##
   ## This function creates a synchronous server for handling Gemini protocol requests.
@@ -901,7 +1768,15 @@ proc newObiwanServer*(reuseAddr = true; reusePort = false; certFile = "";
   ##   reusePort: Allow multiple bindings to same port (default: false)
   ##   certFile: Path to server certificate file in PEM format (required for production)
   ##   keyFile: Path to server private key file in PEM format (required for production)
-  ##   sessionId: Optional custom session ID for TLS session resumption
+  ##   sessionId: Optional secret for TLS session resumption. Servers sharing
+  ##              it accept each other's session tickets.
+  ##   ticketRotation: Seconds between session ticket key rotations (default:
+  ##                   12 hours, 0 disables session tickets)
+  ##   threads: Worker threads that handle connections concurrently (default: 0,
+  ##            connections are handled one at a time in the accept loop).
+  ##            Needs mbedTLS built with MBEDTLS_THREADING_C.
+  ##   queueDepth: Accepted connections that may wait for a free worker before
+  ##               new ones are answered with 41 SERVER UNAVAILABLE (default: 64)
   ##
   ## Returns:
   ##   A new ObiwanServer instance that can be used with serve()
@@ -910,58 +1785,23 @@ proc newObiwanServer*(reuseAddr = true; reusePort = false; certFile = "";
   ##   ObiwanError: If certificate or key files cannot be loaded
   ##
   ## Note:
-  ##   If sessionId is not provided, a random one will be generated.
+  ##   If sessionId is not provided, a random one will be generated, so
+  ##   session tickets don't survive a restart.
   ##   For testing, you can omit certFile and keyFile, but for production use,
   ##   valid certificate and key files are required.
-  result = ObiwanServer(reuseAddr: reuseAddr, reusePort: reusePort)
-
-  # Create TLS context
-  var actualContext = tlsSocket.newContext()
+  ##   The request length limit and the timeouts start at their Default
+  ##   constants and can be changed on the returned server before serve().
+  result = ObiwanServer(reuseAddr: reuseAddr, reusePort: reusePort,
+                        threads: threads, queueDepth: queueDepth, listenFd: -1,
+                        maxRequestLength: DefaultMaxRequestLength,
+                        handshakeTimeoutMs: DefaultHandshakeTimeoutMs,
+                        requestTimeoutMs: DefaultRequestTimeoutMs)
+
+  # Create TLS context, cheap since the crypto state is shared
+  let actualContext = newServerContext(certFile, keyFile)
   # Store concrete context directly
   result.sslContext = actualContext
 
-  # Configure for server mode
-  discard mbedtls.mbedtls_ssl_config_defaults(
-    addr actualContext.config,
-    mbedtls.MBEDTLS_SSL_IS_SERVER,
-    mbedtls.MBEDTLS_SSL_TRANSPORT_STREAM,
-    mbedtls.MBEDTLS_SSL_PRESET_DEFAULT)
-
-  # Load certificate and key
-  if certFile != "" and keyFile != "":
-    let ret1 = mbedtls.mbedtls_x509_crt_parse_file(addr actualContext.cert, certFile)
-    if ret1 != 0:
-      raise newException(ObiwanError, "Failed to parse certificate file")
-
-    # Parse the key - platform-specific implementation
-    debug("Loading private key from: " & keyFile)
-
-    let ret2 =
-      mbedtls.mbedtls_pk_parse_keyfile(
-        addr actualContext.key, keyFile, nil,
-        mbedtls.mbedtls_ctr_drbg_random, addr actualContext.ctr_drbg)
-
-    if ret2 != 0:
-      # Get a more detailed error message
-      var errorStr = newString(100)
-      mbedtls.mbedtls_strerror(ret2, cast[cstring](addr errorStr[0]), 100)
-      raise newException(ObiwanError, "Failed to parse key file: " & errorStr &
-          " (code: " & $ret2 & ")")
-
-    # Configure certificate in SSL context
-    let ret3 = mbedtls.mbedtls_ssl_conf_own_cert(addr actualContext.config,
-                                          addr actualContext.cert,
-                                          addr actualContext.key)
-    if ret3 != 0:
-      raise newException(ObiwanError, "Failed to set own certificate")
-
-  # Set custom verify to allow self-signed client certificates
-  tlsSocket.setCustomVerify(actualContext)
-
-  # Set authentication mode to OPTIONAL - we don't want to require client certificates
-  mbedtls.mbedtls_ssl_conf_authmode(addr actualContext.config,
-      mbedtls.MBEDTLS_SSL_VERIFY_OPTIONAL)
-
   # Generate session ID if needed
   var id: string
   if sessionId == "":
@@ -971,12 +1811,13 @@ proc newObiwanServer*(reuseAddr = true; reusePort = false; certFile = "";
   else:
     id = sessionId
 
-  # Set session ID
-  # mbedtls doesn't have session ID context in this version, we'll implement it later
-  #discard mbedtls.mbedtls_ssl_conf_session_id_context(addr actualContext.config, cast[ptr uint8](id.cstring), id.len.uint)
+  # Session tickets replace session IDs in TLS 1.3; the ID is the secret the
+  # ticket keys are derived from
+  enableSessionTickets(actualContext, id, ticketRotation)
 
 proc newAsyncObiwanServer*(reuseAddr = true; reusePort = false; certFile = "";
-    keyFile = ""; sessionId = ""): AsyncObiwanServer =
+    keyFile = ""; sessionId = "";
+    ticketRotation = DefaultTicketRotation): AsyncObiwanServer =
   ## Creates a new asynchronous Gemini protocol server.
   ##
   ## This function creates an asynchronous server for handling Gemini protocol requests
@@ -992,7 +1833,10 @@ proc newAsyncObiwanServer*(reuseAddr = true; reusePort = false; certFile = "";
   ##   reusePort: Allow multiple bindings to same port (default: false)
   ##   certFile: Path to server certificate file in PEM format (required for production)
   ##   keyFile: Path to server private key file in PEM format (required for production)
-  ##   sessionId: Optional custom session ID for TLS session resumption
+  ##   sessionId: Optional secret for TLS session resumption. Servers sharing
+  ##              it accept each other's session tickets.
+  ##   ticketRotation: Seconds between session ticket key rotations (default:
+  ##                   12 hours, 0 disables session tickets)
   ##
   ## Returns:
   ##   A new AsyncObiwanServer instance that can be used with serve()
@@ -1001,58 +1845,26 @@ proc newAsyncObiwanServer*(reuseAddr = true; reusePort = false; certFile = "";
   ##   ObiwanError: If certificate or key files cannot be loaded
   ##
   ## Note:
-  ##   If sessionId is not provided, a random one will be generated.
+  ##   If sessionId is not provided, a random one will be generated, so
+  ##   session tickets don't survive a restart.
   ##   For testing, you can omit certFile and keyFile, but for production use,
   ##   valid certificate and key files are required.
-  result = AsyncObiwanServer(reuseAddr: reuseAddr, reusePort: reusePort)
-
-  # Create TLS context
-  var actualContext = tlsSocket.newContext()
+  ##   The connection limits, the request length limit and the timeouts start
+  ##   at their Default constants and can be changed on the returned server
+  ##   before serve().
+  result = AsyncObiwanServer(reuseAddr: reuseAddr, reusePort: reusePort,
+                             maxRequestLength: DefaultMaxRequestLength,
+                             handshakeTimeoutMs: DefaultHandshakeTimeoutMs,
+                             requestTimeoutMs: DefaultRequestTimeoutMs,
+                             maxConnections: DefaultMaxConnections,
+                             maxPerIp: DefaultMaxPerIp, listenFd: -1,
+                             drainTimeoutMs: DefaultDrainTimeoutMs)
+
+  # Create TLS context, cheap since the crypto state is shared
+  let actualContext = newServerContext(certFile, keyFile)
   # Store concrete context directly
   result.sslContext = actualContext
 
-  # Configure for server mode
-  discard mbedtls.mbedtls_ssl_config_defaults(
-    addr actualContext.config,
-    mbedtls.MBEDTLS_SSL_IS_SERVER,
-    mbedtls.MBEDTLS_SSL_TRANSPORT_STREAM,
-    mbedtls.MBEDTLS_SSL_PRESET_DEFAULT)
-
-  # Load certificate and key
-  if certFile != "" and keyFile != "":
-    let ret1 = mbedtls.mbedtls_x509_crt_parse_file(addr actualContext.cert, certFile)
-    if ret1 != 0:
-      raise newException(ObiwanError, "Failed to parse certificate file")
-
-    # Parse the key - platform-specific implementation
-    debug("Loading private key from: " & keyFile)
-
-    let ret2 =
-      mbedtls.mbedtls_pk_parse_keyfile(
-        addr actualContext.key, keyFile, nil,
-        mbedtls.mbedtls_ctr_drbg_random, addr actualContext.ctr_drbg)
-
-    if ret2 != 0:
-      # Get a more detailed error message
-      var errorStr = newString(100)
-      mbedtls.mbedtls_strerror(ret2, cast[cstring](addr errorStr[0]), 100)
-      raise newException(ObiwanError, "Failed to parse key file: " & errorStr &
-          " (code: " & $ret2 & ")")
-
-    # Configure certificate in SSL context
-    let ret3 = mbedtls.mbedtls_ssl_conf_own_cert(addr actualContext.config,
-                                          addr actualContext.cert,
-                                          addr actualContext.key)
-    if ret3 != 0:
-      raise newException(ObiwanError, "Failed to set own certificate")
-
-  # Set custom verify to allow self-signed client certificates
-  tlsSocket.setCustomVerify(actualContext)
-
-  # Set authentication mode to OPTIONAL - we don't want to require client certificates
-  mbedtls.mbedtls_ssl_conf_authmode(addr actualContext.config,
-      mbedtls.MBEDTLS_SSL_VERIFY_OPTIONAL)
-
   # Generate session ID if needed
   var id: string
   if sessionId == "":
@@ -1061,3 +1873,60 @@ proc newAsyncObiwanServer*(reuseAddr = true; reusePort = false; certFile = "";
     discard randomBytes(id)
   else:
     id = sessionId
+
+  # Session tickets replace session IDs in TLS 1.3; the ID is the secret the
+  # ticket keys are derived from
+  enableSessionTickets(actualContext, id, ticketRotation)
+
+proc reloadCertificates*(server: AsyncObiwanServer; certFile, keyFile: string) =
+  ## Switches the server to a new TLS context presenting the certificate and
+  ## key in the files, for example after they were renewed.
+  ##
+  ## The new context takes over the settings of the current one (record
+  ## size, cipher suites, kTLS) and its session ticket keys, so clients keep
+  ## resuming their sessions. Connections accepted from now on use it.
+  ## Those already open hold on to the context they started with and finish
+  ## on it; it is freed when the last of them closes, and so is its
+  ## certificate once no other context presents it. Files that changed
+  ## since they were loaded are parsed again, even when rewritten within
+  ## the same second.
+  ##
+  ## Parameters:
+  ##   server: The server to update, while it serves or before
+  ##   certFile: Path to the certificate chain in PEM format
+  ##   keyFile: Path to its private key in PEM format
+  ##
+  ## Raises:
+  ##   ObiwanError: If the files can't be loaded; the server keeps the
+  ##                current context then
+  let current = MbedtlsSslContext(server.sslContext)
+  let context = newServerContext(certFile, keyFile)
+  try:
+    context.setRecordSize(current.recordSize)
+    context.setCipherSuites(current.cipherSuites)
+  except MbedtlsError as e:
+    raise newException(ObiwanError, e.msg)
+  context.ktls = current.ktls
+  context.poolSize = current.poolSize
+  shareSessionTickets(context, current)
+  server.sslContext = context
+  debug("Switched to certificate " & certFile)
+
+proc stopAccepting*(server: ObiwanServer) =
+  ## Makes serve() of a synchronous server stop accepting connections and
+  ## return once those being handled are done. It only sets a flag, so it
+  ## can be called from a signal handler; one installed without SA_RESTART
+  ## also interrupts the accept serve() is waiting in.
+  server.draining = true
+
+proc stopAccepting*(server: AsyncObiwanServer) =
+  ## Makes serve() stop accepting connections and return once those open
+  ## are done, or after `drainTimeoutMs`. Call it once another process
+  ## accepts on the listening socket (see upgrade.nim), or to shut down
+  ## without cutting downloads short.
+  if server.draining:
+    return
+  server.draining = true
+  let wake = server.acceptWaiter
+  if not wake.isNil and not wake.finished:
+    wake.complete()
@@ -0,0 +1,215 @@
+## ObiWAN Access Log Module
+##
+## This module writes one line per served request without ever blocking the
+## request path on log I/O. Finished lines are copied into a fixed-size ring
+## buffer in shared memory; a background thread writes out whatever has
+## accumulated in one write() call every FlushInterval milliseconds, or
+## sooner once the buffer is half full. When the buffer is full, new entries
+## are dropped and counted instead of waiting for the writer.
+##
+## Lines are written in logfmt:
+##
+##   time=2025-01-31T12:00:00Z peer=192.0.2.7 status=20 bytes=1832
+##   handshake_ms=4.12 total_ms=5.03 cert=- url="gemini://example.com/"
+##
+## The log is shared by all threads of a server; worker processes each open
+## their own, and O_APPEND keeps their lines from overwriting each other.
+
+import std/locks
+import std/typedthreads
+import std/posix
+import std/os
+import std/times
+import std/strutils
+import std/nativesockets
+
+const
+  DefaultAccessLogBuffer* = 64 * 1024 ## Default ring buffer size in bytes
+  FlushInterval = 500                 # Milliseconds between flushes
+  PollInterval = 20                   # Milliseconds between checks for a half-full buffer
+
+type
+  AccessLogEntry* = object
+    ## A finished request, as passed to log()
+    peer*: string           ## Client IP address
+    url*: string            ## Requested URL as sent by the client
+    status*: int            ## Gemini status code sent (0 if none)
+    bytesSent*: int         ## Bytes sent to the client, header included
+    handshake*: Duration    ## Time spent in the TLS handshake
+    total*: Duration        ## Time from accept to the end of the response
+    fingerprint*: string    ## Client certificate fingerprint, empty if none
+
+  AccessLogObj = object
+    lock: Lock
+    fd: cint
+    ownsFd: bool
+    timestamps: bool
+    buffer: ptr UncheckedArray[char]  # Ring buffer of finished lines
+    capacity: int
+    head: int
+    count: int
+    dropped: int
+    stopping: bool
+    writer: Thread[AccessLog]
+
+  AccessLog* = ptr AccessLogObj
+    ## An access log with its background writer thread
+
+proc writeAll(fd: cint, data: ptr char, len: int) =
+  var offset = 0
+  while offset < len:
+    let n = posix.write(fd, cast[pointer](cast[int](data) + offset), len - offset)
+    if n < 0:
+      if errno == EINTR:
+        continue
+      return # Nothing sensible to do about a broken log, keep serving
+    offset += n
+
+proc flushLocked(log: AccessLog, scratch: var string) =
+  ## Moves the buffered lines into `scratch`. Called with the lock held.
+  scratch.setLen(log.count)
+  let first = min(log.count, log.capacity - log.head)
+  if first > 0:
+    copyMem(addr scratch[0], addr log.buffer[log.head], first)
+  if log.count > first:
+    copyMem(addr scratch[first], addr log.buffer[0], log.count - first)
+  log.head = 0
+  log.count = 0
+
+proc flushDue(log: AccessLog): bool =
+  withLock log.lock:
+    result = log.stopping or log.count * 2 >= log.capacity
+
+proc writerLoop(log: AccessLog) {.thread.} =
+  var scratch = newStringOfCap(log.capacity)
+  var dropped = 0
+  while true:
+    # Flush on a timer, or early when the buffer fills up
+    var waited = 0
+    while waited < FlushInterval and not log.flushDue():
+      sleep(PollInterval)
+      waited += PollInterval
+
+    acquire(log.lock)
+    let stopping = log.stopping
+    log.flushLocked(scratch)
+    dropped = log.dropped
+    log.dropped = 0
+    release(log.lock)
+
+    if dropped > 0:
+      scratch.add("dropped=" & $dropped & " msg=\"access log buffer full\"\n")
+    if scratch.len > 0:
+      writeAll(log.fd, addr scratch[0], scratch.len)
+    if stopping:
+      break
+
+proc newAccessLog*(path = ""; bufferSize = DefaultAccessLogBuffer;
+                   timestamps = true): AccessLog =
+  ## Opens an access log and starts its writer thread
+  ##
+  ## Parameters:
+  ##   path: File to append to, created if needed (empty for stdout)
+  ##   bufferSize: Bytes of log lines held in memory before entries are dropped
+  ##   timestamps: Include the time of each request
+  ##
+  ## Returns:
+  ##   The running access log. Close it with close() to flush and release it.
+  ##
+  ## Raises:
+  ##   IOError: If the log file can't be opened
+  var fd: cint = STDOUT_FILENO
+  if path.len > 0:
+    fd = posix.open(path.cstring, O_WRONLY or O_CREAT or O_APPEND or O_CLOEXEC, 0o644)
+    if fd < 0:
+      raise newException(IOError, "Failed to open access log " & path & ": " &
+                         osErrorMsg(osLastError()))
+
+  result = createShared(AccessLogObj)
+  initLock(result.lock)
+  result.fd = fd
+  result.ownsFd = path.len > 0
+  result.timestamps = timestamps
+  result.capacity = max(bufferSize, 1024)
+  result.buffer = cast[ptr UncheckedArray[char]](allocShared0(result.capacity))
+  createThread(result.writer, writerLoop, result)
+
+proc quoted(s: string): string =
+  result = "\""
+  for c in s:
+    case c
+    of '"', '\\':
+      result.add('\\')
+      result.add(c)
+    of '\0'..'\31', '\127':
+      result.add("\\x" & toHex(ord(c), 2))
+    else:
+      result.add(c)
+  result.add('"')
+
+proc millis(d: Duration): string =
+  formatFloat(d.inMicroseconds.float / 1000.0, ffDecimal, 2)
+
+proc formatEntry*(entry: AccessLogEntry; timestamps = true): string =
+  ## Formats an entry as one logfmt line, newline included
+  if timestamps:
+    result.add("time=" & now().utc.format("yyyy-MM-dd'T'HH:mm:ss'Z'") & ' ')
+  result.add("peer=" & (if entry.peer.len > 0: entry.peer else: "-"))
+  result.add(" status=" & $entry.status)
+  result.add(" bytes=" & $entry.bytesSent)
+  result.add(" handshake_ms=" & millis(entry.handshake))
+  result.add(" total_ms=" & millis(entry.total))
+  result.add(" cert=" & (if entry.fingerprint.len > 0: entry.fingerprint else: "-"))
+  result.add(" url=" & quoted(entry.url))
+  result.add('\n')
+
+proc log*(log: AccessLog, entry: AccessLogEntry): bool {.discardable.} =
+  ## Queues an entry for the writer thread. Never blocks on I/O.
+  ##
+  ## Returns:
+  ##   `true` if the entry was queued, `false` if the buffer was full and
+  ##   the entry was dropped
+  let line = formatEntry(entry, log.timestamps)
+  acquire(log.lock)
+  if log.stopping or log.count + line.len > log.capacity:
+    inc log.dropped
+    release(log.lock)
+    return false
+  let tail = (log.head + log.count) mod log.capacity
+  let first = min(line.len, log.capacity - tail)
+  copyMem(addr log.buffer[tail], unsafeAddr line[0], first)
+  if line.len > first:
+    copyMem(addr log.buffer[0], unsafeAddr line[first], line.len - first)
+  log.count += line.len
+  release(log.lock)
+  return true
+
+proc dropped*(log: AccessLog): int =
+  ## Returns the number of entries dropped since the last flush
+  withLock log.lock:
+    result = log.dropped
+
+proc close*(log: AccessLog) =
+  ## Writes out the buffered entries, stops the writer thread and releases
+  ## the log. It can't be used afterwards.
+  withLock log.lock:
+    log.stopping = true
+  joinThread(log.writer)
+
+  if log.ownsFd:
+    discard posix.close(log.fd)
+  deallocShared(log.buffer)
+  deinitLock(log.lock)
+  deallocShared(log)
+
+proc peerAddress*(fd: cint): string =
+  ## Returns the IP address of the peer of a connected socket, or "" if it
+  ## isn't known
+  var address: Sockaddr_storage
+  var length = sizeof(address).SockLen
+  if getpeername(SocketHandle(fd), cast[ptr SockAddr](addr address), addr length) != 0:
+    return ""
+  try:
+    result = getAddrString(cast[ptr SockAddr](addr address))
+  except CatchableError:
+    result = ""
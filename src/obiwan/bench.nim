@@ -0,0 +1,351 @@
+## ObiWAN Benchmark Client
+##
+## This module provides a load generator for Gemini servers built on
+## `AsyncObiwanClient`. It keeps a number of connections busy for a fixed
+## time, cycling through a list of URLs, and reports requests per second,
+## bytes per second and latency percentiles, overall and per URL.
+##
+## Usage:
+##   obiwan-bench [options] <url>...
+##
+## Options:
+##   -h --help               Show this help screen
+##   -c --concurrency=<n>    Concurrent connections [default: 16]
+##   -d --duration=<sec>     Seconds to run [default: 10]
+##   -n --requests=<n>       Stop after this many requests, 0 = run for the duration [default: 0]
+##   -p --processes=<n>      Processes generating load [default: 1]
+##   --no-resume             Do a full handshake on every connection
+##   --label=<name>          Name of the run in the report [default: obiwan]
+##   --json                  Print the report as JSON
+##   --cert=<file>           Client certificate file for authentication
+##   --key=<file>            Client key file for authentication
+##   --version               Show version information
+##
+## Gemini closes the connection after every response, so each request is a
+## new connection and a new handshake. Each connection keeps the session
+## ticket of its previous one and resumes it unless --no-resume is given.
+##
+## URLs are requested in turn; repeat a URL to give it more weight, e.g.
+## `obiwan-bench gemini://localhost/ gemini://localhost/ gemini://localhost/big.bin`
+## asks for the index twice as often as the large file.
+##
+## The JSON report has the same fields as the text one, so runs of different
+## releases or server modes can be compared with `jq` or a script.
+
+import asyncdispatch
+import strutils
+import tables
+import json
+import algorithm
+import posix
+import std/monotimes
+import std/times
+import docopt
+import "../obiwan"
+
+const doc = """
+ObiWAN Gemini Benchmark
+
+Usage:
+  obiwan-bench [options] <url>...
+
+Options:
+  -h --help               Show this help screen
+  -c --concurrency=<n>    Concurrent connections [default: 16]
+  -d --duration=<sec>     Seconds to run [default: 10]
+  -n --requests=<n>       Stop after this many requests, 0 = run for the duration [default: 0]
+  -p --processes=<n>      Processes generating load [default: 1]
+  --no-resume             Do a full handshake on every connection
+  --label=<name>          Name of the run in the report [default: obiwan]
+  --json                  Print the report as JSON
+  --cert=<file>           Client certificate file for authentication
+  --key=<file>            Client key file for authentication
+  --version               Show version information
+"""
+
+const version = "ObiWAN Gemini Benchmark v" & ObiwanVersion
+
+type
+  Settings = object
+    ## What one load-generating process does
+    urls: seq[string]
+    concurrency: int      ## Connections kept busy at once
+    requests: int         ## Requests to make, 0 = until the deadline
+    duration: Duration
+    resume: bool          ## Resume TLS sessions on later connections
+    certFile, keyFile: string
+
+  UrlStats = object
+    ## Results for one URL of the mix
+    url: string
+    requests: int
+    errors: int
+    bytes: int
+    latencies: seq[int]   ## Microseconds from connecting to the end of the body
+
+  RunStats = object
+    ## Results of one process, merged into the report
+    elapsedUs: int
+    urls: seq[UrlStats]
+    headerLatencies: seq[int] ## Microseconds from connecting to the response header
+    statuses: Table[string, int]
+    errors: Table[string, int] ## Error messages and how often they happened
+
+  BenchRun = ref object
+    settings: Settings
+    stats: RunStats
+    started: int
+    deadline: MonoTime
+
+proc micros(d: Duration): int = d.inMicroseconds.int
+
+proc connectionLoop(run: BenchRun; first: int) {.async.} =
+  ## Makes requests one after the other until the run is over, starting
+  ## with URL `first` of the mix
+  let settings = run.settings
+  let client = newAsyncObiwanClient(maxRedirects = 0,
+                                    certFile = settings.certFile,
+                                    keyFile = settings.keyFile)
+  # Bodies are counted, not kept
+  var buffer = newString(BodyChunkSize)
+  var next = first
+  while getMonoTime() < run.deadline and
+        (settings.requests == 0 or run.started < settings.requests):
+    inc run.started
+    let index = next mod settings.urls.len
+    inc next
+
+    if not settings.resume:
+      MbedtlsSslContext(client.sslContext).sessions.clear()
+
+    let start = getMonoTime()
+    try:
+      let response = await client.request(settings.urls[index])
+      run.stats.headerLatencies.add(micros(getMonoTime() - start))
+      var size = 0
+      if response.status == Success:
+        while true:
+          let bytesRead = await response.readBody(addr buffer[0], buffer.len)
+          if bytesRead == 0:
+            break
+          size += bytesRead
+      else:
+        client.close()
+
+      let key = $response.status.int
+      run.stats.statuses[key] = run.stats.statuses.getOrDefault(key) + 1
+      inc run.stats.urls[index].requests
+      run.stats.urls[index].bytes += size
+      run.stats.urls[index].latencies.add(micros(getMonoTime() - start))
+    except CatchableError as e:
+      client.close()
+      inc run.stats.urls[index].errors
+      run.stats.errors[e.msg] = run.stats.errors.getOrDefault(e.msg) + 1
+
+proc runLoad(settings: Settings): RunStats =
+  ## Runs the connections of one process and returns what they measured
+  let run = BenchRun(settings: settings)
+  for url in settings.urls:
+    run.stats.urls.add(UrlStats(url: url))
+
+  let start = getMonoTime()
+  run.deadline = start + settings.duration
+  var loops: seq[Future[void]]
+  for i in 0 ..< settings.concurrency:
+    loops.add(connectionLoop(run, i))
+  waitFor all(loops)
+  run.stats.elapsedUs = micros(getMonoTime() - start)
+  result = run.stats
+
+proc merge(total: var RunStats; part: RunStats) =
+  ## Adds the results of one process to `total`
+  total.elapsedUs = max(total.elapsedUs, part.elapsedUs)
+  if total.urls.len == 0:
+    total.urls = part.urls
+  else:
+    for i, urlStats in part.urls:
+      total.urls[i].requests += urlStats.requests
+      total.urls[i].errors += urlStats.errors
+      total.urls[i].bytes += urlStats.bytes
+      total.urls[i].latencies.add(urlStats.latencies)
+  total.headerLatencies.add(part.headerLatencies)
+  for status, count in part.statuses:
+    total.statuses[status] = total.statuses.getOrDefault(status) + count
+  for message, count in part.errors:
+    total.errors[message] = total.errors.getOrDefault(message) + count
+
+proc portion(value, parts, index: int): int =
+  ## Share of `value` for part `index` when dividing it into `parts`
+  value div parts + (if index < value mod parts: 1 else: 0)
+
+proc runProcesses(settings: Settings; processes: int): RunStats =
+  ## Runs the load in `processes` forked processes and merges their
+  ## results, which each child sends back as JSON through a pipe
+  if processes <= 1:
+    return runLoad(settings)
+
+  var pipes: seq[cint]
+  var children: seq[Pid]
+  for i in 0 ..< processes:
+    var share = settings
+    share.concurrency = portion(settings.concurrency, processes, i)
+    share.requests = portion(settings.requests, processes, i)
+    if share.concurrency == 0 or (settings.requests > 0 and share.requests == 0):
+      continue
+
+    var fds: array[2, cint]
+    if pipe(fds) != 0:
+      raise newException(OSError, "Failed to create pipe: " & $strerror(errno))
+    let pid = fork()
+    if pid < 0:
+      raise newException(OSError, "Failed to fork: " & $strerror(errno))
+    if pid == 0:
+      discard close(fds[0])
+      var output: File
+      if open(output, FileHandle(fds[1]), fmWrite):
+        output.write($(%runLoad(share)))
+        output.close()
+      quit(QuitSuccess)
+    discard close(fds[1])
+    pipes.add(fds[0])
+    children.add(pid)
+
+  for fd in pipes:
+    var input: File
+    if not open(input, FileHandle(fd), fmRead):
+      raise newException(IOError, "Failed to read benchmark results")
+    let data = input.readAll()
+    input.close()
+    if data.len > 0:
+      result.merge(parseJson(data).to(RunStats))
+  for pid in children:
+    var status: cint
+    discard waitpid(pid, status, 0)
+
+proc percentileMs(sorted: seq[int]; q: float): float =
+  ## Latency at quantile `q` of sorted microsecond samples, in milliseconds
+  if sorted.len == 0:
+    return 0.0
+  sorted[min(int(q * sorted.len.float), sorted.high)].float / 1000.0
+
+proc latencyReport(samples: seq[int]): JsonNode =
+  ## Latency summary of microsecond samples, in milliseconds
+  let sorted = samples.sorted()
+  var total = 0
+  for sample in sorted:
+    total += sample
+  %*{
+    "mean": (if sorted.len > 0: total.float / sorted.len.float / 1000.0 else: 0.0),
+    "p50": percentileMs(sorted, 0.50),
+    "p90": percentileMs(sorted, 0.90),
+    "p99": percentileMs(sorted, 0.99),
+    "max": percentileMs(sorted, 1.0)
+  }
+
+proc buildReport(label: string; settings: Settings; processes: int;
+                 stats: RunStats): JsonNode =
+  ## Builds the report of a run. The text report is rendered from it too.
+  let seconds = max(stats.elapsedUs, 1).float / 1_000_000.0
+  var requests, errors, bytes = 0
+  var allLatencies: seq[int]
+  var urls = newJArray()
+  for urlStats in stats.urls:
+    requests += urlStats.requests
+    errors += urlStats.errors
+    bytes += urlStats.bytes
+    allLatencies.add(urlStats.latencies)
+    urls.add(%*{
+      "url": urlStats.url,
+      "requests": urlStats.requests,
+      "errors": urlStats.errors,
+      "bytes": urlStats.bytes,
+      "bytes_per_request": (if urlStats.requests > 0: urlStats.bytes div urlStats.requests else: 0),
+      "total_ms": latencyReport(urlStats.latencies)
+    })
+
+  %*{
+    "label": label,
+    "version": version,
+    "concurrency": settings.concurrency,
+    "processes": processes,
+    "resume": settings.resume,
+    "duration_s": seconds,
+    "requests": requests,
+    "errors": errors,
+    "bytes": bytes,
+    "requests_per_s": requests.float / seconds,
+    "handshakes_per_s": requests.float / seconds, # Failed ones are in errors_per_s
+    "errors_per_s": errors.float / seconds,
+    "bytes_per_s": bytes.float / seconds,
+    "statuses": %stats.statuses,
+    "error_messages": %stats.errors,
+    "header_ms": latencyReport(stats.headerLatencies),
+    "total_ms": latencyReport(allLatencies),
+    "urls": urls
+  }
+
+proc formatLatency(node: JsonNode): string =
+  "p50 " & formatFloat(node["p50"].getFloat, ffDecimal, 2) &
+    "  p90 " & formatFloat(node["p90"].getFloat, ffDecimal, 2) &
+    "  p99 " & formatFloat(node["p99"].getFloat, ffDecimal, 2) &
+    "  max " & formatFloat(node["max"].getFloat, ffDecimal, 2)
+
+proc printReport(report: JsonNode) =
+  ## Prints a report for people
+  echo "ObiWAN benchmark: ", report["label"].getStr
+  echo "  Duration:     ", formatFloat(report["duration_s"].getFloat, ffDecimal, 2),
+       " s, ", report["concurrency"].getInt, " connections in ",
+       report["processes"].getInt, " process(es), session resumption ",
+       (if report["resume"].getBool: "on" else: "off")
+  echo "  Requests:     ", report["requests"].getInt, " (",
+       formatFloat(report["requests_per_s"].getFloat, ffDecimal, 1), "/s), ",
+       report["errors"].getInt, " errors (",
+       formatFloat(report["errors_per_s"].getFloat, ffDecimal, 1), "/s)"
+  echo "  Transferred:  ", formatSize(report["bytes"].getInt), " (",
+       formatSize(report["bytes_per_s"].getFloat.int), "/s)"
+  var statuses: seq[string]
+  for status, count in report["statuses"]:
+    statuses.add(status & "=" & $count.getInt)
+  echo "  Statuses:     ", statuses.join(" ")
+  echo "  Header ms:    ", formatLatency(report["header_ms"])
+  echo "  Total ms:     ", formatLatency(report["total_ms"])
+  for urlReport in report["urls"]:
+    echo "  ", urlReport["url"].getStr
+    echo "    ", urlReport["requests"].getInt, " requests, ",
+         urlReport["errors"].getInt, " errors, ",
+         formatSize(urlReport["bytes_per_request"].getInt), " each, ",
+         formatLatency(urlReport["total_ms"])
+  for message, count in report["error_messages"]:
+    echo "  Error (", count.getInt, "x): ", message
+
+# Main application code
+when isMainModule:
+  let args = docopt(doc, version = version)
+
+  try:
+    var settings = Settings(
+      concurrency: parseInt($args["--concurrency"]),
+      requests: parseInt($args["--requests"]),
+      duration: initDuration(milliseconds = int(parseFloat($args["--duration"]) * 1000)),
+      resume: not args["--no-resume"],
+      certFile: if args["--cert"]: $args["--cert"] else: "",
+      keyFile: if args["--key"]: $args["--key"] else: ""
+    )
+    for url in @(args["<url>"]):
+      settings.urls.add(url)
+    if settings.concurrency < 1:
+      raise newException(ValueError, "concurrency must be at least 1")
+    # With a request count the run ends when it's reached
+    if settings.requests > 0:
+      settings.duration = initDuration(days = 1)
+
+    let processes = max(parseInt($args["--processes"]), 1)
+    let stats = runProcesses(settings, processes)
+    let report = buildReport($args["--label"], settings, processes, stats)
+    if args["--json"]:
+      echo report.pretty()
+    else:
+      printReport(report)
+  except CatchableError:
+    echo "Error: ", getCurrentExceptionMsg()
+    quit(QuitFailure)
@@ -0,0 +1,286 @@
+## ObiWAN Content Cache Module
+##
+## This module provides a bounded, in-memory LRU cache for content served
+## from the document root. Entries are keyed by sanitized filesystem path and
+## hold the body and MIME type of small files, index pages and pre-rendered
+## directory listings, so hot pages skip the stat/open/read and walkDir work
+## on every request.
+##
+## Entries are invalidated through inotify on Linux. When inotify isn't
+## available (or a watch can't be added), entries are revalidated by comparing
+## the modification time of their source at most once per revalidation interval.
+##
+## A ContentCache can be shared by the worker threads of the synchronous
+## server; every operation takes the cache's lock.
+
+import std/os
+import std/tables
+import std/lists
+import std/times
+import std/monotimes
+import std/locks
+
+when defined(linux):
+  import std/inotify
+  import std/posix
+
+const
+  DefaultCacheEntries* = 4096               ## Default maximum number of entries
+  DefaultCacheBytes* = 64 * 1024 * 1024     ## Default maximum total size (64MB)
+  DefaultCacheFileSize* = 256 * 1024        ## Default maximum size of one file (256KB)
+  DefaultRevalidateMs* = 1000               ## Default mtime revalidation interval
+
+type
+  CachedContent* = object
+    ## A cached response body
+    content*: string    ## Body to send to the client
+    mimeType*: string   ## MIME type of the body
+    source*: string     ## File (or directory, for listings) the body was built from
+    mtime*: Time        ## Modification time of the source when the body was built
+    watched: bool       # Whether inotify reports changes to the source
+    checkedAt: MonoTime # Last time the mtime was revalidated
+
+  CacheItem = tuple[key: string, entry: CachedContent]
+
+  ContentCache* = ref object
+    ## Bounded LRU cache for docroot content
+    maxEntries*: int            ## Maximum number of cached entries
+    maxBytes*: int              ## Maximum total size of cached entries in bytes
+    maxFileSize*: int           ## Files larger than this are never cached
+    revalidateInterval*: Duration ## Minimum time between mtime checks of an entry
+    hits*: int                  ## Number of lookups served from the cache
+    misses*: int                ## Number of lookups not served from the cache
+    lock: Lock
+    totalBytes: int
+    lru: DoublyLinkedList[CacheItem]
+    index: Table[string, DoublyLinkedNode[CacheItem]]
+    when defined(linux):
+      inotifyFd: cint
+      watches: Table[cint, string]     # watch descriptor -> directory
+      watchedDirs: Table[string, cint] # directory -> watch descriptor
+
+proc cacheKey*(path: string): string =
+  ## Normalizes a filesystem path for use as a cache key
+  ##
+  ## Trailing separators are removed so that `/docroot/dir` and
+  ## `/docroot/dir/` share a single entry.
+  result = path
+  while result.len > 1 and result[^1] == DirSep:
+    result.setLen(result.len - 1)
+
+proc newContentCache*(maxEntries = DefaultCacheEntries;
+                      maxBytes = DefaultCacheBytes;
+                      maxFileSize = DefaultCacheFileSize;
+                      revalidateMs = DefaultRevalidateMs;
+                      useInotify = true): ContentCache =
+  ## Creates a new content cache
+  ##
+  ## Parameters:
+  ##   maxEntries: Maximum number of cached entries
+  ##   maxBytes: Maximum total size of cached entries in bytes
+  ##   maxFileSize: Files larger than this are streamed from disk instead of cached
+  ##   revalidateMs: Minimum interval between mtime checks of one entry
+  ##                 (0 checks on every hit). Only used for entries that
+  ##                 aren't watched through inotify.
+  ##   useInotify: Use inotify for invalidation where available (Linux only)
+  ##
+  ## Returns:
+  ##   A new, empty ContentCache
+  result = ContentCache(
+    maxEntries: maxEntries,
+    maxBytes: maxBytes,
+    maxFileSize: maxFileSize,
+    revalidateInterval: initDuration(milliseconds = revalidateMs)
+  )
+  initLock(result.lock)
+  when defined(linux):
+    result.inotifyFd = -1
+    if useInotify:
+      result.inotifyFd = inotify_init1(O_NONBLOCK or O_CLOEXEC)
+
+proc entrySize(item: CacheItem): int =
+  item.key.len + item.entry.content.len + item.entry.mimeType.len +
+    item.entry.source.len
+
+proc removeNode(cache: ContentCache, node: DoublyLinkedNode[CacheItem]) =
+  cache.totalBytes -= entrySize(node.value)
+  cache.index.del(node.value.key)
+  cache.lru.remove(node)
+
+proc len*(cache: ContentCache): int =
+  ## Returns the number of cached entries
+  withLock cache.lock:
+    result = cache.index.len
+
+proc size*(cache: ContentCache): int =
+  ## Returns the total size of cached entries in bytes
+  withLock cache.lock:
+    result = cache.totalBytes
+
+proc invalidateLocked(cache: ContentCache, path: string) =
+  let node = cache.index.getOrDefault(cacheKey(path))
+  if not node.isNil:
+    cache.removeNode(node)
+
+proc clearLocked(cache: ContentCache) =
+  cache.index.clear()
+  cache.lru = initDoublyLinkedList[CacheItem]()
+  cache.totalBytes = 0
+
+proc invalidate*(cache: ContentCache, path: string) =
+  ## Drops the entry for `path` from the cache, if there is one
+  withLock cache.lock:
+    cache.invalidateLocked(path)
+
+proc clear*(cache: ContentCache) =
+  ## Drops every entry from the cache
+  withLock cache.lock:
+    cache.clearLocked()
+
+when defined(linux):
+  proc processEvents(cache: ContentCache) =
+    ## Drains pending inotify events and invalidates the affected entries.
+    ##
+    ## An event for `name` inside a watched directory invalidates both that
+    ## path and the directory's own entry (its listing or index page).
+    if cache.inotifyFd < 0:
+      return
+
+    var buffer: array[4096, byte]
+    while true:
+      let n = posix.read(cache.inotifyFd, addr buffer[0], buffer.len)
+      if n <= 0:
+        break # EAGAIN: no more events
+
+      for event in inotify_events(addr buffer[0], n):
+        if (event.mask and IN_Q_OVERFLOW.uint32) != 0:
+          # Events were lost, we can't tell what changed
+          cache.clearLocked()
+          continue
+
+        let dir = cache.watches.getOrDefault(event.wd)
+        if dir == "":
+          continue
+
+        if event.len > 0:
+          cache.invalidateLocked(dir / $cast[cstring](addr event.name))
+        cache.invalidateLocked(dir)
+
+        if (event.mask and IN_IGNORED.uint32) != 0:
+          # The directory is gone, so is the watch
+          cache.watches.del(event.wd)
+          cache.watchedDirs.del(dir)
+
+  proc watchDir(cache: ContentCache, dir: string): bool =
+    ## Ensures `dir` is watched, returning false if it can't be
+    if cache.inotifyFd < 0:
+      return false
+    if dir in cache.watchedDirs:
+      return true
+
+    const mask = IN_MODIFY or IN_ATTRIB or IN_CLOSE_WRITE or IN_MOVED_FROM or
+                 IN_MOVED_TO or IN_CREATE or IN_DELETE or IN_DELETE_SELF or
+                 IN_MOVE_SELF
+    let wd = inotify_add_watch(cache.inotifyFd, dir.cstring, mask.uint32)
+    if wd < 0:
+      return false # Most likely out of watches, fall back to mtime checks
+    cache.watches[wd] = dir
+    cache.watchedDirs[dir] = wd
+    return true
+
+proc get*(cache: ContentCache, path: string, value: var CachedContent): bool =
+  ## Looks up the entry for `path`
+  ##
+  ## A hit moves the entry to the front of the LRU list. Stale entries are
+  ## dropped and reported as misses.
+  ##
+  ## Parameters:
+  ##   path: The sanitized filesystem path of the request
+  ##   value: Receives the cached entry on a hit
+  ##
+  ## Returns:
+  ##   `true` if a fresh entry was found, `false` otherwise
+  withLock cache.lock:
+    when defined(linux):
+      cache.processEvents()
+
+    let node = cache.index.getOrDefault(cacheKey(path))
+    if node.isNil:
+      inc cache.misses
+      return false
+
+    if not node.value.entry.watched:
+      let now = getMonoTime()
+      if now - node.value.entry.checkedAt >= cache.revalidateInterval:
+        var stale = false
+        try:
+          stale = getLastModificationTime(node.value.entry.source) != node.value.entry.mtime
+        except OSError:
+          stale = true # Source was removed
+        if stale:
+          cache.removeNode(node)
+          inc cache.misses
+          return false
+        node.value.entry.checkedAt = now
+
+    # Most recently used entries live at the head of the list
+    cache.lru.remove(node)
+    cache.lru.prepend(node)
+    inc cache.hits
+    value = node.value.entry
+    return true
+
+proc put*(cache: ContentCache, path, content, mimeType, source: string;
+          mtime: Time; isDirectory = false) =
+  ## Adds or replaces the entry for `path`
+  ##
+  ## Least recently used entries are evicted until the cache fits its limits.
+  ## Entries larger than the whole cache are not stored.
+  ##
+  ## Parameters:
+  ##   path: The sanitized filesystem path of the request
+  ##   content: The body to cache
+  ##   mimeType: MIME type of the body
+  ##   source: The file the body was read from, or the directory for listings
+  ##   mtime: Modification time of `source`, taken before it was read
+  ##   isDirectory: Whether `source` is a directory (a generated listing)
+  withLock cache.lock:
+    let key = cacheKey(path)
+    cache.invalidateLocked(key)
+
+    var item: CacheItem = (key: key, entry: CachedContent(
+      content: content,
+      mimeType: mimeType,
+      source: source,
+      mtime: mtime,
+      checkedAt: getMonoTime()
+    ))
+    let itemSize = entrySize(item)
+    if itemSize > cache.maxBytes or cache.maxEntries <= 0:
+      return
+
+    when defined(linux):
+      let dir = if isDirectory: cacheKey(source) else: cacheKey(source.parentDir)
+      item.entry.watched = cache.watchDir(dir)
+
+    # Evict from the tail until the new entry fits
+    while cache.lru.tail != nil and
+          (cache.index.len >= cache.maxEntries or
+           cache.totalBytes + itemSize > cache.maxBytes):
+      cache.removeNode(cache.lru.tail)
+
+    let node = newDoublyLinkedNode(item)
+    cache.lru.prepend(node)
+    cache.index[key] = node
+    cache.totalBytes += itemSize
+
+proc close*(cache: ContentCache) =
+  ## Releases the cache's entries and its inotify descriptor
+  withLock cache.lock:
+    cache.clearLocked()
+    when defined(linux):
+      if cache.inotifyFd >= 0:
+        discard posix.close(cache.inotifyFd)
+        cache.inotifyFd = -1
+      cache.watches.clear()
+      cache.watchedDirs.clear()
@@ -5,7 +5,7 @@
 ## It uses the ObiWAN library and supports configuration via TOML files.
 ##
 ## Usage:
-##   obiwan-client [options] [<url>]
+##   obiwan-client [options] [<url>...]
 ##
 ## Options:
 ##   -h --help               Show this help screen
@@ -15,10 +15,14 @@
 ##   --cert=<file>           Client certificate file for authentication
 ##   --key=<file>            Client key file for authentication
 ##   -a --async              Use asynchronous (non-blocking) mode
+##   --crawl=<dir>           Crawl from the URLs and mirror the pages into <dir>
+##   --max-pages=<num>       Stop a crawl after this many pages
+##   --all-hosts             Let a crawl follow links to other hosts
 ##   --version               Show version information
 ##
 ## Arguments:
-##   <url>                   URL to request [default: gemini://geminiprotocol.net/]
+##   <url>                   URL to request, or to start a crawl from
+##                           [default: gemini://geminiprotocol.net/]
 ##
 ## Configuration is loaded from (in order):
 ## 1. The specified config file with --config
@@ -34,18 +38,26 @@
 ## cert_file = "client-cert.pem"
 ## key_file = "client-key.pem"
 ## ```
+##
+## A crawl (--crawl) resumes where it stopped when run again with the same
+## directory. Its limits are set in the [crawl] section of the config file;
+## Ctrl-C stops it after saving a checkpoint.
 
 import asyncdispatch
 import strutils
+import os
 import "../obiwan"
 import "config"
+import "crawler"
+import "tofu"
+import "url"
 import docopt
 
 const doc = """
 ObiWAN Gemini Client
 
 Usage:
-  obiwan-client [options] [<url>]
+  obiwan-client [options] [<url>...]
 
 Options:
   -h --help               Show this help screen
@@ -55,13 +67,35 @@ Options:
   --cert=<file>           Client certificate file for authentication
   --key=<file>            Client key file for authentication
   -a --async              Use asynchronous (non-blocking) mode
+  --crawl=<dir>           Crawl from the URLs and mirror the pages into <dir>
+  --max-pages=<num>       Stop a crawl after this many pages
+  --all-hosts             Let a crawl follow links to other hosts
   --version               Show version information
 
 Arguments:
-  <url>                   URL to request [default: gemini://geminiprotocol.net/]
+  <url>                   URL to request, or to start a crawl from
+                          [default: gemini://geminiprotocol.net/]
 """
 
-const version = "ObiWAN Gemini Client v0.5.0"
+const version = "ObiWAN Gemini Client v" & ObiwanVersion
+
+proc reportTrust(config: Config, url: string, certificate: X509Certificate) =
+  ## Checks the server certificate against the known hosts, if configured,
+  ## trusting it on first use
+  if config.client.knownHosts == "":
+    return
+  let known = openKnownHosts(expandTilde(config.client.knownHosts))
+  defer: known.close()
+  let target = parseUrl(url)
+  let key = hostKey(target.hostname.unbracketed, target.geminiPort)
+  case known.checkOrTrust(key, certificate.fingerprint)
+  of trustNew:
+    echo "  TOFU:           first visit, now trusted"
+  of trustKnown:
+    echo "  TOFU:           matches the trusted certificate"
+  of trustChanged:
+    echo "  TOFU:           WARNING: differs from the certificate trusted for " & key
+    echo "                  (was " & known.lookup(key) & ")"
 
 proc runSync(args: Table[string, Value], config: Config, url: string) =
   ## Run the client in synchronous (blocking) mode
@@ -73,6 +107,8 @@ proc runSync(args: Table[string, Value], config: Config, url: string) =
     certFile = config.client.certFile,
     keyFile = config.client.keyFile
   )
+  client.recordSize = config.client.recordSize
+  client.cipherSuites = parseCipherSuites(config.client.cipherSuites)
   
   # Make request to the specified URL
   let response = client.request(url)
@@ -90,6 +126,8 @@ proc runSync(args: Table[string, Value], config: Config, url: string) =
     echo "  Certificate available"
     echo "  Is Verified:    " & $response.isVerified
     echo "  Is Self-signed: " & $response.isSelfSigned
+    echo "  Fingerprint:    " & response.certificate.fingerprint
+    reportTrust(config, response.url, response.certificate)
   else:
     echo "  No certificate available"
 
@@ -107,6 +145,8 @@ proc runAsync(args: Table[string, Value], config: Config, url: string) {.async.}
     certFile = config.client.certFile,
     keyFile = config.client.keyFile
   )
+  client.recordSize = config.client.recordSize
+  client.cipherSuites = parseCipherSuites(config.client.cipherSuites)
   
   # Make request to the specified URL
   let response = await client.request(url)
@@ -124,6 +164,8 @@ proc runAsync(args: Table[string, Value], config: Config, url: string) {.async.}
     echo "  Certificate available"
     echo "  Is Verified:    " & $response.isVerified
     echo "  Is Self-signed: " & $response.isSelfSigned
+    echo "  Fingerprint:    " & response.certificate.fingerprint
+    reportTrust(config, response.url, response.certificate)
   else:
     echo "  No certificate available"
 
@@ -131,6 +173,56 @@ proc runAsync(args: Table[string, Value], config: Config, url: string) {.async.}
   echo "\nResponse body:"
   echo await response.body
 
+var activeCrawler: Crawler # For the Ctrl-C hook
+
+proc runCrawl(config: Config, urls: seq[string], outputDir: string) {.async.} =
+  ## Crawl from `urls`, mirroring the pages into `outputDir`
+  let client = newAsyncObiwanClient(
+    certFile = config.client.certFile,
+    keyFile = config.client.keyFile
+  )
+  client.recordSize = config.client.recordSize
+  client.cipherSuites = parseCipherSuites(config.client.cipherSuites)
+  defer: client.close()
+
+  let crawl = config.crawl
+  let crawler = newCrawler(client, CrawlOptions(
+    outputDir: outputDir,
+    concurrency: crawl.concurrency,
+    perHost: crawl.perHost,
+    delayMs: crawl.delayMs,
+    maxPages: crawl.maxPages,
+    maxDepth: crawl.maxDepth,
+    maxBodySize: crawl.maxBodySize,
+    timeoutMs: crawl.timeoutMs,
+    allHosts: crawl.allHosts,
+    checkpointEvery: crawl.checkpointEvery,
+    knownHosts: if config.client.knownHosts != "": expandTilde(config.client.knownHosts) else: ""
+  ))
+  defer: crawler.close()
+  for url in urls:
+    if not crawler.addSeed(url):
+      echo "Skipping seed: ", url
+
+  activeCrawler = crawler
+  setControlCHook(proc() {.noconv.} =
+    echo "\nStopping the crawl..."
+    activeCrawler.stop()
+  )
+
+  echo "\nCrawling into: ", outputDir
+  await crawler.run()
+
+  let stats = crawler.stats
+  echo "\nCrawl stats:"
+  echo "  Fetched: ", stats.fetched
+  echo "  Failed:  ", stats.failed
+  echo "  Skipped: ", stats.skipped, " (robots.txt)"
+  echo "  Bytes:   ", stats.bytes
+  echo "  Queued:  ", stats.queued
+  if stats.queued > 0:
+    echo "Run the same crawl again to resume it"
+
 # Main application code
 when isMainModule:
   # Parse command line arguments with docopt
@@ -160,8 +252,20 @@ when isMainModule:
     if args["--key"]:
       config.client.keyFile = $args["--key"]
     
-    # Get URL from arguments
-    let url = if args["<url>"]: $args["<url>"] else: "gemini://geminiprotocol.net/"
+    # Crawl settings override from command line
+    if args["--max-pages"]:
+      try:
+        config.crawl.maxPages = parseInt($args["--max-pages"])
+      except ValueError:
+        echo "Warning: Invalid page count, using the configured one"
+
+    if args["--all-hosts"]:
+      config.crawl.allHosts = true
+
+    # Get URLs from arguments
+    var urls = @(args["<url>"])
+    if urls.len == 0:
+      urls = @["gemini://geminiprotocol.net/"]
     
     # Initialize logging
     initializeLogging(config)
@@ -178,7 +282,7 @@ when isMainModule:
     
     # Show client settings
     echo "Client settings:"
-    echo "  Mode:         ", if args["--async"]: "Asynchronous" else: "Synchronous"
+    echo "  Mode:         ", if args["--crawl"]: "Crawl" elif args["--async"]: "Asynchronous" else: "Synchronous"
     echo "  Max redirects: ", config.client.maxRedirects
     if config.client.certFile != "":
       echo "  Client cert:   ", config.client.certFile
@@ -187,10 +291,14 @@ when isMainModule:
       echo "  Client cert:   none"
     
     # Run in the appropriate mode
-    if args["--async"]:
-      waitFor runAsync(args, config, url)
+    if args["--crawl"]:
+      waitFor runCrawl(config, urls, $args["--crawl"])
+    elif args["--async"]:
+      for url in urls:
+        waitFor runAsync(args, config, url)
     else:
-      runSync(args, config, url)
+      for url in urls:
+        runSync(args, config, url)
       
   except CatchableError:
     # Handle any errors that occurred during the request
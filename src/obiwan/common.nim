@@ -1,12 +1,27 @@
 ## Common types and protocols
-import streams
 import asyncdispatch
 import net
+import tables
 import "./url"
+import "./accesslog"
+import "./metrics"
+from std/times import Duration
+from std/strutils import splitLines, split, strip
 
 # Export specific symbols from dependency modules
 export Port
 
+proc nimbleVersion(): string {.compileTime.} =
+  ## The version set in obiwan.nimble, read when compiling
+  for line in staticRead("../../obiwan.nimble").splitLines():
+    let parts = line.split('=', 1)
+    if parts.len == 2 and parts[0].strip() == "version":
+      return parts[1].strip().strip(chars = {'"'})
+  doAssert false, "No version in obiwan.nimble"
+
+const
+  ObiwanVersion* = nimbleVersion() ## Version of this ObiWAN release, as in obiwan.nimble
+
 type
   # Forward declaration (to be defined in TLS modules)
   X509Certificate* = pointer
@@ -70,9 +85,6 @@ type
     socket*: SocketType ## Socket connection to server
     maxRedirects*: Natural ## Maximum number of redirects to follow (default: 5)
     sslContext*: SslContext ## TLS/SSL context for secure connection
-    bodyStreamVariant*: tuple[isFutureStream: bool] ## Internal type marker
-    bodyStreamSync*: Stream ## Stream for body content in synchronous mode
-    bodyStreamAsync*: FutureStream[string] ## Stream for body content in async mode
     parseBodyFut*: Future[void] ## Future for tracking body parsing
 
   ResponseBase*[ClientType] = ref object
@@ -83,6 +95,7 @@ type
     ## Use the concrete types `Response` and `AsyncResponse` in application code.
     status*: Status ## Response status (see Status enum)
     meta*: string ## Meta information (MIME type for success responses, redirection target, error details, etc.)
+    url*: string ## URL the response answers, the last one when redirects were followed
     certificate*: X509Certificate ## Server's X.509 certificate (nil if not provided)
     verification*: int ## Certificate verification result (0 = verified, other values indicate verification issues)
     client*: ClientType ## Reference to client that created this response
@@ -96,6 +109,23 @@ type
     reuseAddr*: bool ## Allow reuse of local addresses (default: true)
     reusePort*: bool ## Allow multiple bindings to same port (default: false)
     sslContext*: SslContext ## TLS/SSL context for secure connections
+    threads*: int ## Worker threads of the synchronous server (0 = handle connections inline)
+    queueDepth*: int ## Connections that may wait for a worker before new ones get 41 SERVER UNAVAILABLE
+    accessLog*: AccessLog ## Log of served requests (nil to disable, see newAccessLog)
+    metrics*: Metrics ## Connection and latency metrics (nil to disable, see newMetrics)
+    maxRequestLength*: int ## Longest request line accepted; longer ones get 59 (0 = no limit)
+    handshakeTimeoutMs*: int ## Time a client has to complete the TLS handshake (0 = no limit)
+    requestTimeoutMs*: int ## Time a client has to send its request line after the handshake (0 = no limit)
+    maxConnections*: int ## Async server: open connections before new ones get 41 SERVER UNAVAILABLE (0 = no limit)
+    maxPerIp*: int ## Async server: open connections per client address before new ones get 44 SLOW DOWN (0 = no limit)
+    ioUring*: bool ## Async server: do socket I/O through io_uring where available (Linux, built with -d:obiwanUring)
+    connections*: int ## Async server: connections being handled right now
+    rejecting*: int ## Async server: over-limit connections still being answered
+    peerConnections*: CountTable[string] ## Async server: open connections by client address, when maxPerIp is set
+    listenFd*: cint ## Listening socket serve() accepts on instead of binding one (-1 = bind); serve() sets it to the one it uses
+    drainTimeoutMs*: int ## Async server: time open connections get after stopAccepting() before serve() returns anyway (0 = no limit)
+    draining*: bool ## stopAccepting() was called
+    acceptWaiter*: Future[void] ## Async server: what the accept loop waits on, completed early by stopAccepting()
 
   RequestBase*[SocketType] = ref object
     ## Request from a client in a Gemini server. Contains the requested URL,
@@ -103,9 +133,13 @@ type
     ##
     ## Use the concrete types `Request` and `AsyncRequest` in application code.
     url*: Url ## Requested URL, can be used to handle virtual hosts, resources, and query parameters
+    rawQuery*: string ## Query of the URL as sent, still percent-encoded ("" without one)
     certificate*: X509Certificate ## Client's X.509 certificate (nil if not provided)
     verification*: int ## Certificate verification result (0 = verified, other values indicate verification issues)
     client*: SocketType ## Client socket connection
+    status*: int ## Status code sent by respond() or respondFile() (0 until a response is sent)
+    bytesSent*: int ## Bytes sent by respond() and respondFile(), header included
+    sendTime*: Duration ## Time spent in respond() and respondFile()
 
   # We use a dynamic binding at runtime, so the static type
   # just needs to be compatible with the concrete implementation
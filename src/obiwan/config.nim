@@ -6,7 +6,12 @@
 
 import parsetoml
 import os
+import strutils
 import obiwan/debug
+import obiwan/common
+
+const
+  DefaultUserAgent* = "ObiWAN/" & ObiwanVersion ## User agent when `user_agent` is empty
 
 type
   ConfigError* = object of CatchableError
@@ -21,10 +26,24 @@ type
     reuseAddr*: bool      ## Allow reuse of local addresses
     reusePort*: bool      ## Allow multiple bindings to same port
     useIPv6*: bool        ## Use IPv6 instead of IPv4
-    sessionId*: string    ## Optional session ID for TLS
+    sessionId*: string    ## Optional secret for TLS session tickets (random if empty)
+    ticketRotation*: int  ## Seconds between session ticket key rotations (0 = no tickets)
     docRoot*: string      ## Document root directory for serving files
+    pack*: string         ## Content pack served instead of docRoot ("" = serve docRoot)
     logRequests*: bool    ## Whether to log all requests
     maxRequestLength*: int ## Maximum request length in bytes
+    handshakeTimeoutMs*: int ## Time a client has to complete the TLS handshake (0 = no limit)
+    requestTimeoutMs*: int ## Time a client has to send its request after the handshake (0 = no limit)
+    maxConnections*: int  ## Open connections in async mode before new ones get 41 (0 = no limit)
+    maxPerIp*: int        ## Open connections per client address in async mode before new ones get 44 (0 = no limit)
+    drainTimeoutMs*: int  ## Time open connections get to finish after an upgrade or SIGQUIT in async mode (0 = no limit)
+    ioUring*: bool        ## Do async mode socket I/O through io_uring (Linux, built with -d:obiwanUring)
+    workers*: int         ## Number of worker processes (0 = one per CPU core)
+    threads*: int         ## Worker threads in synchronous mode (0 = handle connections inline; more need MBEDTLS_THREADING_C)
+    queueDepth*: int      ## Connections waiting for a thread before new ones get 41
+    recordSize*: int      ## Plaintext bytes per TLS record sent (0 = adaptive)
+    cipherSuites*: string ## Allowed TLS 1.3 cipher suites, comma separated ("auto" = by CPU)
+    ktls*: bool           ## Send files with kernel TLS and sendfile() (Linux only)
 
   ClientConfig* = object
     ## Configuration for a Gemini client
@@ -32,19 +51,64 @@ type
     keyFile*: string      ## Path to client private key for auth
     maxRedirects*: int    ## Maximum number of redirects to follow
     timeout*: int         ## Connection timeout in seconds
-    userAgent*: string    ## User agent string (for debugging)
+    userAgent*: string    ## User agent string (for debugging, DefaultUserAgent by default)
+    recordSize*: int      ## Plaintext bytes per TLS record, also asked of servers (0 = adaptive)
+    cipherSuites*: string ## TLS 1.3 cipher suites, most preferred first ("auto" = by CPU)
+    knownHosts*: string   ## TOFU store of trusted server certificates ("" = no checks)
 
   LogConfig* = object
     ## Logging configuration
     level*: int           ## Verbosity level (0-3)
     file*: string         ## Log file path (empty for stdout)
     timestamp*: bool      ## Include timestamps in log entries
+    bufferSize*: int      ## Access log buffer in bytes; entries are dropped when it's full
+
+  CacheConfig* = object
+    ## In-memory content cache configuration
+    enabled*: bool        ## Cache small files and directory listings
+    maxEntries*: int      ## Maximum number of cached entries
+    maxSize*: int         ## Maximum total size of the cache in bytes
+    maxFileSize*: int     ## Larger files are streamed from disk, never cached
+    revalidateMs*: int    ## Interval between mtime checks when inotify isn't used
+    useInotify*: bool     ## Invalidate entries through inotify (Linux only)
+
+  MetricsConfig* = object
+    ## Metrics exposition configuration. Metrics are collected when either
+    ## the admin port or the route is set.
+    port*: int            ## Plain HTTP admin port for Prometheus (0 = off)
+    address*: string      ## Address the admin port binds to
+    route*: string        ## Gemini path that serves the metrics ("" = off)
+
+  CrawlConfig* = object
+    ## Crawl mode of the client (obiwan-client --crawl)
+    concurrency*: int     ## Requests running at once
+    perHost*: int         ## Requests running at once to one host
+    delayMs*: int         ## Time between the requests to one host
+    maxPages*: int        ## Pages fetched before the crawl stops (0 = no limit)
+    maxDepth*: int        ## Links followed away from the seeds (0 = no limit)
+    maxBodySize*: int     ## Larger bodies are abandoned (0 = no limit)
+    timeoutMs*: int       ## Time a server has for each step of a request (0 = no limit)
+    allHosts*: bool       ## Follow links to hosts other than the seeds'
+    checkpointEvery*: int ## Pages between checkpoints of the frontier (0 = only when stopping)
+
+  GatewayConfig* = object
+    ## A path prefix served by a backend application (async server only)
+    route*: string        ## Path prefix handed to the backend, e.g. "/app"
+    socket*: string       ## Unix socket the backend listens on
+    protocol*: string     ## "scgi" or "fastcgi"
+    maxConcurrency*: int  ## Requests sent to the backend at once (0 = no limit)
+    maxIdle*: int         ## Idle FastCGI connections kept open for later requests
+    timeoutMs*: int       ## Time the backend has for each read of its answer (0 = no limit)
 
   Config* = object
     ## Main configuration object
     server*: ServerConfig   ## Server configuration
     client*: ClientConfig   ## Client configuration
     log*: LogConfig         ## Logging configuration
+    cache*: CacheConfig     ## Content cache configuration
+    metrics*: MetricsConfig ## Metrics configuration
+    crawl*: CrawlConfig     ## Crawl mode configuration
+    gateways*: seq[GatewayConfig] ## Backend applications, from [[gateway]] tables
 
 proc defaultConfig*(): Config =
   ## Creates a default configuration with sensible defaults
@@ -58,24 +122,70 @@ proc defaultConfig*(): Config =
       reusePort: false,
       useIPv6: false,
       sessionId: "",      # Will be randomly generated
+      ticketRotation: 43200, # 12 hours
       docRoot: "./content",
+      pack: "",
       logRequests: true,
-      maxRequestLength: 1024
+      maxRequestLength: 1024,
+      handshakeTimeoutMs: 10000,
+      requestTimeoutMs: 10000,
+      maxConnections: 1024,
+      maxPerIp: 32,
+      drainTimeoutMs: 60000,
+      ioUring: false,
+      workers: 1,
+      threads: 0,
+      queueDepth: 64,
+      recordSize: 0,       # Small records first, 16KB once a transfer is bulk
+      cipherSuites: "auto", # AES-GCM first with AES instructions, else ChaCha20
+      ktls: false
     ),
     client: ClientConfig(
       certFile: "",
       keyFile: "",
       maxRedirects: 5,
       timeout: 30,
-      userAgent: "ObiWAN/0.5.0"
+      userAgent: DefaultUserAgent,
+      recordSize: 0,
+      cipherSuites: "auto",
+      knownHosts: ""
     ),
     log: LogConfig(
       level: 0,             # Default to minimal logging
       file: "",            # Default to stdout
-      timestamp: true
+      timestamp: true,
+      bufferSize: 64 * 1024  # 64KB
+    ),
+    cache: CacheConfig(
+      enabled: true,
+      maxEntries: 4096,
+      maxSize: 64 * 1024 * 1024,  # 64MB
+      maxFileSize: 256 * 1024,    # 256KB
+      revalidateMs: 1000,
+      useInotify: true
+    ),
+    metrics: MetricsConfig(
+      port: 0,
+      address: "127.0.0.1",
+      route: ""
+    ),
+    crawl: CrawlConfig(
+      concurrency: 32,
+      perHost: 2,
+      delayMs: 500,
+      maxPages: 0,
+      maxDepth: 0,
+      maxBodySize: 16 * 1024 * 1024, # 16MB
+      timeoutMs: 30000,
+      allHosts: false,
+      checkpointEvery: 500
     )
   )
 
+proc defaultGatewayConfig*(): GatewayConfig =
+  ## Settings of a [[gateway]] table that leaves them out
+  GatewayConfig(protocol: "fastcgi", maxConcurrency: 16, maxIdle: 4, timeoutMs: 30000)
+
 proc loadConfig*(configFile: string): Config =
   ## Loads configuration from a TOML file
   ##
@@ -125,12 +235,40 @@ proc loadConfig*(configFile: string): Config =
       result.server.useIPv6 = server["use_ipv6"].getBool()
     if server.hasKey("session_id"):
       result.server.sessionId = server["session_id"].getStr()
+    if server.hasKey("ticket_rotation"):
+      result.server.ticketRotation = server["ticket_rotation"].getInt().int
     if server.hasKey("doc_root"):
       result.server.docRoot = server["doc_root"].getStr()
+    if server.hasKey("pack"):
+      result.server.pack = server["pack"].getStr()
     if server.hasKey("log_requests"):
       result.server.logRequests = server["log_requests"].getBool()
     if server.hasKey("max_request_length"):
       result.server.maxRequestLength = server["max_request_length"].getInt().int
+    if server.hasKey("handshake_timeout_ms"):
+      result.server.handshakeTimeoutMs = server["handshake_timeout_ms"].getInt().int
+    if server.hasKey("request_timeout_ms"):
+      result.server.requestTimeoutMs = server["request_timeout_ms"].getInt().int
+    if server.hasKey("max_connections"):
+      result.server.maxConnections = server["max_connections"].getInt().int
+    if server.hasKey("max_per_ip"):
+      result.server.maxPerIp = server["max_per_ip"].getInt().int
+    if server.hasKey("drain_timeout_ms"):
+      result.server.drainTimeoutMs = server["drain_timeout_ms"].getInt().int
+    if server.hasKey("io_uring"):
+      result.server.ioUring = server["io_uring"].getBool()
+    if server.hasKey("workers"):
+      result.server.workers = server["workers"].getInt().int
+    if server.hasKey("threads"):
+      result.server.threads = server["threads"].getInt().int
+    if server.hasKey("queue_depth"):
+      result.server.queueDepth = server["queue_depth"].getInt().int
+    if server.hasKey("record_size"):
+      result.server.recordSize = server["record_size"].getInt().int
+    if server.hasKey("cipher_suites"):
+      result.server.cipherSuites = server["cipher_suites"].getStr()
+    if server.hasKey("ktls"):
+      result.server.ktls = server["ktls"].getBool()
   
   # Client section
   if toml.hasKey("client"):
@@ -143,8 +281,14 @@ proc loadConfig*(configFile: string): Config =
       result.client.maxRedirects = client["max_redirects"].getInt().int
     if client.hasKey("timeout"):
       result.client.timeout = client["timeout"].getInt().int
-    if client.hasKey("user_agent"):
+    if client.hasKey("user_agent") and client["user_agent"].getStr() != "":
       result.client.userAgent = client["user_agent"].getStr()
+    if client.hasKey("record_size"):
+      result.client.recordSize = client["record_size"].getInt().int
+    if client.hasKey("cipher_suites"):
+      result.client.cipherSuites = client["cipher_suites"].getStr()
+    if client.hasKey("known_hosts"):
+      result.client.knownHosts = client["known_hosts"].getStr()
   
   # Log section
   if toml.hasKey("log"):
@@ -155,6 +299,80 @@ proc loadConfig*(configFile: string): Config =
       result.log.file = log["file"].getStr()
     if log.hasKey("timestamp"):
       result.log.timestamp = log["timestamp"].getBool()
+    if log.hasKey("buffer_size"):
+      result.log.bufferSize = log["buffer_size"].getInt().int
+
+  # Cache section
+  if toml.hasKey("cache"):
+    let cache = toml["cache"]
+    if cache.hasKey("enabled"):
+      result.cache.enabled = cache["enabled"].getBool()
+    if cache.hasKey("max_entries"):
+      result.cache.maxEntries = cache["max_entries"].getInt().int
+    if cache.hasKey("max_size"):
+      result.cache.maxSize = cache["max_size"].getInt().int
+    if cache.hasKey("max_file_size"):
+      result.cache.maxFileSize = cache["max_file_size"].getInt().int
+    if cache.hasKey("revalidate_ms"):
+      result.cache.revalidateMs = cache["revalidate_ms"].getInt().int
+    if cache.hasKey("use_inotify"):
+      result.cache.useInotify = cache["use_inotify"].getBool()
+
+  # Metrics section
+  if toml.hasKey("metrics"):
+    let metrics = toml["metrics"]
+    if metrics.hasKey("port"):
+      result.metrics.port = metrics["port"].getInt().int
+    if metrics.hasKey("address"):
+      result.metrics.address = metrics["address"].getStr()
+    if metrics.hasKey("route"):
+      result.metrics.route = metrics["route"].getStr()
+
+  # Crawl section
+  if toml.hasKey("crawl"):
+    let crawl = toml["crawl"]
+    if crawl.hasKey("concurrency"):
+      result.crawl.concurrency = crawl["concurrency"].getInt().int
+    if crawl.hasKey("per_host"):
+      result.crawl.perHost = crawl["per_host"].getInt().int
+    if crawl.hasKey("delay_ms"):
+      result.crawl.delayMs = crawl["delay_ms"].getInt().int
+    if crawl.hasKey("max_pages"):
+      result.crawl.maxPages = crawl["max_pages"].getInt().int
+    if crawl.hasKey("max_depth"):
+      result.crawl.maxDepth = crawl["max_depth"].getInt().int
+    if crawl.hasKey("max_body_size"):
+      result.crawl.maxBodySize = crawl["max_body_size"].getInt().int
+    if crawl.hasKey("timeout_ms"):
+      result.crawl.timeoutMs = crawl["timeout_ms"].getInt().int
+    if crawl.hasKey("all_hosts"):
+      result.crawl.allHosts = crawl["all_hosts"].getBool()
+    if crawl.hasKey("checkpoint_every"):
+      result.crawl.checkpointEvery = crawl["checkpoint_every"].getInt().int
+
+  # Gateway tables
+  if toml.hasKey("gateway"):
+    for gateway in toml["gateway"].getElems():
+      var entry = defaultGatewayConfig()
+      if gateway.hasKey("route"):
+        entry.route = gateway["route"].getStr()
+      if gateway.hasKey("socket"):
+        entry.socket = gateway["socket"].getStr()
+      if gateway.hasKey("protocol"):
+        entry.protocol = gateway["protocol"].getStr()
+      if gateway.hasKey("max_concurrency"):
+        entry.maxConcurrency = gateway["max_concurrency"].getInt().int
+      if gateway.hasKey("max_idle"):
+        entry.maxIdle = gateway["max_idle"].getInt().int
+      if gateway.hasKey("timeout_ms"):
+        entry.timeoutMs = gateway["timeout_ms"].getInt().int
+      if not entry.route.startsWith('/'):
+        raise newException(ConfigError, "Gateway route must start with '/': " & entry.route)
+      if entry.socket == "":
+        raise newException(ConfigError, "Gateway " & entry.route & " has no socket")
+      if entry.protocol notin ["scgi", "fastcgi"]:
+        raise newException(ConfigError, "Unknown gateway protocol: " & entry.protocol)
+      result.gateways.add(entry)
 
 proc findConfigFile*(): string =
   ## Attempts to find a configuration file in standard locations:
@@ -189,7 +407,7 @@ proc initializeLogging*(config: Config) =
   ## Parameters:
   ##   config: The Config object containing logging settings
   
-  # Set verbosity level (no-op in current implementation to avoid linking issues)
+  # Set verbosity level (levels compiled out with -d:obiwanLogLevel stay off)
   debug.setVerbosityLevel(config.log.level)
   
   # TODO: Implement log file output when needed
@@ -221,9 +439,23 @@ proc saveConfig*(config: Config, filePath: string) =
   tomlStr &= "reuse_port = " & $config.server.reusePort & "\n"
   tomlStr &= "use_ipv6 = " & $config.server.useIPv6 & "\n"
   tomlStr &= "session_id = \"" & config.server.sessionId & "\"\n"
+  tomlStr &= "ticket_rotation = " & $config.server.ticketRotation & "\n"
   tomlStr &= "doc_root = \"" & config.server.docRoot & "\"\n"
+  tomlStr &= "pack = \"" & config.server.pack & "\"\n"
   tomlStr &= "log_requests = " & $config.server.logRequests & "\n"
-  tomlStr &= "max_request_length = " & $config.server.maxRequestLength & "\n\n"
+  tomlStr &= "max_request_length = " & $config.server.maxRequestLength & "\n"
+  tomlStr &= "handshake_timeout_ms = " & $config.server.handshakeTimeoutMs & "\n"
+  tomlStr &= "request_timeout_ms = " & $config.server.requestTimeoutMs & "\n"
+  tomlStr &= "max_connections = " & $config.server.maxConnections & "\n"
+  tomlStr &= "max_per_ip = " & $config.server.maxPerIp & "\n"
+  tomlStr &= "drain_timeout_ms = " & $config.server.drainTimeoutMs & "\n"
+  tomlStr &= "io_uring = " & $config.server.ioUring & "\n"
+  tomlStr &= "workers = " & $config.server.workers & "\n"
+  tomlStr &= "threads = " & $config.server.threads & "\n"
+  tomlStr &= "queue_depth = " & $config.server.queueDepth & "\n"
+  tomlStr &= "record_size = " & $config.server.recordSize & "\n"
+  tomlStr &= "cipher_suites = \"" & config.server.cipherSuites & "\"\n"
+  tomlStr &= "ktls = " & $config.server.ktls & "\n\n"
   
   # Client section
   tomlStr &= "[client]\n"
@@ -231,13 +463,56 @@ proc saveConfig*(config: Config, filePath: string) =
   tomlStr &= "key_file = \"" & config.client.keyFile & "\"\n"
   tomlStr &= "max_redirects = " & $config.client.maxRedirects & "\n"
   tomlStr &= "timeout = " & $config.client.timeout & "\n"
-  tomlStr &= "user_agent = \"" & config.client.userAgent & "\"\n\n"
+  # Left empty by default, so the file follows the version of the binary
+  let userAgent = if config.client.userAgent == DefaultUserAgent: "" else: config.client.userAgent
+  tomlStr &= "user_agent = \"" & userAgent & "\"\n"
+  tomlStr &= "record_size = " & $config.client.recordSize & "\n"
+  tomlStr &= "cipher_suites = \"" & config.client.cipherSuites & "\"\n"
+  tomlStr &= "known_hosts = \"" & config.client.knownHosts & "\"\n\n"
   
   # Log section
   tomlStr &= "[log]\n"
   tomlStr &= "level = " & $config.log.level & "\n"
   tomlStr &= "file = \"" & config.log.file & "\"\n"
   tomlStr &= "timestamp = " & $config.log.timestamp & "\n"
+  tomlStr &= "buffer_size = " & $config.log.bufferSize & "\n\n"
+
+  # Cache section
+  tomlStr &= "[cache]\n"
+  tomlStr &= "enabled = " & $config.cache.enabled & "\n"
+  tomlStr &= "max_entries = " & $config.cache.maxEntries & "\n"
+  tomlStr &= "max_size = " & $config.cache.maxSize & "\n"
+  tomlStr &= "max_file_size = " & $config.cache.maxFileSize & "\n"
+  tomlStr &= "revalidate_ms = " & $config.cache.revalidateMs & "\n"
+  tomlStr &= "use_inotify = " & $config.cache.useInotify & "\n\n"
+
+  # Metrics section
+  tomlStr &= "[metrics]\n"
+  tomlStr &= "port = " & $config.metrics.port & "\n"
+  tomlStr &= "address = \"" & config.metrics.address & "\"\n"
+  tomlStr &= "route = \"" & config.metrics.route & "\"\n\n"
+
+  # Crawl section
+  tomlStr &= "[crawl]\n"
+  tomlStr &= "concurrency = " & $config.crawl.concurrency & "\n"
+  tomlStr &= "per_host = " & $config.crawl.perHost & "\n"
+  tomlStr &= "delay_ms = " & $config.crawl.delayMs & "\n"
+  tomlStr &= "max_pages = " & $config.crawl.maxPages & "\n"
+  tomlStr &= "max_depth = " & $config.crawl.maxDepth & "\n"
+  tomlStr &= "max_body_size = " & $config.crawl.maxBodySize & "\n"
+  tomlStr &= "timeout_ms = " & $config.crawl.timeoutMs & "\n"
+  tomlStr &= "all_hosts = " & $config.crawl.allHosts & "\n"
+  tomlStr &= "checkpoint_every = " & $config.crawl.checkpointEvery & "\n"
+
+  # Gateway tables
+  for gateway in config.gateways:
+    tomlStr &= "\n[[gateway]]\n"
+    tomlStr &= "route = \"" & gateway.route & "\"\n"
+    tomlStr &= "socket = \"" & gateway.socket & "\"\n"
+    tomlStr &= "protocol = \"" & gateway.protocol & "\"\n"
+    tomlStr &= "max_concurrency = " & $gateway.maxConcurrency & "\n"
+    tomlStr &= "max_idle = " & $gateway.maxIdle & "\n"
+    tomlStr &= "timeout_ms = " & $gateway.timeoutMs & "\n"
   
   # Write to file
   try:
@@ -0,0 +1,726 @@
+## Crawler and mirror of Gemini capsules
+##
+## A Crawler starts from seed URLs, follows the links of the text/gemini
+## pages it fetches, and mirrors every page it fetches into a directory tree,
+## one directory per host. It runs on the async client:
+##
+## - The frontier is a queue per host, visited round robin. At most
+##   `concurrency` requests run at once, at most `perHost` of them to one host,
+##   and requests to a host start at least `delayMs` apart.
+## - The robots.txt of each host is fetched once, before any of its pages,
+##   and its Disallow rules for `userAgents` are obeyed (see the robots.txt
+##   companion specification of Gemini).
+## - Links are extracted while bodies stream to disk, so no page is held in
+##   memory whole. Redirects are followed as links.
+## - URLs are deduplicated by a 64-bit hash in an open-addressing set, 8
+##   bytes per URL seen. Two URLs with the same hash count as one, so a
+##   page can be skipped, but that is unlikely: about one chance in 370,000
+##   over a crawl of ten million URLs.
+## - The frontier, the visited set, the seed hosts and the number of pages
+##   fetched are checkpointed to `<dir>/.crawl` every `checkpointEvery`
+##   pages and when the crawl stops early, so running the same crawl again
+##   resumes it, with `maxPages` counted over the whole crawl. A crawl that
+##   completes removes its checkpoint.
+##
+## Gemini closes the connection after each response, so requests don't
+## share connections. They share the TLS context of the client, though,
+## and with it its session tickets, so only the first connection to a host
+## does the full handshake, and dial() resolves each host name once.
+##
+## Example:
+##   ```nim
+##   let crawler = newCrawler(newAsyncObiwanClient(), CrawlOptions(
+##     outputDir: "mirror", concurrency: 32, perHost: 2, delayMs: 500))
+##   crawler.addSeed("gemini://geminiprotocol.net/")
+##   waitFor crawler.run()
+##   echo crawler.stats.fetched, " pages mirrored"
+##   ```
+
+import std/asyncdispatch
+import std/deques
+import std/monotimes
+import std/os
+import std/sets
+import std/strutils
+import std/tables
+import std/times
+
+import "../obiwan"
+import "url"
+import "tofu"
+
+const
+  DefaultCrawlConcurrency* = 32 ## Requests a crawl runs at once by default
+  DefaultCrawlPerHost* = 2 ## Requests a crawl runs at once to one host by default
+  DefaultCrawlDelayMs* = 500 ## Time between the requests to one host by default
+  DefaultCrawlMaxBodySize* = 16 * 1024 * 1024 ## Largest body mirrored by default (16MB)
+  DefaultCrawlTimeoutMs* = 30_000 ## Time a server has for each step of a request by default
+  DefaultCheckpointEvery* = 500 ## Pages between checkpoints by default
+  DefaultRobotsAgents* = ["*", "archiver", "indexer"] ## robots.txt user agents a crawl obeys
+  MaxRobotsSize = 64 * 1024 # Larger robots.txt files are cut there
+  MaxLinkLine = 4096 # Longer lines are only checked for a link at their start
+  PollMs = 100 # Longest wait of the scheduler for a host to become ready
+  CheckpointDir = ".crawl"
+
+type
+  CrawlOptions* = object
+    ## Settings of a crawl
+    outputDir*: string       ## Directory the mirror and its checkpoint are written to
+    concurrency*: int        ## Requests running at once
+    perHost*: int            ## Requests running at once to one host
+    delayMs*: int            ## Time between the starts of requests to one host
+    maxPages*: int           ## Pages fetched before the crawl stops, over all its runs (0 = no limit)
+    maxDepth*: int           ## Links followed away from the seeds (0 = no limit)
+    maxBodySize*: int        ## Larger bodies are abandoned (0 = no limit)
+    timeoutMs*: int          ## Time a server has to answer, and for each read of a body (0 = no limit)
+    allHosts*: bool          ## Follow links to hosts other than the seeds'
+    checkpointEvery*: int    ## Pages between checkpoints (0 = only when stopping)
+    userAgents*: seq[string] ## robots.txt user agents whose rules apply (empty = DefaultRobotsAgents)
+    knownHosts*: string      ## TOFU store checked for every host ("" = no checks)
+
+  CrawlStats* = object
+    ## Progress of a crawl
+    fetched*: int   ## Pages answered, whatever their status
+    failed*: int    ## Requests that failed or timed out
+    skipped*: int   ## URLs disallowed by robots.txt
+    bytes*: int64   ## Body bytes written to the mirror
+    queued*: int    ## URLs waiting in the frontier
+
+  RobotsRules* = object
+    ## The Disallow rules of a robots.txt that apply to a crawl
+    disallow*: seq[string] ## Disallowed path prefixes
+
+  LinkExtractor* = object
+    ## Finds the links of a text/gemini body fed to it in pieces
+    base: string        # Canonical URL of the page
+    line: string        # Start of the line being read
+    preformatted: bool  # Inside a ``` block
+    links*: seq[string] ## Canonical URLs of the links found so far
+
+  VisitedSet* = object
+    ## Set of URLs seen, stored as 64-bit hashes in an open-addressing table.
+    ## The URLs themselves aren't kept, so a URL whose hash collides with
+    ## one already in the set is taken as seen.
+    slots: seq[uint64] # 0 marks an empty slot
+    count: int
+
+  RobotsState = enum
+    rsUnknown, rsFetching, rsReady
+
+  FrontierEntry = object
+    url: string
+    depth: int
+
+  HostState = ref object
+    key: string                    # "host:port"
+    pending: Deque[FrontierEntry]
+    active: int                    # Requests running
+    nextStart: MonoTime            # Earliest start of the next request
+    robots: RobotsState
+    rules: RobotsRules
+    queued: bool                   # Whether the host is in the rotation
+    distrusted: bool               # Whether its certificate changed
+
+  Crawler* = ref object
+    ## A crawl in progress
+    options*: CrawlOptions
+    stats*: CrawlStats
+    client: AsyncObiwanClient      # Settings and TLS context of the requests
+    hosts: Table[string, HostState]
+    rotation: Deque[HostState]     # Hosts with URLs pending, round robin
+    visited: VisitedSet
+    inFlight: Table[string, int]   # URLs being fetched, with their depth
+    seedHosts: HashSet[string]
+    running: int
+    started: int                   # Pages requested, those of the runs resumed from included
+    sinceCheckpoint: int
+    stopping: bool
+    wakeup: Future[void]
+    log: File                      # crawl.log of the mirror
+    known: KnownHosts
+
+# URLs
+
+proc removeDotSegments(path: string): string =
+  ## Resolves the "." and ".." segments of an absolute path
+  var segments: seq[string]
+  let parts = path.split('/')
+  for i in 1 ..< parts.len:
+    case parts[i]
+    of ".":
+      if i == parts.high:
+        segments.add("")
+    of "..":
+      if segments.len > 0:
+        segments.setLen(segments.len - 1)
+      if i == parts.high:
+        segments.add("")
+    else:
+      segments.add(parts[i])
+  "/" & segments.join("/")
+
+proc canonicalUrl*(url: string): string =
+  ## The form of a gemini:// URL the crawler compares and stores: host in
+  ## lowercase, default port left out, dot segments resolved, no fragment.
+  ##
+  ## Returns:
+  ##   The canonical URL, or "" if `url` isn't an absolute gemini:// URL
+  ##   a request could be sent for
+  var url = url
+  let hash = url.find('#')
+  if hash >= 0:
+    url.setLen(hash)
+  var target: RequestTarget
+  if parseRequestLine(url, target) != rlValid:
+    return ""
+  result = "gemini://" & url[target.host].toLowerAscii()
+  if target.port != 1965:
+    result.add(":" & $target.port)
+  result.add(removeDotSegments(if target.path.len > 0: url[target.path] else: "/"))
+  if target.hasQuery:
+    result.add("?" & url[target.query])
+  if result.len > 1024:
+    result = ""
+
+proc hostOf*(url: string): string =
+  ## The "host:port" key of a canonical URL, as used by tofu.nim
+  var target: RequestTarget
+  if parseRequestLine(url, target) != rlValid:
+    return ""
+  url[target.host].toLowerAscii() & ":" & $target.port
+
+proc resolveLink*(base, link: string): string =
+  ## Resolves a link of a page against the page's canonical URL.
+  ##
+  ## Returns:
+  ##   The canonical URL of the link, or "" for links of other schemes and
+  ##   links that aren't valid URLs
+  var scheme = 0
+  while scheme < link.len and link[scheme] in {'a'..'z', 'A'..'Z', '0'..'9', '+', '-', '.'}:
+    inc scheme
+  if scheme > 0 and scheme < link.len and link[scheme] == ':' and link[0] in Letters:
+    if link[0 ..< scheme].toLowerAscii() != "gemini":
+      return ""
+    return canonicalUrl(link)
+  if link.startsWith("//"):
+    return canonicalUrl("gemini:" & link)
+
+  var target: RequestTarget
+  if parseRequestLine(base, target) != rlValid:
+    return ""
+  let origin = base[0 .. target.path.a - 1]
+  let path = if target.path.len > 0: base[target.path] else: "/"
+  if link.len == 0:
+    canonicalUrl(base)
+  elif link[0] == '/':
+    canonicalUrl(origin & link)
+  elif link[0] == '?':
+    canonicalUrl(origin & path & link)
+  elif link[0] == '#':
+    canonicalUrl(base)
+  else:
+    canonicalUrl(origin & path[0 .. path.rfind('/')] & link)
+
+proc mirrorPath*(outputDir, url: string): string =
+  ## Where the mirror keeps a canonical URL: `<host>[_<port>]/<path>`, with
+  ## "index.gmi" for directories and the query, if any, after a '?'. Paths
+  ## stay percent-encoded, so no URL can lead outside of `outputDir`.
+  var target: RequestTarget
+  if parseRequestLine(url, target) != rlValid:
+    return ""
+  var host = url[target.host].unbracketed
+  if target.port != 1965:
+    host.add("_" & $target.port)
+  var path = if target.path.len > 0: url[target.path] else: "/"
+  if path.endsWith('/'):
+    path.add("index.gmi")
+  if target.hasQuery:
+    path.add("?" & url[target.query].replace("/", "%2F"))
+  result = outputDir / host
+  for segment in path.split('/'):
+    if segment.len > 0:
+      result = result / segment
+
+# Links
+
+proc initLinkExtractor*(base: string): LinkExtractor =
+  ## A link extractor for the page at canonical URL `base`
+  LinkExtractor(base: base)
+
+proc processLine(extractor: var LinkExtractor) =
+  let line = extractor.line
+  if line.startsWith("```"):
+    extractor.preformatted = not extractor.preformatted
+  elif not extractor.preformatted and line.startsWith("=>"):
+    var start = 2
+    while start < line.len and line[start] in Whitespace:
+      inc start
+    var stop = start
+    while stop < line.len and line[stop] notin Whitespace:
+      inc stop
+    if stop > start:
+      let link = resolveLink(extractor.base, line[start ..< stop])
+      if link.len > 0:
+        extractor.links.add(link)
+
+proc feed*(extractor: var LinkExtractor; data: openArray[char]) =
+  ## Reads the next piece of the body
+  for c in data:
+    if c == '\n':
+      extractor.processLine()
+      extractor.line.setLen(0)
+    elif extractor.line.len < MaxLinkLine:
+      extractor.line.add(c)
+
+proc finish*(extractor: var LinkExtractor) =
+  ## Reads the last line of the body, when it doesn't end with a newline
+  if extractor.line.len > 0:
+    extractor.processLine()
+    extractor.line.setLen(0)
+
+proc extractLinks*(base, body: string): seq[string] =
+  ## The canonical URLs of the links of a text/gemini body
+  var extractor = initLinkExtractor(base)
+  extractor.feed(body)
+  extractor.finish()
+  extractor.links
+
+# robots.txt
+
+proc parseRobots*(text: string; agents: openArray[string] = DefaultRobotsAgents): RobotsRules =
+  ## Reads the Disallow rules of a robots.txt that apply to any of `agents`.
+  ## Consecutive User-agent lines open a group the following rules belong to.
+  var applies = false
+  var inAgents = false
+  for rawLine in text.splitLines():
+    var line = rawLine
+    let comment = line.find('#')
+    if comment >= 0:
+      line.setLen(comment)
+    let colon = line.find(':')
+    if colon < 0:
+      continue
+    let field = line[0 ..< colon].strip().toLowerAscii()
+    let value = line[colon + 1 .. ^1].strip()
+    if field == "user-agent":
+      if not inAgents:
+        applies = false
+        inAgents = true
+      for agent in agents:
+        if cmpIgnoreCase(agent, value) == 0:
+          applies = true
+    else:
+      inAgents = false
+      if field == "disallow" and applies and value.len > 0:
+        result.disallow.add(value)
+
+proc allows*(rules: RobotsRules; path: string): bool =
+  ## Whether the rules let the crawler fetch `path`
+  for prefix in rules.disallow:
+    if path.startsWith(prefix):
+      return false
+  true
+
+# Visited set
+
+proc urlHash*(url: string): uint64 =
+  ## 64-bit FNV-1a hash of a URL, never 0
+  result = 0xcbf29ce484222325'u64
+  for c in url:
+    result = (result xor uint64(c.ord)) * 0x100000001b3'u64
+  result = result xor (result shr 29) # FNV leaves the low bits weak
+  if result == 0:
+    result = 1
+
+proc len*(visited: VisitedSet): int =
+  ## Returns the number of URLs in the set
+  visited.count
+
+proc insertHash(visited: var VisitedSet; hash: uint64): bool =
+  ## Adds a hash, false if it was present already
+  if visited.count * 2 >= visited.slots.len:
+    let old = move(visited.slots)
+    visited.slots = newSeq[uint64](max(1024, old.len * 2))
+    visited.count = 0
+    for value in old:
+      if value != 0:
+        discard visited.insertHash(value)
+  let mask = uint64(visited.slots.len - 1)
+  var slot = hash and mask
+  while visited.slots[slot] != 0:
+    if visited.slots[slot] == hash:
+      return false
+    slot = (slot + 1) and mask
+  visited.slots[slot] = hash
+  inc visited.count
+  true
+
+proc containsOrIncl*(visited: var VisitedSet; url: string): bool =
+  ## Adds a URL to the set. Returns true if it was in it already, or if
+  ## another URL with the same hash was.
+  not visited.insertHash(urlHash(url))
+
+proc contains*(visited: VisitedSet; url: string): bool =
+  ## Whether a URL is in the set
+  if visited.slots.len == 0:
+    return false
+  let hash = urlHash(url)
+  let mask = uint64(visited.slots.len - 1)
+  var slot = hash and mask
+  while visited.slots[slot] != 0:
+    if visited.slots[slot] == hash:
+      return true
+    slot = (slot + 1) and mask
+  false
+
+proc save*(visited: VisitedSet; path: string) =
+  ## Writes the hashes of the set to a file
+  var file = open(path, fmWrite)
+  try:
+    for value in visited.slots:
+      if value != 0:
+        var value = value
+        if file.writeBuffer(addr value, sizeof(value)) != sizeof(value):
+          raise newException(IOError, "Failed to write " & path)
+  finally:
+    file.close()
+
+proc loadVisited*(path: string): VisitedSet =
+  ## Reads a set written by save()
+  let data = readFile(path)
+  let hashes = cast[ptr UncheckedArray[uint64]](data.cstring)
+  for i in 0 ..< data.len div sizeof(uint64):
+    discard result.insertHash(hashes[i])
+
+# Crawler
+
+proc checkpointPath(crawler: Crawler; name: string): string =
+  crawler.options.outputDir / CheckpointDir / name
+
+proc enqueue(crawler: Crawler; url: string; depth: int) =
+  ## Adds a URL to the frontier of its host
+  let key = hostOf(url)
+  var host = crawler.hosts.getOrDefault(key)
+  if host.isNil:
+    host = HostState(key: key, pending: initDeque[FrontierEntry]())
+    crawler.hosts[key] = host
+  host.pending.addLast(FrontierEntry(url: url, depth: depth))
+  inc crawler.stats.queued
+  if not host.queued:
+    host.queued = true
+    crawler.rotation.addLast(host)
+
+proc discover(crawler: Crawler; url: string; depth: int) =
+  ## Queues a URL found on a page, unless it was seen or is out of scope
+  if url.len == 0 or (crawler.options.maxDepth > 0 and depth > crawler.options.maxDepth):
+    return
+  if not crawler.options.allHosts and hostOf(url) notin crawler.seedHosts:
+    return
+  if not crawler.visited.containsOrIncl(url):
+    crawler.enqueue(url, depth)
+
+proc saveCheckpoint*(crawler: Crawler) =
+  ## Writes the frontier, the visited set, the seed hosts and the number of
+  ## pages fetched, so that the crawl can resume. URLs being fetched are
+  ## saved as pending, and not counted as fetched.
+  createDir(crawler.options.outputDir / CheckpointDir)
+  let state = crawler.checkpointPath("state")
+  var stateFile = open(state & ".tmp", fmWrite)
+  try:
+    stateFile.write("pages " & $(crawler.started - crawler.inFlight.len) & "\n")
+    for host in crawler.seedHosts:
+      stateFile.write("seed " & host & "\n")
+  finally:
+    stateFile.close()
+  let frontier = crawler.checkpointPath("frontier")
+  var file = open(frontier & ".tmp", fmWrite)
+  try:
+    for url, depth in crawler.inFlight:
+      file.write($depth & " " & url & "\n")
+    for host in crawler.hosts.values:
+      for entry in host.pending:
+        file.write($entry.depth & " " & entry.url & "\n")
+  finally:
+    file.close()
+  let visited = crawler.checkpointPath("visited")
+  crawler.visited.save(visited & ".tmp")
+  moveFile(state & ".tmp", state)
+  moveFile(visited & ".tmp", visited)
+  moveFile(frontier & ".tmp", frontier)
+  if not crawler.log.isNil:
+    crawler.log.flushFile()
+  crawler.sinceCheckpoint = 0
+
+proc loadCheckpoint(crawler: Crawler): bool =
+  ## Picks up the frontier, visited set, seed hosts and page count of an
+  ## interrupted crawl
+  let frontier = crawler.checkpointPath("frontier")
+  let visited = crawler.checkpointPath("visited")
+  let state = crawler.checkpointPath("state")
+  if not fileExists(frontier) or not fileExists(visited):
+    return false
+  crawler.visited = loadVisited(visited)
+  if fileExists(state):
+    for line in lines(state):
+      if line.startsWith("pages "):
+        try:
+          crawler.started = parseInt(line[6 .. ^1])
+        except ValueError:
+          discard
+      elif line.startsWith("seed "):
+        crawler.seedHosts.incl(line[5 .. ^1])
+  for line in lines(frontier):
+    let space = line.find(' ')
+    if space > 0:
+      try:
+        crawler.enqueue(line[space + 1 .. ^1], parseInt(line[0 ..< space]))
+      except ValueError:
+        discard
+  true
+
+proc newCrawler*(client: AsyncObiwanClient; options: CrawlOptions): Crawler =
+  ## Creates a crawl mirroring into `options.outputDir`. If the directory
+  ## holds the checkpoint of an interrupted crawl, its frontier and visited
+  ## set are loaded and the crawl carries on from there.
+  ##
+  ## Requests use the TLS context, client certificate and session cache of
+  ## `client`, which is otherwise left alone. Zero limits in `options`
+  ## are replaced by the defaults, except maxPages, maxDepth, maxBodySize,
+  ## timeoutMs and checkpointEvery, where 0 means no limit.
+  ##
+  ## Raises:
+  ##   IOError, OSError: If the output directory or its files can't be written
+  result = Crawler(options: options, client: client,
+                   rotation: initDeque[HostState]())
+  if result.options.concurrency <= 0:
+    result.options.concurrency = DefaultCrawlConcurrency
+  if result.options.perHost <= 0:
+    result.options.perHost = DefaultCrawlPerHost
+  if result.options.userAgents.len == 0:
+    result.options.userAgents = @DefaultRobotsAgents
+  createDir(options.outputDir)
+  result.log = open(options.outputDir / "crawl.log", fmAppend)
+  if options.knownHosts.len > 0:
+    result.known = openKnownHosts(options.knownHosts)
+  if result.loadCheckpoint():
+    echo "Resuming crawl with ", result.stats.queued, " queued URLs and ",
+         result.visited.len, " seen, ", result.started, " pages fetched"
+
+proc addSeed*(crawler: Crawler; url: string): bool {.discardable.} =
+  ## Adds a URL to start the crawl from. Its host is in the scope of the
+  ## crawl even without `allHosts`.
+  ##
+  ## Returns:
+  ##   false if the URL isn't a gemini:// URL, or was seen already
+  let canonical = canonicalUrl(url)
+  if canonical.len == 0:
+    return false
+  crawler.seedHosts.incl(hostOf(canonical))
+  if crawler.visited.containsOrIncl(canonical):
+    return false
+  crawler.enqueue(canonical, 0)
+  true
+
+proc stop*(crawler: Crawler) =
+  ## Makes run() checkpoint and return as soon as possible. Safe to call
+  ## from a signal handler.
+  crawler.stopping = true
+
+proc wake(crawler: Crawler) =
+  if not crawler.wakeup.isNil and not crawler.wakeup.finished:
+    crawler.wakeup.complete()
+
+proc record(crawler: Crawler; status: string; bytes: int64; url, detail: string) =
+  ## Appends a line to crawl.log. Requests still running after close()
+  ## aren't logged.
+  if crawler.log.isNil:
+    return
+  crawler.log.write(now().utc.format("yyyy-MM-dd'T'HH:mm:ss'Z'") & "\t" & status &
+                    "\t" & $bytes & "\t" & url & "\t" & detail & "\n")
+
+proc withDeadline[T](crawler: Crawler; future: Future[T]; what: string): Future[T] {.async.} =
+  ## Waits for `future`, failing once it takes longer than timeoutMs
+  if crawler.options.timeoutMs > 0 and
+      not (await withTimeout(future, crawler.options.timeoutMs)):
+    raise newException(ObiwanError, what & " timed out")
+  return await future
+
+proc newFetcher(crawler: Crawler): AsyncObiwanClient =
+  ## A client of its own for a request, sharing the TLS context. Redirects
+  ## come back as responses and are queued as links.
+  AsyncObiwanClient(maxRedirects: 0, sslContext: crawler.client.sslContext)
+
+proc checkTrust(crawler: Crawler; host: HostState; response: AsyncResponse) =
+  ## Checks the certificate of a host against the TOFU store
+  if crawler.known.isNil or response.certificate.isNil:
+    return
+  let fingerprint = response.certificate.fingerprint
+  if crawler.known.checkOrTrust(host.key, fingerprint) == trustChanged:
+    host.distrusted = true
+    raise newException(ObiwanError, "Certificate of " & host.key &
+                       " differs from the trusted one " & crawler.known.lookup(host.key))
+
+proc fetchRobots(crawler: Crawler; host: HostState) {.async.} =
+  ## Fetches and parses the robots.txt of a host
+  let fetcher = crawler.newFetcher()
+  let url = "gemini://" & (if host.key.endsWith(":1965"): host.key[0 ..< ^5] else: host.key) &
+            "/robots.txt"
+  try:
+    let response = await crawler.withDeadline(fetcher.request(url), url)
+    crawler.checkTrust(host, response)
+    if response.status == Success and response.meta.startsWith("text/plain"):
+      var text = ""
+      while text.len < MaxRobotsSize:
+        let chunk = await crawler.withDeadline(response.nextChunk(), url)
+        if chunk.len == 0:
+          break
+        text.add(chunk)
+      host.rules = parseRobots(text, crawler.options.userAgents)
+  except CatchableError as e:
+    debug("No robots.txt for " & host.key & ": " & e.msg)
+  fetcher.close()
+  host.robots = rsReady
+  dec host.active
+  dec crawler.running
+  crawler.wake()
+
+proc download(crawler: Crawler; fetcher: AsyncObiwanClient; host: HostState;
+              entry: FrontierEntry): Future[tuple[status: string, bytes: int64, meta: string]] {.async.} =
+  ## Requests a page and streams a successful body to the mirror. Returns
+  ## the status, the bytes written and the meta.
+  let response = await crawler.withDeadline(fetcher.request(entry.url), entry.url)
+  crawler.checkTrust(host, response)
+  let status = $response.status.int
+  case response.status.int div 10
+  of 2:
+    let path = mirrorPath(crawler.options.outputDir, entry.url)
+    createDir(parentDir(path))
+    let partial = path & ".part"
+    var file: File
+    if not open(file, partial, fmWrite):
+      raise newException(IOError, "Cannot open " & partial & " for writing")
+    let gemtext = response.meta.startsWith("text/gemini")
+    var extractor = initLinkExtractor(entry.url)
+    var written: int64 = 0
+    var buffer = newString(BodyChunkSize)
+    try:
+      while true:
+        let count = await crawler.withDeadline(
+          response.readBody(addr buffer[0], buffer.len), entry.url)
+        if count == 0:
+          break
+        written += count
+        if crawler.options.maxBodySize > 0 and written > crawler.options.maxBodySize:
+          raise newException(IOError, "Body larger than " & $crawler.options.maxBodySize)
+        if file.writeBuffer(addr buffer[0], count) != count:
+          raise newException(IOError, "Failed to write " & partial)
+        if gemtext:
+          extractor.feed(buffer.toOpenArray(0, count - 1))
+    except CatchableError:
+      file.close()
+      removeFile(partial)
+      raise
+    file.close()
+    moveFile(partial, path)
+    if gemtext:
+      extractor.finish()
+      for link in extractor.links:
+        crawler.discover(link, entry.depth + 1)
+    return (status, written, response.meta)
+  of 3:
+    crawler.discover(resolveLink(entry.url, response.meta), entry.depth + 1)
+    return (status, 0'i64, response.meta)
+  else:
+    return (status, 0'i64, response.meta)
+
+proc fetchPage(crawler: Crawler; host: HostState; entry: FrontierEntry) {.async.} =
+  ## Fetches a page of the frontier and records the outcome
+  var target: RequestTarget
+  discard parseRequestLine(entry.url, target)
+  let path = if target.path.len > 0: entry.url[target.path] else: "/"
+  if not host.rules.allows(path):
+    inc crawler.stats.skipped
+    crawler.record("-", 0, entry.url, "robots.txt")
+  else:
+    let fetcher = crawler.newFetcher()
+    try:
+      let outcome = await crawler.download(fetcher, host, entry)
+      inc crawler.stats.fetched
+      crawler.stats.bytes += outcome.bytes
+      crawler.record(outcome.status, outcome.bytes, entry.url, outcome.meta)
+    except CatchableError as e:
+      inc crawler.stats.failed
+      crawler.record("error", 0, entry.url, e.msg)
+    fetcher.close()
+    inc crawler.sinceCheckpoint
+  crawler.inFlight.del(entry.url)
+  dec host.active
+  dec crawler.running
+  if crawler.options.checkpointEvery > 0 and
+      crawler.sinceCheckpoint >= crawler.options.checkpointEvery:
+    crawler.saveCheckpoint()
+  crawler.wake()
+
+proc limitReached(crawler: Crawler): bool =
+  crawler.options.maxPages > 0 and crawler.started >= crawler.options.maxPages
+
+proc startReady(crawler: Crawler) =
+  ## Starts as many requests as the limits let, going round the hosts
+  let now = getMonoTime()
+  let delay = initDuration(milliseconds = crawler.options.delayMs)
+  var turns = crawler.rotation.len
+  while turns > 0 and crawler.running < crawler.options.concurrency and
+      not crawler.limitReached():
+    dec turns
+    let host = crawler.rotation.popFirst()
+    if host.pending.len == 0 or host.distrusted:
+      # Out of the rotation until more URLs come in; those of a host whose
+      # certificate changed are dropped
+      crawler.stats.queued -= host.pending.len
+      host.pending.clear()
+      host.queued = false
+      continue
+    crawler.rotation.addLast(host)
+    if host.active >= crawler.options.perHost or host.robots == rsFetching or
+        now < host.nextStart:
+      continue
+    host.nextStart = now + delay
+    inc host.active
+    inc crawler.running
+    if host.robots == rsUnknown:
+      host.robots = rsFetching
+      asyncCheck crawler.fetchRobots(host)
+    else:
+      let entry = host.pending.popFirst()
+      dec crawler.stats.queued
+      crawler.inFlight[entry.url] = entry.depth
+      inc crawler.started
+      asyncCheck crawler.fetchPage(host, entry)
+
+proc run*(crawler: Crawler) {.async.} =
+  ## Crawls until the frontier is empty, maxPages pages were fetched over
+  ## all the runs of the crawl, or stop() is called. A crawl that didn't
+  ## complete leaves a checkpoint to resume from; one that did removes it.
+  while true:
+    if crawler.stopping:
+      break
+    crawler.startReady()
+    if crawler.running == 0 and (crawler.rotation.len == 0 or crawler.limitReached()):
+      break
+    crawler.wakeup = newFuture[void]("crawler.wakeup")
+    discard await withTimeout(crawler.wakeup, PollMs)
+
+  if crawler.stats.queued > 0 or crawler.inFlight.len > 0:
+    crawler.saveCheckpoint()
+  else:
+    removeDir(crawler.options.outputDir / CheckpointDir)
+  crawler.log.flushFile()
+
+proc close*(crawler: Crawler) =
+  ## Closes the crawl log and the TOFU store
+  if not crawler.log.isNil:
+    crawler.log.close()
+    crawler.log = nil
+  if not crawler.known.isNil:
+    crawler.known.close()
+    crawler.known = nil
@@ -1,13 +1,22 @@
 # Debug utilities
 #
-# This module provides debug logging that is automatically disabled in release builds
-when not defined(release):
-  import strutils
+# This module provides debug logging that is automatically disabled in release builds.
+#
+# The logging calls are templates, so a message is only built when it is
+# actually going to be printed. Levels above `obiwanLogLevel` are removed at
+# compile time; the remaining ones are filtered at runtime against the
+# verbosity set with setVerbosityLevel().
+import strutils
 
-when not defined(release):
-  const debugEnabled* = true
+when defined(release):
+  const obiwanLogLevel* {.intdefine.} = -1
+    ## Highest level compiled in. Release builds drop all logging unless
+    ## built with e.g. `-d:obiwanLogLevel=1` to keep errors.
 else:
-  const debugEnabled* = false
+  const obiwanLogLevel* {.intdefine.} = 4
+    ## Highest level compiled in (-1 disables all logging)
+
+const debugEnabled* = obiwanLogLevel >= 0
 
 # Default verbosity level
 # 0 = Critical only
@@ -17,22 +26,43 @@ else:
 # 4 = Debug, info, warnings, errors, and critical
 const defaultVerbosity = 3
 
+# Plain int so it can be read from any thread; a torn read can't happen and
+# a stale one only delays a verbosity change
+var verbosity = defaultVerbosity
+
 {.push stack_trace: off.}
-proc getVerbosityLevel*(): int {.inline.} = 
-  return defaultVerbosity
+proc getVerbosityLevel*(): int {.inline.} =
+  return verbosity
 
-# No global variable, use accessor functions instead
-proc setVerbosityLevel*(val: int) {.inline.} = 
-  # This is intentionally a no-op to avoid the linking issues
-  discard
+proc setVerbosityLevel*(val: int) {.inline.} =
+  ## Sets the runtime verbosity (0-4). Levels removed at compile time by
+  ## `obiwanLogLevel` stay off regardless.
+  verbosity = val
 {.pop.}
 
-proc debug*(msg: string, level: int = 4) =
+template logEnabled*(level: int): bool =
+  ## Returns whether messages of `level` are printed. Use it to guard
+  ## logging code that is expensive beyond building the message.
+  ##
+  ## Example:
+  ##   ```nim
+  ##   if logEnabled(4):
+  ##     debug("Peer certificate:\n" & $cert)
+  ##   ```
+  debugEnabled and level <= obiwanLogLevel and level <= verbosity
+
+proc formatDebug(format: string, args: openArray[string]): string =
+  # Use a simple replacement approach
+  result = format
+  for arg in args:
+    result = result.replace("{}", arg)
+
+template debug*(msg: string, level: int = 4) =
   ## Logs a debug message to stdout if the verbosity level is high enough.
   ##
-  ## This procedure outputs debug information during development and testing.
-  ## All debug output is automatically disabled in release builds, with no
-  ## runtime overhead.
+  ## This template outputs debug information during development and testing.
+  ## `msg` is only evaluated when the message is printed, and all debug
+  ## output is removed from release builds, with no runtime overhead.
   ##
   ## Parameters:
   ##   msg: The debug message to output
@@ -42,16 +72,16 @@ proc debug*(msg: string, level: int = 4) =
   ##   ```nim
   ##   debug("Connecting to server...", 3) # Only shown at verbosity 3+
   ##   ```
-  when not defined(release):
-    if level <= getVerbosityLevel():
+  when debugEnabled:
+    if logEnabled(level):
       echo msg
 
-proc debugf*(format: string, args: varargs[string], level: int = 4) =
+template debugf*(format: string, args: varargs[string], level: int = 4) =
   ## Formats and logs a debug message with placeholders if the verbosity level is high enough.
   ##
-  ## This procedure allows formatted debug output with string interpolation
-  ## using "{}" placeholders. All debug output is automatically disabled in
-  ## release builds, with no runtime overhead.
+  ## This template allows formatted debug output with string interpolation
+  ## using "{}" placeholders. The arguments are only evaluated when the
+  ## message is printed, and all debug output is removed from release builds.
   ##
   ## Parameters:
   ##   format: The format string with "{}" placeholders
@@ -62,18 +92,14 @@ proc debugf*(format: string, args: varargs[string], level: int = 4) =
   ##   ```nim
   ##   debugf("Connecting to {}:{}", serverName, $port, 2) # Only shown at verbosity 2+
   ##   ```
-  when not defined(release):
-    if level <= getVerbosityLevel():
-      # Use a simple replacement approach
-      var result = format
-      for arg in args:
-        result = result.replace("{}", arg)
-      echo result
+  when debugEnabled:
+    if logEnabled(level):
+      echo formatDebug(format, args)
 
-proc critical*(msg: string) = debug(msg, 0)
-proc error*(msg: string) = debug(msg, 1)
-proc warning*(msg: string) = debug(msg, 2)
-proc info*(msg: string) = debug(msg, 3)
+template critical*(msg: string) = debug(msg, 0)
+template error*(msg: string) = debug(msg, 1)
+template warning*(msg: string) = debug(msg, 2)
+template info*(msg: string) = debug(msg, 3)
 
 template withDebug*(body: untyped) =
   ## Executes the given code block only in debug builds.
@@ -88,5 +114,19 @@ template withDebug*(body: untyped) =
   ##     let elapsed = epochTime() - startTime
   ##     echo "Operation took ", elapsed, " seconds"
   ##   ```
-  when not defined(release):
+  when debugEnabled:
     body
+
+template withDebug*(level: int, body: untyped) =
+  ## Executes the given code block only in debug builds, and only while
+  ## messages of `level` are printed. Use this for debug code that walks
+  ## buffers or formats large values on hot paths.
+  ##
+  ## Example:
+  ##   ```nim
+  ##   withDebug(4):
+  ##     debug("Received: " & hexPreview(buffer))
+  ##   ```
+  when debugEnabled:
+    if logEnabled(level):
+      body
@@ -0,0 +1,171 @@
+## Address cache shared by the synchronous and asynchronous dial()
+##
+## Without it every connection looked its host up again, so a batch of
+## requests to one capsule paid for a DNS round trip per request. Lookups are
+## kept for `dnsCacheTtlMs`: getaddrinfo() doesn't report the TTL of the
+## records it returns, so a fixed lifetime is used instead. The cache is per
+## thread, like the async dispatcher the clients run on.
+##
+## getaddrinfo() blocks, for as long as the resolver takes. The synchronous
+## dial() calls it directly; the async one uses resolveAsync(), which runs
+## it on a thread of its own so the event loop keeps serving other
+## connections meanwhile.
+
+import asyncdispatch
+import nativesockets
+import net
+import options
+import tables
+import std/monotimes
+import std/typedthreads
+from std/times import initDuration
+
+const
+  DefaultDnsCacheTtlMs* = 60_000 ## Default lifetime of a cached lookup (1 minute)
+
+var dnsCacheTtlMs* = DefaultDnsCacheTtlMs
+  ## How long resolved addresses are reused, 0 disables the cache
+
+type
+  ResolvedAddress* = object
+    ## One address a host name resolved to
+    address*: string ## Numeric IPv4 or IPv6 address
+    domain*: Domain  ## AF_INET or AF_INET6
+
+  CacheEntry = object
+    addresses: seq[ResolvedAddress]
+    expires: MonoTime
+
+  LookupJob = object
+    ## A lookup running on a thread of its own for resolveAsync()
+    host: string
+    addresses: seq[ResolvedAddress]
+    error: string
+    done: AsyncEvent # Triggered by the thread once it's done
+    thread: Thread[ptr LookupJob]
+
+var cache {.threadvar.}: Table[string, CacheEntry]
+var lookups {.threadvar.}: Table[string, Future[seq[ResolvedAddress]]] # Running resolveAsync() lookups
+
+proc lookup(host: string): seq[ResolvedAddress] =
+  ## Asks the system resolver for the TCP addresses of `host`
+  let info = getAddrInfo(host, Port(0), Domain.AF_UNSPEC, SockType.SOCK_STREAM,
+                         Protocol.IPPROTO_TCP)
+  defer: freeAddrInfo(info)
+  var current = info
+  while current != nil:
+    let domain = toKnownDomain(current.ai_family)
+    if domain.isSome:
+      let resolved = ResolvedAddress(address: getAddrString(current.ai_addr),
+                                     domain: domain.get)
+      if resolved notin result:
+        result.add(resolved)
+    current = current.ai_next
+
+proc ipAddress(host: string): seq[ResolvedAddress] =
+  ## `host` as the only address when it's an IP address, nothing otherwise
+  if isIpAddress(host):
+    let domain = if parseIpAddress(host).family == IpAddressFamily.IPv6:
+                   Domain.AF_INET6
+                 else:
+                   Domain.AF_INET
+    result = @[ResolvedAddress(address: host, domain: domain)]
+
+proc cached(host: string): seq[ResolvedAddress] =
+  ## The cached addresses of `host`, nothing if its entry is missing or expired
+  cache.withValue(host, entry):
+    if getMonoTime() < entry.expires:
+      return entry.addresses
+
+proc store(host: string; addresses: seq[ResolvedAddress]) =
+  ## Caches the result of a lookup, raising if it found nothing
+  if addresses.len == 0:
+    raise newException(OSError, "No address found for " & host)
+  if dnsCacheTtlMs > 0:
+    cache[host] = CacheEntry(addresses: addresses,
+                             expires: getMonoTime() + initDuration(milliseconds = dnsCacheTtlMs))
+
+proc resolve*(host: string): seq[ResolvedAddress] =
+  ## Returns the addresses to try when connecting to `host`, in the order
+  ## the resolver prefers them.
+  ##
+  ## IP addresses are returned as they are, host names are looked up once
+  ## and then answered from the cache until their entry expires.
+  ##
+  ## Parameters:
+  ##   host: Host name or IP address, without IPv6 brackets
+  ##
+  ## Returns:
+  ##   At least one resolved address
+  ##
+  ## Raises:
+  ##   OSError: If the host name cannot be resolved
+  result = ipAddress(host)
+  if result.len > 0:
+    return
+  result = cached(host)
+  if result.len > 0:
+    return
+  result = lookup(host)
+  store(host, result)
+
+proc lookupThread(job: ptr LookupJob) {.thread.} =
+  try:
+    job.addresses = lookup(job.host)
+  except CatchableError as e:
+    job.error = e.msg
+  job.done.trigger()
+
+proc lookupAsync(host: string): Future[seq[ResolvedAddress]] {.async.} =
+  ## Runs lookup() on a thread and caches its result
+  let job = createShared(LookupJob)
+  job.host = host
+  job.done = newAsyncEvent()
+  let finished = newFuture[void]("dns.lookupAsync")
+  addEvent(job.done, proc (fd: AsyncFD): bool =
+    finished.complete()
+    true)
+  try:
+    createThread(job.thread, lookupThread, job)
+  except ResourceExhaustedError as e:
+    job.done.unregister()
+    job.done.close()
+    reset(job[])
+    freeShared(job)
+    lookups.del(host)
+    raise newException(OSError, "Can't start a lookup of " & host & ": " & e.msg)
+  await finished
+  joinThread(job.thread)
+  job.done.close()
+  let error = move job.error
+  result = move job.addresses
+  reset(job[])
+  freeShared(job)
+  lookups.del(host)
+  if error.len > 0:
+    raise newException(OSError, error)
+  store(host, result)
+
+proc resolveAsync*(host: string): Future[seq[ResolvedAddress]] {.async.} =
+  ## Same as resolve(), without blocking the event loop: the lookup runs on
+  ## a thread of its own. Concurrent calls for the same host, like those of
+  ## a fetchMany() batch, share one lookup.
+  ##
+  ## Raises:
+  ##   OSError: If the host name cannot be resolved
+  result = ipAddress(host)
+  if result.len > 0:
+    return
+  result = cached(host)
+  if result.len > 0:
+    return
+  var running = lookups.getOrDefault(host)
+  if running.isNil:
+    running = lookupAsync(host)
+    if not running.finished:
+      lookups[host] = running
+  return await running
+
+proc clearDnsCache*() =
+  ## Forgets every cached lookup of the calling thread
+  cache.clear()
@@ -7,7 +7,9 @@ import std/os
 import std/strutils
 import std/tables
 import std/algorithm # For sort
-import webby as wb
+import std/times
+import url
+import cache
 
 # MIME type mapping based on file extensions
 const mimeTypes = {
@@ -73,9 +75,31 @@ proc detectMimeType*(filePath: string): string =
   # Default to binary if unknown
   return "application/octet-stream"
 
+var pathBuffer {.threadvar.}: string # Reused by sanitizePath() for every request
+
+proc normalizeRequestPath*(reqPath: string): string =
+  ## Normalizes a request path the way sanitizePath() does, without
+  ## joining it to a directory
+  ##
+  ## Parameters:
+  ##   reqPath: The request path to normalize
+  ##
+  ## Returns:
+  ##   The decoded path with a single leading slash and no trailing one,
+  ##   "/" for the root
+  ##
+  ## Raises:
+  ##   FileSecurityError: If path traversal is detected
+  if not normalizePath(reqPath, result):
+    raise newException(FileSecurityError, "Path traversal detected")
+
 proc sanitizePath*(basePath, reqPath: string): string =
   ## Sanitizes a request path to prevent directory traversal attacks
   ##
+  ## The path is decoded and normalized in one pass into a buffer reused
+  ## across requests (see normalizePath()), so the joined path is the only
+  ## string allocated.
+  ##
   ## Parameters:
   ##   basePath: The base directory (docRoot)
   ##   reqPath: The request path to sanitize
@@ -85,40 +109,16 @@ proc sanitizePath*(basePath, reqPath: string): string =
   ##
   ## Raises:
   ##   FileSecurityError: If path traversal is detected
-  
-  # Decode URL path (handle percent encoding)
-  var path = wb.decodeURIComponent(reqPath)
-  
-  # Remove leading slash if present
-  if path.startsWith("/"):
-    path = path[1..^1]
-  
-  # Normalize the path (resolve . and ..)
-  var normalizedParts: seq[string] = @[]
-  
-  for part in path.split('/'):
-    if part == "..":
-      if normalizedParts.len > 0:
-        discard normalizedParts.pop()
-      else:
-        # Trying to go above the root directory - security violation
-        raise newException(FileSecurityError, "Path traversal detected")
-    elif part == "." or part == "":
-      # Skip . and empty parts
-      continue
-    else:
-      normalizedParts.add(part)
-  
-  # Join the path with OS-specific separator
-  var resultPath = basePath
-  for part in normalizedParts:
-    resultPath = resultPath / part
-  
-  # Verify the final path is still within the base path
-  if not resultPath.startsWith(basePath):
+  if not normalizePath(reqPath, pathBuffer):
     raise newException(FileSecurityError, "Path traversal detected")
-  
-  return resultPath
+
+  # No segment of the normalized path can lead out of basePath
+  result = newStringOfCap(basePath.len + pathBuffer.len)
+  result.add(basePath)
+  if pathBuffer.len > 1:
+    if result.len > 0 and result[^1] != DirSep:
+      result.add(DirSep)
+    result.add(pathBuffer.toOpenArray(1, pathBuffer.high))
 
 proc readFileContents*(filePath: string): tuple[content: string, size: int64] =
   ## Reads a file's contents and returns them with the file size
@@ -162,12 +162,14 @@ proc generateDirectoryListing*(dirPath, requestPath: string): string =
   ## Returns:
   ##   Gemini-formatted text for the directory listing
   
-  result = "# Directory listing for " & requestPath & "\n\n"
-  
-  # Ensure request path ends with a slash for proper link construction
+  # Ensure request path ends with a slash for proper link construction.
+  # This also makes the listing the same for `/dir` and `/dir/`, so both
+  # can share one cache entry.
   var urlPath = requestPath
   if not urlPath.endsWith("/"):
     urlPath &= "/"
+
+  result = "# Directory listing for " & urlPath & "\n\n"
   
   # Add parent directory link unless we're at the root
   if urlPath != "/":
@@ -208,51 +210,167 @@ proc generateDirectoryListing*(dirPath, requestPath: string): string =
   
   return result
 
-proc handleFileRequest*(basePath, reqPath: string): tuple[content: string, mimeType: string, success: bool, errorMsg: string] =
-  ## Handles a file request, returning the content and MIME type
+type
+  FileError* = enum
+    ## Why a file request can't be served, `$` gives its error message
+    feNone = "",                          ## The request can be served
+    feNotFound = "File not found",        ## Nothing at the path, or a hidden file
+    feListingNotAllowed = "Directory listing not allowed", ## Directory without index.gmi
+    feTraversal = "Security violation: Path traversal attempt", ## Path leading above the root
+    feRead = "Error reading file",        ## The file exists but couldn't be read
+    feUnknown = "Unknown error"           ## Anything else, details in errorMsg
+
+  FileTarget* = object
+    ## Resolved target of a file request.
+    ##
+    ## Regular files are described by their path and size rather than their
+    ## content, so the server can stream them with respondFile() instead of
+    ## loading them into memory. Generated content (directory listings) is
+    ## returned in `content` with an empty `path`. Bodies served from a
+    ## content pack (see pack.nim) stay in its mapping and are described by
+    ## `data` and `size`.
+    path*: string       ## Filesystem path of the file to stream ("" for generated content)
+    content*: string    ## Generated content, such as a directory listing
+    data*: pointer      ## Body inside a mapped content pack (nil otherwise)
+    mimeType*: string   ## MIME type of the content
+    size*: int64        ## Size of the body in bytes
+    success*: bool      ## Whether the request can be served
+    error*: FileError   ## Why the request can't be served if success is false
+    errorMsg*: string   ## Error message if success is false, `$error` with details
+
+proc fileTargetError*(error: FileError; details = ""): FileTarget =
+  ## A FileTarget for a request that can't be served because of `error`
+  let msg = if details.len > 0: $error & ": " & details else: $error
+  FileTarget(success: false, error: error, errorMsg: msg)
+
+proc resolveFileRequest*(basePath, reqPath: string): FileTarget =
+  ## Resolves a file request to what should be served, without reading files
   ##
   ## Parameters:
   ##   basePath: The base directory (docRoot)
   ##   reqPath: The request path
   ##
   ## Returns:
-  ##   Tuple containing:
-  ##   - content: File content or directory listing
-  ##   - mimeType: MIME type of the content
-  ##   - success: Whether the request was successful
-  ##   - errorMsg: Error message if success is false
-  
+  ##   A FileTarget describing the file to stream or the generated content.
+  ##   The error messages are the same as the ones from handleFileRequest.
+
   try:
     let fullPath = sanitizePath(basePath, reqPath)
-    
-    # Check if path exists
-    if not fileExists(fullPath) and not dirExists(fullPath):
-      return (content: "", mimeType: "", success: false, errorMsg: "File not found")
-    
+
     # Handle directory
     if dirExists(fullPath):
       # Check for index.gmi
       let indexPath = fullPath / "index.gmi"
       if fileExists(indexPath):
-        let (content, _) = readFileContents(indexPath)
-        return (content: content, mimeType: "text/gemini", success: true, errorMsg: "")
-      
+        return FileTarget(path: indexPath, mimeType: "text/gemini",
+                          size: getFileSize(indexPath), success: true)
+
       # No index file, check if directory listing is allowed
       if isDirectoryListingAllowed(fullPath):
         let listing = generateDirectoryListing(fullPath, reqPath)
-        return (content: listing, mimeType: "text/gemini", success: true, errorMsg: "")
+        return FileTarget(content: listing, mimeType: "text/gemini",
+                          size: listing.len.int64, success: true)
       else:
-        return (content: "", mimeType: "", success: false, errorMsg: "Directory listing not allowed")
-    
+        return fileTargetError(feListingNotAllowed)
+
+    # Check if path exists
+    if not fileExists(fullPath):
+      return fileTargetError(feNotFound)
+
     # Handle file
-    let (content, _) = readFileContents(fullPath)
-    let mimeType = detectMimeType(fullPath)
-    
-    return (content: content, mimeType: mimeType, success: true, errorMsg: "")
-    
+    return FileTarget(path: fullPath, mimeType: detectMimeType(fullPath),
+                      size: getFileSize(fullPath), success: true)
+
+  except FileSecurityError:
+    return fileTargetError(feTraversal)
+  except IOError, OSError:
+    return fileTargetError(feRead)
+  except:
+    return fileTargetError(feUnknown, getCurrentExceptionMsg())
+
+proc resolveFileRequest*(basePath, reqPath: string; cache: ContentCache): FileTarget =
+  ## Resolves a file request, serving small files and listings from `cache`
+  ##
+  ## On a cache hit the body is returned in `content` without touching the
+  ## filesystem. On a miss the request is resolved as usual; index pages,
+  ## directory listings and files no larger than `cache.maxFileSize` are
+  ## read into the cache and returned in `content`, while larger files keep
+  ## their `path` so they are still streamed.
+  ##
+  ## Parameters:
+  ##   basePath: The base directory (docRoot)
+  ##   reqPath: The request path
+  ##   cache: The content cache to use, or nil to disable caching
+  ##
+  ## Returns:
+  ##   A FileTarget, as for resolveFileRequest(basePath, reqPath)
+
+  if cache.isNil:
+    return resolveFileRequest(basePath, reqPath)
+
+  var fullPath: string
+  try:
+    fullPath = sanitizePath(basePath, reqPath)
   except FileSecurityError:
-    return (content: "", mimeType: "", success: false, errorMsg: "Security violation: Path traversal attempt")
+    return fileTargetError(feTraversal)
+  except:
+    return fileTargetError(feUnknown, getCurrentExceptionMsg())
+
+  var cached: CachedContent
+  if cache.get(fullPath, cached):
+    return FileTarget(content: cached.content, mimeType: cached.mimeType,
+                      size: cached.content.len.int64, success: true)
+
+  result = resolveFileRequest(basePath, reqPath)
+  if not result.success:
+    return
+
+  let isListing = result.path == ""
+  let source = if isListing: fullPath else: result.path
+  if not isListing and result.size > cache.maxFileSize:
+    return # Too large to cache, stream it
+
+  try:
+    # Take the mtime before reading so a concurrent write makes the entry stale
+    let mtime = getLastModificationTime(source)
+    if not isListing:
+      result.content = readFile(result.path)
+      result.size = result.content.len.int64
+      result.path = ""
+    cache.put(fullPath, result.content, result.mimeType, source, mtime,
+              isDirectory = isListing)
+  except IOError, OSError:
+    discard # Serve uncached; a file that can't be read is streamed as before
+
+proc handleFileRequest*(basePath, reqPath: string): tuple[content: string, mimeType: string, success: bool, errorMsg: string] =
+  ## Handles a file request, returning the content and MIME type
+  ##
+  ## This reads the whole file into memory. Servers should prefer
+  ## resolveFileRequest() together with respondFile(), which streams
+  ## the file instead.
+  ##
+  ## Parameters:
+  ##   basePath: The base directory (docRoot)
+  ##   reqPath: The request path
+  ##
+  ## Returns:
+  ##   Tuple containing:
+  ##   - content: File content or directory listing
+  ##   - mimeType: MIME type of the content
+  ##   - success: Whether the request was successful
+  ##   - errorMsg: Error message if success is false
+
+  let target = resolveFileRequest(basePath, reqPath)
+  if not target.success:
+    return (content: "", mimeType: "", success: false, errorMsg: target.errorMsg)
+
+  if target.path == "":
+    return (content: target.content, mimeType: target.mimeType, success: true, errorMsg: "")
+
+  try:
+    let (content, _) = readFileContents(target.path)
+    return (content: content, mimeType: target.mimeType, success: true, errorMsg: "")
   except IOError:
     return (content: "", mimeType: "", success: false, errorMsg: "Error reading file")
   except:
-    return (content: "", mimeType: "", success: false, errorMsg: "Unknown error: " & getCurrentExceptionMsg())
\ No newline at end of file
+    return (content: "", mimeType: "", success: false, errorMsg: "Unknown error: " & getCurrentExceptionMsg())
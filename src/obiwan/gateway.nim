@@ -0,0 +1,546 @@
+## Gateways to long-running backends for dynamic content
+##
+## A gateway hands the requests under a path prefix to an application
+## server listening on a Unix socket, and streams its answer back to the
+## client as it arrives. Applications stay up between requests instead of
+## being started for each one, like CGI scripts would be.
+##
+## Two protocols are spoken:
+## - SCGI: the request parameters as a netstring, then the response until
+##   the backend closes the connection. Each request opens a connection.
+## - FastCGI (responder role): the parameters and the response framed as
+##   records, with FCGI_KEEP_CONN set so the backend leaves the connection
+##   open. Up to `maxIdle` connections are kept per backend and reused by
+##   later requests, which then skip connecting altogether.
+##
+## Backends get the usual CGI variables, GEMINI_URL, and the client
+## certificate in TLS_CLIENT_HASH and REMOTE_USER when one was presented.
+## They answer with a Gemini response, a header line and an optional body.
+##
+## Each backend admits `maxConcurrency` requests at a time; the others wait
+## for a slot in arrival order. The limit and the pool are per process, so
+## with several workers (see workers.nim) a backend sees up to
+## `maxConcurrency` requests from each of them.
+##
+## Gateways need the async server.
+##
+## Example:
+##   ```nim
+##   let gateways = @[newGateway("/app", newBackend("/run/app.sock", gpFastCgi))]
+##
+##   proc handler(request: AsyncRequest) {.async.} =
+##     let gateway = findGateway(gateways, gatewayPath(request.url.path))
+##     if gateway.isNil:
+##       await request.respond(NotFound, "Not found")
+##     else:
+##       await gateway.serve(request)
+##   ```
+
+import std/asyncdispatch
+import std/asyncnet
+import std/monotimes
+import std/net
+import std/strutils
+
+import "../obiwan"
+import "fs"
+import "url"
+
+const
+  DefaultMaxConcurrency* = 16 ## Requests a backend handles at once by default
+  DefaultMaxIdle* = 4 ## Idle FastCGI connections kept per backend by default
+  DefaultGatewayTimeoutMs* = 30_000 ## Time a backend has to answer by default
+  GatewaySoftware = "ObiWAN/" & ObiwanVersion
+  MaxHeaderLength = 1024 + 5 # Meta, status digits, space and CR LF
+
+  # FastCGI record types and flags, see the FastCGI specification
+  FcgiVersion = 1
+  FcgiBeginRequest = 1
+  FcgiEndRequest = 3
+  FcgiParams = 4
+  FcgiStdin = 5
+  FcgiStdout = 6
+  FcgiStderr = 7
+  FcgiResponder = 1
+  FcgiKeepConn = 1
+  FcgiRequestComplete = 0
+  FcgiRequestId = 1 # Connections carry one request at a time
+  FcgiHeaderSize = 8
+  FcgiMaxContent = 65535
+
+type
+  GatewayError* = object of ObiwanError
+    ## Raised when a backend can't be reached or answers out of protocol
+
+  GatewayProtocol* = enum
+    ## Protocol spoken with a backend
+    gpScgi = "scgi",      ## SCGI, one connection per request
+    gpFastCgi = "fastcgi" ## FastCGI, connections kept open and reused
+
+  GatewayOutput* = proc (data: pointer; size: int): Future[void] {.closure, gcsafe.}
+    ## Receives the response of a backend as it arrives
+
+  Backend* = ref object
+    ## An application server and the connections to it
+    socketPath*: string        ## Unix socket the backend listens on
+    protocol*: GatewayProtocol ## Protocol it speaks
+    maxConcurrency*: int       ## Requests it handles at once (0 = no limit)
+    maxIdle*: int              ## Idle FastCGI connections kept open (0 = close after each request)
+    timeoutMs*: int            ## Time it has for each read of its answer (0 = no limit)
+    active: int                # Requests holding a slot
+    waiting: seq[Future[void]] # Requests waiting for one, oldest first
+    idle: seq[AsyncSocket]     # Open FastCGI connections, most recently used last
+    connectionsOpened*: int    ## Connections opened to the backend so far
+
+  Gateway* = ref object
+    ## A path prefix served by a backend
+    route*: string    ## Path prefix, without a trailing slash; SCRIPT_NAME of the backend
+    backend*: Backend ## Backend serving it
+
+proc newBackend*(socketPath: string; protocol = gpFastCgi;
+                 maxConcurrency = DefaultMaxConcurrency; maxIdle = DefaultMaxIdle;
+                 timeoutMs = DefaultGatewayTimeoutMs): Backend =
+  ## Creates a backend listening on a Unix socket. No connection is opened
+  ## until a request needs one.
+  ##
+  ## Parameters:
+  ##   socketPath: Path of the backend's Unix socket
+  ##   protocol: Protocol the backend speaks
+  ##   maxConcurrency: Requests sent to it at once (0 = no limit)
+  ##   maxIdle: Idle FastCGI connections kept for later requests
+  ##   timeoutMs: Time it has for each read of its answer (0 = no limit)
+  ##
+  ## Returns:
+  ##   The new Backend
+  Backend(socketPath: socketPath, protocol: protocol,
+          maxConcurrency: maxConcurrency, maxIdle: maxIdle, timeoutMs: timeoutMs)
+
+proc newGateway*(route: string; backend: Backend): Gateway =
+  ## Creates a gateway serving `route` and every path below it from
+  ## `backend`. A trailing slash of the route is dropped, so "/app/" serves
+  ## /app as well as /app/anything.
+  ##
+  ## Raises:
+  ##   ValueError: If the route doesn't start with '/'
+  if not route.startsWith('/'):
+    raise newException(ValueError, "Gateway routes start with '/': " & route)
+  var prefix = route
+  while prefix.len > 1 and prefix.endsWith('/'):
+    prefix.setLen(prefix.len - 1)
+  if prefix == "/":
+    prefix = ""
+  Gateway(route: prefix, backend: backend)
+
+proc gatewayPath*(path: string): string =
+  ## Normalizes a request path for routing to a gateway, with
+  ## normalizeRequestPath(), so that /app/../secret, /app/%2e%2e/x and
+  ## //app are routed as /secret, /x and /app. A trailing slash is kept,
+  ## backends may tell /dir/ from /dir.
+  ##
+  ## Returns:
+  ##   The decoded, normalized path, or "" if it leads above the root
+  try:
+    result = normalizeRequestPath(path)
+  except FileSecurityError:
+    return ""
+  if result.len > 1 and path.len > 1 and path.endsWith('/'):
+    result.add('/')
+
+proc findGateway*(gateways: openArray[Gateway]; path: string): Gateway =
+  ## Finds the gateway serving a request path.
+  ##
+  ## A gateway serves its route and the paths below it, so /app serves
+  ## /app and /app/x but not /apple. The longest matching route wins.
+  ## `path` is expected normalized, see gatewayPath().
+  ##
+  ## Returns:
+  ##   The gateway, or nil if none serves the path
+  for gateway in gateways:
+    let route = gateway.route
+    if path.startsWith(route) and (path.len == route.len or path[route.len] == '/') and
+        (result.isNil or route.len > result.route.len):
+      result = gateway
+
+proc idleConnections*(backend: Backend): int =
+  ## Open FastCGI connections waiting for a request
+  backend.idle.len
+
+proc close*(backend: Backend) =
+  ## Closes the idle connections of a backend
+  for socket in backend.idle:
+    socket.close()
+  backend.idle.setLen(0)
+
+proc acquire(backend: Backend): Future[bool] {.async.} =
+  ## Waits for one of the backend's request slots, at most timeoutMs.
+  ## Returns false if none freed up in time.
+  ##
+  ## The timeout and release() can both fire before this resumes; when the
+  ## request is no longer waiting, release() already handed it the slot.
+  if backend.maxConcurrency <= 0 or backend.active < backend.maxConcurrency:
+    inc backend.active
+    return true
+  let turn = newFuture[void]("gateway.acquire")
+  backend.waiting.add(turn)
+  if backend.timeoutMs <= 0:
+    await turn
+    return true
+  if await withTimeout(turn, backend.timeoutMs):
+    return true
+  let index = backend.waiting.find(turn)
+  if index < 0:
+    return true # Granted as the timeout fired
+  backend.waiting.delete(index)
+  return false
+
+proc release(backend: Backend) =
+  ## Passes a request slot on to the oldest waiting request, or frees it
+  if backend.waiting.len > 0:
+    backend.waiting[0].complete() # The slot changes hands, active stays
+    backend.waiting.delete(0)
+  else:
+    dec backend.active
+
+proc connect(backend: Backend): Future[AsyncSocket] {.async.} =
+  ## Opens a new connection to the backend
+  let socket = newAsyncSocket(AF_UNIX, SOCK_STREAM, IPPROTO_IP, buffered = false)
+  try:
+    await socket.connectUnix(backend.socketPath)
+  except CatchableError as e:
+    socket.close()
+    raise newException(GatewayError, "Can't connect to backend " &
+                       backend.socketPath & ": " & e.msg)
+  inc backend.connectionsOpened
+  return socket
+
+proc receive(backend: Backend; socket: AsyncSocket; buffer: pointer;
+             size: int): Future[int] {.async.} =
+  ## Reads what the backend sent, up to `size` bytes, 0 once it closed the
+  ## connection
+  let reading = socket.recvInto(buffer, size)
+  if backend.timeoutMs > 0 and not (await withTimeout(reading, backend.timeoutMs)):
+    raise newException(GatewayError, "Backend " & backend.socketPath & " timed out")
+  return await reading
+
+proc receiveExactly(backend: Backend; socket: AsyncSocket; buffer: pointer;
+                    size: int) {.async.} =
+  ## Reads exactly `size` bytes from the backend
+  var received = 0
+  while received < size:
+    let count = await backend.receive(socket,
+                                      cast[pointer](cast[int](buffer) + received),
+                                      size - received)
+    if count <= 0:
+      raise newException(GatewayError, "Backend " & backend.socketPath &
+                         " closed the connection mid-record")
+    received += count
+
+proc gatewayParams*(gateway: Gateway; request: AsyncRequest): seq[(string, string)] =
+  ## The CGI variables a backend gets for a request.
+  ##
+  ## Besides the CGI/1.1 ones, GEMINI_URL holds the requested URL and, when
+  ## the client presented a certificate, TLS_CLIENT_HASH its fingerprint,
+  ## TLS_CLIENT_VERIFIED whether it chains to a trusted CA, and REMOTE_USER
+  ## its common name. QUERY_STRING is sent the way the client encoded it;
+  ## PATH_INFO is the rest of the path after SCRIPT_NAME, decoded and
+  ## normalized by gatewayPath(). serve() refuses paths that normalize
+  ## outside the gateway's route before asking for these.
+  ##
+  ## Parameters:
+  ##   gateway: The gateway serving the request
+  ##   request: The request
+  ##
+  ## Returns:
+  ##   Names and values of the variables
+  let url = request.url
+  let path = gatewayPath(url.path)
+  let pathInfo = if path.len > gateway.route.len: path[gateway.route.len .. ^1] else: ""
+  result = @[
+    ("GATEWAY_INTERFACE", "CGI/1.1"),
+    ("SERVER_PROTOCOL", "GEMINI"),
+    ("SERVER_SOFTWARE", GatewaySoftware),
+    ("REQUEST_METHOD", "GET"),
+    ("GEMINI_URL", $url),
+    ("SCRIPT_NAME", gateway.route),
+    ("PATH_INFO", pathInfo),
+    ("QUERY_STRING", request.rawQuery),
+    ("SERVER_NAME", url.hostname.unbracketed),
+    ("SERVER_PORT", $url.geminiPort),
+    ("REMOTE_ADDR", peerAddress(request.client.fd)),
+  ]
+  if request.hasCertificate():
+    result.add(("AUTH_TYPE", "CERTIFICATE"))
+    result.add(("TLS_CLIENT_HASH", fingerprint(request.certificate)))
+    result.add(("TLS_CLIENT_VERIFIED", if request.isVerified(): "1" else: "0"))
+    result.add(("REMOTE_USER", commonName(request.certificate)))
+
+proc encodeScgi*(params: openArray[(string, string)]): string =
+  ## Encodes an SCGI request without a body: the parameters as a netstring,
+  ## CONTENT_LENGTH first as SCGI requires.
+  var headers = "CONTENT_LENGTH\x000\x00SCGI\x001\x00"
+  for (name, value) in params:
+    headers.add(name)
+    headers.add('\0')
+    headers.add(value)
+    headers.add('\0')
+  result = $headers.len & ":" & headers & ","
+
+proc addLength(message: var string; length: int) =
+  ## Adds the length of a FastCGI name or value, in one byte below 128
+  if length < 128:
+    message.add(char(length))
+  else:
+    message.add(char((length shr 24) or 0x80))
+    message.add(char((length shr 16) and 0xff))
+    message.add(char((length shr 8) and 0xff))
+    message.add(char(length and 0xff))
+
+proc addRecord(message: var string; kind: int; content: openArray[char]) =
+  ## Adds a FastCGI record of the request, with no content padding
+  assert content.len <= FcgiMaxContent
+  message.add(char(FcgiVersion))
+  message.add(char(kind))
+  message.add(char(FcgiRequestId shr 8))
+  message.add(char(FcgiRequestId and 0xff))
+  message.add(char(content.len shr 8))
+  message.add(char(content.len and 0xff))
+  message.add('\0') # Padding length
+  message.add('\0') # Reserved
+  let start = message.len
+  message.setLen(start + content.len)
+  if content.len > 0:
+    copyMem(addr message[start], unsafeAddr content[0], content.len)
+
+proc encodeFastCgi*(params: openArray[(string, string)]; keepConnection = true): string =
+  ## Encodes a FastCGI responder request without a body: BEGIN_REQUEST,
+  ## the parameters in as many PARAMS records as they need, and the empty
+  ## PARAMS and STDIN records ending both streams.
+  ##
+  ## Parameters:
+  ##   params: Names and values of the parameters
+  ##   keepConnection: Whether to ask the backend to keep the connection open
+  let flags = if keepConnection: FcgiKeepConn else: 0
+  result.addRecord(FcgiBeginRequest,
+                   [char(0), char(FcgiResponder), char(flags), '\0', '\0', '\0', '\0', '\0'])
+  var pairs: string
+  for (name, value) in params:
+    pairs.addLength(name.len)
+    pairs.addLength(value.len)
+    pairs.add(name)
+    pairs.add(value)
+  var offset = 0
+  while offset < pairs.len:
+    let size = min(pairs.len - offset, FcgiMaxContent)
+    result.addRecord(FcgiParams, pairs.toOpenArray(offset, offset + size - 1))
+    offset += size
+  result.addRecord(FcgiParams, [])
+  result.addRecord(FcgiStdin, [])
+
+proc queryScgi(backend: Backend; message: string; output: GatewayOutput;
+               buffer: pointer; size: int) {.async.} =
+  ## One SCGI exchange, on a connection of its own
+  let socket = await backend.connect()
+  try:
+    await socket.send(message)
+    while true:
+      let count = await backend.receive(socket, buffer, size)
+      if count <= 0:
+        break
+      await output(buffer, count)
+  finally:
+    socket.close()
+
+proc exchangeFastCgi(backend: Backend; socket: AsyncSocket; message: string;
+                     output: GatewayOutput; buffer: pointer; size: int;
+                     started: ptr bool) {.async.} =
+  ## Sends a FastCGI request over `socket` and streams STDOUT to `output`
+  ## until END_REQUEST. `started` is set once output was produced.
+  await socket.send(message)
+  var header: array[FcgiHeaderSize, uint8]
+  while true:
+    await backend.receiveExactly(socket, addr header[0], FcgiHeaderSize)
+    let kind = header[1].int
+    let requestId = (header[2].int shl 8) or header[3].int
+    var remaining = (header[4].int shl 8) or header[5].int
+    let padding = header[6].int
+    if header[0].int != FcgiVersion:
+      raise newException(GatewayError, "Backend " & backend.socketPath &
+                         " sent a record of FastCGI version " & $header[0])
+
+    if kind == FcgiEndRequest:
+      var body: array[8, uint8]
+      if remaining != body.len:
+        raise newException(GatewayError, "Malformed END_REQUEST record")
+      await backend.receiveExactly(socket, addr body[0], body.len)
+      if padding > 0:
+        await backend.receiveExactly(socket, buffer, padding)
+      if requestId == FcgiRequestId:
+        if body[4].int != FcgiRequestComplete:
+          raise newException(GatewayError, "Backend " & backend.socketPath &
+                             " refused the request (" & $body[4] & ")")
+        return
+      continue
+
+    # Content is read in buffer sized pieces and passed on as it comes
+    remaining += padding
+    let content = remaining - padding
+    var offset = 0
+    while remaining > 0:
+      let count = min(remaining, size)
+      await backend.receiveExactly(socket, buffer, count)
+      let useful = max(min(count, content - offset), 0)
+      if useful > 0 and requestId == FcgiRequestId:
+        if kind == FcgiStdout:
+          started[] = true
+          await output(buffer, useful)
+        elif kind == FcgiStderr:
+          var text = newString(useful)
+          copyMem(addr text[0], buffer, useful)
+          debug("Backend " & backend.socketPath & ": " & text)
+      offset += count
+      remaining -= count
+
+proc queryFastCgi(backend: Backend; message: string; output: GatewayOutput;
+                  buffer: pointer; size: int) {.async.} =
+  ## One FastCGI exchange, over an idle connection when there is one
+  var started = false
+  while true:
+    let reused = backend.idle.len > 0
+    var socket: AsyncSocket
+    if reused:
+      socket = backend.idle.pop()
+    else:
+      socket = await backend.connect()
+    try:
+      await backend.exchangeFastCgi(socket, message, output, buffer, size, addr started)
+    except CatchableError:
+      socket.close()
+      # A kept connection may have been closed by the backend meanwhile,
+      # which shows as soon as it's used: try again on a new one
+      if reused and not started:
+        continue
+      raise
+    if backend.idle.len < backend.maxIdle:
+      backend.idle.add(socket)
+    else:
+      socket.close()
+    return
+
+proc query*(backend: Backend; params: seq[(string, string)];
+            output: GatewayOutput) {.async.} =
+  ## Sends a request to a backend and streams its response to `output`,
+  ## piece by piece as it arrives. Waits for one of the backend's request
+  ## slots first.
+  ##
+  ## Parameters:
+  ##   backend: The backend to ask
+  ##   params: CGI variables of the request (see gatewayParams())
+  ##   output: Called with each piece of the response
+  ##
+  ## Raises:
+  ##   GatewayError: If the backend has no free slot in time, can't be
+  ##     reached, times out, or answers out of protocol
+  if not await backend.acquire():
+    raise newException(GatewayError, "Backend " & backend.socketPath & " is busy")
+  var buffer = newString(StreamChunkSize)
+  try:
+    case backend.protocol
+    of gpScgi:
+      await backend.queryScgi(encodeScgi(params), output, addr buffer[0], buffer.len)
+    of gpFastCgi:
+      let message = encodeFastCgi(params, keepConnection = backend.maxIdle > 0)
+      await backend.queryFastCgi(message, output, addr buffer[0], buffer.len)
+  finally:
+    backend.release()
+
+proc appendBytes(text: var string; data: pointer; size: int) =
+  ## Adds `size` bytes at `data` to `text`
+  let start = text.len
+  text.setLen(start + size)
+  if size > 0:
+    copyMem(addr text[start], data, size)
+
+proc headerStatus*(line: openArray[char]): int =
+  ## The status of a response header line a backend sent, without its CRLF.
+  ##
+  ## Returns:
+  ##   The status, or -1 if the line isn't a valid Gemini header
+  if line.len < 2 or line.len > MaxHeaderLength - 2 or
+      line[0] notin {'1'..'6'} or line[1] notin Digits:
+    return -1
+  if line.len > 2 and line[2] != ' ':
+    return -1
+  (line[0].ord - '0'.ord) * 10 + line[1].ord - '0'.ord
+
+proc serve*(gateway: Gateway; request: AsyncRequest) {.async.} =
+  ## Answers a request with the response of the gateway's backend.
+  ##
+  ## The backend's header line is checked before anything is sent; a
+  ## backend that can't be reached, fails, or sends an invalid header gets
+  ## the client a 42 CGI ERROR. Once the header is out, the body is relayed
+  ## as it arrives and a failing backend cuts the response short. A path
+  ## that normalizes outside the gateway's route, or above the root, gets
+  ## a 59 without reaching the backend.
+  ##
+  ## Parameters:
+  ##   gateway: The gateway serving the request
+  ##   request: The request
+  let path = gatewayPath(request.url.path)
+  let route = gateway.route
+  if path.len == 0 or not path.startsWith(route) or
+      (path.len > route.len and path[route.len] != '/'):
+    debug("Gateway " & route & ": refused path " & request.url.path)
+    await request.respond(MalformedRequest, "Invalid request")
+    return
+
+  let sendStart = getMonoTime()
+  var header = ""
+  var headerSent = false
+
+  proc relay(data: pointer; size: int) {.async.} =
+    let bytes = cast[ptr UncheckedArray[char]](data)
+    if headerSent:
+      if request.status in 20..29: # Only successful responses have a body
+        await request.client.send(data, size)
+        request.bytesSent += size
+      return
+
+    # Hold everything back until the whole header line is in
+    var lineEnd = -1
+    for i in 0 ..< size:
+      if bytes[i] == '\n':
+        lineEnd = i
+        break
+    let taken = if lineEnd < 0: size else: lineEnd + 1
+    if header.len + taken > MaxHeaderLength:
+      raise newException(GatewayError, "Backend header too long")
+    header.appendBytes(data, taken)
+    if lineEnd < 0:
+      return
+    let lineLength = header.len - (if header.len >= 2 and header[^2] == '\r': 2 else: 1)
+    let status = headerStatus(header.toOpenArray(0, lineLength - 1))
+    if status < 0:
+      raise newException(GatewayError, "Backend sent an invalid header")
+    request.status = status
+    headerSent = true
+    if taken < size and status in 20..29:
+      # The header shares a record with the start of the body
+      header.appendBytes(addr bytes[taken], size - taken)
+    await request.client.send(header)
+    request.bytesSent += header.len
+
+  try:
+    await gateway.backend.query(gateway.gatewayParams(request), relay)
+    if not headerSent:
+      raise newException(GatewayError, "Backend sent no header")
+  except CatchableError as e:
+    debug("Gateway " & gateway.route & ": " & e.msg)
+    if not headerSent:
+      request.status = Status.CGIError.int
+      let answer = $Status.CGIError.int & " CGI ERROR\r\n"
+      try:
+        await request.client.send(answer)
+        request.bytesSent += answer.len
+      except CatchableError:
+        discard
+  request.sendTime += getMonoTime() - sendStart
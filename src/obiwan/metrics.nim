@@ -0,0 +1,320 @@
+## ObiWAN Metrics Module
+##
+## This module collects server metrics without locks: every counter is an
+## atomic integer, and latencies go into HDR-style histograms with eight
+## buckets per power of two (about 12% relative error), so recording a value
+## is two atomic additions and an increment.
+##
+## Each connection is split into phases:
+##
+## - queue: from accept until a thread or task starts on the connection
+## - handshake: the TLS handshake
+## - request: reading the request line
+## - handler: the request callback, sending included
+## - send: time spent in respond() and respondFile()
+## - total: from accept until the connection is closed
+##
+## The metrics live in anonymous shared memory. Create them before
+## runWorkers() and every worker process adds to the same counters, so any
+## worker can report the totals for the whole server.
+##
+## render() produces the Prometheus text exposition format. It can be served
+## on a plain HTTP admin port (startMetricsServer) or through a Gemini route.
+
+import std/atomics
+import std/bitops
+import std/posix
+import std/monotimes
+import std/times
+import std/strutils
+import std/net
+import std/typedthreads
+import ./tls/mbedtls as mbedtls
+
+type
+  Phase* = enum
+    ## Phases of a connection whose latency is recorded
+    phQueue = "queue"
+    phHandshake = "handshake"
+    phRequest = "request"
+    phHandler = "handler"
+    phSend = "send"
+    phTotal = "total"
+
+  HandshakeFailure* = enum
+    ## Why a TLS handshake failed
+    hfClosed = "closed"           ## The client went away or reset the connection
+    hfTimeout = "timeout"         ## The client didn't finish in time
+    hfNegotiation = "negotiation" ## No common protocol version or cipher suite, or a fatal alert
+    hfMalformed = "malformed"     ## The client sent something that isn't TLS 1.3
+    hfCertificate = "certificate" ## The client certificate couldn't be parsed
+    hfOther = "other"
+
+const
+  SubBucketBits = 3
+  SubBuckets = 1 shl SubBucketBits
+  MaxExponent = 40 # Values up to 2^41 microseconds, longer ones are clamped
+  HistogramBuckets = (MaxExponent - SubBucketBits + 2) * SubBuckets
+  MaxStatus = 69
+
+  # Upper bounds of the exported Prometheus buckets, in seconds
+  ExportBuckets = [0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025,
+                   0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0, 30.0]
+  Quantiles = [0.5, 0.9, 0.99, 0.999]
+
+type
+  Histogram = object
+    buckets: array[HistogramBuckets, Atomic[int]]
+    count: Atomic[int]
+    sumMicros: Atomic[int]
+
+  MetricsObj = object
+    phases: array[Phase, Histogram]
+    statuses: array[MaxStatus + 1, Atomic[int]]
+    handshakeFailures: array[HandshakeFailure, Atomic[int]]
+    connections: Atomic[int]
+    active: Atomic[int]
+    rejected: Atomic[int]
+    bytesIn: Atomic[int]
+    bytesOut: Atomic[int]
+
+  Metrics* = ptr MetricsObj
+    ## Server metrics, shared by all threads and worker processes
+
+# Histogram buckets
+
+proc bucketIndex(micros: int): int {.inline.} =
+  let v = clamp(micros, 0, (1 shl (MaxExponent + 1)) - 1)
+  if v < 2 * SubBuckets:
+    return v
+  let e = fastLog2(v)
+  (e - SubBucketBits) * SubBuckets + (v shr (e - SubBucketBits))
+
+proc bucketBounds(index: int): (int, int) =
+  ## Lowest value and exclusive upper bound of a bucket, in microseconds
+  if index < 2 * SubBuckets:
+    return (index, index + 1)
+  let e = index div SubBuckets + SubBucketBits - 1
+  let m = index mod SubBuckets + SubBuckets
+  (m shl (e - SubBucketBits), (m + 1) shl (e - SubBucketBits))
+
+proc record(h: var Histogram, micros: int) {.inline.} =
+  discard h.buckets[bucketIndex(micros)].fetchAdd(1, moRelaxed)
+  discard h.count.fetchAdd(1, moRelaxed)
+  discard h.sumMicros.fetchAdd(max(micros, 0), moRelaxed)
+
+proc quantileMicros(h: var Histogram, q: float): float =
+  let count = h.count.load(moRelaxed)
+  if count == 0:
+    return 0.0
+  let target = max(1, int(q * count.float + 0.5))
+  var seen = 0
+  for i in 0 ..< HistogramBuckets:
+    seen += h.buckets[i].load(moRelaxed)
+    if seen >= target:
+      let (lower, upper) = bucketBounds(i)
+      return (lower + upper - 1).float / 2.0
+  return bucketBounds(HistogramBuckets - 1)[1].float
+
+# Metrics
+
+proc newMetrics*(): Metrics =
+  ## Creates zeroed metrics in shared memory
+  ##
+  ## Create them before forking worker processes so that all of them share
+  ## the same counters.
+  ##
+  ## Raises:
+  ##   OSError: If the shared memory can't be mapped
+  let p = mmap(nil, sizeof(MetricsObj), PROT_READ or PROT_WRITE,
+               MAP_SHARED or MAP_ANONYMOUS, -1, 0)
+  if p == MAP_FAILED:
+    raise newException(OSError, "Failed to map shared memory for metrics")
+  result = cast[Metrics](p)
+
+proc close*(metrics: Metrics) =
+  ## Unmaps the metrics. They can't be used afterwards.
+  if not metrics.isNil:
+    discard munmap(metrics, sizeof(MetricsObj))
+
+# All recording procs accept nil, so callers don't have to check whether
+# metrics are enabled
+
+proc observe*(metrics: Metrics, phase: Phase, elapsed: Duration) {.inline.} =
+  ## Records how long a phase took
+  if not metrics.isNil:
+    metrics.phases[phase].record(elapsed.inMicroseconds.int)
+
+proc connectionOpened*(metrics: Metrics) {.inline.} =
+  ## Counts an accepted connection that is being handled
+  if not metrics.isNil:
+    discard metrics.connections.fetchAdd(1, moRelaxed)
+    discard metrics.active.fetchAdd(1, moRelaxed)
+
+proc connectionClosed*(metrics: Metrics, acceptedAt: MonoTime) {.inline.} =
+  ## Records the end of a connection opened with connectionOpened()
+  if not metrics.isNil:
+    discard metrics.active.fetchSub(1, moRelaxed)
+    metrics.observe(phTotal, getMonoTime() - acceptedAt)
+
+proc connectionRejected*(metrics: Metrics) {.inline.} =
+  ## Counts a connection turned away because the server was busy
+  if not metrics.isNil:
+    discard metrics.connections.fetchAdd(1, moRelaxed)
+    discard metrics.rejected.fetchAdd(1, moRelaxed)
+
+proc requestServed*(metrics: Metrics, status, bytesIn, bytesOut: int) {.inline.} =
+  ## Counts a served request by status code and adds its traffic
+  if not metrics.isNil:
+    discard metrics.statuses[clamp(status, 0, MaxStatus)].fetchAdd(1, moRelaxed)
+    discard metrics.bytesIn.fetchAdd(bytesIn, moRelaxed)
+    discard metrics.bytesOut.fetchAdd(bytesOut, moRelaxed)
+
+proc handshakeFailureReason*(code: int): HandshakeFailure =
+  ## Classifies an mbedTLS handshake error code
+  let code = code.cint
+  if code == mbedtls.MBEDTLS_ERR_SSL_CONN_EOF or
+     code == mbedtls.MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY or
+     code == mbedtls.MBEDTLS_ERR_NET_RECV_FAILED or
+     code == mbedtls.MBEDTLS_ERR_NET_SEND_FAILED or
+     code == mbedtls.MBEDTLS_ERR_NET_CONN_RESET:
+    hfClosed
+  elif code == mbedtls.MBEDTLS_ERR_SSL_TIMEOUT or
+       # Blocking sockets only want more data once their receive timeout expired
+       code == mbedtls.MBEDTLS_ERR_SSL_WANT_READ or
+       code == mbedtls.MBEDTLS_ERR_SSL_WANT_WRITE:
+    hfTimeout
+  elif code == mbedtls.MBEDTLS_ERR_SSL_HANDSHAKE_FAILURE or
+       code == mbedtls.MBEDTLS_ERR_SSL_BAD_PROTOCOL_VERSION or
+       code == mbedtls.MBEDTLS_ERR_SSL_FATAL_ALERT_MESSAGE:
+    hfNegotiation
+  elif code == mbedtls.MBEDTLS_ERR_SSL_DECODE_ERROR:
+    hfMalformed
+  elif code == mbedtls.MBEDTLS_ERR_SSL_BAD_CERTIFICATE or
+       (code <= -0x2000 and code > -0x3000): # X.509 error range
+    hfCertificate
+  else:
+    hfOther
+
+proc handshakeFailed*(metrics: Metrics, reason: HandshakeFailure) {.inline.} =
+  ## Counts a failed TLS handshake
+  if not metrics.isNil:
+    discard metrics.handshakeFailures[reason].fetchAdd(1, moRelaxed)
+
+# Exposition
+
+proc seconds(micros: float): string =
+  formatFloat(micros / 1_000_000.0, ffDefault, 6)
+
+proc metric(output: var string, name, kind, help: string) =
+  output.add("# HELP " & name & " " & help & "\n")
+  output.add("# TYPE " & name & " " & kind & "\n")
+
+proc render*(metrics: Metrics): string =
+  ## Returns the metrics in the Prometheus text exposition format
+  if metrics.isNil:
+    return ""
+
+  result.metric("obiwan_connections_total", "counter", "Accepted connections")
+  result.add("obiwan_connections_total " & $metrics.connections.load(moRelaxed) & "\n")
+  result.metric("obiwan_connections_active", "gauge", "Connections being handled")
+  result.add("obiwan_connections_active " & $metrics.active.load(moRelaxed) & "\n")
+  result.metric("obiwan_connections_rejected_total", "counter",
+                "Connections answered with 41 because the server was busy")
+  result.add("obiwan_connections_rejected_total " & $metrics.rejected.load(moRelaxed) & "\n")
+
+  result.metric("obiwan_requests_total", "counter", "Requests by response status")
+  for status in 0 .. MaxStatus:
+    let n = metrics.statuses[status].load(moRelaxed)
+    if n > 0:
+      result.add("obiwan_requests_total{status=\"" & $status & "\"} " & $n & "\n")
+
+  result.metric("obiwan_received_bytes_total", "counter", "Request bytes received")
+  result.add("obiwan_received_bytes_total " & $metrics.bytesIn.load(moRelaxed) & "\n")
+  result.metric("obiwan_sent_bytes_total", "counter", "Response bytes sent, headers included")
+  result.add("obiwan_sent_bytes_total " & $metrics.bytesOut.load(moRelaxed) & "\n")
+
+  result.metric("obiwan_handshake_failures_total", "counter", "Failed TLS handshakes by reason")
+  for reason in HandshakeFailure:
+    result.add("obiwan_handshake_failures_total{reason=\"" & $reason & "\"} " &
+               $metrics.handshakeFailures[reason].load(moRelaxed) & "\n")
+
+  result.metric("obiwan_phase_duration_seconds", "histogram",
+                "Time spent in each phase of a connection")
+  for phase in Phase:
+    var cumulative = 0
+    var bucket = 0
+    for le in ExportBuckets:
+      let limit = int(le * 1_000_000.0)
+      while bucket < HistogramBuckets and bucketBounds(bucket)[1] <= limit:
+        cumulative += metrics.phases[phase].buckets[bucket].load(moRelaxed)
+        inc bucket
+      result.add("obiwan_phase_duration_seconds_bucket{phase=\"" & $phase &
+                 "\",le=\"" & $le & "\"} " & $cumulative & "\n")
+    let count = metrics.phases[phase].count.load(moRelaxed)
+    result.add("obiwan_phase_duration_seconds_bucket{phase=\"" & $phase &
+               "\",le=\"+Inf\"} " & $count & "\n")
+    result.add("obiwan_phase_duration_seconds_sum{phase=\"" & $phase & "\"} " &
+               seconds(metrics.phases[phase].sumMicros.load(moRelaxed).float) & "\n")
+    result.add("obiwan_phase_duration_seconds_count{phase=\"" & $phase & "\"} " &
+               $count & "\n")
+
+  result.metric("obiwan_phase_quantile_seconds", "gauge",
+                "Latency quantiles of each phase since startup")
+  for phase in Phase:
+    for q in Quantiles:
+      result.add("obiwan_phase_quantile_seconds{phase=\"" & $phase &
+                 "\",quantile=\"" & $q & "\"} " &
+                 seconds(metrics.phases[phase].quantileMicros(q)) & "\n")
+
+# HTTP admin port
+
+type
+  MetricsServerArgs = tuple[metrics: Metrics, fd: SocketHandle]
+
+var metricsThread: Thread[MetricsServerArgs]
+
+proc metricsServerLoop(args: MetricsServerArgs) {.thread.} =
+  let server = newSocket(args.fd)
+  while true:
+    var client: Socket
+    try:
+      server.accept(client)
+    except CatchableError:
+      continue
+    try:
+      # Skip the request, every path gets the metrics
+      while true:
+        let line = client.recvLine(timeout = 2000)
+        if line.len == 0 or line == "\r\L":
+          break
+      let body = render(args.metrics)
+      client.send("HTTP/1.0 200 OK\r\L" &
+                  "Content-Type: text/plain; version=0.0.4\r\L" &
+                  "Content-Length: " & $body.len & "\r\L" &
+                  "Connection: close\r\L\r\L" & body)
+    except CatchableError:
+      discard
+    finally:
+      client.close()
+
+proc startMetricsServer*(metrics: Metrics, port: int, address = "127.0.0.1") =
+  ## Serves the metrics over plain HTTP on a background thread
+  ##
+  ## The listener uses SO_REUSEPORT, so every worker process can start one on
+  ## the same port; since the metrics are shared, any of them reports the
+  ## totals of the whole server.
+  ##
+  ## Parameters:
+  ##   metrics: The metrics to serve
+  ##   port: TCP port of the admin listener
+  ##   address: Address to bind to (default: localhost only)
+  ##
+  ## Raises:
+  ##   OSError: If the port can't be bound
+  let socket = newSocket()
+  socket.setSockOpt(OptReuseAddr, true)
+  socket.setSockOpt(OptReusePort, true)
+  socket.bindAddr(Port(port), address)
+  socket.listen()
+  createThread(metricsThread, metricsServerLoop, (metrics, socket.getFd()))
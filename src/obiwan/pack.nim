@@ -0,0 +1,363 @@
+## Content packs: a docroot compiled into one memory-mapped file
+##
+## Serving from a docroot costs every request a path sanitization, several
+## stat() calls, open() and read(), and a MIME type lookup. For capsules
+## whose content never changes at runtime (e.g. shipped in an immutable
+## container image) all of that can be done once, at build time:
+##
+## - `obiwan-pack <docroot> <output>` walks the docroot and writes a pack
+##   holding a sorted index of request paths, their MIME types, the
+##   pre-rendered directory listings and the file bodies
+## - `obiwan-server --pack=<file>` maps the pack and answers each request
+##   with a binary search of the index, sending the body straight from the
+##   mapping. Nothing is opened, read or stat()ed per request, and startup
+##   costs a single mmap().
+##
+## Paths are normalized like sanitizePath() does, so a pack answers the same
+## requests as the docroot it was built from: a directory serves its
+## index.gmi, or its listing if it has none. Hidden files and directories
+## are left out, as they are from listings, and symbolic links to
+## directories aren't followed.
+##
+## Layout, in the byte order of the machine that built the pack
+## (little-endian on every platform ObiWAN supports):
+##
+## ===============  ==========================================================
+## Header           "OBIWPACK", version, entry count, MIME type count
+## MIME table       Offset and length of every distinct MIME type
+## Entry table      One PackEntry per request path, sorted by path bytes
+## Strings          The MIME types and request paths
+## Bodies           File contents and listings; a directory shares the body
+##                  of its index.gmi
+## ===============  ==========================================================
+
+import std/os
+import std/strutils
+import std/tables
+import std/algorithm
+import std/memfiles
+import fs
+
+const
+  PackMagic = "OBIWPACK"
+  PackVersion = 1'u32
+  CopyChunkSize = 64 * 1024
+
+type
+  PackError* = object of CatchableError
+    ## Raised when a file is not a valid content pack
+
+  PackHeader {.packed.} = object
+    magic: array[8, char]
+    version: uint32
+    entryCount: uint32
+    mimeCount: uint32
+    reserved: uint32
+
+  PackString {.packed.} = object
+    offset: uint64
+    len: uint64
+
+  PackEntry {.packed.} = object
+    pathOffset: uint64
+    bodyOffset: uint64
+    bodySize: uint64
+    pathLen: uint32
+    mime: uint32 ## Index into the MIME table
+
+  ContentPack* = ref object
+    ## A content pack mapped into memory. Read-only once opened, so it can
+    ## be shared by any number of threads.
+    file: MemFile
+    entries: ptr UncheckedArray[PackEntry]
+    count: int
+    mimes: seq[string]
+
+  PackSource = object
+    ## Where the body of an entry comes from while building
+    key: string     ## Normalized request path
+    mime: string
+    file: string    ## File to copy the body from, "" for a listing
+    listing: string ## Pre-rendered directory listing
+
+proc collect(dir, key: string; sources: var seq[PackSource]) =
+  ## Adds `dir`, served at `key`, and everything below it to `sources`
+  let index = dir / "index.gmi"
+  if fileExists(index):
+    sources.add(PackSource(key: key, mime: "text/gemini", file: index))
+  elif isDirectoryListingAllowed(dir):
+    sources.add(PackSource(key: key, mime: "text/gemini",
+                           listing: generateDirectoryListing(dir, key)))
+
+  for kind, path in walkDir(dir):
+    let name = path.extractFilename
+    if name.startsWith("."):
+      continue
+    let child = if key == "/": "/" & name else: key & "/" & name
+    case kind
+    of pcDir:
+      collect(path, child, sources)
+    of pcFile, pcLinkToFile:
+      sources.add(PackSource(key: child, mime: detectMimeType(path), file: path))
+    of pcLinkToDir:
+      discard # Not followed, links could form cycles
+
+proc writeAll(file: File; data: pointer; len: int) =
+  if len > 0 and file.writeBuffer(data, len) != len:
+    raise newException(IOError, "Failed to write content pack")
+
+proc copyBody(output: File; path: string; buffer: var seq[byte]): uint64 =
+  ## Appends the contents of `path` to `output`, returning their size
+  var input = open(path, fmRead)
+  defer: input.close()
+  while true:
+    let n = input.readBuffer(addr buffer[0], buffer.len)
+    if n <= 0:
+      break
+    output.writeAll(addr buffer[0], n)
+    result += n.uint64
+
+proc buildPack*(docRoot, output: string): int =
+  ## Compiles a docroot into a content pack.
+  ##
+  ## The pack is written next to `output` and renamed into place once it is
+  ## complete, so servers still mapping a previous version keep serving it.
+  ##
+  ## Parameters:
+  ##   docRoot: The document root directory to pack
+  ##   output: Path of the pack to write
+  ##
+  ## Returns:
+  ##   The number of request paths in the pack
+  ##
+  ## Raises:
+  ##   IOError, OSError: If the docroot cannot be read or the pack written
+  ##
+  ## Example:
+  ##   ```nim
+  ##   discard buildPack("./content", "content.pack")
+  ##   ```
+  if not dirExists(docRoot):
+    raise newException(OSError, "Document root not found: " & docRoot)
+
+  var sources: seq[PackSource]
+  collect(docRoot, "/", sources)
+  sources.sort(proc (a, b: PackSource): int = cmp(a.key, b.key))
+
+  var mimes: seq[string]
+  var mimeIndex: Table[string, uint32]
+  for source in sources:
+    if source.mime notin mimeIndex:
+      mimeIndex[source.mime] = mimes.len.uint32
+      mimes.add(source.mime)
+
+  var header = PackHeader(version: PackVersion, entryCount: sources.len.uint32,
+                          mimeCount: mimes.len.uint32)
+  for i, c in PackMagic:
+    header.magic[i] = c
+
+  # Everything before the bodies has a known size, the bodies are appended
+  # after it and the tables written last, once their offsets are known
+  let mimeTableOffset = sizeof(PackHeader)
+  let entryTableOffset = mimeTableOffset + mimes.len * sizeof(PackString)
+  let stringsOffset = (entryTableOffset + sources.len * sizeof(PackEntry)).uint64
+  var offset = stringsOffset
+
+  var mimeTable = newSeq[PackString](mimes.len)
+  var entries = newSeq[PackEntry](sources.len)
+  var strings = ""
+  for i, mime in mimes:
+    mimeTable[i] = PackString(offset: offset + strings.len.uint64, len: mime.len.uint64)
+    strings.add(mime)
+  for i, source in sources:
+    entries[i] = PackEntry(pathOffset: offset + strings.len.uint64,
+                           pathLen: source.key.len.uint32,
+                           mime: mimeIndex[source.mime])
+    strings.add(source.key)
+  offset += strings.len.uint64
+
+  let tempPath = output & ".tmp"
+  var file = open(tempPath, fmWrite)
+  try:
+    file.setFilePos(stringsOffset.int64)
+    file.write(strings)
+
+    # A directory and its index.gmi share one copy of the body
+    var written: Table[string, tuple[offset, size: uint64]]
+    var buffer = newSeq[byte](CopyChunkSize)
+    for i, source in sources:
+      if source.file == "":
+        entries[i].bodyOffset = offset
+        entries[i].bodySize = source.listing.len.uint64
+        file.write(source.listing)
+      elif source.file in written:
+        entries[i].bodyOffset = written[source.file].offset
+        entries[i].bodySize = written[source.file].size
+        continue
+      else:
+        entries[i].bodyOffset = offset
+        entries[i].bodySize = file.copyBody(source.file, buffer)
+        written[source.file] = (entries[i].bodyOffset, entries[i].bodySize)
+      offset += entries[i].bodySize
+
+    file.setFilePos(0)
+    file.writeAll(addr header, sizeof(header))
+    if mimeTable.len > 0:
+      file.writeAll(addr mimeTable[0], mimeTable.len * sizeof(PackString))
+    if entries.len > 0:
+      file.writeAll(addr entries[0], entries.len * sizeof(PackEntry))
+    file.close()
+  except CatchableError:
+    file.close()
+    removeFile(tempPath)
+    raise
+  moveFile(tempPath, output)
+  result = sources.len
+
+proc at(pack: ContentPack; offset: uint64): pointer {.inline.} =
+  cast[pointer](cast[uint](pack.file.mem) + offset.uint)
+
+proc comparePaths(a: pointer; aLen: int; b: pointer; bLen: int): int {.inline.} =
+  ## Byte-wise comparison, the order the entry table is sorted in
+  result = cmpMem(a, b, min(aLen, bLen))
+  if result == 0:
+    result = aLen - bLen
+
+proc openPack*(path: string): ContentPack =
+  ## Maps a content pack built with buildPack() into memory.
+  ##
+  ## The whole pack is validated once here, so lookups can trust its
+  ## offsets. The mapping is shared with other processes using the same
+  ## file, and pages are only read from disk when first served.
+  ##
+  ## Parameters:
+  ##   path: Path of the pack
+  ##
+  ## Returns:
+  ##   The mapped pack, to be released with close()
+  ##
+  ## Raises:
+  ##   OSError: If the file cannot be opened or mapped
+  ##   PackError: If it is not a valid content pack
+  result = ContentPack(file: memfiles.open(path, mode = fmRead))
+  let pack = result
+  let size = pack.file.size.uint64
+
+  proc invalid(reason: string) =
+    pack.file.close()
+    raise newException(PackError, "Invalid content pack " & path & ": " & reason)
+
+  proc inBounds(offset, len: uint64): bool =
+    len <= size and offset <= size - len
+
+  if size < sizeof(PackHeader).uint64:
+    invalid("truncated header")
+  let header = cast[ptr PackHeader](pack.file.mem)
+  for i, c in PackMagic:
+    if header.magic[i] != c:
+      invalid("bad magic")
+  if header.version != PackVersion:
+    invalid("unsupported version " & $header.version)
+
+  let mimeTableOffset = sizeof(PackHeader).uint64
+  let entryTableOffset = mimeTableOffset + header.mimeCount.uint64 * sizeof(PackString).uint64
+  if not inBounds(mimeTableOffset, header.mimeCount.uint64 * sizeof(PackString).uint64) or
+      not inBounds(entryTableOffset, header.entryCount.uint64 * sizeof(PackEntry).uint64):
+    invalid("truncated tables")
+
+  let mimeTable = cast[ptr UncheckedArray[PackString]](pack.at(mimeTableOffset))
+  for i in 0 ..< header.mimeCount.int:
+    let mime = mimeTable[i]
+    if not inBounds(mime.offset, mime.len) or mime.len > 1024:
+      invalid("bad MIME type " & $i)
+    var value = newString(mime.len.int)
+    if mime.len > 0:
+      copyMem(addr value[0], pack.at(mime.offset), mime.len.int)
+    pack.mimes.add(value)
+
+  pack.entries = cast[ptr UncheckedArray[PackEntry]](pack.at(entryTableOffset))
+  pack.count = header.entryCount.int
+  for i in 0 ..< pack.count:
+    let entry = pack.entries[i]
+    if not inBounds(entry.pathOffset, entry.pathLen.uint64) or
+        not inBounds(entry.bodyOffset, entry.bodySize) or
+        entry.mime >= header.mimeCount:
+      invalid("bad entry " & $i)
+    if i > 0:
+      let previous = pack.entries[i - 1]
+      if comparePaths(pack.at(previous.pathOffset), previous.pathLen.int,
+                      pack.at(entry.pathOffset), entry.pathLen.int) >= 0:
+        invalid("index not sorted")
+
+proc close*(pack: ContentPack) =
+  ## Unmaps a content pack. Bodies returned by resolvePackRequest() must
+  ## not be used afterwards.
+  if not pack.entries.isNil:
+    pack.entries = nil
+    pack.count = 0
+    pack.file.close()
+
+proc len*(pack: ContentPack): int {.inline.} =
+  ## Number of request paths in the pack
+  pack.count
+
+proc resolvePackRequest*(pack: ContentPack; reqPath: string): FileTarget =
+  ## Resolves a request against a content pack, without any syscall.
+  ##
+  ## Parameters:
+  ##   pack: The mapped pack
+  ##   reqPath: The request path
+  ##
+  ## Returns:
+  ##   A FileTarget whose `data` and `size` point at the body inside the
+  ##   pack, valid until the pack is closed. The errors are the same as the
+  ##   ones from resolveFileRequest.
+  var key: string
+  try:
+    key = normalizeRequestPath(reqPath)
+  except FileSecurityError:
+    return fileTargetError(feTraversal)
+  except CatchableError:
+    return fileTargetError(feUnknown, getCurrentExceptionMsg())
+
+  var low = 0
+  var high = pack.count - 1
+  while low <= high:
+    let middle = (low + high) div 2
+    let entry = addr pack.entries[middle]
+    let order = comparePaths(pack.at(entry.pathOffset), entry.pathLen.int,
+                             addr key[0], key.len)
+    if order == 0:
+      return FileTarget(data: pack.at(entry.bodyOffset), mimeType: pack.mimes[entry.mime],
+                        size: entry.bodySize.int64, success: true)
+    elif order < 0:
+      low = middle + 1
+    else:
+      high = middle - 1
+  fileTargetError(feNotFound)
+
+when isMainModule:
+  import docopt
+  from common import ObiwanVersion
+
+  const doc = """
+ObiWAN Content Pack Compiler
+
+Usage:
+  obiwan-pack <docroot> <output>
+  obiwan-pack (-h | --help)
+  obiwan-pack --version
+
+Options:
+  -h --help               Show this help screen
+  --version               Show version information
+"""
+
+  let args = docopt(doc, version = "ObiWAN Content Pack Compiler v" & ObiwanVersion)
+  try:
+    let output = $args["<output>"]
+    let count = buildPack($args["<docroot>"], output)
+    echo "Packed ", count, " paths into ", output, " (", getFileSize(output), " bytes)"
+  except CatchableError:
+    echo "Error: ", getCurrentExceptionMsg()
+    quit(1)
@@ -0,0 +1,125 @@
+## ObiWAN Connection Pool Module
+##
+## This module provides the worker pool used by the synchronous server: a
+## fixed number of threads fed by a bounded queue of accepted connections.
+## The accept loop hands each connection to the pool with submit(), which
+## never blocks. When the queue is full submit() returns false and the
+## caller is expected to turn the client away.
+##
+## Handlers run on the pool threads, so everything they share with other
+## connections has to be thread-safe.
+
+import std/locks
+import std/typedthreads
+import std/monotimes
+
+type
+  ConnectionHandler* = proc (fd: cint; acceptedAt: MonoTime) {.gcsafe, closure.}
+    ## Handles one accepted connection. The handler owns `fd` and must close it.
+
+  PendingConnection = object
+    fd: cint
+    acceptedAt: MonoTime
+
+  ConnectionPoolObj = object
+    lock: Lock
+    notEmpty: Cond
+    queue: ptr UncheckedArray[PendingConnection]   # Ring buffer of accepted connections
+    capacity: int
+    head: int
+    count: int
+    stopping: bool
+    handler: ConnectionHandler
+    threads: ptr UncheckedArray[Thread[ConnectionPool]]
+    threadCount: int
+
+  ConnectionPool* = ptr ConnectionPoolObj
+    ## A pool of worker threads handling accepted connections
+
+proc workerLoop(pool: ConnectionPool) {.thread.} =
+  while true:
+    acquire(pool.lock)
+    while pool.count == 0 and not pool.stopping:
+      wait(pool.notEmpty, pool.lock)
+    if pool.count == 0:
+      # Stopping and the queue is drained
+      release(pool.lock)
+      break
+    let pending = pool.queue[pool.head]
+    pool.head = (pool.head + 1) mod pool.capacity
+    dec pool.count
+    release(pool.lock)
+
+    try:
+      pool.handler(pending.fd, pending.acceptedAt)
+    except CatchableError:
+      discard # Handlers deal with their own errors, don't let one kill the thread
+
+proc newConnectionPool*(threads, queueDepth: int;
+                        handler: ConnectionHandler): ConnectionPool =
+  ## Starts a pool of worker threads
+  ##
+  ## Parameters:
+  ##   threads: Number of worker threads (at least 1)
+  ##   queueDepth: Number of accepted connections that may wait for a free
+  ##               worker (at least 1)
+  ##   handler: Procedure run on a worker thread for each connection
+  ##
+  ## Returns:
+  ##   The running pool. Stop it with stop() to release it.
+  result = createShared(ConnectionPoolObj)
+  initLock(result.lock)
+  initCond(result.notEmpty)
+  result.capacity = max(queueDepth, 1)
+  result.queue = cast[ptr UncheckedArray[PendingConnection]](
+    allocShared0(sizeof(PendingConnection) * result.capacity))
+  result.handler = handler
+  result.threadCount = max(threads, 1)
+  result.threads = cast[ptr UncheckedArray[Thread[ConnectionPool]]](
+    allocShared0(sizeof(Thread[ConnectionPool]) * result.threadCount))
+  for i in 0 ..< result.threadCount:
+    createThread(result.threads[i], workerLoop, result)
+
+proc submit*(pool: ConnectionPool, fd: cint;
+             acceptedAt = getMonoTime()): bool =
+  ## Queues an accepted connection for the next free worker
+  ##
+  ## Parameters:
+  ##   pool: The pool to hand the connection to
+  ##   fd: The accepted socket; the pool's handler takes ownership of it
+  ##   acceptedAt: When the connection was accepted, passed on to the handler
+  ##
+  ## Returns:
+  ##   `true` if the connection was queued, `false` if the queue is full
+  ##   (or the pool is stopping) and the caller still owns `fd`
+  acquire(pool.lock)
+  if pool.stopping or pool.count >= pool.capacity:
+    release(pool.lock)
+    return false
+  pool.queue[(pool.head + pool.count) mod pool.capacity] =
+    PendingConnection(fd: fd, acceptedAt: acceptedAt)
+  inc pool.count
+  release(pool.lock)
+  signal(pool.notEmpty)
+  return true
+
+proc pending*(pool: ConnectionPool): int =
+  ## Returns the number of connections waiting for a worker
+  withLock pool.lock:
+    result = pool.count
+
+proc stop*(pool: ConnectionPool) =
+  ## Stops the pool once the queued connections have been handled and
+  ## releases it. The pool can't be used afterwards.
+  withLock pool.lock:
+    pool.stopping = true
+  broadcast(pool.notEmpty)
+  for i in 0 ..< pool.threadCount:
+    joinThread(pool.threads[i])
+
+  pool.handler = nil
+  deallocShared(pool.threads)
+  deallocShared(pool.queue)
+  deinitCond(pool.notEmpty)
+  deinitLock(pool.lock)
+  deallocShared(pool)
@@ -0,0 +1,193 @@
+## Compile-time request routing for ObiWAN servers
+##
+## The `router` macro turns a list of routes into a matcher that walks the
+## request path once through a prefix trie, built at compile time as nested
+## `case` statements on its characters. Matching a path costs at most one
+## branch per character, no matter how many routes there are, and compares
+## no strings.
+##
+## Routes map paths to the values of an enum chosen by the server, which
+## then dispatches with a `case` of its own, so the same routes serve sync
+## and async handlers:
+##
+## ```nim
+## type Endpoint = enum
+##   epFiles, epAuth, epApi
+##
+## router matchEndpoint, Endpoint:
+##   exact "/auth", epAuth, certAccepted # Only with a certificate
+##   prefix "/api/", epApi               # /api/ and everything below it
+##
+## proc handle(request: Request) =
+##   let route = matchEndpoint(request.url.path)
+##   let status = request.checkCertificate(route.certificate)
+##   if status != Success:
+##     request.respond(status, certificateMeta(status))
+##   elif not route.found:
+##     serveFiles(request)
+##   else:
+##     case route.endpoint
+##     of epAuth: ...
+##     of epApi: handleApi(request, request.url.path[route.rest .. ^1])
+##     of epFiles: discard
+## ```
+
+import std/macros
+import common
+
+type
+  CertificateRequirement* = enum
+    ## Client certificate a route requires
+    certNone,     ## Any client
+    certPresent,  ## Clients presenting a certificate, whether or not it's trusted
+    certAccepted  ## Clients whose certificate is verified or self-signed
+
+  RouteMatch*[E] = object
+    ## Result of a matcher built by `router`
+    found*: bool                         ## Whether a route matched the path
+    endpoint*: E                         ## The matching route's endpoint
+    certificate*: CertificateRequirement ## The matching route's certificate requirement
+    rest*: int                           ## Where the path continues after the matched route
+
+  RouteSpec = object
+    ## A route of the `router` macro
+    path: string
+    isPrefix: bool
+    endpoint: NimNode
+    certificate: NimNode
+
+  TrieNode = object
+    ## A node of the route trie, at the end of the path leading to it
+    children: seq[(char, int)] # Next character and its node
+    exact: int  # Route ending here, -1 if none
+    prefix: int # Route covering everything from here on, -1 if none
+
+proc checkCertificate*(request: RequestBase;
+                       requirement: CertificateRequirement): Status =
+  ## Checks the client certificate of a request against a route.
+  ##
+  ## Parameters:
+  ##   request: The request to check
+  ##   requirement: The certificate the route requires
+  ##
+  ## Returns:
+  ##   Status.Success if the request may be served, otherwise the status to
+  ##   answer with, CertificateRequired or CertificateNotValid
+  case requirement
+  of certNone:
+    Success
+  of certPresent:
+    if request.hasCertificate(): Success else: CertificateRequired
+  of certAccepted:
+    if not request.hasCertificate(): CertificateRequired
+    elif request.isVerified() or request.isSelfSigned(): Success
+    else: CertificateNotValid
+
+proc certificateMeta*(status: Status): string =
+  ## Meta of a response with a status checkCertificate() returned
+  case status
+  of CertificateRequired: "CLIENT CERTIFICATE REQUIRED"
+  of CertificateNotValid: "CERTIFICATE NOT VALID"
+  else: $status
+
+proc parseRoute(statement: NimNode): RouteSpec =
+  ## Reads an `exact` or `prefix` line of a router
+  if statement.kind notin {nnkCommand, nnkCall} or statement.len notin 3..4 or
+      statement[0].kind != nnkIdent or statement[1].kind != nnkStrLit:
+    error("Expected `exact \"/path\", endpoint[, certificate]` or " &
+          "`prefix \"/path/\", endpoint[, certificate]`", statement)
+  case statement[0].strVal
+  of "exact": result.isPrefix = false
+  of "prefix": result.isPrefix = true
+  else: error("Unknown route kind " & statement[0].strVal, statement[0])
+  result.path = statement[1].strVal
+  if result.path.len == 0 or result.path[0] != '/':
+    error("Route paths start with '/'", statement[1])
+  result.endpoint = statement[2]
+  result.certificate = if statement.len == 4: statement[3] else: ident("certNone")
+
+proc buildTrie(routes: seq[RouteSpec]): seq[TrieNode] =
+  ## Builds the trie of `routes`, its root at index 0
+  result.add(TrieNode(exact: -1, prefix: -1))
+  for index, route in routes:
+    var node = 0
+    for c in route.path:
+      var next = -1
+      for (child, childNode) in result[node].children:
+        if child == c:
+          next = childNode
+      if next == -1:
+        next = result.len
+        result.add(TrieNode(exact: -1, prefix: -1))
+        result[node].children.add((c, next))
+      node = next
+    let existing = if route.isPrefix: result[node].prefix else: result[node].exact
+    if existing != -1:
+      error("Duplicate route " & route.path, route.endpoint)
+    if route.isPrefix:
+      result[node].prefix = index
+    else:
+      result[node].exact = index
+
+proc matchCode(trie: seq[TrieNode]; routes: seq[RouteSpec]; node, depth: int;
+               path, resultType: NimNode): NimNode =
+  ## Code matching the rest of `path` from trie `node`, `depth` characters in
+  proc found(route: RouteSpec; depth: int; resultType: NimNode): NimNode =
+    let endpoint = route.endpoint
+    let certificate = route.certificate
+    quote do:
+      `resultType`(found: true, endpoint: `endpoint`,
+                   certificate: `certificate`, rest: `depth`)
+
+  result = newStmtList()
+  let entry = trie[node]
+  if entry.prefix != -1:
+    # The longest prefix wins, deeper ones overwrite this
+    let match = found(routes[entry.prefix], depth, resultType)
+    result.add quote do:
+      result = `match`
+  if entry.exact != -1:
+    let match = found(routes[entry.exact], depth, resultType)
+    result.add quote do:
+      if `path`.len == `depth`:
+        return `match`
+  if entry.children.len > 0:
+    let caseStmt = nnkCaseStmt.newTree(nnkBracketExpr.newTree(path, newLit(depth)))
+    for (c, child) in entry.children:
+      caseStmt.add nnkOfBranch.newTree(newLit(c),
+        matchCode(trie, routes, child, depth + 1, path, resultType))
+    caseStmt.add nnkElse.newTree(nnkDiscardStmt.newTree(newEmptyNode()))
+    result.add quote do:
+      if `path`.len > `depth`:
+        `caseStmt`
+  if result.len == 0:
+    result.add nnkDiscardStmt.newTree(newEmptyNode())
+
+macro router*(name, endpointType, body: untyped): untyped =
+  ## Declares a proc `name(path: openArray[char]): RouteMatch[endpointType]`
+  ## matching request paths against the routes in `body`.
+  ##
+  ## Each line of `body` declares a route, with an optional certificate
+  ## requirement (certNone by default):
+  ##   exact "/path", endpoint[, certificate]    (only this very path)
+  ##   prefix "/path/", endpoint[, certificate]  (the path and everything below it)
+  ##
+  ## An exact route wins over a prefix one, and a longer prefix over a
+  ## shorter one. Paths no route matches give `found: false` and certNone.
+  ## Duplicate routes are compile errors.
+  ##
+  ## Parameters:
+  ##   name: Name of the proc to declare, `name*` to export it
+  ##   endpointType: Enum whose values the routes map to
+  ##   body: The routes
+  var routes: seq[RouteSpec]
+  for statement in body:
+    if statement.kind != nnkCommentStmt:
+      routes.add(parseRoute(statement))
+  let trie = buildTrie(routes)
+  let path = ident("path")
+  let resultType = nnkBracketExpr.newTree(ident("RouteMatch"), endpointType)
+  let matcher = matchCode(trie, routes, 0, 0, path, resultType)
+  quote do:
+    proc `name`(`path`: openArray[char]): `resultType` =
+      `matcher`
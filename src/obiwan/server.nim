@@ -17,9 +17,12 @@
 ##   --sync                  Use synchronous (blocking) mode
 ##   -r --reuse-addr         Allow reuse of local addresses [default: true]
 ##   --reuse-port            Allow multiple bindings to same port
+##   -w --workers=<n>        Worker processes sharing the port (0 = one per CPU core)
+##   -t --threads=<n>        Threads handling connections in synchronous mode
 ##   --cert=<file>           Server certificate file [default: cert.pem]
 ##   --key=<file>            Server key file [default: privkey.pem]
 ##   --docroot=<dir>         Document root directory [default: ./content]
+##   --pack=<file>           Serve a content pack built with obiwan-pack instead
 ##   --version               Show version information
 ##
 ## Configuration is loaded from (in order):
@@ -29,13 +32,28 @@
 ## 4. /etc/obiwan/config.toml (system config)
 ## 5. Default values if no config file is found
 ## Command line options override values from config files.
+##
+## In asynchronous mode, SIGHUP reloads the configuration file and the
+## certificates without dropping connections, SIGUSR2 hands the listening
+## sockets to the binary on disk (see upgrade.nim) and SIGQUIT stops
+## accepting and exits once open connections finish. The synchronous server
+## does the same on SIGINT, SIGTERM and SIGQUIT.
 
 import asyncdispatch
 import strutils # For parseInt
 import os # For getCurrentDir
+import tables # For the parsed arguments
+import std/sysrand # For the shared session ticket secret
+from posix import Sigaction, sigaction, sigemptyset, exitnow, SIGINT, SIGTERM, SIGQUIT
 import "../obiwan"
 import "config"
 import "fs"
+import "cache"
+import "pack"
+import "workers"
+import "router"
+import "gateway"
+import "upgrade"
 import docopt
 
 const doc = """
@@ -54,128 +72,255 @@ Options:
   --sync                  Use synchronous (blocking) mode
   -r --reuse-addr         Allow reuse of local addresses [default: true]
   --reuse-port            Allow multiple bindings to same port
+  -w --workers=<n>        Worker processes sharing the port (0 = one per CPU core)
+  -t --threads=<n>        Threads handling connections in synchronous mode
   --cert=<file>           Server certificate file [default: cert.pem]
   --key=<file>            Server key file [default: privkey.pem]
   --docroot=<dir>         Document root directory [default: ./content]
+  --pack=<file>           Serve a content pack built with obiwan-pack instead
   --version               Show version information
 """
 
-const version = "ObiWAN Gemini Server v0.5.0"
-
-# Synchronous request handler
-proc handleSyncRequest(request: Request, docRoot: string) =
-  ## Handles incoming Gemini requests synchronously.
+const version = "ObiWAN Gemini Server v" & ObiwanVersion
+
+type
+  Endpoint = enum
+    ## What serves a request
+    epFiles, ## The docroot or content pack, for paths no route matches
+    epAuth   ## Client certificate test page
+
+router matchEndpoint, Endpoint:
+  exact "/auth", epAuth, certAccepted
+
+const fileErrorStatus: array[FileError, Status] = [
+  feNone: Success,
+  feNotFound: NotFound,
+  feListingNotAllowed: NotFound,
+  feTraversal: MalformedRequest,
+  feRead: TempError,
+  feUnknown: TempError
+]
+
+proc fileErrorMeta(target: FileTarget): string {.inline.} =
+  ## Meta of the response to a file request that can't be served
+  if target.error == feTraversal: "Invalid request" else: target.errorMsg
+
+proc authPage(request: Request | AsyncRequest): string =
+  ## Body of the client certificate test page
+  result = "# Certificate accepted\n\n"
+  result.add("## Certificate Information\n\n")
+  result.add("Certificate available\n")
+  result.add("Verified: " & $request.isVerified & "\n")
+  result.add("Self-signed: " & $request.isSelfSigned & "\n\n")
+  result.add("Hello authenticated client!")
+
+# Request handler for both modes
+proc handleRequest(request: Request | AsyncRequest, docRoot: string,
+                   cache: ContentCache, pack: ContentPack) {.multisync.} =
+  ## Handles incoming Gemini requests.
   ##
-  ## This callback function processes incoming client requests, implementing
-  ## different routes:
+  ## Requests are dispatched by matchEndpoint(), which also enforces the
+  ## certificate requirement of each route:
   ##
-  ## - "/auth": Requires and validates client certificates
-  ## - All other paths: Served from the document root
+  ## - "/auth": Requires a verified or self-signed client certificate
+  ## - All other paths: Served from the document root or the content pack
   ##
   ## Parameters:
-  ##   request: The Request object containing URL, client info, and response methods
+  ##   request: The Request or AsyncRequest containing URL, client info, and response methods
   ##   docRoot: The document root directory for file serving
-  echo "Request path: ", request.url.path
-  
-  # Special route for client certificate authentication
-  if request.url.path == "/auth":
-    if not request.hasCertificate():
-      # Client didn't provide a certificate, request one
-      request.respond(CertificateRequired, "CLIENT CERTIFICATE REQUIRED")
-    elif not (request.isVerified() or request.isSelfSigned()):
-      # Certificate was provided but isn't valid
-      request.respond(CertificateRequired, "CERTIFICATE NOT VALID")
-    else:
-      # Client certificate is valid (either verified or self-signed)
-      var response = "# Certificate accepted\n\n"
-      if request.certificate != nil:
-        response.add("## Certificate Information\n\n")
-        response.add("Certificate available\n")
-        response.add("Verified: " & $request.isVerified & "\n")
-        response.add("Self-signed: " & $request.isSelfSigned & "\n\n")
-      response.add("Hello authenticated client!")
-      request.respond(Success, "text/gemini", response)
-  else:
-    # Handle file requests for other paths
-    let result = handleFileRequest(docRoot, request.url.path)
-    
-    if result.success:
-      # File or directory found, serve it
-      request.respond(Success, result.mimeType, result.content)
+  ##   cache: Content cache for small files and listings (nil to disable)
+  ##   pack: Content pack served instead of docRoot (nil to serve docRoot)
+  let route = matchEndpoint(request.url.path)
+  let certificateStatus = request.checkCertificate(route.certificate)
+  if certificateStatus != Success:
+    await request.respond(certificateStatus, certificateMeta(certificateStatus))
+    return
+
+  let endpoint = if route.found: route.endpoint else: epFiles
+  case endpoint
+  of epAuth:
+    await request.respond(Success, "text/gemini", authPage(request))
+  of epFiles:
+    let target = if pack.isNil: resolveFileRequest(docRoot, request.url.path, cache)
+                 else: resolvePackRequest(pack, request.url.path)
+
+    if not target.success:
+      await request.respond(fileErrorStatus[target.error], fileErrorMeta(target))
+    elif not target.data.isNil:
+      # Packed bodies are sent straight from the mapping
+      await request.respond(Success, target.mimeType, target.data, target.size.int)
+    elif target.path != "":
+      # Stream files from disk instead of loading them into memory
+      await request.respondFile(target.mimeType, target.path)
     else:
-      # Handle errors
-      case result.errorMsg:
-      of "File not found":
-        request.respond(NotFound, result.errorMsg)
-      of "Directory listing not allowed":
-        request.respond(NotFound, result.errorMsg)
-      of "Security violation: Path traversal attempt":
-        request.respond(MalformedRequest, "Invalid request")
-      else:
-        request.respond(TempError, result.errorMsg)
+      await request.respond(Success, target.mimeType, target.content)
+
+proc newSessionSecret(): string =
+  ## Returns a random hex secret for session tickets shared by all workers
+  for b in urandom(32):
+    result.add(toHex(b))
+
+proc applyArguments(config: var Config, args: Table[string, Value]) =
+  ## Overrides the configuration with the command line options
+  if args["--verbose"]:
+    config.log.level = 2  # Increase verbosity
+
+  if args["--port"]:
+    try:
+      config.server.port = parseInt($args["--port"])
+    except ValueError:
+      echo "Warning: Invalid port number, using default"
+
+  if args["--address"]:
+    config.server.address = $args["--address"]
+
+  # IPv6 setting
+  if args["--ipv6"]:
+    config.server.useIPv6 = true
+
+  # Reuse flags
+  if args["--reuse-addr"]:  # If explicitly set to true
+    config.server.reuseAddr = true
+  elif args.hasKey("--reuse-addr") and not args["--reuse-addr"].toBool():
+    config.server.reuseAddr = false
+
+  if args["--reuse-port"]:
+    config.server.reusePort = true
+
+  if args["--threads"]:
+    try:
+      config.server.threads = parseInt($args["--threads"])
+    except ValueError:
+      echo "Warning: Invalid number of threads, using default"
+
+  if args["--workers"]:
+    try:
+      config.server.workers = parseInt($args["--workers"])
+    except ValueError:
+      echo "Warning: Invalid number of workers, using one"
+      config.server.workers = 1
+
+  # Certificate settings
+  if args["--cert"]:
+    config.server.certFile = $args["--cert"]
+
+  if args["--key"]:
+    config.server.keyFile = $args["--key"]
+
+  # Document root
+  if args["--docroot"]:
+    config.server.docRoot = $args["--docroot"]
+
+  if args["--pack"]:
+    config.server.pack = $args["--pack"]
+
+proc loadServerConfig(args: Table[string, Value]): Config =
+  ## Loads the configuration file and applies the command line over it, at
+  ## startup and on every reload
+  let configPath = if args["--config"]: $args["--config"] else: ""
+  result = loadOrCreateConfig(configPath)
+  applyArguments(result, args)
+
+proc newServerAccessLog(config: Config): AccessLog =
+  ## Opens the access log configured by `log_requests` and the [log] section,
+  ## or returns nil if request logging is off
+  if not config.server.logRequests:
+    return nil
+  newAccessLog(config.log.file, config.log.bufferSize, config.log.timestamp)
+
+proc newServerMetrics(config: Config): Metrics =
+  ## Creates the shared metrics if the admin port or the route is configured,
+  ## or returns nil
+  if config.metrics.port <= 0 and config.metrics.route == "":
+    return nil
+  newMetrics()
+
+proc startServerMetrics(config: Config, metrics: Metrics) =
+  ## Opens the metrics admin port of this process, if configured
+  if not metrics.isNil and config.metrics.port > 0:
+    startMetricsServer(metrics, config.metrics.port, config.metrics.address)
+
+proc newServerCache(config: Config): ContentCache =
+  ## Creates the content cache described by the [cache] config section,
+  ## or nil when caching is disabled or a content pack is served
+  if not config.cache.enabled or config.server.pack != "":
+    return nil
+  newContentCache(
+    maxEntries = config.cache.maxEntries,
+    maxBytes = config.cache.maxSize,
+    maxFileSize = config.cache.maxFileSize,
+    revalidateMs = config.cache.revalidateMs,
+    useInotify = config.cache.useInotify
+  )
 
-# Asynchronous request handler
-proc handleAsyncRequest(request: AsyncRequest, docRoot: string): Future[void] {.async.} =
-  ## Handles incoming Gemini requests asynchronously.
-  ##
-  ## This callback function processes incoming client requests, implementing
-  ## different routes:
-  ##
-  ## - "/auth": Requires and validates client certificates
-  ## - All other paths: Served from the document root
-  ##
-  ## Parameters:
-  ##   request: The AsyncRequest object containing URL, client info, and response methods
-  ##   docRoot: The document root directory for file serving
-  echo "Request path: ", request.url.path
-  
-  # Special route for client certificate authentication
-  if request.url.path == "/auth":
-    if not request.hasCertificate():
-      # Client didn't provide a certificate, request one
-      await request.respond(CertificateRequired, "CLIENT CERTIFICATE REQUIRED")
-    elif not (request.isVerified() or request.isSelfSigned()):
-      # Certificate was provided but isn't valid
-      await request.respond(CertificateRequired, "CERTIFICATE NOT VALID")
-    else:
-      # Client certificate is valid (either verified or self-signed)
-      var response = "# Certificate accepted\n\n"
-      if request.certificate != nil:
-        response.add("## Certificate Information\n\n")
-        response.add("Certificate available\n")
-        response.add("Verified: " & $request.isVerified & "\n")
-        response.add("Self-signed: " & $request.isSelfSigned & "\n\n")
-      response.add("Hello authenticated client!")
-      await request.respond(Success, "text/gemini", response)
+proc openServerPack(config: Config): ContentPack =
+  ## Maps the content pack configured by `pack`, or returns nil to serve the
+  ## docroot.
+  if config.server.pack == "":
+    return nil
+  result = openPack(config.server.pack)
+  echo "Serving ", result.len, " paths from content pack ", config.server.pack
+
+proc newServerGateways(config: Config): seq[Gateway] =
+  ## Creates the gateways of the [[gateway]] tables. Their backends are
+  ## connected to once requests come in.
+  for entry in config.gateways:
+    let protocol = if entry.protocol == "scgi": gpScgi else: gpFastCgi
+    let backend = newBackend(entry.socket, protocol, entry.maxConcurrency,
+                             entry.maxIdle, entry.timeoutMs)
+    result.add(newGateway(entry.route, backend))
+    echo "Serving ", entry.route, " from ", entry.protocol, " backend ", entry.socket
+
+proc effectiveDocRoot(config: Config): string =
+  ## The document root, relative paths converted to absolute for proper
+  ## file resolution
+  if config.server.docRoot.startsWith("./"):
+    getCurrentDir() / config.server.docRoot[2..^1]
   else:
-    # Handle file requests for other paths
-    let result = handleFileRequest(docRoot, request.url.path)
-    
-    if result.success:
-      # File or directory found, serve it
-      await request.respond(Success, result.mimeType, result.content)
-    else:
-      # Handle errors
-      case result.errorMsg:
-      of "File not found":
-        await request.respond(NotFound, result.errorMsg)
-      of "Directory listing not allowed":
-        await request.respond(NotFound, result.errorMsg)
-      of "Security violation: Path traversal attempt":
-        await request.respond(MalformedRequest, "Invalid request")
-      else:
-        await request.respond(TempError, result.errorMsg)
+    config.server.docRoot
+
+var syncServer: ObiwanServer # The server stopSyncServer() stops
+
+proc stopSyncServer(sig: cint) {.noconv.} =
+  ## Signal handler of the synchronous server: makes serve() return, so that
+  ## the access log is written out before the process exits. A second signal
+  ## exits right away.
+  if syncServer.isNil or syncServer.draining:
+    exitnow(1)
+  syncServer.stopAccepting()
+
+proc installSyncStop() =
+  ## Stops the synchronous server on SIGINT, SIGTERM and SIGQUIT. Without
+  ## SA_RESTART the signals interrupt the accept serve() waits in.
+  var action: Sigaction
+  action.sa_handler = stopSyncServer
+  discard sigemptyset(action.sa_mask)
+  action.sa_flags = 0
+  for sig in [SIGINT, SIGTERM, SIGQUIT]:
+    discard sigaction(sig, action, nil)
 
 # Run the server in synchronous mode
-proc runSyncServer(config: Config) =
+proc runSyncServer(config: Config, metrics: Metrics) =
   # Initialize server with TLS certificates
   var server = newObiwanServer(
     reuseAddr = config.server.reuseAddr,
     reusePort = config.server.reusePort,
     certFile = config.server.certFile,
     keyFile = config.server.keyFile,
-    sessionId = config.server.sessionId
+    sessionId = config.server.sessionId,
+    ticketRotation = config.server.ticketRotation,
+    threads = config.server.threads,
+    queueDepth = config.server.queueDepth
   )
+  server.accessLog = newServerAccessLog(config)
+  server.metrics = metrics
+  server.maxRequestLength = config.server.maxRequestLength
+  server.handshakeTimeoutMs = config.server.handshakeTimeoutMs
+  server.requestTimeoutMs = config.server.requestTimeoutMs
+  server.recordSize = config.server.recordSize
+  server.cipherSuites = parseCipherSuites(config.server.cipherSuites)
+  server.ktls = config.server.ktls
+  startServerMetrics(config, metrics)
 
   # Get the effective address
   let effectiveAddress = if config.server.address == "":
@@ -183,48 +328,248 @@ proc runSyncServer(config: Config) =
                          else: config.server.address
 
   # Create a request handler that includes the docRoot
-  # Convert relative paths to absolute for proper file resolution
-  let docRoot = if config.server.docRoot.startsWith("./"):
-                  getCurrentDir() / config.server.docRoot[2..^1]
-                else:
-                  config.server.docRoot
-  
+  let docRoot = effectiveDocRoot(config)
+
+  # Shared by the worker threads, the cache does its own locking and the
+  # pack is read-only
+  let cache = newServerCache(config)
+  let pack = openServerPack(config)
+
+  let metricsRoute = config.metrics.route
+  if config.gateways.len > 0:
+    echo "Warning: gateways need the async server, not serving ",
+         config.gateways.len, " of them"
+
   proc requestHandler(request: Request) =
-    handleSyncRequest(request, docRoot)
+    if metricsRoute.len > 0 and request.url.path == metricsRoute:
+      request.respond(Success, "text/plain", render(metrics))
+    else:
+      handleRequest(request, docRoot, cache, pack)
 
   # Start the server
   echo "\nServer starting in synchronous mode..."
-  server.serve(config.server.port, requestHandler, effectiveAddress)
+  syncServer = server
+  installSyncStop()
+  try:
+    server.serve(config.server.port, requestHandler, effectiveAddress)
+  finally:
+    # Writes out the entries still buffered before the process exits
+    if not server.accessLog.isNil:
+      server.accessLog.close()
+    syncServer = nil
 
 # Run the server in asynchronous mode
-proc runAsyncServer(config: Config) {.async.} =
+type
+  Site = ref object
+    ## What requests are served from. A reload replaces it; the requests
+    ## still being served from the previous one finish on it.
+    config: Config
+    docRoot: string
+    cache: ContentCache
+    pack: ContentPack
+    gateways: seq[Gateway]
+    accessLog: AccessLog # Opened anew by every reload, so rotated files are reopened
+    metricsRoute: string
+    active: int # Requests being served from it
+
+  Sites = ref object
+    ## The site being served and those a reload replaced
+    current: Site
+    retired: seq[Site]
+
+  ServerControl = object
+    ## How an async server takes part in reloads and upgrades
+    args: Table[string, Value] # Command line, applied again over reloaded configs
+    listenFd: cint             # Listening socket to accept on, -1 to bind one
+    sessionSecret: string      # Passed to upgraded binaries
+    upgrades: bool             # Whether SIGUSR2 upgrades this process, rather than its parent
+    ready: proc () {.closure.} # Called once the server accepts connections
+
+const ControlPollMs = 200 # Interval between checks for control signals
+
+proc newSite(config: Config, previous: Site): Site =
+  ## Creates the site of a configuration, reusing the cache, content pack
+  ## and gateways of `previous` where their configuration didn't change.
+  ## The access log is always opened again.
+  result = Site(config: config, docRoot: effectiveDocRoot(config),
+                metricsRoute: config.metrics.route)
+  let same = not previous.isNil
+  if same and previous.config.cache == config.cache and
+      previous.config.server.pack == config.server.pack:
+    result.cache = previous.cache
+  else:
+    result.cache = newServerCache(config)
+  if same and previous.config.server.pack == config.server.pack:
+    result.pack = previous.pack
+  else:
+    result.pack = openServerPack(config)
+  if same and previous.config.gateways == config.gateways:
+    result.gateways = previous.gateways
+  else:
+    result.gateways = newServerGateways(config)
+  result.accessLog = newServerAccessLog(config)
+
+proc uses(site: Site, cache: ContentCache, pack: ContentPack, gateway: Gateway): bool =
+  (not cache.isNil and site.cache == cache) or (not pack.isNil and site.pack == pack) or
+    (not gateway.isNil and gateway in site.gateways)
+
+proc releaseRetired(sites: Sites) =
+  ## Closes what the retired sites no request uses anymore opened, unless
+  ## another site still uses it
+  var i = 0
+  while i < sites.retired.len:
+    let site = sites.retired[i]
+    if site.active > 0:
+      inc i
+      continue
+    sites.retired.del(i)
+    var live = @[sites.current]
+    live.add(sites.retired)
+    proc inUse(cache: ContentCache = nil, pack: ContentPack = nil, gateway: Gateway = nil): bool =
+      for other in live:
+        if other.uses(cache, pack, gateway):
+          return true
+    if not site.cache.isNil and not inUse(cache = site.cache):
+      site.cache.close()
+    if not site.pack.isNil and not inUse(pack = site.pack):
+      site.pack.close()
+    for gateway in site.gateways:
+      if not inUse(gateway = gateway):
+        gateway.backend.close()
+    if not site.accessLog.isNil:
+      site.accessLog.close()
+
+proc applySettings(server: AsyncObiwanServer, config: Config) =
+  ## Applies the settings of the [server] section that can change while
+  ## serving, at startup and on reload
+  server.maxRequestLength = config.server.maxRequestLength
+  server.handshakeTimeoutMs = config.server.handshakeTimeoutMs
+  server.requestTimeoutMs = config.server.requestTimeoutMs
+  server.recordSize = config.server.recordSize
+  server.cipherSuites = parseCipherSuites(config.server.cipherSuites)
+  server.ktls = config.server.ktls
+  server.maxConnections = config.server.maxConnections
+  server.maxPerIp = config.server.maxPerIp
+  server.drainTimeoutMs = config.server.drainTimeoutMs
+
+proc reloadServer(server: AsyncObiwanServer, sites: Sites, control: ServerControl) =
+  ## Loads the configuration and certificates again, on SIGHUP. On errors
+  ## the server keeps serving as before.
+  let previous = sites.current.config
+  try:
+    let config = loadServerConfig(control.args)
+    server.reloadCertificates(config.server.certFile, config.server.keyFile)
+    applySettings(server, config)
+    initializeLogging(config)
+    let site = newSite(config, sites.current)
+    sites.retired.add(sites.current)
+    sites.current = site
+    # Connections log when they close, from now on to the new log
+    server.accessLog = site.accessLog
+    if config.server.port != previous.server.port or
+        config.server.address != previous.server.address or
+        config.server.useIPv6 != previous.server.useIPv6 or
+        config.server.workers != previous.server.workers or
+        config.server.ioUring != previous.server.ioUring:
+      echo "Warning: the listener, workers and io_uring only change on upgrade (SIGUSR2)"
+    echo "Reloaded configuration and certificates"
+  except CatchableError:
+    echo "Reload failed, keeping the current configuration: ", getCurrentExceptionMsg()
+
+proc controlServer(server: AsyncObiwanServer, sites: Sites,
+                   control: ServerControl) {.async.} =
+  ## Reacts to the control signals while the server accepts connections,
+  ## and closes what reloads left unused
+  var upgrading = false
+  var pending: Upgrade
+  while not server.draining:
+    await sleepAsync(ControlPollMs)
+    sites.releaseRetired()
+    if takeSignal(csReload):
+      reloadServer(server, sites, control)
+    if takeSignal(csDrain):
+      echo "Draining ", server.connections, " connections before exiting"
+      server.stopAccepting()
+    if takeSignal(csUpgrade) and control.upgrades and not upgrading and server.listenFd >= 0:
+      try:
+        pending = spawnUpgrade([server.listenFd], control.sessionSecret)
+        upgrading = true
+        echo "Starting upgraded server, process ", pending.pid
+      except OSError:
+        echo "Upgrade failed: ", getCurrentExceptionMsg()
+    if upgrading:
+      case pending.refresh()
+      of usPending:
+        discard
+      of usReady:
+        upgrading = false
+        echo "Process ", pending.pid, " took over, draining ", server.connections, " connections"
+        server.stopAccepting()
+      of usFailed:
+        upgrading = false
+        echo "Upgraded server failed to start, still serving"
+
+proc runAsyncServer(config: Config, metrics: Metrics, control: ServerControl) {.async.} =
   # Initialize server with TLS certificates
   var server = newAsyncObiwanServer(
     reuseAddr = config.server.reuseAddr,
     reusePort = config.server.reusePort,
     certFile = config.server.certFile,
     keyFile = config.server.keyFile,
-    sessionId = config.server.sessionId
+    sessionId = config.server.sessionId,
+    ticketRotation = config.server.ticketRotation
   )
+  server.metrics = metrics
+  applySettings(server, config)
+  server.ioUring = config.server.ioUring
+  server.listenFd = control.listenFd
+  startServerMetrics(config, metrics)
 
   # Get the effective address
   let effectiveAddress = if config.server.address == "":
                           if config.server.useIPv6: "::" else: ""
                          else: config.server.address
 
-  # Create a request handler that includes the docRoot
-  # Convert relative paths to absolute for proper file resolution
-  let docRoot = if config.server.docRoot.startsWith("./"):
-                  getCurrentDir() / config.server.docRoot[2..^1]
-                else:
-                  config.server.docRoot
-  
+  # Swapped by reloads, the handler serves each request from the site that
+  # was current when it came in
+  let sites = Sites(current: newSite(config, nil))
+  server.accessLog = sites.current.accessLog
+
   proc requestHandler(request: AsyncRequest): Future[void] {.async.} =
-    await handleAsyncRequest(request, docRoot)
+    let site = sites.current
+    inc site.active
+    try:
+      if not metrics.isNil and site.metricsRoute.len > 0 and
+          request.url.path == site.metricsRoute:
+        await request.respond(Success, "text/plain", render(metrics))
+        return
+      let gateway = findGateway(site.gateways, gatewayPath(request.url.path))
+      if gateway.isNil:
+        await handleRequest(request, site.docRoot, site.cache, site.pack)
+      else:
+        await gateway.serve(request)
+    finally:
+      dec site.active
 
-  # Start the server
+  installControlSignals(if control.upgrades: {csReload, csUpgrade, csDrain}
+                        else: {csReload, csDrain})
+
+  # Start the server. It listens once serve() first yields.
   echo "\nServer starting in asynchronous mode..."
-  await server.serve(config.server.port, requestHandler, effectiveAddress)
+  let serving = server.serve(config.server.port, requestHandler, effectiveAddress)
+  if not serving.finished and not control.ready.isNil:
+    control.ready()
+  asyncCheck controlServer(server, sites, control)
+  try:
+    await serving
+  finally:
+    # Writes out the entries still buffered, those of the requests drained
+    # after a SIGQUIT or an upgrade included, before the process exits
+    for site in @[sites.current] & sites.retired:
+      if not site.accessLog.isNil:
+        site.accessLog.close()
+        site.accessLog = nil # Not again when the retired sites are released
+    server.accessLog = nil
 
 # Main application code
 when isMainModule:
@@ -235,45 +580,11 @@ when isMainModule:
     # Get configuration file path from arguments
     let configPath = if args["--config"]: $args["--config"] else: ""
 
-    # Load configuration
-    var config = loadOrCreateConfig(configPath)
-
-    # Override configuration with command line arguments
-    if args["--verbose"]:
-      config.log.level = 2  # Increase verbosity
-
-    if args["--port"]:
-      try:
-        config.server.port = parseInt($args["--port"])
-      except ValueError:
-        echo "Warning: Invalid port number, using default"
-
-    if args["--address"]:
-      config.server.address = $args["--address"]
-
-    # IPv6 setting
-    if args["--ipv6"]:
-      config.server.useIPv6 = true
-
-    # Reuse flags
-    if args["--reuse-addr"]:  # If explicitly set to true
-      config.server.reuseAddr = true
-    elif args.hasKey("--reuse-addr") and not args["--reuse-addr"].toBool():
-      config.server.reuseAddr = false
-
-    if args["--reuse-port"]:
-      config.server.reusePort = true
-
-    # Certificate settings
-    if args["--cert"]:
-      config.server.certFile = $args["--cert"]
-
-    if args["--key"]:
-      config.server.keyFile = $args["--key"]
+    # Load configuration, overridden by the command line arguments
+    var config = loadServerConfig(args)
 
-    # Document root
-    if args["--docroot"]:
-      config.server.docRoot = $args["--docroot"]
+    # Listening sockets and session secret of the process this one upgrades
+    var handover = takeHandover()
 
     # Initialize logging
     initializeLogging(config)
@@ -288,6 +599,10 @@ when isMainModule:
     else:
       echo "Using default configuration (no config file found)"
 
+    # Inherited listeners set the number of workers, one per listener
+    let workerCount = if handover.listeners.len > 0: handover.listeners.len
+                      else: effectiveWorkerCount(config.server.workers)
+
     # Show key server settings
     echo "Server settings:"
     echo "  Mode:       ", if args["--sync"]: "Synchronous" else: "Asynchronous"
@@ -298,13 +613,109 @@ when isMainModule:
     echo "  Protocol:   ", if config.server.useIPv6: "IPv6" else: "IPv4"
     echo "  Cert file:  ", config.server.certFile
     echo "  Key file:   ", config.server.keyFile
-    echo "  Doc root:   ", config.server.docRoot
+    if config.server.pack != "":
+      echo "  Pack:       ", config.server.pack
+    else:
+      echo "  Doc root:   ", config.server.docRoot
+    if args["--sync"]:
+      echo "  Threads:    ", config.server.threads, " (queue depth ", config.server.queueDepth, ")"
+    else:
+      echo "  Workers:    ", workerCount
+      echo "  Limits:     ", config.server.maxConnections, " connections, ",
+                             config.server.maxPerIp, " per address"
+      let perConnection = connectionMemory(config.server.ioUring)
+      echo "  Memory:     ", perConnection div 1024, "KB per connection",
+           if config.server.maxConnections > 0:
+             ", " & $(perConnection * config.server.maxConnections div (1024 * 1024)) &
+               "MB at the limit"
+           else: ""
+      if config.server.ioUring:
+        echo "  I/O:        io_uring (falls back to asyncdispatch)"
+      if handover.listeners.len > 0:
+        echo "  Upgrade:    taking over ", handover.listeners.len, " listening sockets"
+    echo "  Cache:      ", if config.cache.enabled and config.server.pack == "":
+                            $(config.cache.maxSize div (1024 * 1024)) & "MB, files up to " &
+                              $(config.cache.maxFileSize div 1024) & "KB"
+                          else: "disabled"
+    if config.metrics.port > 0:
+      echo "  Metrics:    http://", config.metrics.address, ":", config.metrics.port, "/"
+    if config.metrics.route != "":
+      echo "  Metrics at: ", config.metrics.route
+
+    # Created before forking so that all workers share the counters
+    let metrics = newServerMetrics(config)
 
     # Run in the appropriate mode
     if args["--sync"]:
-      runSyncServer(config)
+      # Synchronous connections don't own the TLS context a reload would
+      # replace, and its blocking accept can't share a listener with the
+      # non-blocking one of an async server
+      if handover.listeners.len > 0:
+        echo "Error: upgrades need the asynchronous server"
+        quit(QuitFailure)
+      if workerCount > 1:
+        echo "Warning: --workers only applies to asynchronous mode, using one"
+      runSyncServer(config, metrics)
     else:
-      waitFor runAsyncServer(config)
+      # Session ticket keys are derived from the session ID. Workers and
+      # upgraded binaries must use the same one for tickets to work across
+      # them, so it is passed on with the listeners.
+      if handover.sessionSecret != "":
+        config.server.sessionId = handover.sessionSecret
+      elif config.server.sessionId == "":
+        config.server.sessionId = newSessionSecret()
+      let sessionSecret = config.server.sessionId
+
+      if workerCount > 1:
+        # The parent binds one listener per worker, the kernel spreads
+        # accepts, and keeps them open across worker restarts and upgrades
+        config.server.reusePort = true
+        if workerCount != effectiveWorkerCount(config.server.workers):
+          echo "Warning: keeping the ", workerCount, " workers of the previous process"
+        var listeners = handover.listeners
+        if listeners.len == 0:
+          for slot in 0 ..< workerCount:
+            listeners.add(bindListener(config.server.port, config.server.address,
+                                       config.server.useIPv6, config.server.reuseAddr,
+                                       reusePort = true))
+        var workerConfig = config
+
+        proc worker() =
+          let control = ServerControl(args: args, listenFd: listeners[workerIndex()],
+                                      sessionSecret: sessionSecret)
+          waitFor runAsyncServer(workerConfig, metrics, control)
+
+        proc reload() =
+          # Workers restarted from now on start with the new configuration
+          try:
+            workerConfig = loadServerConfig(args)
+            workerConfig.server.reusePort = true
+            workerConfig.server.sessionId = sessionSecret
+          except CatchableError:
+            echo "Reload failed, keeping the current configuration: ", getCurrentExceptionMsg()
+
+        proc startUpgrade(pending: var Upgrade): bool =
+          # runWorkers waits for it to get ready, supervising the workers
+          try:
+            pending = spawnUpgrade(listeners, sessionSecret)
+            echo "Starting upgraded server, process ", pending.pid
+            result = true
+          except OSError:
+            echo "Upgrade failed: ", getCurrentExceptionMsg()
+
+        # The listeners accept from here on, connections queue until the
+        # workers are up
+        handover.notifyReady()
+        runWorkers(workerCount, worker, reload, startUpgrade)
+      else:
+        let control = ServerControl(
+          args: args,
+          listenFd: if handover.listeners.len > 0: handover.listeners[0] else: -1,
+          sessionSecret: sessionSecret,
+          upgrades: true,
+          ready: proc () = handover.notifyReady()
+        )
+        waitFor runAsyncServer(config, metrics, control)
 
   except:
     # Handle any exceptions that occur during server setup or operation
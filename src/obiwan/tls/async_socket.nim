@@ -1,13 +1,19 @@
 import asyncdispatch
 import net
+import nativesockets
 import posix # For low-level socket functions
 import ./mbedtls as mbedtls
 import strutils
 import ./socket
+import ./buffer
+import ./ktls
+import ./uring
 import ../debug
+import ../dns
 
 const
-  DefaultBufferSize* = 4096  ## Default size for TLS read buffer (4KB)
+  DefaultBufferSize* = ReadBufferSize  ## Size of the TLS read buffer (4KB)
+  SocketOverhead = 1024  ## The socket object, its futures and the dispatcher's entry for it
 
 # Helper functions for async socket waiting
 proc waitForReadable(socket: AsyncFD): Future[void] =
@@ -59,13 +65,20 @@ type
     fd*: cint                                   ## Socket file descriptor
     domain*: cint                               ## Socket domain (AF_INET or AF_INET6)
     isBuffered*: bool                           ## Whether the socket uses buffering
-    buffer*: string                             ## Buffer for received data
+    buffer*: ReadBuffer                         ## Received data not consumed yet, reused for every read
     sendQueue*: string                          ## Queue for data to be sent
     isSsl*: bool                                ## Whether TLS is enabled
     sock*: int ## AsyncFD representation (AsyncFD is an int wrapper)
     sslContext*: MbedtlsSslContext              ## SSL context for TLS operations
     sslSession*: MbedtlsSslSession              ## Per-connection SSL session
     sslHandle*: ptr mbedtls.mbedtls_ssl_context ## Handle to mbedTLS SSL context
+    sessionKey*: string                         ## Client: "host:port" the session is saved under for resumption
+    corked*: bool                               ## Partial TCP frames are held back until flush()
+    recordSize*: int                            ## Plaintext per record sent, 0 = adaptive (see recordLimit)
+    bytesWritten*: int                          ## Plaintext sent so far, drives adaptive record sizing
+    ktls*: bool                                 ## Sending is encrypted by the kernel, mbedTLS must not write anymore
+    uring*: UringConn                           ## io_uring connection doing the socket's I/O, nil with asyncdispatch
+    readWaiter, writeWaiter: Future[void]       # Pending asyncdispatch waits, failed by close()
 
   ## Reference type for asynchronous TLS socket.
   ##
@@ -73,6 +86,24 @@ type
   ## It provides high-level methods for non-blocking TLS-encrypted network operations.
   MbedtlsAsyncSocket* = ref MbedtlsAsyncSocketObj
 
+proc waitReadable(socket: MbedtlsAsyncSocket): Future[void] =
+  ## Completes when mbedTLS can read from the socket again, through the
+  ## socket's io_uring connection or the async dispatcher. Fails when the
+  ## socket is closed meanwhile, see close().
+  if not socket.uring.isNil:
+    socket.uring.waitReadable()
+  else:
+    socket.readWaiter = waitForReadable(asyncdispatch.AsyncFD(socket.sock))
+    socket.readWaiter
+
+proc waitWritable(socket: MbedtlsAsyncSocket): Future[void] =
+  ## Completes when the socket can take more output, see waitReadable()
+  if not socket.uring.isNil:
+    socket.uring.waitWritable()
+  else:
+    socket.writeWaiter = waitForWritable(asyncdispatch.AsyncFD(socket.sock))
+    socket.writeWaiter
+
 proc getSslHandle*(socket: MbedtlsAsyncSocket): ptr mbedtls.mbedtls_ssl_context =
   ## Retrieves the mbedTLS SSL context handle from an async socket.
   ##
@@ -86,6 +117,23 @@ proc getSslHandle*(socket: MbedtlsAsyncSocket): ptr mbedtls.mbedtls_ssl_context
   ##   Pointer to the mbedTLS SSL context
   socket.sslHandle
 
+proc connectionMemory*(ioUring = false): int =
+  ## Memory an open server connection takes at most, for capacity planning.
+  ##
+  ## Counts the TLS session (SessionMemory), the read buffer and the socket
+  ## itself, plus the send and receive buffers of an io_uring connection.
+  ## Handshakes take a few KB more while they run; connections that haven't
+  ## sent their ClientHello yet, or send with kTLS, hold no TLS session.
+  ##
+  ## Parameters:
+  ##   ioUring: Whether the connection's I/O goes through io_uring
+  ##
+  ## Returns:
+  ##   Bytes per connection
+  result = SessionMemory + DefaultBufferSize + SocketOverhead
+  if ioUring:
+    result += 2 * UringBufferSize
+
 proc newMbedtlsAsyncSocket*(): MbedtlsAsyncSocket =
   ## Creates a new asynchronous TLS socket.
   ##
@@ -105,7 +153,6 @@ proc newMbedtlsAsyncSocket*(): MbedtlsAsyncSocket =
   result.fd = -1 # Invalid FD until connected
   result.domain = 2 # Domain.AF_INET default
   result.isBuffered = true # Enable buffering
-  result.buffer = "" # Empty buffer
   result.sendQueue = "" # Empty send queue
   result.isSsl = true
   result.sslHandle = nil
@@ -135,8 +182,9 @@ proc dial*(address: string, port: int): Future[MbedtlsAsyncSocket] {.async.} =
   ## Asynchronously establishes a TCP connection to the specified address and port.
   ##
   ## This function creates a new async socket and connects it to the specified server,
-  ## handling both IPv4 and IPv6 addresses. It configures the socket for non-blocking
-  ## operation and registers it with the async dispatcher.
+  ## handling both IPv4 and IPv6 addresses. Host names are resolved through the
+  ## address cache of the dns module, and every address is tried in turn with a
+  ## non-blocking connect on a socket registered with the async dispatcher.
   ##
   ## Parameters:
   ##   address: The hostname or IP address to connect to
@@ -155,35 +203,33 @@ proc dial*(address: string, port: int): Future[MbedtlsAsyncSocket] {.async.} =
   ##   ```
   var socket = newMbedtlsAsyncSocket()
 
-  # Create the socket FD
-  var socketContext: mbedtls.mbedtls_net_context
-  mbedtls.mbedtls_net_init(addr socketContext)
-
-  # Connect to server
-  var portStr = $port
-  let ret = mbedtls.mbedtls_net_connect(addr socketContext, address, cast[
-      cstring](addr portStr[0]), mbedtls.MBEDTLS_NET_PROTO_TCP)
-  if ret != 0:
-    var errorStr = newString(100)
-    mbedtls.mbedtls_strerror(ret, cast[cstring](addr errorStr[0]), 100)
-    raise newException(OSError, "Failed to connect to " & address & ":" &
-        portStr & ": " & errorStr)
-
-  # Set non-blocking mode
-  discard mbedtls.mbedtls_net_set_nonblock(addr socketContext)
-
-  # Assign the socket fd
-  socket.fd = socketContext.fd
-  # Detect IPv6 addresses for proper socket domain
-  # IPv6 addresses have multiple colons and may be enclosed in square brackets
-  socket.domain = if address.contains('[') or address.count(':') >
-      1: 10 else: 2 # AF_INET6 = 10, AF_INET = 2
+  # Host names come from the address cache or a lookup on another thread,
+  # and the connect itself is non-blocking, so a slow resolver or server
+  # doesn't stall every other connection
+  var lastError = ""
+  let targets = await resolveAsync(address)
+  for target in targets:
+    let fd = createAsyncNativeSocket(target.domain, SockType.SOCK_STREAM,
+                                     Protocol.IPPROTO_TCP)
+    var connected = false
+    try:
+      await asyncdispatch.connect(fd, target.address, Port(port), target.domain)
+      connected = true
+    except OSError as e:
+      debug("Connecting to " & target.address & " failed: " & e.msg)
+      lastError = e.msg
+    if not connected:
+      closeSocket(fd)
+      continue
 
-  # Register with async dispatcher
-  socket.sock = socket.fd # AsyncFD is just an int wrapper
-  asyncdispatch.register(asyncdispatch.AsyncFD(socket.fd))
+    # createAsyncNativeSocket already registered it with the dispatcher
+    socket.fd = fd.cint
+    socket.sock = fd.int
+    socket.domain = toInt(target.domain)
+    return socket
 
-  return socket
+  raise newException(OSError, "Failed to connect to " & address & ":" & $port &
+      ": " & lastError)
 
 proc wrapConnectedSocketObj*(context: MbedtlsSslContext, socket: ref MbedtlsAsyncSocketObj,
                           handshakeFunc: proc(
@@ -214,21 +260,21 @@ proc wrapConnectedSocketObj*(context: MbedtlsSslContext, socket: ref MbedtlsAsyn
   ##   codes are accepted to support the Gemini protocol's security model.
   debug("Starting async TLS session setup (per-connection context)...")
 
-  # Create per-connection SSL session (GC-managed)
-  var session = MbedtlsSslSession(sharedConfig: context)
-
-  # Initialize per-connection SSL context
-  debug("Initializing per-connection SSL context")
-  mbedtls.mbedtls_ssl_init(addr session.context)
-
-  # Setup SSL context with SHARED config
-  debug("Setting up SSL context with shared config")
-  let ret = mbedtls.mbedtls_ssl_setup(addr session.context, addr context.config)
-  if ret != 0:
-    var errorStr = newString(100)
-    mbedtls.mbedtls_strerror(ret, cast[cstring](addr errorStr[0]), 100)
-    debug("SSL setup error: " & errorStr)
-    raise newException(OSError, "Failed to setup SSL context: " & errorStr)
+  # A server connection takes no TLS buffers until its ClientHello arrives,
+  # so connections that never send anything only cost their socket
+  if context.isServer:
+    await socket.waitReadable()
+
+  # Per-connection SSL session with the SHARED config, pooled or new. The
+  # socket holds it from here, so close() gives it back if the handshake fails.
+  var session: MbedtlsSslSession
+  try:
+    session = context.acquireSession()
+  except MbedtlsError as e:
+    debug("SSL setup error: " & e.msg)
+    raise newException(OSError, e.msg)
+  socket.sslSession = session
+  socket.sslContext = context
 
   # Set hostname for SNI
   if hostname.len > 0:
@@ -238,6 +284,13 @@ proc wrapConnectedSocketObj*(context: MbedtlsSslContext, socket: ref MbedtlsAsyn
       mbedtls.mbedtls_strerror(ret2, cast[cstring](addr errorStr[0]), 100)
       raise newException(OSError, "Failed to set hostname: " & errorStr)
 
+  # Offer a saved session so the handshake can be resumed
+  if socket.sessionKey.len > 0:
+    context.resumeSession(socket.sessionKey, addr session.context)
+
+  if context.ktls:
+    captureKeys(addr session.context, addr session.ktlsKeys)
+
   # Custom socket I/O for async operations
   proc asyncSend(ctx: pointer, buf: pointer, len: uint): cint {.cdecl.} =
     let sock = cast[MbedtlsAsyncSocket](ctx)
@@ -265,18 +318,23 @@ proc wrapConnectedSocketObj*(context: MbedtlsSslContext, socket: ref MbedtlsAsyn
     except:
       return mbedtls.MBEDTLS_ERR_NET_RECV_FAILED
 
-  # Connect bio with per-connection SSL context
-  mbedtls.mbedtls_ssl_set_bio(addr session.context, cast[pointer](socket),
-      asyncSend, asyncRecv, nil)
+  # Connect bio with per-connection SSL context. On io_uring, records are
+  # queued on the ring instead of written with a syscall each.
+  if socket.uring.isNil:
+    mbedtls.mbedtls_ssl_set_bio(addr session.context, cast[pointer](socket),
+        asyncSend, asyncRecv, nil)
+  else:
+    mbedtls.mbedtls_ssl_set_bio(addr session.context, cast[pointer](socket.uring),
+        uring.bioSend, uring.bioRecv, nil)
 
   # Perform SSL handshake (async)
   var handshakeRet = handshakeFunc(addr session.context)
   while handshakeRet == mbedtls.MBEDTLS_ERR_SSL_WANT_READ or
         handshakeRet == mbedtls.MBEDTLS_ERR_SSL_WANT_WRITE:
     if handshakeRet == mbedtls.MBEDTLS_ERR_SSL_WANT_READ:
-      await waitForReadable(asyncdispatch.AsyncFD(socket.sock))
+      await socket.waitReadable()
     else:
-      await waitForWritable(asyncdispatch.AsyncFD(socket.sock))
+      await socket.waitWritable()
     handshakeRet = handshakeFunc(addr session.context)
 
   if handshakeRet != 0:
@@ -286,12 +344,12 @@ proc wrapConnectedSocketObj*(context: MbedtlsSslContext, socket: ref MbedtlsAsyn
     else:
       var errorStr = newString(100)
       mbedtls.mbedtls_strerror(handshakeRet, cast[cstring](addr errorStr[0]), 100)
-      raise newException(OSError, "SSL handshake failed: " & errorStr)
+      raise (ref OSError)(msg: "SSL handshake failed: " & errorStr,
+                          errorCode: handshakeRet.int32)
 
-  # Store per-connection SSL session and handle in socket
-  socket.sslSession = session  # GC ref keeps session alive
+  # Store the handle of the per-connection SSL session in socket
   socket.sslHandle = addr session.context
-  socket.sslContext = context
+  socket.recordSize = context.recordSize
 
 # Convenient wrapper for ref version
 proc wrapConnectedSocket*(context: MbedtlsSslContext, socket: MbedtlsAsyncSocket,
@@ -318,47 +376,55 @@ proc handshakeAsClient*(sslCtx: ptr mbedtls.mbedtls_ssl_context): cint =
     debug("Async client handshake successful")
   return ret
 
-proc send*(socket: MbedtlsAsyncSocket, data: string) {.async.} =
-  ## Asynchronously sends data over a TLS-encrypted connection.
+proc send*(socket: MbedtlsAsyncSocket, data: pointer, size: int) {.async.} =
+  ## Asynchronously sends a raw buffer over a TLS-encrypted connection.
   ##
-  ## This function sends the specified string over a TLS-encrypted socket
-  ## connection without blocking. It handles the encryption transparently
-  ## through mbedTLS and manages asynchronous I/O with WANT_READ/WANT_WRITE
-  ## conditions. It ensures all data is sent, potentially over multiple
-  ## operations.
+  ## This overload takes a pointer and a length instead of a string, so that
+  ## callers streaming through a reusable buffer don't need to build a new
+  ## string for every write. Like the string version, it keeps writing until
+  ## all `size` bytes have been handed to mbedTLS.
   ##
   ## Parameters:
   ##   socket: The TLS async socket to send data through
-  ##   data: The string data to send
+  ##   data: Pointer to the buffer containing the data to send
+  ##   size: Number of bytes to send
   ##
   ## Raises:
   ##   OSError: If the send operation fails or the socket is invalid
   ##
-  ## Example:
-  ##   ```nim
-  ##   await socket.send("gemini://example.com/\r\n")
-  ##   ```
-  debug("Sending data of size " & $data.len & " bytes")
+  ## Note:
+  ##   The buffer must stay valid until the returned Future completes.
+  debug("Sending buffer of size " & $size & " bytes")
   var sent = 0
-  while sent < data.len:
-    let toSend = data[sent..^1]
-    withDebug:
-      if toSend.len > 0:
-        var preview = toSend[0..min(40, toSend.len-1)]
-        debug("Data to send (first bytes): " & preview)
 
-    debug("Calling mbedtls_ssl_write with size=" & $toSend.len)
-    var ret = mbedtls.mbedtls_ssl_write(socket.sslHandle, cast[pointer](
-        unsafeAddr toSend[0]), toSend.len.cuint)
+  # Once the kernel encrypts, data is written to the socket as it is
+  if socket.ktls:
+    while sent < size:
+      let ret = posix.write(socket.fd, cast[pointer](cast[int](data) + sent), size - sent)
+      if ret >= 0:
+        sent += ret
+        socket.bytesWritten += ret
+      elif errno == EAGAIN or errno == EWOULDBLOCK:
+        await socket.waitWritable()
+      elif errno != EINTR:
+        raise newException(OSError, "Failed to send data: " & $strerror(errno))
+    return
+
+  while sent < size:
+    # One record per call, sized by recordLimit. A retried write asks for the
+    # same length again, as mbedTLS requires.
+    let chunk = min(size - sent, recordLimit(socket.recordSize, socket.bytesWritten))
+    let ret = mbedtls.mbedtls_ssl_write(socket.sslHandle,
+        cast[pointer](cast[int](data) + sent), chunk.cuint)
 
     if ret == mbedtls.MBEDTLS_ERR_SSL_WANT_WRITE:
       debug("SSL_WANT_WRITE, waiting for socket to be writable")
-      await waitForWritable(asyncdispatch.AsyncFD(socket.sock))
+      await socket.waitWritable()
       continue
 
     if ret == mbedtls.MBEDTLS_ERR_SSL_WANT_READ:
       debug("SSL_WANT_READ, waiting for socket to be readable")
-      await waitForReadable(asyncdispatch.AsyncFD(socket.sock))
+      await socket.waitReadable()
       continue
 
     if ret < 0:
@@ -367,59 +433,165 @@ proc send*(socket: MbedtlsAsyncSocket, data: string) {.async.} =
       debug("Error in mbedtls_ssl_write: " & errorStr)
       raise newException(OSError, "Failed to send data: " & errorStr)
 
-    debug("Successfully sent " & $ret & " bytes")
     sent += ret.int
+    socket.bytesWritten += ret.int
 
-proc recv*(socket: MbedtlsAsyncSocket, size: int): Future[string] {.async.} =
-  ## Asynchronously receives data from a TLS-encrypted connection.
+proc send*(socket: MbedtlsAsyncSocket, data: string) {.async.} =
+  ## Asynchronously sends data over a TLS-encrypted connection.
   ##
-  ## This function reads up to the specified number of bytes from a TLS-encrypted
-  ## socket connection without blocking. It handles the decryption transparently
+  ## This function sends the specified string over a TLS-encrypted socket
+  ## connection without blocking. It handles the encryption transparently
   ## through mbedTLS and manages asynchronous I/O with WANT_READ/WANT_WRITE
-  ## conditions.
+  ## conditions. It ensures all data is sent, potentially over multiple
+  ## operations.
+  ##
+  ## Parameters:
+  ##   socket: The TLS async socket to send data through
+  ##   data: The string data to send
+  ##
+  ## Raises:
+  ##   OSError: If the send operation fails or the socket is invalid
+  ##
+  ## Example:
+  ##   ```nim
+  ##   await socket.send("gemini://example.com/\r\n")
+  ##   ```
+  debug("Sending data of size " & $data.len & " bytes")
+  withDebug(4):
+    if data.len > 0:
+      debug("Data to send (first bytes): " & data[0..min(40, data.len-1)])
+  if data.len > 0:
+    # The string lives in this proc's environment until the send completes,
+    # so it can be written from in place instead of copying what's left
+    # after every partial write
+    await socket.send(unsafeAddr data[0], data.len)
+
+proc cork*(socket: MbedtlsAsyncSocket) =
+  ## Holds back partial TCP frames until flush() is called.
+  ##
+  ## Use this around a response made of several writes, so its TLS records
+  ## are packed into full segments instead of one packet each.
+  if not socket.corked and socket.fd != -1:
+    if socket.uring.isNil:
+      setCork(socket.fd, true)
+    else:
+      socket.uring.cork()
+    socket.corked = true
+
+proc flush*(socket: MbedtlsAsyncSocket) =
+  ## Sends the data held back since cork() right away.
+  ##
+  ## Does nothing if the socket is not corked. Only call it once the sends
+  ## of the response have completed, data still queued in mbedTLS is not
+  ## affected.
+  if socket.corked:
+    socket.corked = false
+    if not socket.uring.isNil:
+      # Output may still be waiting in the ring's send buffer
+      socket.uring.uncork()
+    elif socket.fd != -1:
+      setCork(socket.fd, false)
+
+proc startKtls*(socket: MbedtlsAsyncSocket): bool =
+  ## Hands encryption of everything this server connection sends from now
+  ## on to the kernel, see startKtls(MbedtlsSocket).
+  ##
+  ## Returns:
+  ##   true if the kernel now encrypts the connection's output
+  if socket.ktls:
+    return true
+  if socket.sslSession.isNil or not socket.sslSession.ktlsKeys.hasKeys:
+    return false
+  # Records mbedTLS has written must reach the socket before the kernel
+  # starts encrypting, see drain()
+  if not socket.uring.isNil and socket.uring.pendingOutput > 0:
+    return false
+  socket.ktls = enableKtlsTx(socket.fd, socket.sslHandle, socket.sslSession.ktlsKeys)
+  if socket.ktls:
+    # mbedTLS is done with the connection, its buffers can serve another one
+    socket.sslHandle = nil
+    socket.sslContext.releaseSession(socket.sslSession)
+    socket.sslSession = nil
+  socket.ktls
+
+proc drain*(socket: MbedtlsAsyncSocket) {.async.} =
+  ## Waits until everything sent so far has been handed to the kernel.
+  ##
+  ## Sends complete once mbedTLS has the data. On io_uring connections the
+  ## records may still sit in the connection's send buffer then, which
+  ## matters before startKtls(). Completes right away otherwise.
+  if not socket.uring.isNil:
+    await socket.uring.drain()
+
+proc sendFile*(socket: MbedtlsAsyncSocket; file: File; offset, size: int64) {.async.} =
+  ## Asynchronously sends `size` bytes of `file` from `offset` with
+  ## sendfile(), on a connection startKtls() succeeded on.
+  ##
+  ## Raises:
+  ##   OSError: If sending fails or the file ends early
+  var position = offset
+  let stop = offset + size
+  while position < stop:
+    let sent = sendFileChunk(socket.fd, getOsFileHandle(file).cint, position,
+                             int(min(stop - position, int64(int32.high))))
+    if sent > 0:
+      socket.bytesWritten += sent
+    elif sent == 0:
+      raise newException(OSError, "File ended before " & $size & " bytes were sent")
+    elif errno == EAGAIN or errno == EWOULDBLOCK:
+      await socket.waitWritable()
+    elif errno != EINTR:
+      raise newException(OSError, "sendfile failed: " & $strerror(errno))
+
+proc recv*(socket: MbedtlsAsyncSocket, data: pointer, size: int): Future[int] {.async.} =
+  ## Asynchronously receives up to `size` bytes into a caller-owned buffer.
+  ##
+  ## This is the allocation-free counterpart of recv(socket, size): data that
+  ## recvLine() read ahead is returned first, otherwise it waits for one TLS
+  ## record and decrypts it directly into `data`.
   ##
   ## Parameters:
   ##   socket: The TLS async socket to receive data from
+  ##   data: Pointer to the buffer to receive into
   ##   size: Maximum number of bytes to receive
   ##
   ## Returns:
-  ##   A Future that completes with the received data as a string.
-  ##   The length may be less than the requested size if the connection
-  ##   was closed or if a partial read occurred.
+  ##   A Future that completes with the number of bytes received, 0 if the
+  ##   connection was closed
   ##
   ## Raises:
   ##   OSError: If the receive operation fails
   ##
-  ## Example:
-  ##   ```nim
-  ##   let data = await socket.recv(1024)
-  ##   echo "Received ", data.len, " bytes"
-  ##   ```
+  ## Note:
+  ##   The buffer must stay valid until the returned Future completes.
   debug("Attempting to receive up to " & $size & " bytes")
-  var data = newString(size)
-  var bytesReceived = 0
+  if size <= 0:
+    return 0
+  if socket.buffer.len > 0:
+    return socket.buffer.read(data, size)
 
-  while bytesReceived < size:
-    debug("Calling mbedtls_ssl_read with size=" & $(size - bytesReceived))
-    var ret = mbedtls.mbedtls_ssl_read(socket.sslHandle,
-                                     cast[pointer](addr data[bytesReceived]),
-                                     (size - bytesReceived).cuint)
+  while true:
+    debug("Calling mbedtls_ssl_read with size=" & $size)
+    var ret = mbedtls.mbedtls_ssl_read(socket.sslHandle, data, size.cuint)
 
     if ret == mbedtls.MBEDTLS_ERR_SSL_WANT_READ:
       debug("SSL_WANT_READ, waiting for socket to be readable")
-      await waitForReadable(asyncdispatch.AsyncFD(socket.sock))
+      await socket.waitReadable()
       continue
 
     if ret == mbedtls.MBEDTLS_ERR_SSL_WANT_WRITE:
       debug("SSL_WANT_WRITE, waiting for socket to be writable")
-      await waitForWritable(asyncdispatch.AsyncFD(socket.sock))
+      await socket.waitWritable()
+      continue
+
+    if ret == mbedtls.MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET:
+      socket.sslContext.storeSession(socket.sessionKey, socket.sslHandle)
       continue
 
     if ret == 0 or ret == mbedtls.MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY:
       # Connection closed by peer
       debug("Peer closed connection")
-      data.setLen(bytesReceived)
-      break
+      return 0
 
     if ret < 0:
       # Actual error
@@ -429,33 +601,57 @@ proc recv*(socket: MbedtlsAsyncSocket, size: int): Future[string] {.async.} =
       raise newException(OSError, "Failed to receive data: " & errorStr)
 
     debug("Successfully received " & $ret & " bytes")
-    bytesReceived += ret.int
 
     # Show data received for debugging
-    if ret > 0:
-      withDebug:
-        let bytes = min(ret.int, 40)
-        let preview = data[bytesReceived-ret.int..<bytesReceived-ret.int+bytes]
-        var debugBytes = ""
-        for c in preview:
-          if ord(c) >= 32 and ord(c) < 127: # Only print ASCII printable chars
-            debugBytes.add(c)
-          else:
-            debugBytes.add('.')
-        debug("Received data (first " & $bytes & " bytes): " & debugBytes)
-
-    if bytesReceived < size:
-      # We have more data available immediately
-      data.setLen(bytesReceived)
-      break
+    withDebug(4):
+      var debugBytes = ""
+      for i in 0..<min(ret.int, 40):
+        let c = cast[ptr char](cast[int](data) + i)[]
+        if ord(c) >= 32 and ord(c) < 127: # Only print ASCII printable chars
+          debugBytes.add(c)
+        else:
+          debugBytes.add('.')
+      debug("Received data (first bytes): " & debugBytes)
+
+    return ret.int
 
+proc recv*(socket: MbedtlsAsyncSocket, size: int): Future[string] {.async.} =
+  ## Asynchronously receives data from a TLS-encrypted connection.
+  ##
+  ## This function reads up to the specified number of bytes from a TLS-encrypted
+  ## socket connection without blocking. It handles the decryption transparently
+  ## through mbedTLS and manages asynchronous I/O with WANT_READ/WANT_WRITE
+  ## conditions.
+  ##
+  ## Parameters:
+  ##   socket: The TLS async socket to receive data from
+  ##   size: Maximum number of bytes to receive
+  ##
+  ## Returns:
+  ##   A Future that completes with the received data as a string.
+  ##   The length may be less than the requested size if the connection
+  ##   was closed or if a partial read occurred.
+  ##
+  ## Raises:
+  ##   OSError: If the receive operation fails
+  ##
+  ## Example:
+  ##   ```nim
+  ##   let data = await socket.recv(1024)
+  ##   echo "Received ", data.len, " bytes"
+  ##   ```
+  var data = newString(size)
+  if size > 0:
+    let received = await socket.recv(addr data[0], size)
+    data.setLen(received)
   return data
 
 proc fillBuffer(socket: MbedtlsAsyncSocket): Future[int] {.async.} =
   ## Fills the socket's internal buffer with data from the TLS connection.
   ##
-  ## This is an internal helper function for buffered reading. It reads
-  ## up to DefaultBufferSize bytes into the socket's buffer.
+  ## This is an internal helper function for buffered reading. It decrypts
+  ## straight into the free space of the socket's buffer, so it doesn't
+  ## allocate.
   ##
   ## Returns:
   ##   Number of bytes read into the buffer, or 0 if connection closed.
@@ -465,41 +661,13 @@ proc fillBuffer(socket: MbedtlsAsyncSocket): Future[int] {.async.} =
   if socket.buffer.len > 0:
     return socket.buffer.len  # Already have data in buffer
 
-  var tempBuf = newString(DefaultBufferSize)
-
-  while true:
-    debug("fillBuffer: attempting to read up to " & $DefaultBufferSize & " bytes")
-    var ret = mbedtls.mbedtls_ssl_read(socket.sslHandle,
-                                       cast[pointer](addr tempBuf[0]),
-                                       DefaultBufferSize.cuint)
-
-    if ret == mbedtls.MBEDTLS_ERR_SSL_WANT_READ:
-      debug("fillBuffer: SSL_WANT_READ, waiting...")
-      await waitForReadable(asyncdispatch.AsyncFD(socket.sock))
-      continue
-
-    if ret == mbedtls.MBEDTLS_ERR_SSL_WANT_WRITE:
-      debug("fillBuffer: SSL_WANT_WRITE, waiting...")
-      await waitForWritable(asyncdispatch.AsyncFD(socket.sock))
-      continue
-
-    if ret == 0 or ret == mbedtls.MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY:
-      debug("fillBuffer: connection closed")
-      return 0
-
-    if ret < 0:
-      var errorStr = newString(100)
-      mbedtls.mbedtls_strerror(ret, cast[cstring](addr errorStr[0]), 100)
-      debug("fillBuffer: error - " & errorStr)
-      raise newException(OSError, "Failed to fill buffer: " & errorStr)
-
-    # Successfully read data
-    tempBuf.setLen(ret)
-    socket.buffer = tempBuf
-    debug("fillBuffer: read " & $ret & " bytes into buffer")
-    return ret
+  let (space, size) = socket.buffer.prepareWrite()
+  let ret = await socket.recv(space, size)
+  socket.buffer.commit(ret)
+  debug("fillBuffer: read " & $ret & " bytes into buffer")
+  return ret
 
-proc recvLine*(socket: MbedtlsAsyncSocket): Future[string] {.async.} =
+proc recvLine*(socket: MbedtlsAsyncSocket; maxLength = 0): Future[string] {.async.} =
   ## Asynchronously reads a line of text from a TLS-encrypted connection.
   ##
   ## This function uses buffered I/O for efficiency, reading chunks of data
@@ -508,6 +676,8 @@ proc recvLine*(socket: MbedtlsAsyncSocket): Future[string] {.async.} =
   ##
   ## Parameters:
   ##   socket: The TLS async socket to read from
+  ##   maxLength: Longest line accepted, line ending excluded (0 = no limit).
+  ##              Reading stops as soon as the limit is exceeded.
   ##
   ## Returns:
   ##   A Future that completes with the line read from the socket,
@@ -516,6 +686,7 @@ proc recvLine*(socket: MbedtlsAsyncSocket): Future[string] {.async.} =
   ## Raises:
   ##   EOFError: If the connection is closed and no data was read
   ##   OSError: If there's an error reading from the socket
+  ##   LineTooLongError: If the line is longer than maxLength
   ##
   ## Example:
   ##   ```nim
@@ -523,49 +694,38 @@ proc recvLine*(socket: MbedtlsAsyncSocket): Future[string] {.async.} =
   ##   echo "Received response header: ", response
   ##   ```
   debug("Reading a line from async socket (buffered)...")
-  result = ""
-
-  while true:
-    # Check buffer for newline
-    let nlPos = socket.buffer.find('\n')
-    if nlPos >= 0:
-      # Found newline in buffer - extract line including the newline
-      result.add(socket.buffer[0..nlPos])
-      socket.buffer = socket.buffer[nlPos+1..^1]
-      debug("Found newline in buffer at position " & $nlPos)
-      break
-
-    # No newline in buffer - append what we have and get more
-    if socket.buffer.len > 0:
-      result.add(socket.buffer)
-      socket.buffer = ""
+  var line = ""
 
+  # Take buffered data up to the newline, refilling the buffer until one arrives
+  while not socket.buffer.takeLine(line, maxLength):
     let filled = await socket.fillBuffer()
     if filled == 0:
       # Connection closed
-      debug("Connection closed, returning partial line of " & $result.len & " bytes")
-      if result.len == 0:
+      debug("Connection closed, returning partial line of " & $line.len & " bytes")
+      if line.len == 0:
         raise newException(EOFError, "Disconnected")
       break
 
-  debug("Raw received line: " & $result.len & " bytes")
+  debug("Raw received line: " & $line.len & " bytes")
 
   # Remove trailing \r\n
-  if result.len > 0 and result[^1] == '\n':
-    result.setLen(result.len - 1)
-    if result.len > 0 and result[^1] == '\r':
-      result.setLen(result.len - 1)
+  finishLine(line, maxLength)
 
-  debug("Processed line: " & result)
+  debug("Processed line: " & line)
+  return line
 
 proc close*(socket: MbedtlsAsyncSocket) =
   ## Closes an async TLS socket and frees associated resources.
   ##
   ## This function performs a clean shutdown of the TLS connection by sending
   ## a close notify alert, unregisters the socket from the async dispatcher,
-  ## and marks the socket as closed. This should be called when you're done
+  ## and closes its file descriptor. This should be called when you're done
   ## with a connection to properly free resources.
   ##
+  ## An operation still waiting on the socket, one a deadline gave up on,
+  ## fails with an OSError rather than staying pending forever. It never
+  ## touches the connection's TLS state again, which goes back to the pool.
+  ##
   ## Parameters:
   ##   socket: The async TLS socket to close
   ##
@@ -576,16 +736,27 @@ proc close*(socket: MbedtlsAsyncSocket) =
   ##   ```
   if socket.fd != -1:
     debug("Closing async socket with fd=" & $socket.fd)
-    if socket.sslHandle != nil:
+    if socket.ktls:
+      debug("Sending TLS close notify")
+      sendCloseNotify(socket.fd)
+    elif socket.sslHandle != nil:
       debug("Sending TLS close notify")
       discard mbedtls.mbedtls_ssl_close_notify(socket.sslHandle)
-      socket.sslHandle = nil
+    socket.sslHandle = nil
 
-    # Release per-connection SSL session (GC will call destructor to free SSL context)
+    # Give the per-connection SSL session back for the next connection
     if socket.sslSession != nil:
       debug("Releasing per-connection SSL session")
+      socket.sslContext.releaseSession(socket.sslSession)
       socket.sslSession = nil
 
+    # Fail operations still waiting, the dispatcher won't call them anymore
+    for waiter in [socket.readWaiter, socket.writeWaiter]:
+      if not waiter.isNil and not waiter.finished:
+        waiter.fail(newException(OSError, "Socket closed"))
+    socket.readWaiter = nil
+    socket.writeWaiter = nil
+
     # Unregister from async dispatcher if needed
     if socket.sock != -1:
       debug("Unregistering from async dispatcher")
@@ -595,6 +766,12 @@ proc close*(socket: MbedtlsAsyncSocket) =
         debug("Error during unregister (ignoring)")
       socket.sock = -1
 
-    # Set fd to -1 to mark it as closed
+    # Close the file descriptor, otherwise every connection leaks one. An
+    # io_uring connection closes it once its buffered output is sent.
+    if not socket.uring.isNil:
+      socket.uring.close()
+      socket.uring = nil
+    else:
+      discard posix.close(socket.fd)
     socket.fd = -1
     debug("Async socket closed")
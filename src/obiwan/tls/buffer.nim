@@ -0,0 +1,97 @@
+## Read buffer shared by the synchronous and asynchronous TLS sockets
+##
+## The buffer is allocated once per socket and reused for every read:
+## decrypted data is written straight into its free space, and lines and
+## raw reads are taken from the front by moving a cursor instead of
+## copying the remainder into a new string.
+
+import strutils
+
+const
+  ReadBufferSize* = 4096 ## Size of a socket's read buffer (4KB)
+
+type
+  LineTooLongError* = object of CatchableError
+    ## Raised by recvLine when a line is longer than its maxLength
+
+  ReadBuffer* = object
+    ## Bytes received but not consumed yet are `data[start ..< stop]`
+    data: string
+    start, stop: int
+
+proc len*(buffer: ReadBuffer): int {.inline.} =
+  ## Number of bytes waiting to be consumed
+  buffer.stop - buffer.start
+
+proc clear*(buffer: var ReadBuffer) {.inline.} =
+  ## Drops the unconsumed bytes, keeping the storage
+  buffer.start = 0
+  buffer.stop = 0
+
+proc consume(buffer: var ReadBuffer; count: int) {.inline.} =
+  buffer.start += count
+  if buffer.start == buffer.stop:
+    buffer.clear()
+
+proc prepareWrite*(buffer: var ReadBuffer): tuple[data: pointer, size: int] =
+  ## Returns the free space at the end of the buffer for a read to fill,
+  ## moving unconsumed bytes to the front first if that makes room.
+  ## Call commit() with the number of bytes written.
+  if buffer.data.len == 0:
+    buffer.data = newString(ReadBufferSize)
+  if buffer.stop == buffer.data.len and buffer.start > 0:
+    let count = buffer.len
+    moveMem(addr buffer.data[0], addr buffer.data[buffer.start], count)
+    buffer.start = 0
+    buffer.stop = count
+  (cast[pointer](cast[int](addr buffer.data[0]) + buffer.stop),
+   buffer.data.len - buffer.stop)
+
+proc commit*(buffer: var ReadBuffer; count: int) {.inline.} =
+  ## Marks `count` bytes written after prepareWrite() as received
+  buffer.stop += count
+
+proc read*(buffer: var ReadBuffer; dest: pointer; size: int): int =
+  ## Moves up to `size` buffered bytes to `dest` and returns how many
+  result = min(size, buffer.len)
+  if result > 0:
+    copyMem(dest, addr buffer.data[buffer.start], result)
+    buffer.consume(result)
+
+proc takeLine*(buffer: var ReadBuffer; line: var string; maxLength: int): bool =
+  ## Appends buffered bytes to `line` up to and including the first newline.
+  ##
+  ## Returns true if the line is complete, or false if the whole buffer was
+  ## appended and more data is needed.
+  ##
+  ## Raises:
+  ##   LineTooLongError: If the line exceeds `maxLength` bytes without its
+  ##                     line ending (0 = no limit)
+  if buffer.len == 0:
+    return false
+  var count = buffer.len
+  let newline = buffer.data.find('\n', buffer.start, buffer.stop - 1)
+  result = newline >= 0
+  if result:
+    count = newline - buffer.start + 1
+  let offset = line.len
+  line.setLen(offset + count)
+  copyMem(addr line[offset], addr buffer.data[buffer.start], count)
+  buffer.consume(count)
+
+  # Leave room for the CR of a line ending split across reads
+  if not result and maxLength > 0 and line.len > maxLength + 1:
+    raise newException(LineTooLongError, "Line longer than " & $maxLength & " bytes")
+
+proc finishLine*(line: var string; maxLength: int) =
+  ## Removes the trailing CR LF of a line read with takeLine()
+  ##
+  ## Raises:
+  ##   LineTooLongError: If what remains is longer than `maxLength`
+  ##                     (0 = no limit)
+  if line.len > 0 and line[^1] == '\n':
+    line.setLen(line.len - 1)
+    if line.len > 0 and line[^1] == '\r':
+      line.setLen(line.len - 1)
+  if maxLength > 0 and line.len > maxLength:
+    raise newException(LineTooLongError, "Line longer than " & $maxLength & " bytes")
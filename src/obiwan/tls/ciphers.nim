@@ -0,0 +1,93 @@
+## TLS 1.3 cipher suites and the order they are offered in
+##
+## ChaCha20-Poly1305 is fast in software everywhere, AES-GCM is several times
+## faster than it on CPUs with AES instructions (AES-NI on x86-64, the ARMv8
+## crypto extensions on arm64) and slower without them. The default order
+## therefore depends on the CPU the process runs on. Only suites compiled
+## into mbedTLS are offered: the minimal build profile has ChaCha20 only, so
+## small builds keep using it whatever the order says.
+
+import strutils
+import ./mbedtls as mbedtls
+import ./runtime
+
+type
+  CipherSuite* = enum
+    ## TLS 1.3 cipher suites ObiWAN can offer, by their config names
+    csAes128Gcm = "aes128-gcm"        ## TLS_AES_128_GCM_SHA256
+    csAes256Gcm = "aes256-gcm"        ## TLS_AES_256_GCM_SHA384
+    csChaCha20 = "chacha20-poly1305"  ## TLS_CHACHA20_POLY1305_SHA256
+
+proc detectHardwareAes(): bool =
+  when defined(linux) and (defined(amd64) or defined(arm64)):
+    # "flags" on x86, "Features" on arm64, both list the "aes" extension
+    try:
+      for line in lines("/proc/cpuinfo"):
+        if line.startsWith("flags") or line.startsWith("Features"):
+          return "aes" in line.split(':', 1)[^1].splitWhitespace()
+    except IOError:
+      discard
+    false
+  elif defined(macosx) and defined(arm64):
+    true # Every Apple silicon CPU has the crypto extensions
+  else:
+    false
+
+let hardwareAes = detectHardwareAes()
+
+proc hasHardwareAes*(): bool {.inline.} =
+  ## Whether the CPU has AES instructions, which make AES-GCM faster than
+  ## ChaCha20-Poly1305
+  hardwareAes
+
+proc id*(suite: CipherSuite): cint =
+  ## IANA identifier of a suite, as mbedTLS expects it
+  case suite
+  of csAes128Gcm: mbedtls.MBEDTLS_TLS_AES_128_GCM_SHA256
+  of csAes256Gcm: mbedtls.MBEDTLS_TLS_AES_256_GCM_SHA384
+  of csChaCha20: mbedtls.MBEDTLS_TLS_CHACHA20_POLY1305_SHA256
+
+proc isAvailable*(suite: CipherSuite): bool =
+  ## Whether the mbedTLS build supports a suite
+  mbedtls.mbedtls_ssl_ciphersuite_from_id(suite.id) != nil
+
+proc defaultCipherSuites*(): seq[CipherSuite] =
+  ## The order used when none is configured: AES-GCM first on CPUs with AES
+  ## instructions, ChaCha20-Poly1305 first everywhere else
+  if hasHardwareAes():
+    @[csAes128Gcm, csAes256Gcm, csChaCha20]
+  else:
+    @[csChaCha20, csAes128Gcm, csAes256Gcm]
+
+proc parseCipherSuites*(spec: string): seq[CipherSuite] =
+  ## Parses a comma separated list of suite names, most preferred first.
+  ##
+  ## Parameters:
+  ##   spec: Names such as "aes128-gcm, chacha20-poly1305", or "auto" or ""
+  ##         for defaultCipherSuites()
+  ##
+  ## Returns:
+  ##   The suites in order of preference
+  ##
+  ## Raises:
+  ##   ValueError: If a name isn't a known suite
+  if spec.strip() in ["", "auto"]:
+    return defaultCipherSuites()
+  for name in spec.split(','):
+    let suite = parseEnum[CipherSuite](name.strip().toLowerAscii())
+    if suite notin result:
+      result.add(suite)
+
+proc suiteList*(suites: openArray[CipherSuite]): seq[cint] =
+  ## Builds the zero-terminated identifier list mbedtls_ssl_conf_ciphersuites
+  ## takes, leaving out suites the build doesn't support.
+  ##
+  ## Raises:
+  ##   MbedtlsError: If none of the suites is supported
+  for suite in suites:
+    if suite.isAvailable:
+      result.add(suite.id)
+  if result.len == 0:
+    raise newException(MbedtlsError, "None of the cipher suites " & $(@suites) &
+                       " is supported by this mbedTLS build")
+  result.add(0)
@@ -0,0 +1,246 @@
+## Kernel TLS (kTLS) transmit offload for Linux
+##
+## mbedTLS performs the handshake and sends everything up to the response
+## header. After that, the server's application traffic keys can be handed
+## to the kernel (TCP_ULP "tls", then SOL_TLS / TLS_TX), which encrypts
+## whatever is written to the socket from then on. Static files are then sent
+## with sendfile() straight from the page cache, without being copied into
+## userspace and encrypted there. Receiving stays with mbedTLS.
+##
+## Any step can fail: the kernel may lack the tls module or the negotiated
+## cipher suite, and other platforms have no kTLS at all. enableKtlsTx()
+## returns false then, and the connection carries on with mbedTLS.
+
+import posix
+import ./mbedtls as mbedtls
+import ../debug
+
+const
+  MaxSecretSize = 48 # SHA-384, the largest TLS 1.3 hash
+
+type
+  KtlsKeys* = object
+    ## Server application traffic secret, exported by mbedTLS during the
+    ## handshake and erased once it has been handed to the kernel
+    secret: array[MaxSecretSize, byte]
+    len: int
+
+when defined(linux):
+  const
+    SOL_TLS = 282
+    TLS_TX = 1
+    TCP_ULP = 31
+    TLS_SET_RECORD_TYPE = 1
+    TLS_1_3_VERSION = 0x0304'u16
+    TLS_CIPHER_AES_GCM_128 = 51'u16
+    TLS_CIPHER_AES_GCM_256 = 52'u16
+    TLS_CIPHER_CHACHA20_POLY1305 = 54'u16
+    AlertRecord = 21'u8
+
+  type
+    # The tls12_crypto_info_* structs of <linux/tls.h>, also used for TLS 1.3
+    CryptoInfo = object
+      version: uint16
+      cipherType: uint16
+
+    AesGcm128Info = object
+      info: CryptoInfo
+      iv: array[8, byte]
+      key: array[16, byte]
+      salt: array[4, byte]
+      recSeq: array[8, byte]
+
+    AesGcm256Info = object
+      info: CryptoInfo
+      iv: array[8, byte]
+      key: array[32, byte]
+      salt: array[4, byte]
+      recSeq: array[8, byte]
+
+    ChaCha20Poly1305Info = object
+      info: CryptoInfo
+      iv: array[12, byte]
+      key: array[32, byte]
+      recSeq: array[8, byte]
+
+  proc c_sendfile(outFd, inFd: cint; offset: ptr Off; count: csize_t): int {.
+      importc: "sendfile", header: "<sys/sendfile.h>".}
+
+proc exportKeys(keys: pointer; kind: cint; secret: pointer; secretLen: csize_t;
+                clientRandom, serverRandom: pointer; prf: cint) {.cdecl.} =
+  if kind == mbedtls.MBEDTLS_SSL_KEY_EXPORT_TLS1_3_SERVER_APPLICATION_TRAFFIC_SECRET and
+      secretLen.int <= MaxSecretSize:
+    let keys = cast[ptr KtlsKeys](keys)
+    copyMem(addr keys.secret[0], secret, secretLen)
+    keys.len = secretLen.int
+
+proc captureKeys*(ssl: ptr mbedtls.mbedtls_ssl_context; keys: ptr KtlsKeys) =
+  ## Has mbedTLS store the server's application traffic secret in `keys`
+  ## during the handshake of `ssl`. `keys` must stay where it is until then.
+  when defined(linux):
+    mbedtls.mbedtls_ssl_set_export_keys_cb(ssl, exportKeys, keys)
+
+proc hasKeys*(keys: KtlsKeys): bool {.inline.} =
+  ## Whether a secret was captured and not used yet
+  keys.len > 0
+
+proc wipe(data: pointer; size: int) {.inline.} =
+  ## Erases key material in a way the compiler can't optimize away, unlike
+  ## zeroMem() right before the memory goes out of scope
+  mbedtls.mbedtls_platform_zeroize(data, size.csize_t)
+
+proc wipe*(keys: var KtlsKeys) =
+  ## Erases a captured secret, for connections that never hand it to the
+  ## kernel
+  wipe(addr keys, sizeof(keys))
+
+proc expandLabel(md: pointer; secret: openArray[byte]; label: string;
+                 output: var openArray[byte]): bool =
+  ## HKDF-Expand-Label of RFC 8446 with an empty context
+  let fullLabel = "tls13 " & label
+  var info = @[byte(output.len shr 8), byte(output.len and 0xff), byte(fullLabel.len)]
+  for c in fullLabel:
+    info.add(byte(c))
+  info.add(0)
+  mbedtls.mbedtls_hkdf_expand(md, unsafeAddr secret[0], secret.len.csize_t,
+                              addr info[0], info.len.csize_t,
+                              addr output[0], output.len.csize_t) == 0
+
+proc nextSequence(ssl: ptr mbedtls.mbedtls_ssl_context;
+                  sequence: var array[8, byte]): bool =
+  ## Copies the sequence number of the next record mbedTLS would send.
+  ## Returns false if output is still buffered in mbedTLS.
+  var pending: csize_t
+  {.emit: """
+  memcpy(`sequence`, `ssl`->MBEDTLS_PRIVATE(cur_out_ctr), 8);
+  `pending` = `ssl`->MBEDTLS_PRIVATE(out_left);
+  """.}
+  pending == 0
+
+proc enableKtlsTx*(fd: cint; ssl: ptr mbedtls.mbedtls_ssl_context;
+                   keys: var KtlsKeys): bool =
+  ## Moves record encryption of the sending side of a connection from
+  ## mbedTLS to the kernel.
+  ##
+  ## mbedTLS must not send anything on `ssl` afterwards: plain writes to
+  ## `fd` are encrypted by the kernel, which continues the record sequence
+  ## where mbedTLS stopped. The secret in `keys` is erased either way.
+  ##
+  ## Parameters:
+  ##   fd: The connection's socket
+  ##   ssl: Its mbedTLS context, after the handshake
+  ##   keys: The secret captured with captureKeys()
+  ##
+  ## Returns:
+  ##   true if the kernel now encrypts what is sent on `fd`, false if the
+  ##   platform, kernel or cipher suite doesn't support it
+  defer: keys.wipe()
+  when not defined(linux):
+    return false
+  else:
+    if not keys.hasKeys:
+      return false
+
+    let suite = mbedtls.mbedtls_ssl_get_ciphersuite_id_from_ssl(ssl)
+    var keyLen = 32
+    var md = mbedtls.MBEDTLS_MD_SHA256
+    if suite == mbedtls.MBEDTLS_TLS_AES_128_GCM_SHA256:
+      keyLen = 16
+    elif suite == mbedtls.MBEDTLS_TLS_AES_256_GCM_SHA384:
+      md = mbedtls.MBEDTLS_MD_SHA384
+    elif suite != mbedtls.MBEDTLS_TLS_CHACHA20_POLY1305_SHA256:
+      debug("kTLS: unsupported cipher suite " & $suite)
+      return false
+
+    var sequence: array[8, byte]
+    if not nextSequence(ssl, sequence):
+      debug("kTLS: mbedTLS still has output pending")
+      return false
+
+    var key: array[32, byte]
+    var iv: array[12, byte]
+    defer:
+      wipe(addr key, sizeof(key))
+      wipe(addr iv, sizeof(iv))
+    let mdInfo = mbedtls.mbedtls_md_info_from_type(md)
+    if mdInfo.isNil or
+        not expandLabel(mdInfo, keys.secret.toOpenArray(0, keys.len - 1), "key",
+                        key.toOpenArray(0, keyLen - 1)) or
+        not expandLabel(mdInfo, keys.secret.toOpenArray(0, keys.len - 1), "iv", iv):
+      debug("kTLS: deriving the traffic keys failed")
+      return false
+
+    var ulp = "tls"
+    if setsockopt(SocketHandle(fd), posix.IPPROTO_TCP, TCP_ULP, addr ulp[0],
+                  ulp.len.SockLen) != 0:
+      debug("kTLS: TCP_ULP unavailable: " & $strerror(errno))
+      return false
+
+    # For AES-GCM the kernel takes the first 4 IV bytes as the salt
+    var ret: cint
+    if suite == mbedtls.MBEDTLS_TLS_AES_128_GCM_SHA256:
+      var info = AesGcm128Info(info: CryptoInfo(version: TLS_1_3_VERSION,
+                                                cipherType: TLS_CIPHER_AES_GCM_128))
+      copyMem(addr info.salt[0], addr iv[0], 4)
+      copyMem(addr info.iv[0], addr iv[4], 8)
+      copyMem(addr info.key[0], addr key[0], 16)
+      info.recSeq = sequence
+      ret = setsockopt(SocketHandle(fd), SOL_TLS, TLS_TX, addr info, sizeof(info).SockLen)
+      wipe(addr info, sizeof(info))
+    elif suite == mbedtls.MBEDTLS_TLS_AES_256_GCM_SHA384:
+      var info = AesGcm256Info(info: CryptoInfo(version: TLS_1_3_VERSION,
+                                                cipherType: TLS_CIPHER_AES_GCM_256))
+      copyMem(addr info.salt[0], addr iv[0], 4)
+      copyMem(addr info.iv[0], addr iv[4], 8)
+      info.key = key
+      info.recSeq = sequence
+      ret = setsockopt(SocketHandle(fd), SOL_TLS, TLS_TX, addr info, sizeof(info).SockLen)
+      wipe(addr info, sizeof(info))
+    else:
+      var info = ChaCha20Poly1305Info(info: CryptoInfo(version: TLS_1_3_VERSION,
+                                                       cipherType: TLS_CIPHER_CHACHA20_POLY1305))
+      info.iv = iv
+      info.key = key
+      info.recSeq = sequence
+      ret = setsockopt(SocketHandle(fd), SOL_TLS, TLS_TX, addr info, sizeof(info).SockLen)
+      wipe(addr info, sizeof(info))
+
+    # Without TX keys the tls ULP passes data through unchanged, so the
+    # connection can go on with mbedTLS
+    if ret != 0:
+      debug("kTLS: TLS_TX rejected: " & $strerror(errno))
+      return false
+    debug("kTLS: transmit offload enabled on fd " & $fd)
+    return true
+
+proc sendCloseNotify*(fd: cint) =
+  ## Sends a close_notify alert on a connection whose sending side is
+  ## encrypted by the kernel
+  when defined(linux):
+    var alert = [1'u8, 0'u8] # Level warning, close_notify
+    var control: array[32, byte] # Room for CMSG_SPACE(1)
+    var iov = IOVec(iov_base: addr alert[0], iov_len: typeof(IOVec().iov_len)(alert.len))
+    var msg: Tmsghdr
+    msg.msg_iov = addr iov
+    msg.msg_iovlen = typeof(msg.msg_iovlen)(1)
+    msg.msg_control = addr control[0]
+    msg.msg_controllen = typeof(msg.msg_controllen)(CMSG_SPACE(1))
+    let cmsg = CMSG_FIRSTHDR(addr msg)
+    cmsg.cmsg_level = SOL_TLS
+    cmsg.cmsg_type = TLS_SET_RECORD_TYPE
+    cmsg.cmsg_len = typeof(cmsg.cmsg_len)(CMSG_LEN(1))
+    cast[ptr uint8](CMSG_DATA(cmsg))[] = AlertRecord
+    discard sendmsg(SocketHandle(fd), addr msg, MSG_NOSIGNAL)
+
+proc sendFileChunk*(fd, fileFd: cint; offset: var int64; count: int): int =
+  ## Sends up to `count` bytes of `fileFd` from `offset` with sendfile(),
+  ## advancing `offset`. Returns the number of bytes sent, or -1 with errno
+  ## set. Only meaningful once enableKtlsTx() succeeded.
+  when defined(linux):
+    var off = Off(offset)
+    result = c_sendfile(fd, fileFd, addr off, count.csize_t)
+    if result > 0:
+      offset = off.int64
+  else:
+    errno = ENOSYS
+    result = -1
@@ -8,6 +8,7 @@ when defined(useSystemMbedTLS):
   {.pragma: mbedtlsRandom, importc, header: "<mbedtls/ctr_drbg.h>".}
   {.pragma: mbedtlsCerts, importc, header: "<mbedtls/x509_crt.h>".}
   {.pragma: mbedtlsPsa, importc, header: "<psa/crypto.h>".}
+  {.pragma: mbedtlsTicket, importc, header: "<mbedtls/ssl_ticket.h>".}
 else:
   # When using vendored mbedTLS, use our local include paths
   {.pragma: mbedtls, importc, header: "<mbedtls/ssl.h>".}
@@ -16,6 +17,7 @@ else:
   {.pragma: mbedtlsRandom, importc, header: "<mbedtls/ctr_drbg.h>".}
   {.pragma: mbedtlsCerts, importc, header: "<mbedtls/x509_crt.h>".}
   {.pragma: mbedtlsPsa, importc, header: "<psa/crypto.h>".}
+  {.pragma: mbedtlsTicket, importc, header: "<mbedtls/ssl_ticket.h>".}
 
 # Basic types
 type
@@ -23,10 +25,18 @@ type
   mbedtls_ssl_config* {.mbedtls.} = object
   mbedtls_entropy_context* {.mbedtlsCrypto.} = object
   mbedtls_ctr_drbg_context* {.mbedtlsRandom.} = object
+  mbedtls_x509_buf* {.mbedtlsCerts.} = object
+    len*: csize_t  # Length of the data
+    p*: ptr uint8  # The data, DER encoded
+  mbedtls_x509_name* {.mbedtlsCerts.} = object
   mbedtls_x509_crt* {.mbedtlsCerts.} = object
+    raw*: mbedtls_x509_buf       # The whole certificate, DER encoded
+    subject*: mbedtls_x509_name  # Parsed subject name, for mbedtls_x509_dn_gets()
   mbedtls_pk_context* {.mbedtls.} = object
   mbedtls_net_context* {.mbedtlsNetSockets.} = object
     fd*: cint
+  mbedtls_ssl_session* {.mbedtls.} = object
+  mbedtls_ssl_ticket_context* {.mbedtlsTicket.} = object
 
 # Constants
 # These are defined in the mbedTLS headers
@@ -64,11 +74,39 @@ var
       header: "<mbedtls/net_sockets.h>".}: cint
   MBEDTLS_ERR_X509_CERT_VERIFY_FAILED* {.mbedtlsConstants,
       header: "<mbedtls/x509_crt.h>".}: cint
+  MBEDTLS_ERR_SSL_CONN_EOF* {.mbedtlsConstants,
+      header: "<mbedtls/ssl.h>".}: cint
+  MBEDTLS_ERR_SSL_TIMEOUT* {.mbedtlsConstants,
+      header: "<mbedtls/ssl.h>".}: cint
+  MBEDTLS_ERR_SSL_HANDSHAKE_FAILURE* {.mbedtlsConstants,
+      header: "<mbedtls/ssl.h>".}: cint
+  MBEDTLS_ERR_SSL_BAD_PROTOCOL_VERSION* {.mbedtlsConstants,
+      header: "<mbedtls/ssl.h>".}: cint
+  MBEDTLS_ERR_SSL_FATAL_ALERT_MESSAGE* {.mbedtlsConstants,
+      header: "<mbedtls/ssl.h>".}: cint
+  MBEDTLS_ERR_SSL_DECODE_ERROR* {.mbedtlsConstants,
+      header: "<mbedtls/ssl.h>".}: cint
+  MBEDTLS_ERR_SSL_BAD_CERTIFICATE* {.mbedtlsConstants,
+      header: "<mbedtls/ssl.h>".}: cint
+  MBEDTLS_ERR_NET_CONN_RESET* {.mbedtlsConstants,
+      header: "<mbedtls/net_sockets.h>".}: cint
   MBEDTLS_NET_PROTO_TCP* {.mbedtlsConstants,
       header: "<mbedtls/net_sockets.h>".}: cint
   MBEDTLS_X509_BADCERT_NOT_TRUSTED* {.mbedtlsConstants,
       header: "<mbedtls/x509_crt.h>".}: cuint
 
+  # Session resumption
+  MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET* {.mbedtlsConstants,
+      header: "<mbedtls/ssl.h>".}: cint
+  MBEDTLS_SSL_SESSION_TICKETS_ENABLED* {.mbedtlsConstants,
+      header: "<mbedtls/ssl.h>".}: cint
+  MBEDTLS_SSL_TLS1_3_SIGNAL_NEW_SESSION_TICKETS_ENABLED* {.mbedtlsConstants,
+      header: "<mbedtls/ssl.h>".}: cint
+  MBEDTLS_SSL_TLS1_3_KEY_EXCHANGE_MODE_ALL* {.mbedtlsConstants,
+      header: "<mbedtls/ssl.h>".}: cint
+  MBEDTLS_CIPHER_CHACHA20_POLY1305* {.mbedtlsConstants,
+      header: "<mbedtls/cipher.h>".}: cint
+
   # TLS 1.3 cipher suite constants - manually defined with their standard values
   # These are defined directly instead of imported because they might not be available in all builds
   MBEDTLS_TLS_AES_128_GCM_SHA256* = 0x1301.cint
@@ -76,6 +114,7 @@ var
   MBEDTLS_TLS_CHACHA20_POLY1305_SHA256* = 0x1303.cint
 
   # Max fragment length constants
+  MBEDTLS_SSL_MAX_FRAG_LEN_NONE* = 0.cint
   MBEDTLS_SSL_MAX_FRAG_LEN_512* = 1.cint
   MBEDTLS_SSL_MAX_FRAG_LEN_1024* = 2.cint
   MBEDTLS_SSL_MAX_FRAG_LEN_2048* = 3.cint
@@ -92,10 +131,12 @@ proc mbedtls_ssl_conf_authmode*(conf: ptr mbedtls_ssl_config,
     authmode: cint) {.mbedtls.}
 proc mbedtls_ssl_conf_ciphersuites*(conf: ptr mbedtls_ssl_config,
     ciphersuites: ptr cint) {.mbedtls.}
+proc mbedtls_ssl_ciphersuite_from_id*(ciphersuite_id: cint): pointer {.mbedtls.}
 proc mbedtls_ssl_conf_max_frag_len*(conf: ptr mbedtls_ssl_config,
     fragment_length: cint): cint {.mbedtls.}
 proc mbedtls_ssl_setup*(ssl: ptr mbedtls_ssl_context,
     conf: ptr mbedtls_ssl_config): cint {.mbedtls.}
+proc mbedtls_ssl_session_reset*(ssl: ptr mbedtls_ssl_context): cint {.mbedtls.}
 proc mbedtls_ssl_set_hostname*(ssl: ptr mbedtls_ssl_context,
     hostname: cstring): cint {.mbedtls.}
 proc mbedtls_ssl_set_bio*(ssl: ptr mbedtls_ssl_context, ctx: pointer,
@@ -105,18 +146,74 @@ proc mbedtls_ssl_read*(ssl: ptr mbedtls_ssl_context, buf: pointer,
     len: cuint): cint {.mbedtls.}
 proc mbedtls_ssl_write*(ssl: ptr mbedtls_ssl_context, buf: pointer,
     len: cuint): cint {.mbedtls.}
+proc mbedtls_ssl_get_max_out_record_payload*(ssl: ptr mbedtls_ssl_context): cint {.mbedtls.}
 proc mbedtls_ssl_close_notify*(ssl: ptr mbedtls_ssl_context): cint {.mbedtls.}
 proc mbedtls_ssl_free*(ssl: ptr mbedtls_ssl_context) {.mbedtls.}
 proc mbedtls_ssl_get_verify_result*(ssl: ptr mbedtls_ssl_context): cuint {.mbedtls.}
 proc mbedtls_ssl_get_peer_cert*(ssl: ptr mbedtls_ssl_context): ptr mbedtls_x509_crt {.mbedtls.}
 proc mbedtls_ssl_conf_verify*(conf: ptr mbedtls_ssl_config, f_vrfy: pointer,
     p_vrfy: pointer) {.mbedtls.}
+proc mbedtls_ssl_get_ciphersuite_id_from_ssl*(ssl: ptr mbedtls_ssl_context): cint {.mbedtls.}
+
+# Key export, used to hand the traffic keys to kernel TLS
+var MBEDTLS_SSL_KEY_EXPORT_TLS1_3_SERVER_APPLICATION_TRAFFIC_SECRET* {.mbedtlsConstants,
+    header: "<mbedtls/ssl.h>".}: cint
+proc mbedtls_ssl_set_export_keys_cb*(ssl: ptr mbedtls_ssl_context,
+    f_export_keys: pointer, p_export_keys: pointer) {.mbedtls.}
+
+# HKDF, for deriving TLS 1.3 record keys from an exported traffic secret
+var
+  MBEDTLS_MD_SHA256* {.mbedtlsConstants, header: "<mbedtls/md.h>".}: cint
+  MBEDTLS_MD_SHA384* {.mbedtlsConstants, header: "<mbedtls/md.h>".}: cint
+proc mbedtls_md_info_from_type*(md_type: cint): pointer {.importc,
+    header: "<mbedtls/md.h>".}
+proc mbedtls_hkdf_expand*(md: pointer, prk: pointer, prk_len: csize_t,
+    info: pointer, info_len: csize_t, okm: pointer,
+    okm_len: csize_t): cint {.importc, header: "<mbedtls/hkdf.h>".}
+proc mbedtls_platform_zeroize*(buf: pointer, len: csize_t) {.importc,
+    header: "<mbedtls/platform_util.h>".}
+
+# Session resumption functions
+proc mbedtls_ssl_session_init*(session: ptr mbedtls_ssl_session) {.mbedtls.}
+proc mbedtls_ssl_session_free*(session: ptr mbedtls_ssl_session) {.mbedtls.}
+proc mbedtls_ssl_get_session*(ssl: ptr mbedtls_ssl_context,
+    session: ptr mbedtls_ssl_session): cint {.mbedtls.}
+proc mbedtls_ssl_set_session*(ssl: ptr mbedtls_ssl_context,
+    session: ptr mbedtls_ssl_session): cint {.mbedtls.}
+proc mbedtls_ssl_conf_session_tickets*(conf: ptr mbedtls_ssl_config,
+    use_tickets: cint) {.mbedtls.}
+proc mbedtls_ssl_conf_tls13_enable_signal_new_session_tickets*(
+    conf: ptr mbedtls_ssl_config, signal_new_session_tickets: cint) {.mbedtls.}
+proc mbedtls_ssl_conf_new_session_tickets*(conf: ptr mbedtls_ssl_config,
+    num_tickets: uint16) {.mbedtls.}
+proc mbedtls_ssl_conf_tls13_key_exchange_modes*(conf: ptr mbedtls_ssl_config,
+    kex_modes: cint) {.mbedtls.}
+proc mbedtls_ssl_conf_session_tickets_cb*(conf: ptr mbedtls_ssl_config,
+    f_ticket_write: pointer, f_ticket_parse: pointer,
+    p_ticket: pointer) {.mbedtls.}
+
+# Session ticket key functions
+proc mbedtls_ssl_ticket_init*(ctx: ptr mbedtls_ssl_ticket_context) {.mbedtlsTicket.}
+proc mbedtls_ssl_ticket_setup*(ctx: ptr mbedtls_ssl_ticket_context,
+    f_rng: pointer, p_rng: pointer, cipher: cint,
+    lifetime: uint32): cint {.mbedtlsTicket.}
+proc mbedtls_ssl_ticket_rotate*(ctx: ptr mbedtls_ssl_ticket_context,
+    name: pointer, nlength: csize_t, k: pointer, klength: csize_t,
+    lifetime: uint32): cint {.mbedtlsTicket.}
+proc mbedtls_ssl_ticket_write*(p_ticket: pointer, session: ptr mbedtls_ssl_session,
+    start: pointer, `end`: pointer, tlen: ptr csize_t,
+    lifetime: ptr uint32): cint {.mbedtlsTicket, cdecl.}
+proc mbedtls_ssl_ticket_parse*(p_ticket: pointer, session: ptr mbedtls_ssl_session,
+    buf: pointer, len: csize_t): cint {.mbedtlsTicket, cdecl.}
+proc mbedtls_ssl_ticket_free*(ctx: ptr mbedtls_ssl_ticket_context) {.mbedtlsTicket.}
 
 # Certificate functions
 proc mbedtls_x509_crt_init*(crt: ptr mbedtls_x509_crt) {.mbedtlsCerts.}
 proc mbedtls_x509_crt_parse_file*(crt: ptr mbedtls_x509_crt,
     path: cstring): cint {.mbedtlsCerts.}
+proc mbedtls_x509_crt_free*(crt: ptr mbedtls_x509_crt) {.mbedtlsCerts.}
 proc mbedtls_pk_init*(ctx: ptr mbedtls_pk_context) {.mbedtls.}
+proc mbedtls_pk_free*(ctx: ptr mbedtls_pk_context) {.mbedtls.}
 # Import the platform-specific version of mbedtls_pk_parse_keyfile
 proc mbedtls_pk_parse_keyfile*(ctx: ptr mbedtls_pk_context, path: cstring, password: cstring,
                               f_rng: pointer,
@@ -132,6 +229,8 @@ proc mbedtls_ctr_drbg_seed*(ctx: ptr mbedtls_ctr_drbg_context,
     len: csize_t): cint {.mbedtlsRandom.}
 proc mbedtls_ctr_drbg_random*(p_rng: pointer, output: pointer,
     output_len: csize_t): cint {.mbedtlsRandom, cdecl.}
+proc mbedtls_ctr_drbg_reseed*(ctx: ptr mbedtls_ctr_drbg_context,
+    additional: pointer, len: csize_t): cint {.mbedtlsRandom.}
 proc mbedtls_entropy_func*(data: pointer, output: pointer,
     len: csize_t): cint {.mbedtlsCrypto, cdecl.}
 
@@ -160,9 +259,28 @@ proc mbedtls_sha256*(input: pointer, ilen: csize_t, output: pointer,
 
 # PSA Crypto functions (required for TLS 1.3)
 proc psa_crypto_init*(): cint {.mbedtlsPsa.}
+proc mbedtls_psa_crypto_free*() {.mbedtlsPsa.}
 
 # X509 utility functions
 proc mbedtls_x509_dn_gets*(buf: cstring, size: csize_t,
     dn: pointer): cint {.importc, header: "<mbedtls/x509_crt.h>".}
 proc mbedtls_x509_crt_info*(buf: cstring, size: csize_t, prefix: cstring,
     crt: ptr mbedtls_x509_crt): cint {.importc, header: "<mbedtls/x509_crt.h>".}
+
+# Build configuration
+{.emit: """/*INCLUDESECTION*/
+#include <mbedtls/build_info.h>
+""".}
+
+proc threadingSupported*(): bool =
+  ## Whether mbedTLS was built with MBEDTLS_THREADING_C, which one config,
+  ## identity and ticket state shared by several threads needs. The default
+  ## mbedTLS configuration leaves it out; the OBIWAN_TLS_PROFILE builds
+  ## enable it (see mbedtls_config.h).
+  var supported: cint = 0
+  {.emit: """
+#if defined(MBEDTLS_THREADING_C)
+  `supported` = 1;
+#endif
+  """.}
+  supported != 0
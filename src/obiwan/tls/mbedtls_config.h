@@ -1,6 +1,10 @@
 /**
  * Minimal mbedTLS configuration for ObiWAN
  * Focused on TLS 1.3 with ChaCha20-Poly1305
+ *
+ * Defining OBIWAN_TLS_HWAES (OBIWAN_TLS_PROFILE=hwaes) adds the TLS 1.3
+ * AES-GCM suites, accelerated with AES-NI on x86-64 and the ARMv8 crypto
+ * extensions on arm64.
  * 
  * This configuration optimizes for minimum binary size while maintaining
  * security and functionality for the Gemini protocol.
@@ -18,6 +22,11 @@
 #define MBEDTLS_PLATFORM_C
 #define MBEDTLS_FS_IO
 
+/* Thread safety: the synchronous server handles connections on a pool of
+ * threads that share one config and CTR_DRBG */
+#define MBEDTLS_THREADING_C
+#define MBEDTLS_THREADING_PTHREAD
+
 /* PSA API Support - Required for TLS 1.3 */
 #define MBEDTLS_PSA_CRYPTO_C
 #define MBEDTLS_USE_PSA_CRYPTO
@@ -54,11 +63,32 @@
 #define MBEDTLS_SSL_TLS1_3_COMPATIBILITY_MODE
 #define MBEDTLS_HKDF_C                  /* Required for TLS 1.3 key derivation */
 
+/* Session resumption with TLS 1.3 session tickets */
+#define MBEDTLS_SSL_SESSION_TICKETS
+#define MBEDTLS_SSL_TICKET_C                                  /* Server-side ticket encryption */
+#define MBEDTLS_SSL_TLS1_3_KEY_EXCHANGE_MODE_PSK_ENABLED
+#define MBEDTLS_SSL_TLS1_3_KEY_EXCHANGE_MODE_PSK_EPHEMERAL_ENABLED
+
 /* ChaCha20-Poly1305 for TLS 1.3 */
 #define MBEDTLS_CHACHA20_C
 #define MBEDTLS_POLY1305_C
 #define MBEDTLS_CHACHAPOLY_C
 
+/* Hardware AES profile: AES-GCM, several times faster than ChaCha20 where
+ * the CPU has AES instructions. mbedTLS falls back to software AES at
+ * runtime on CPUs without them */
+#if defined(OBIWAN_TLS_HWAES)
+#define MBEDTLS_GCM_C
+#if defined(__x86_64__) || defined(_M_X64)
+#define MBEDTLS_AESNI_C
+#endif
+#if defined(__aarch64__) || defined(_M_ARM64)
+#define MBEDTLS_AESCE_C
+#endif
+#define MBEDTLS_SHA512_C                /* SHA-384 for TLS_AES_256_GCM_SHA384 */
+#define MBEDTLS_SHA384_C
+#endif
+
 /* ECC Support - only what's needed */
 #define MBEDTLS_ECP_C
 #define MBEDTLS_ECP_DP_SECP256R1_ENABLED
@@ -73,6 +103,7 @@
 
 /* PSA Crypto Requirements for TLS 1.3 */
 #define PSA_WANT_ALG_CHACHA20_POLY1305
+#define PSA_WANT_KEY_TYPE_CHACHA20     /* Required for session ticket keys */
 #define PSA_WANT_ALG_ECDH
 #define PSA_WANT_ALG_ECDSA
 #define PSA_WANT_ALG_HKDF
@@ -83,19 +114,41 @@
 #define PSA_WANT_ECC_MONTGOMERY_255
 #define PSA_WANT_KEY_TYPE_AES          /* Required for random generation */
 #define PSA_WANT_ALG_ECB_NO_PADDING    /* Required for random generation */
+#if defined(OBIWAN_TLS_HWAES)
+#define PSA_WANT_ALG_GCM
+#define PSA_WANT_ALG_SHA_384
+#endif
 
 /* Size Optimizations */
 #define MBEDTLS_ECP_WINDOW_SIZE 2
 #define MBEDTLS_ECP_FIXED_POINT_OPTIM 0
 #define MBEDTLS_MPI_WINDOW_SIZE 1
 #define MBEDTLS_MPI_MAX_SIZE 64        /* 512 bits, sufficient for 256-bit curves */
-#define MBEDTLS_SSL_MAX_CONTENT_LEN 2048  /* Optimized for Gemini protocol's small message size */
+/* Full-sized records, as in mbedTLS's default configuration that builds
+ * without a profile use. The size records are actually sent with is chosen
+ * at runtime (see record_size) */
+#define MBEDTLS_SSL_MAX_CONTENT_LEN 16384
+
+/* Record buffers follow the record size a connection negotiated (see
+ * setRecordSize) once its handshake is done, instead of staying at 16KB as
+ * they do with the default configuration.
+ * The input buffer can't be made smaller at build time: peers that didn't
+ * negotiate a smaller size may send full 16KB records, and ObiWAN's own
+ * server does. Per-connection memory is documented in the README */
+#define MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH
 
-/* TLS 1.3 Ciphersuites - only ChaCha20-Poly1305 */
+/* TLS 1.3 Ciphersuites - ChaCha20-Poly1305, plus AES-GCM in the hwaes profile.
+ * The order offered at runtime is set by newContext (see ciphers.nim) */
 #define MBEDTLS_SSL_TLS1_3_CHACHA20_POLY1305_SHA256  /* Required for TLS 1.3 ChaCha20-Poly1305 */
-#define MBEDTLS_SSL_CIPHERSUITES MBEDTLS_TLS_CHACHA20_POLY1305_SHA256
+#if defined(OBIWAN_TLS_HWAES)
+#define MBEDTLS_SSL_CIPHERSUITES MBEDTLS_TLS1_3_AES_128_GCM_SHA256, \
+                                 MBEDTLS_TLS1_3_AES_256_GCM_SHA384, \
+                                 MBEDTLS_TLS1_3_CHACHA20_POLY1305_SHA256
+#else
+#define MBEDTLS_SSL_CIPHERSUITES MBEDTLS_TLS1_3_CHACHA20_POLY1305_SHA256
+#endif
 
-/* Include check_config.h to catch configuration errors */
-#include "check_config.h"
+/* check_config.h is included by mbedtls/build_info.h once the configuration
+ * has been adjusted, it must not be included from here */
 
 #endif /* MBEDTLS_CONFIG_H */
\ No newline at end of file
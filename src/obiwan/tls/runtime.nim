@@ -0,0 +1,187 @@
+## Crypto state shared by every TLS context of the process
+##
+## Creating a context used to initialize PSA crypto, gather entropy for a
+## DRBG of its own and parse its certificate and key again, which made short
+## lived clients cost milliseconds each. Instead:
+##
+## - PSA crypto is initialized once, by the first context, and stays so for
+##   the life of the process
+## - Random numbers come from a DRBG per thread, seeded the first time that
+##   thread needs one and reseeded when it finds itself in a forked worker,
+##   so neither threads nor processes ever share a random stream
+## - Certificates and keys are parsed once per file pair and shared
+##   read-only by every context using them, then freed with the last one
+
+import locks
+import os
+import posix
+import tables
+from std/times import toUnix, nanosecond
+import ./mbedtls as mbedtls
+import ../debug
+
+type
+  MbedtlsError* = object of CatchableError
+    code*: int  # mbedTLS error code, 0 if the error didn't come from mbedTLS
+
+  CryptoRef* = object
+    ## Proof that the crypto runtime is initialized, held by every context.
+    ## It is never torn down: parsed identities and ticket keys outlive the
+    ## contexts using them and keep their keys in PSA, and freeing it while
+    ## another thread creates a context would race with that context.
+    active: bool
+
+  IdentityObj* = object
+    ## A parsed certificate chain and its private key
+    cert*: mbedtls.mbedtls_x509_crt
+    key*: mbedtls.mbedtls_pk_context
+    cacheKey: string # Its entry in the identity cache
+    refs: int        # Live IdentityRefs, guarded by runtimeLock
+
+  Identity* = ptr IdentityObj
+    ## Contexts keep raw pointers to it in their config, an IdentityRef
+    ## keeps it alive meanwhile
+
+  IdentityRef* = object
+    ## Keeps an identity loaded with loadIdentity() alive. Not copyable; the
+    ## identity is freed, and leaves the cache, once no IdentityRef holds it.
+    identity*: Identity
+
+  ThreadRng = object
+    entropy: mbedtls.mbedtls_entropy_context
+    drbg: mbedtls.mbedtls_ctr_drbg_context
+    pid: Pid # Process the DRBG was seeded in, 0 before the first use
+
+var
+  runtimeLock: Lock
+  psaReady: bool # Guarded by runtimeLock
+  identities: Table[string, Identity] # Guarded by runtimeLock
+  rng {.threadvar.}: ThreadRng
+
+initLock(runtimeLock)
+
+proc cryptoError(ret: cint; msg: string): ref MbedtlsError =
+  var errorStr = newString(100)
+  mbedtls.mbedtls_strerror(ret, cast[cstring](addr errorStr[0]), 100)
+  result = newException(MbedtlsError, msg & ": " & $cstring(errorStr))
+  result.code = ret.int
+
+proc acquireCrypto*(): CryptoRef =
+  ## Makes sure PSA crypto is initialized, for the rest of the process.
+  ## Only the first call does any work.
+  ##
+  ## Raises:
+  ##   MbedtlsError: If PSA crypto cannot be initialized
+  withLock runtimeLock:
+    if not psaReady:
+      debug("Initializing PSA crypto subsystem for TLS 1.3")
+      let ret = mbedtls.psa_crypto_init()
+      if ret != 0:
+        raise cryptoError(ret, "Failed to initialize PSA crypto subsystem")
+      psaReady = true
+  result.active = true
+
+proc threadRandom*(context: pointer; output: pointer; len: csize_t): cint {.cdecl.} =
+  ## mbedTLS random callback drawing from the calling thread's DRBG.
+  ##
+  ## Use it with a nil context wherever mbedTLS takes an `f_rng`. The DRBG
+  ## is seeded on first use, and reseeded with fresh entropy after a fork so
+  ## workers don't repeat their parent's random stream.
+  let pid = getpid()
+  if rng.pid != pid:
+    var ret: cint
+    if rng.pid == 0:
+      mbedtls.mbedtls_entropy_init(addr rng.entropy)
+      mbedtls.mbedtls_ctr_drbg_init(addr rng.drbg)
+      ret = mbedtls.mbedtls_ctr_drbg_seed(addr rng.drbg, mbedtls.mbedtls_entropy_func,
+                                          addr rng.entropy, nil, 0)
+    else:
+      var personalization = pid
+      ret = mbedtls.mbedtls_ctr_drbg_reseed(addr rng.drbg, addr personalization,
+                                            sizeof(personalization).csize_t)
+    if ret != 0:
+      return ret
+    rng.pid = pid
+  mbedtls.mbedtls_ctr_drbg_random(addr rng.drbg, output, len)
+
+proc freeIdentity(identity: Identity) =
+  mbedtls.mbedtls_x509_crt_free(addr identity.cert)
+  mbedtls.mbedtls_pk_free(addr identity.key)
+  reset(identity.cacheKey)
+  freeShared(identity)
+
+proc `=destroy`(held: IdentityRef) =
+  let identity = held.identity
+  if identity.isNil:
+    return
+  {.cast(gcsafe).}:
+    withLock runtimeLock:
+      dec identity.refs
+      if identity.refs > 0:
+        return
+      debug("Freeing identity no context uses anymore")
+      identities.del(identity.cacheKey)
+  freeIdentity(identity)
+
+proc `=copy`(dest: var IdentityRef; src: IdentityRef) {.error.}
+
+proc identityKey(certFile, keyFile: string): string =
+  ## Cache key of a file pair, changing whenever one of the files does: a
+  ## renewal replacing the file (a new inode), or rewriting it in place,
+  ## which changes its size or nanosecond modification time
+  result = certFile & '\0' & keyFile
+  for path in [certFile, keyFile]:
+    try:
+      let info = getFileInfo(path)
+      result.add('\0' & $info.id.file & ':' & $info.size & ':' &
+                 $info.lastWriteTime.toUnix() & '.' & $info.lastWriteTime.nanosecond)
+    except OSError:
+      discard # Parsing reports the missing file
+
+proc loadIdentity*(certFile, keyFile: string): IdentityRef =
+  ## Returns the parsed certificate chain and key of a file pair.
+  ##
+  ## Each pair is parsed once, later calls with the same unchanged files
+  ## share the result while it is held. Identities are read-only once
+  ## loaded, so contexts on any thread can use them. Once the files change
+  ## the next call parses them again, and the old identity is freed when
+  ## the contexts still presenting it are.
+  ##
+  ## Parameters:
+  ##   certFile: Path to the certificate chain in PEM format
+  ##   keyFile: Path to its private key in PEM format
+  ##
+  ## Returns:
+  ##   A hold on the shared identity
+  ##
+  ## Raises:
+  ##   MbedtlsError: If either file cannot be parsed
+  let key = identityKey(certFile, keyFile)
+  {.cast(gcsafe).}:
+    withLock runtimeLock:
+      let cached = identities.getOrDefault(key)
+      if not cached.isNil:
+        inc cached.refs
+        return IdentityRef(identity: cached)
+
+      let identity = createShared(IdentityObj)
+      mbedtls.mbedtls_x509_crt_init(addr identity.cert)
+      mbedtls.mbedtls_pk_init(addr identity.key)
+      var ret = mbedtls.mbedtls_x509_crt_parse_file(addr identity.cert, certFile)
+      if ret != 0:
+        mbedtls.mbedtls_x509_crt_free(addr identity.cert)
+        freeShared(identity)
+        raise cryptoError(ret, "Failed to parse certificate file " & certFile)
+      ret = mbedtls.mbedtls_pk_parse_keyfile(addr identity.key, keyFile, nil,
+                                             threadRandom, nil)
+      if ret != 0:
+        mbedtls.mbedtls_x509_crt_free(addr identity.cert)
+        mbedtls.mbedtls_pk_free(addr identity.key)
+        freeShared(identity)
+        raise cryptoError(ret, "Failed to parse key file " & keyFile)
+
+      debug("Parsed identity " & certFile & " / " & keyFile)
+      identity.cacheKey = key
+      identity.refs = 1
+      identities[key] = identity
+      result = IdentityRef(identity: identity)
@@ -1,32 +1,70 @@
 import net
+import nativesockets
 import ./mbedtls as mbedtls
 import strutils
+import tables
 import posix
+import locks
+import std/monotimes
+import std/times
+import ./buffer
 import ../debug
+import ../dns
+import ./runtime
+import ./ciphers
+import ./ktls
+
+export runtime.MbedtlsError, runtime.Identity, runtime.IdentityRef, runtime.threadRandom
+export ciphers
+
+export buffer.LineTooLongError
 
 const
-  SyncBufferSize* = 4096  ## Default size for TLS read buffer (4KB)
+  SyncBufferSize* = ReadBufferSize  ## Size of the TLS read buffer (4KB)
+  MaxRecordSize* = 16384  ## Largest TLS record payload (MBEDTLS_SSL_MAX_CONTENT_LEN, the same in the default mbedTLS configuration and the build profiles)
+  MinRecordSize* = 512  ## Smallest record size that can be configured
+  AdaptiveRecordSize* = 1400  ## Records an adaptive connection starts with, about one TCP segment each
+  AdaptiveRampBytes* = 64 * 1024  ## Bytes an adaptive connection sends before switching to full records
+  TlsBufferSize* = MaxRecordSize + 512  ## One mbedTLS record buffer: a full record plus header and cipher expansion
+  SessionMemory* = 2 * TlsBufferSize + 4096  ## A connection's TLS state: input and output buffers, keys, peer certificate
+  DefaultSessionPoolSize* = 64  ## Reset sessions a context keeps for new connections (see releaseSession)
+  MaxSavedSessions* = 256  ## Resumable sessions a client keeps, the least recently used go first
 
 type
-  MbedtlsError* = object of CatchableError
-
   # SSL context object
   BaseSslContext* = ref object of RootObj
 
+  # A TLS session saved by a client for resumption (holds the session ticket)
+  SavedSessionObj* = object
+    session*: mbedtls.mbedtls_ssl_session
+
+  SavedSession* = ref SavedSessionObj
+
   MbedtlsSslContext* = ref object of BaseSslContext
     context*: mbedtls.mbedtls_ssl_context  # Deprecated: only used for shared config init
     config*: mbedtls.mbedtls_ssl_config
-    entropy*: mbedtls.mbedtls_entropy_context
-    ctr_drbg*: mbedtls.mbedtls_ctr_drbg_context
     cacert*: mbedtls.mbedtls_x509_crt
-    cert*: mbedtls.mbedtls_x509_crt
-    key*: mbedtls.mbedtls_pk_context
+    identities: seq[IdentityRef]              # Own certificates and keys the config points at, shared (see runtime.nim)
+    isServer*: bool                           # Whether the context accepts or opens connections
+    recordSize*: int                          # Plaintext per record sent, 0 = adaptive (see setRecordSize)
+    ktls*: bool                               # Server: capture traffic keys so files can be sent with kTLS
+    ciphersuites: seq[cint]                   # Offered suites, zero-terminated; mbedTLS keeps a pointer to it
+    sessionPool: seq[MbedtlsSslSession]       # Reset sessions for new connections, guarded by poolLock
+    poolLock: Lock
+    poolSize*: int                            # Most sessions kept in sessionPool, 0 frees every session
+    crypto: CryptoRef                         # The shared crypto runtime is up (see runtime.nim)
+    ticketKeys*: RootRef                      # Server: session ticket keys (see tickets.nim)
+    sessions*: OrderedTable[string, SavedSession] # Client: resumable session per "host:port", oldest use first
 
   # Per-connection SSL session state (GC-managed)
   # Each connection gets its own SSL context to avoid race conditions
   MbedtlsSslSessionObj* = object
     context*: mbedtls.mbedtls_ssl_context  # Per-connection TLS state
-    sharedConfig*: MbedtlsSslContext       # Reference to shared config (keeps it alive)
+    # Shared config. Not reference counted: the client or server that owns
+    # the context outlives its connections, and this way connections can be
+    # handled on other threads without touching the count.
+    sharedConfig* {.cursor.}: MbedtlsSslContext
+    ktlsKeys*: KtlsKeys  # Server traffic secret for kTLS, when the context asks for it
 
   MbedtlsSslSession* = ref MbedtlsSslSessionObj
 
@@ -36,51 +74,76 @@ proc `=destroy`(session: MbedtlsSslSessionObj) =
   # Note: We check if sharedConfig is nil to detect uninitialized sessions
   if session.sharedConfig != nil:
     mbedtls.mbedtls_ssl_free(unsafeAddr session.context)
+  # A kTLS secret captured but never handed to the kernel
+  mbedtls.mbedtls_platform_zeroize(unsafeAddr session.ktlsKeys,
+                                   sizeof(session.ktlsKeys).csize_t)
+
+proc `=destroy`(saved: SavedSessionObj) =
+  mbedtls.mbedtls_ssl_session_free(unsafeAddr saved.session)
+
+proc `=copy`(dest: var SavedSessionObj, src: SavedSessionObj) {.error.}
 
 type
   # Base socket object without reference semantics
   MbedtlsSocketObj* = object
     fd*: cint     # Socket file descriptor
     domain*: cint # Socket domain
-    sslContext*: MbedtlsSslContext
+    sslContext* {.cursor.}: MbedtlsSslContext  # Owned by the client or server
     sslSession*: MbedtlsSslSession  # Per-connection SSL session
     sslHandle*: ptr mbedtls.mbedtls_ssl_context
-    buffer*: string  # Read buffer for buffered I/O
+    buffer*: ReadBuffer  # Received data not consumed yet, reused for every read
+    sessionKey*: string  # Client: "host:port" the session is saved under for resumption
+    corked*: bool  # Partial TCP frames are held back until flush()
+    recordSize*: int  # Plaintext per record sent, 0 = adaptive (see recordLimit)
+    bytesWritten*: int  # Plaintext sent so far, drives adaptive record sizing
+    ktls*: bool  # Sending is encrypted by the kernel, mbedTLS must not write anymore
+    deadline*: MonoTime  # Reads and writes fail with MBEDTLS_ERR_SSL_TIMEOUT after it, unset for none (see setDeadline)
 
   # Based on Socket from net module - ref version of MbedtlsSocketObj
   MbedtlsSocket* = ref MbedtlsSocketObj
 
-# Helper functions
-proc isIpv6Address(address: string): bool =
-  ## Determines if a string is an IPv6 address.
-  ##
-  ## This is a helper function to detect IPv6 addresses for proper socket domain configuration.
-  ## It uses a more robust check than just looking for a colon, as that could also appear in
-  ## IPv4 addresses with port specifications or in hostnames with ports.
-  ##
-  ## Parameters:
-  ##   address: The address string to check
-  ##
-  ## Returns:
-  ##   true if the address appears to be an IPv6 address, false otherwise
-  # IPv6 addresses have multiple colons and may be enclosed in square brackets
-  # This is more robust than just checking for a single colon
-  return address.contains('[') or address.count(':') > 1
-
 # Error handling
 proc mbedtlsError(ret: int, msg: string): ref MbedtlsError =
   var errorStr = newString(100)
   mbedtls.mbedtls_strerror(ret.cint, cast[cstring](addr errorStr[0]), 100)
-  return newException(MbedtlsError, msg & ": " & errorStr & " (error code: 0x" &
+  result = newException(MbedtlsError, msg & ": " & errorStr & " (error code: 0x" &
       toHex(ret) & ")")
+  result.code = ret
 
-proc newContext*(): MbedtlsSslContext =
-  ## Creates a new mbedTLS SSL context with proper initialization.
+proc setCipherSuites*(context: MbedtlsSslContext; suites: openArray[CipherSuite]) =
+  ## Sets the TLS 1.3 cipher suites a context offers, most preferred first.
+  ##
+  ## Suites the mbedTLS build doesn't support are left out. Clients send the
+  ## list in this order and mbedTLS servers pick the first suite of the
+  ## client's list they share, so the client's order decides. Set it before
+  ## the context is used: handshakes read the list as they go.
+  ##
+  ## Parameters:
+  ##   context: The context to configure
+  ##   suites: The suites to offer
+  ##
+  ## Raises:
+  ##   MbedtlsError: If none of the suites is supported by the build
+  context.ciphersuites = suiteList(suites)
+  debug("Offering cipher suites " & $(@suites))
+  mbedtls.mbedtls_ssl_conf_ciphersuites(addr context.config, addr context.ciphersuites[0])
+
+proc cipherSuites*(context: MbedtlsSslContext): seq[CipherSuite] =
+  ## The suites a context offers, in order, without the unsupported ones
+  for id in context.ciphersuites:
+    for suite in CipherSuite:
+      if suite.id == id:
+        result.add(suite)
+
+proc newContext*(isServer = false): MbedtlsSslContext =
+  ## Creates a new mbedTLS SSL context with default settings.
+  ##
+  ## This is cheap: PSA crypto, the random number generators and parsed
+  ## certificates are shared process-wide (see runtime.nim), so the only work
+  ## left per context is setting up its configuration.
   ##
-  ## This function creates and initializes a new SSL context with entropy,
-  ## random number generation, and default configuration suitable for
-  ## Gemini protocol TLS requirements. The context needs to be further
-  ## configured for client or server operation before use.
+  ## Parameters:
+  ##   isServer: Whether the context is for the server side of connections
   ##
   ## Returns:
   ##   A new initialized MbedtlsSslContext
@@ -93,69 +156,143 @@ proc newContext*(): MbedtlsSslContext =
   ##   var ctx = newContext()
   ##   # Further configure the context for client or server use
   ##   ```
-  result = MbedtlsSslContext()
-  
-  # Initialize PSA crypto subsystem (required for TLS 1.3)
-  debug("Initializing PSA crypto subsystem for TLS 1.3")
-  let psaInit = mbedtls.psa_crypto_init()
-  if psaInit != 0:
-    raise mbedtlsError(psaInit, "Failed to initialize PSA crypto subsystem")
-  debug("PSA crypto subsystem initialized successfully")
-
-  # Initialize the entropy source and CTRDBG
-  mbedtls.mbedtls_entropy_init(addr result.entropy)
-  mbedtls.mbedtls_ctr_drbg_init(addr result.ctr_drbg)
-
-  # Seed the random number generator
-  let ret = mbedtls.mbedtls_ctr_drbg_seed(
-    addr result.ctr_drbg,
-    mbedtls.mbedtls_entropy_func,
-    addr result.entropy,
-    nil, 0)
-
-  if ret != 0:
-    raise mbedtlsError(ret, "Failed to seed CTRDBG")
+  result = MbedtlsSslContext(isServer: isServer, poolSize: DefaultSessionPoolSize)
+  result.crypto = acquireCrypto()
+  initLock(result.poolLock)
 
   # Initialize the SSL config
   mbedtls.mbedtls_ssl_config_init(addr result.config)
 
   # Initialize default SSL configuration
-  let ret2 = mbedtls.mbedtls_ssl_config_defaults(
+  let endpoint = if isServer: mbedtls.MBEDTLS_SSL_IS_SERVER
+                 else: mbedtls.MBEDTLS_SSL_IS_CLIENT
+  let ret = mbedtls.mbedtls_ssl_config_defaults(
     addr result.config,
-    mbedtls.MBEDTLS_SSL_IS_CLIENT,
+    endpoint,
     mbedtls.MBEDTLS_SSL_TRANSPORT_STREAM,
     mbedtls.MBEDTLS_SSL_PRESET_DEFAULT)
 
-  if ret2 != 0:
-    raise mbedtlsError(ret2, "Failed to set SSL config defaults")
-
-  # Set the random number generator
-  mbedtls.mbedtls_ssl_conf_rng(addr result.config,
-      mbedtls.mbedtls_ctr_drbg_random, addr result.ctr_drbg)
-      
-  # Explicitly set only TLS 1.3 ChaCha20-Poly1305 ciphersuite
-  var ciphersuites = [
-    mbedtls.MBEDTLS_TLS_CHACHA20_POLY1305_SHA256,
-    0  # NULL-terminate the list
-  ]
-  debug("Setting TLS 1.3 ChaCha20-Poly1305 as the only ciphersuite")
-  mbedtls.mbedtls_ssl_conf_ciphersuites(addr result.config, addr ciphersuites[0])
-  
-  # Configure max fragment length for Gemini protocol (requests limited to 1024 bytes)
-  debug("Setting max fragment length to 2048 bytes")
-  let fragResult = mbedtls.mbedtls_ssl_conf_max_frag_len(addr result.config, 
-                                                         mbedtls.MBEDTLS_SSL_MAX_FRAG_LEN_2048)
-  if fragResult != 0:
-    debug("Warning: Failed to set max fragment length, continuing anyway: " & $fragResult)
+  if ret != 0:
+    raise mbedtlsError(ret, "Failed to set SSL config defaults")
+
+  # Random numbers come from the calling thread's DRBG
+  mbedtls.mbedtls_ssl_conf_rng(addr result.config, threadRandom, nil)
+
+  # AES-GCM first where the CPU accelerates it (see ciphers.nim)
+  result.setCipherSuites(defaultCipherSuites())
 
   # Initialize certificate containers
   mbedtls.mbedtls_x509_crt_init(addr result.cacert)
-  mbedtls.mbedtls_x509_crt_init(addr result.cert)
-  mbedtls.mbedtls_pk_init(addr result.key)
 
   # mbedTLS defaults to high security settings already (TLS 1.2+)
   # No need to explicitly set min version
 
+proc acquireSession*(context: MbedtlsSslContext): MbedtlsSslSession =
+  ## Takes a TLS session for a new connection of `context`.
+  ##
+  ## Sessions given back with releaseSession() are reused, so a busy server
+  ## doesn't allocate and set up mbedTLS's record buffers for every
+  ## connection. A new session is set up when the pool is empty.
+  ##
+  ## Raises:
+  ##   MbedtlsError: If a new session can't be set up
+  withLock context.poolLock:
+    if context.sessionPool.len > 0:
+      return context.sessionPool.pop()
+  result = MbedtlsSslSession(sharedConfig: context)
+  mbedtls.mbedtls_ssl_init(addr result.context)
+  let ret = mbedtls.mbedtls_ssl_setup(addr result.context, addr context.config)
+  if ret != 0:
+    raise mbedtlsError(ret, "Failed to setup SSL context")
+
+proc releaseSession*(context: MbedtlsSslContext; session: MbedtlsSslSession) =
+  ## Gives back a session taken with acquireSession() once its connection is
+  ## done with it.
+  ##
+  ## The session is reset, which drops the connection's keys but keeps its
+  ## buffers, and pooled for the next connection while the pool holds fewer
+  ## than `poolSize`. Otherwise it is freed.
+  if session.isNil:
+    return
+  # Nothing of the old connection may reach the next one
+  mbedtls.mbedtls_ssl_set_bio(addr session.context, nil, nil, nil, nil)
+  if not context.isServer:
+    discard mbedtls.mbedtls_ssl_set_hostname(addr session.context, nil)
+  session.ktlsKeys.wipe()
+  if mbedtls.mbedtls_ssl_session_reset(addr session.context) != 0:
+    return
+  withLock context.poolLock:
+    if context.sessionPool.len < context.poolSize:
+      context.sessionPool.add(session)
+
+proc recordLimit*(recordSize, bytesWritten: int): int {.inline.} =
+  ## Largest plaintext to hand to a single mbedtls_ssl_write, and so the
+  ## size of the next record, for a connection that sent `bytesWritten`.
+  ##
+  ## A fixed `recordSize` is used as it is. Adaptive connections (0) start
+  ## with records fitting in one TCP segment, so the first bytes of a page
+  ## can be decrypted as soon as they arrive, and move to full records once
+  ## the transfer is clearly bulk.
+  if recordSize > 0:
+    recordSize
+  elif bytesWritten < AdaptiveRampBytes:
+    AdaptiveRecordSize
+  else:
+    MaxRecordSize
+
+proc setRecordSize*(context: MbedtlsSslContext; size: int) =
+  ## Sets the size of the records connections of a context send.
+  ##
+  ## On client contexts the size is also the largest record servers are
+  ## asked to send back, through the max_fragment_length extension: it can
+  ## only ask for 512, 1024, 2048 or 4096 bytes, so the size is rounded down
+  ## to one of those, and larger sizes and 0 leave servers free to send full
+  ## 16KB records.
+  ##
+  ## Parameters:
+  ##   context: The context to configure
+  ##   size: Plaintext bytes per record, between MinRecordSize and
+  ##         MaxRecordSize, or 0 to size records adaptively
+  ##
+  ## Raises:
+  ##   MbedtlsError: If the size is out of range
+  if size != 0 and size notin MinRecordSize .. MaxRecordSize:
+    raise newException(MbedtlsError, "Record size must be 0 (adaptive) or between " &
+                       $MinRecordSize & " and " & $MaxRecordSize & ": " & $size)
+  context.recordSize = size
+  if not context.isServer:
+    let code = if size == 0 or size > 4096: mbedtls.MBEDTLS_SSL_MAX_FRAG_LEN_NONE
+               elif size >= 4096: mbedtls.MBEDTLS_SSL_MAX_FRAG_LEN_4096
+               elif size >= 2048: mbedtls.MBEDTLS_SSL_MAX_FRAG_LEN_2048
+               elif size >= 1024: mbedtls.MBEDTLS_SSL_MAX_FRAG_LEN_1024
+               else: mbedtls.MBEDTLS_SSL_MAX_FRAG_LEN_512
+    let ret = mbedtls.mbedtls_ssl_conf_max_frag_len(addr context.config, code)
+    if ret != 0:
+      raise mbedtlsError(ret, "Failed to set max fragment length")
+
+proc useIdentity*(context: MbedtlsSslContext; certFile, keyFile: string) =
+  ## Sets the certificate and key a context presents during handshakes.
+  ##
+  ## The files are parsed through the shared identity cache, so contexts
+  ## using the same files share one parsed copy. The context holds it until
+  ## it is freed itself.
+  ##
+  ## Parameters:
+  ##   context: The context to configure
+  ##   certFile: Path to the certificate chain in PEM format
+  ##   keyFile: Path to its private key in PEM format
+  ##
+  ## Raises:
+  ##   MbedtlsError: If the files cannot be parsed or the certificate set
+  var held = loadIdentity(certFile, keyFile)
+  let identity = held.identity
+  let ret = mbedtls.mbedtls_ssl_conf_own_cert(addr context.config,
+                                              addr identity.cert, addr identity.key)
+  if ret != 0:
+    raise mbedtlsError(ret, "Failed to set own certificate")
+  # mbedTLS adds it to those set before, which stay in use too
+  context.identities.add(move held)
+
 proc setMinVersion*(context: MbedtlsSslContext,
     version: mbedtls.TlsVersion): bool =
   ## Sets the minimum TLS version for a context.
@@ -223,12 +360,42 @@ proc setCustomVerify*(context: MbedtlsSslContext) =
 ## such as subject names and generating fingerprints.
 type X509Certificate* = ptr mbedtls.mbedtls_x509_crt
 
+const CertificateCacheSlots = 64 ## Certificates whose details each thread keeps
+
+type CertificateDetails = object
+  ## Fingerprint and common name of a certificate, computed once
+  address: pointer    # Where the certificate's DER was when they were computed
+  der: string         # Copy of the DER, so that a reused address can't give a wrong hit
+  fingerprint: string # "" until computed
+  commonName: string
+  hasCommonName: bool
+
+var certificateCache {.threadvar.}: array[CertificateCacheSlots, CertificateDetails]
+
+proc cachedDetails(cert: X509Certificate): ptr CertificateDetails =
+  ## The details kept for `cert`, keyed by the address and length of its
+  ## DER. A slot holding another certificate is emptied first.
+  ##
+  ## A hit costs a comparison of the DER bytes, far less than hashing or
+  ## parsing them again, and stays correct after mbedTLS frees the
+  ## certificate and puts another one at the same address.
+  let der = cast[pointer](cert.raw.p)
+  let size = cert.raw.len.int
+  let slot = addr certificateCache[int((cast[uint](der) shr 4) mod CertificateCacheSlots.uint)]
+  if slot.address != der or slot.der.len != size or
+      (size > 0 and not equalMem(addr slot.der[0], der, size)):
+    slot[] = CertificateDetails(address: der, der: newString(size))
+    if size > 0:
+      copyMem(addr slot.der[0], der, size)
+  slot
+
 proc commonName*(cert: X509Certificate): string =
   ## Extracts the Common Name (CN) from an X.509 certificate.
   ##
   ## This function extracts the subject Common Name from a certificate, which
   ## typically contains the domain name for server certificates or a user
-  ## identifier for client certificates.
+  ## identifier for client certificates. It is parsed once per certificate
+  ## and thread, later calls return it from a cache.
   ##
   ## Parameters:
   ##   cert: The X.509 certificate to extract information from
@@ -245,14 +412,17 @@ proc commonName*(cert: X509Certificate): string =
   if cert.isNil:
     debug("WARNING: Certificate is nil, returning empty string")
     return ""
+  let details = cachedDetails(cert)
+  if details.hasCommonName:
+    return details.commonName
 
   # Create a buffer to hold the subject string
   var subject = newString(512)
   debug("Calling mbedtls_x509_dn_gets on certificate...")
 
   # Get the distinguished name string
-  let ret = mbedtls.mbedtls_x509_dn_gets(subject.cstring, 512.csize_t, cast[
-      pointer](cert))
+  let ret = mbedtls.mbedtls_x509_dn_gets(subject.cstring, 512.csize_t,
+                                         addr cert.subject)
   if ret <= 0:
     debug("ERROR: mbedtls_x509_dn_gets returned " & $ret)
     return ""
@@ -264,23 +434,24 @@ proc commonName*(cert: X509Certificate): string =
   let cnIndex = subjectStr.find("CN=")
   if cnIndex == -1:
     debug("WARNING: No CN= found in subject string")
-    return ""
-
-  var cnEnd = subjectStr.find(',', cnIndex)
-  if cnEnd == -1:
-    cnEnd = subjectStr.len
-
-  let commonName = subjectStr[cnIndex+3..<cnEnd]
-  debug("Extracted common name: " & commonName)
-  return commonName
+  else:
+    var cnEnd = subjectStr.find(',', cnIndex)
+    if cnEnd == -1:
+      cnEnd = subjectStr.len
+    result = subjectStr[cnIndex+3..<cnEnd]
+    debug("Extracted common name: " & result)
+  details.commonName = result
+  details.hasCommonName = true
 
 proc fingerprint*(cert: X509Certificate): string =
   ## Generates a SHA-256 fingerprint of an X.509 certificate.
   ##
-  ## This function computes a cryptographic fingerprint of the certificate,
-  ## which can be used to uniquely identify and verify certificates in a
-  ## Trust-On-First-Use (TOFU) security model. The fingerprint is presented
-  ## as a colon-separated hexadecimal string.
+  ## This function computes a cryptographic fingerprint of the certificate's
+  ## DER encoding, which can be used to uniquely identify and verify
+  ## certificates in a Trust-On-First-Use (TOFU) security model (see
+  ## tofu.nim). The fingerprint is presented as a colon-separated
+  ## hexadecimal string. It is computed once per certificate and thread,
+  ## later calls return it from a cache.
   ##
   ## Parameters:
   ##   cert: The X.509 certificate to fingerprint
@@ -299,14 +470,17 @@ proc fingerprint*(cert: X509Certificate): string =
   if cert.isNil:
     debug("WARNING: Certificate is nil, returning empty string")
     return ""
+  let details = cachedDetails(cert)
+  if details.fingerprint.len > 0:
+    return details.fingerprint
 
-  var hash = newString(32) # SHA-256 hash length
+  var hash: array[32, uint8] # SHA-256 hash length
 
   # Use the available mbedtls_sha256 function to generate hash
   debug("Calling mbedtls_sha256 on certificate...")
   let ret = mbedtls.mbedtls_sha256(
-    cast[pointer](cert),
-    sizeof(mbedtls.mbedtls_x509_crt).csize_t,
+    cast[pointer](cert.raw.p),
+    cert.raw.len,
     cast[pointer](addr hash[0]),
     0.cint # 0 for SHA-256, 1 for SHA-224
   )
@@ -316,14 +490,16 @@ proc fingerprint*(cert: X509Certificate): string =
     return ""
 
   # Convert the hash bytes to a hexadecimal string with colon separators
-  result = ""
+  const hexDigits = "0123456789abcdef"
+  result = newStringOfCap(32 * 3 - 1)
   for i in 0..<32:
     if i > 0:
       result.add(':')
-    result.add(toHex(ord(hash[i]), 2).toLowerAscii())
+    result.add(hexDigits[hash[i].int shr 4])
+    result.add(hexDigits[hash[i].int and 0xf])
 
   debug("Generated fingerprint: " & result)
-  return result
+  details.fingerprint = result
 
 proc `$`*(cert: X509Certificate): string =
   ## Returns a string representation of an X.509 certificate.
@@ -359,7 +535,7 @@ proc `$`*(cert: X509Certificate): string =
 
   let certInfo = output[0..<ret]
   # Only show a small part of the output in logs to avoid overwhelming
-  withDebug:
+  withDebug(4):
     let preview = certInfo[0..<min(80, ret)]
     debug("Got certificate info of length " & $ret &
         " bytes (first 80 chars): " & preview)
@@ -367,6 +543,32 @@ proc `$`*(cert: X509Certificate): string =
 
 # Define our BIO functions for socket I/O
 # These need to be defined at the module level
+proc setDeadline*(socket: MbedtlsSocket; ms: int) =
+  ## Bounds how long the reads and writes of a blocking socket may take
+  ## from now on, all of them together, unlike SO_RCVTIMEO which bounds
+  ## each read on its own. A client sending a byte now and then can't hold
+  ## a connection open past it. Once it passed, they fail with
+  ## MBEDTLS_ERR_SSL_TIMEOUT.
+  ##
+  ## Parameters:
+  ##   socket: The socket
+  ##   ms: Milliseconds from now, 0 removes the deadline
+  socket.deadline = if ms > 0: getMonoTime() + initDuration(milliseconds = ms)
+                    else: MonoTime()
+
+proc waitDeadline(sock: ptr MbedtlsSocketObj; events: cshort): bool =
+  ## Waits for `events` on a socket with a deadline, false once it passed
+  if sock.deadline == MonoTime():
+    return true
+  while true:
+    let left = (sock.deadline - getMonoTime()).inMilliseconds
+    if left <= 0:
+      return false
+    var pollFd = TPollfd(fd: sock.fd, events: events)
+    let ready = posix.poll(addr pollFd, 1, left.cint)
+    if ready > 0 or (ready < 0 and errno != EINTR):
+      return true # The read or write reports errors
+
 proc my_bio_send(ctx: pointer, buf: pointer, len: csize_t): cint {.cdecl.} =
   debug("[BIO_SEND] Called with len=" & $len & " bytes")
 
@@ -390,7 +592,7 @@ proc my_bio_send(ctx: pointer, buf: pointer, len: csize_t): cint {.cdecl.} =
     return mbedtls.MBEDTLS_ERR_NET_SEND_FAILED
 
   # Show a few bytes of the buffer for debugging
-  withDebug:
+  withDebug(4):
     var debugStr = ""
     var debugHex = ""
     for i in 0..<min(len.int, 40):
@@ -425,6 +627,10 @@ proc my_bio_send(ctx: pointer, buf: pointer, len: csize_t): cint {.cdecl.} =
     debug("[BIO_SEND] Data hex (first 40 bytes): " & debugHex)
     debug("[BIO_SEND] Data str (first 40 bytes): " & debugStr)
 
+  if not waitDeadline(sock, POLLOUT):
+    debug("[BIO_SEND] Deadline passed")
+    return mbedtls.MBEDTLS_ERR_SSL_TIMEOUT
+
   # Try to write to the socket
   debug("[BIO_SEND] Calling posix.write with fd=" & $sock.fd & " and len=" & $len.int)
   let ret = posix.write(sock.fd, cast[pointer](buf), len.int)
@@ -472,6 +678,10 @@ proc my_bio_recv(ctx: pointer, buf: pointer, len: csize_t): cint {.cdecl.} =
     debug("[BIO_RECV] ERROR: Invalid socket FD: " & $sock.fd)
     return mbedtls.MBEDTLS_ERR_NET_RECV_FAILED
 
+  if not waitDeadline(sock, POLLIN):
+    debug("[BIO_RECV] Deadline passed")
+    return mbedtls.MBEDTLS_ERR_SSL_TIMEOUT
+
   # Try to read from the socket
   debug("[BIO_RECV] Calling posix.read with fd=" & $sock.fd & " and len=" & $len.int)
   let ret = posix.read(sock.fd, cast[pointer](buf), len.int)
@@ -479,7 +689,7 @@ proc my_bio_recv(ctx: pointer, buf: pointer, len: csize_t): cint {.cdecl.} =
 
   # Show data received for debugging
   if ret > 0:
-    withDebug:
+    withDebug(4):
       var debugStr = ""
       var debugHex = ""
       for i in 0..<min(ret.int, 40):
@@ -538,6 +748,62 @@ proc my_bio_recv(ctx: pointer, buf: pointer, len: csize_t): cint {.cdecl.} =
   debug("[BIO_RECV] Successfully received " & $ret & " bytes")
   return ret.cint
 
+# Session resumption
+proc enableSessionResumption*(context: MbedtlsSslContext) =
+  ## Configures a client context to accept TLS 1.3 session tickets.
+  ##
+  ## Tickets received on a connection are saved per host with storeSession()
+  ## and offered again by wrapConnectedSocket() on the next connection to the
+  ## same host, which then skips certificate exchange and verification.
+  mbedtls.mbedtls_ssl_conf_session_tickets(addr context.config,
+      mbedtls.MBEDTLS_SSL_SESSION_TICKETS_ENABLED)
+  mbedtls.mbedtls_ssl_conf_tls13_key_exchange_modes(addr context.config,
+      mbedtls.MBEDTLS_SSL_TLS1_3_KEY_EXCHANGE_MODE_ALL)
+  # Make mbedtls_ssl_read() report new tickets so they can be saved
+  mbedtls.mbedtls_ssl_conf_tls13_enable_signal_new_session_tickets(
+      addr context.config, mbedtls.MBEDTLS_SSL_TLS1_3_SIGNAL_NEW_SESSION_TICKETS_ENABLED)
+
+proc storeSession*(context: MbedtlsSslContext, key: string,
+                   ssl: ptr mbedtls.mbedtls_ssl_context) =
+  ## Saves the session of a client connection under `key` ("host:port"),
+  ## replacing any session saved before. Called whenever a new session
+  ## ticket arrives. Beyond MaxSavedSessions, the session used least
+  ## recently is dropped.
+  if key.len == 0 or context.isNil:
+    return
+  let saved = SavedSession()
+  mbedtls.mbedtls_ssl_session_init(addr saved.session)
+  let ret = mbedtls.mbedtls_ssl_get_session(ssl, addr saved.session)
+  if ret == 0:
+    debug("Saved TLS session for " & key)
+    context.sessions.del(key) # Moves it to the end
+    context.sessions[key] = saved
+    while context.sessions.len > MaxSavedSessions:
+      var oldest = ""
+      for name in context.sessions.keys:
+        oldest = name
+        break
+      context.sessions.del(oldest)
+  else:
+    debug("Failed to save TLS session for " & key & ": " & $ret)
+
+proc resumeSession*(context: MbedtlsSslContext, key: string,
+                    ssl: ptr mbedtls.mbedtls_ssl_context) =
+  ## Offers the session saved under `key` on a client connection that
+  ## hasn't done its handshake yet. If the server doesn't accept it, the
+  ## handshake falls back to a full one.
+  let saved = context.sessions.getOrDefault(key)
+  if saved.isNil:
+    return
+  let ret = mbedtls.mbedtls_ssl_set_session(ssl, addr saved.session)
+  if ret != 0:
+    debug("Failed to resume TLS session for " & key & ": " & $ret)
+    context.sessions.del(key)
+  else:
+    debug("Offering saved TLS session for " & key)
+    context.sessions.del(key) # Now the most recently used
+    context.sessions[key] = saved
+
 # Socket wrapper functions
 proc wrapConnectedSocket*(context: MbedtlsSslContext, socket: var MbedtlsSocketObj,
                          handshakeFunc: proc(
@@ -568,19 +834,11 @@ proc wrapConnectedSocket*(context: MbedtlsSslContext, socket: var MbedtlsSocketO
   ##   codes are accepted to support the Gemini protocol's security model.
   debug("Starting TLS session setup (per-connection context)...")
 
-  # Create per-connection SSL session (GC-managed)
-  var session = MbedtlsSslSession(sharedConfig: context)
-
-  # Initialize the per-connection SSL context
-  debug("Initializing per-connection SSL context")
-  mbedtls.mbedtls_ssl_init(addr session.context)
-
-  # Setup SSL context with SHARED config
-  debug("Setting up SSL context with shared config")
-  let ret = mbedtls.mbedtls_ssl_setup(addr session.context, addr context.config)
-  if ret != 0:
-    debug("SSL setup error: " & $ret)
-    raise mbedtlsError(ret, "Failed to setup SSL context")
+  # Per-connection SSL session with the SHARED config, pooled or new. The
+  # socket holds it from here, so close() gives it back if the handshake fails.
+  let session = context.acquireSession()
+  socket.sslSession = session
+  socket.sslContext = context
 
   # Set hostname for SNI
   if hostname.len > 0:
@@ -590,6 +848,13 @@ proc wrapConnectedSocket*(context: MbedtlsSslContext, socket: var MbedtlsSocketO
       debug("SSL set hostname error: " & $ret2)
       raise mbedtlsError(ret2, "Failed to set hostname")
 
+  # Offer a saved session so the handshake can be resumed
+  if socket.sessionKey.len > 0:
+    context.resumeSession(socket.sessionKey, addr session.context)
+
+  if context.ktls:
+    captureKeys(addr session.context, addr session.ktlsKeys)
+
   # Set up BIO callbacks for socket I/O
   debug("Setting up BIO callbacks, socket FD: " & $socket.fd)
   # Pass the socket itself as the context for our BIO functions
@@ -611,11 +876,10 @@ proc wrapConnectedSocket*(context: MbedtlsSslContext, socket: var MbedtlsSocketO
   else:
     debug("SSL handshake completed successfully")
 
-  # Store per-connection SSL session and handle in socket
+  # Store the handle of the per-connection SSL session in socket
   debug("Storing per-connection SSL session in socket")
-  socket.sslSession = session  # GC ref keeps session alive
   socket.sslHandle = addr session.context
-  socket.sslContext = context
+  socket.recordSize = context.recordSize
 
   # Verify the socket FD is still valid
   debug("Verifying socket FD: " & $socket.fd)
@@ -803,16 +1067,25 @@ proc dial*(address: string, port: int): MbedtlsSocket =
 
   # Convert to string and make it persistent for the duration of the call
   var portStr = $port
-  debug("Attempting to connect with mbedtls_net_connect...")
-  let ret = mbedtls.mbedtls_net_connect(addr socketContext, address, cast[
-      cstring](addr portStr[0]), mbedtls.MBEDTLS_NET_PROTO_TCP)
+  let targets = try: resolve(address)
+                except OSError as e:
+                  raise newException(MbedtlsError, "Failed to resolve " & address & ": " & e.msg)
+
+  # Try the resolved addresses in turn, numeric ones skip a second lookup
+  var ret: cint = 0
+  for target in targets:
+    debug("Attempting to connect to " & target.address & " with mbedtls_net_connect...")
+    ret = mbedtls.mbedtls_net_connect(addr socketContext, target.address.cstring, cast[
+        cstring](addr portStr[0]), mbedtls.MBEDTLS_NET_PROTO_TCP)
+    if ret == 0:
+      socket.domain = toInt(target.domain)
+      break
   if ret != 0:
     debug("Connection failed with error code: " & $ret)
     raise mbedtlsError(ret, "Failed to connect to " & address & ":" & portStr)
 
   debug("Socket connection successful, fd=" & $socketContext.fd)
   socket.fd = socketContext.fd
-  socket.domain = if isIpv6Address(address): 10 else: 2 # AF_INET6 = 10, AF_INET = 2
 
   # Verify the socket is valid
   if socket.fd < 0:
@@ -852,12 +1125,8 @@ proc send*(socket: MbedtlsSocket, data: pointer, size: int): int =
     debug("ERROR: Invalid socket FD: " & $socket.fd)
     raise newException(MbedtlsError, "Invalid socket FD: " & $socket.fd)
 
-  if socket.sslHandle.isNil:
-    debug("ERROR: SSL handle is nil!")
-    raise newException(MbedtlsError, "SSL handle is nil")
-
   # Print first few bytes of data for debugging
-  withDebug:
+  withDebug(4):
     var debugBytes = ""
     for i in 0..<min(size, 40):
       let b = cast[ptr uint8](cast[int](data) + i)[]
@@ -867,8 +1136,24 @@ proc send*(socket: MbedtlsSocket, data: pointer, size: int): int =
         debugBytes.add('.')
     debug("Data to send (first 40 bytes): " & debugBytes)
 
-  debug("Calling mbedtls_ssl_write with size=" & $size)
-  let ret = mbedtls.mbedtls_ssl_write(socket.sslHandle, cast[pointer](data), size.cuint)
+  # Once the kernel encrypts, data is written to the socket as it is
+  if socket.ktls:
+    while true:
+      let sent = posix.write(socket.fd, data, size)
+      if sent >= 0:
+        socket.bytesWritten += sent
+        return sent
+      if errno != EINTR:
+        raise newException(MbedtlsError, "Failed to send data: " & $strerror(errno))
+
+  if socket.sslHandle.isNil:
+    debug("ERROR: SSL handle is nil!")
+    raise newException(MbedtlsError, "SSL handle is nil")
+
+  # One record per call, as large as the record size allows
+  let chunk = min(size, recordLimit(socket.recordSize, socket.bytesWritten))
+  debug("Calling mbedtls_ssl_write with size=" & $chunk)
+  let ret = mbedtls.mbedtls_ssl_write(socket.sslHandle, cast[pointer](data), chunk.cuint)
   if ret < 0:
     debug("Error in mbedtls_ssl_write: " & $ret)
     # Check specifically for MBEDTLS_ERR_NET_SEND_FAILED
@@ -876,6 +1161,7 @@ proc send*(socket: MbedtlsSocket, data: pointer, size: int): int =
       debug("Network send failed - possible socket error or connection closed")
     raise mbedtlsError(ret.int, "Failed to send data")
   debug("Successfully sent " & $ret & " bytes")
+  socket.bytesWritten += ret
   return ret
 
 proc send*(socket: MbedtlsSocket, data: string): int =
@@ -904,6 +1190,105 @@ proc send*(socket: MbedtlsSocket, data: string): int =
     debug("String content: " & data)
   return socket.send(unsafeAddr data[0], data.len)
 
+proc sendAll*(socket: MbedtlsSocket, data: pointer, size: int) =
+  ## Sends a whole buffer over a TLS-encrypted connection.
+  ##
+  ## mbedtls_ssl_write accepts at most one record's worth of data per call,
+  ## so a single send() may write less than requested. This helper keeps
+  ## calling send() until every byte has been written.
+  ##
+  ## Parameters:
+  ##   socket: The TLS socket to send data through
+  ##   data: Pointer to the buffer containing the data to send
+  ##   size: Number of bytes to send
+  ##
+  ## Raises:
+  ##   MbedtlsError: If the send operation fails or the socket is invalid
+  var sent = 0
+  while sent < size:
+    let ret = socket.send(cast[pointer](cast[int](data) + sent), size - sent)
+    if ret <= 0:
+      raise newException(MbedtlsError, "Failed to send data: connection stalled")
+    sent += ret
+
+proc sendAll*(socket: MbedtlsSocket, data: openArray[char]) =
+  ## Sends all of `data`, see sendAll(socket, pointer, int)
+  if data.len > 0:
+    socket.sendAll(unsafeAddr data[0], data.len)
+
+when defined(linux):
+  var TCP_CORK {.importc, header: "<netinet/tcp.h>".}: cint
+
+proc setCork*(fd: cint; on: bool) =
+  ## Turns TCP_CORK on or off for `fd`.
+  ##
+  ## While corked, the kernel only sends full-sized TCP segments, so the
+  ## records of a response written one mbedTLS call at a time leave in as
+  ## few packets as possible. Turning it off sends whatever is left at once.
+  ## This is a no-op on platforms without TCP_CORK.
+  when defined(linux):
+    var value: cint = if on: 1 else: 0
+    discard posix.setsockopt(SocketHandle(fd), posix.IPPROTO_TCP, TCP_CORK,
+                             addr value, sizeof(value).SockLen)
+
+proc cork*(socket: MbedtlsSocket) =
+  ## Holds back partial TCP frames until flush() is called.
+  ##
+  ## Use this around a response made of several writes, so its TLS records
+  ## are packed into full segments instead of one packet each.
+  if not socket.corked and socket.fd != -1:
+    setCork(socket.fd, true)
+    socket.corked = true
+
+proc flush*(socket: MbedtlsSocket) =
+  ## Sends the data held back since cork() right away.
+  ##
+  ## Does nothing if the socket is not corked.
+  if socket.corked:
+    socket.corked = false
+    if socket.fd != -1:
+      setCork(socket.fd, false)
+
+proc startKtls*(socket: MbedtlsSocket): bool =
+  ## Hands encryption of everything this server connection sends from now
+  ## on to the kernel, see enableKtlsTx().
+  ##
+  ## Only works once, on connections of a context with `ktls` set, and after
+  ## mbedTLS has sent something since the handshake, so that its session
+  ## tickets are out.
+  ##
+  ## Returns:
+  ##   true if the kernel now encrypts the connection's output
+  if socket.ktls:
+    return true
+  if socket.sslSession.isNil or not socket.sslSession.ktlsKeys.hasKeys:
+    return false
+  socket.ktls = enableKtlsTx(socket.fd, socket.sslHandle, socket.sslSession.ktlsKeys)
+  if socket.ktls:
+    # mbedTLS is done with the connection, its buffers can serve another one
+    socket.sslHandle = nil
+    socket.sslContext.releaseSession(socket.sslSession)
+    socket.sslSession = nil
+  socket.ktls
+
+proc sendFile*(socket: MbedtlsSocket; file: File; offset, size: int64) =
+  ## Sends `size` bytes of `file` from `offset` with sendfile(), on a
+  ## connection startKtls() succeeded on.
+  ##
+  ## Raises:
+  ##   MbedtlsError: If sending fails or the file ends early
+  var position = offset
+  let stop = offset + size
+  while position < stop:
+    let sent = sendFileChunk(socket.fd, getOsFileHandle(file).cint, position,
+                             int(min(stop - position, int64(int32.high))))
+    if sent > 0:
+      socket.bytesWritten += sent
+    elif sent == 0:
+      raise newException(MbedtlsError, "File ended before " & $size & " bytes were sent")
+    elif errno != EINTR:
+      raise newException(MbedtlsError, "sendfile failed: " & $strerror(errno))
+
 proc recv*(socket: MbedtlsSocket, data: pointer, size: int): int =
   debug("Attempting to receive up to " & $size & " bytes")
 
@@ -933,9 +1318,16 @@ proc recv*(socket: MbedtlsSocket, data: pointer, size: int): int =
     debug("WARNING: Requested to receive 0 or negative bytes, returning 0")
     return 0
 
+  # Data recvLine read ahead comes first
+  if socket.buffer.len > 0:
+    return socket.buffer.read(data, size)
+
   # Perform the read operation
   debug("Calling mbedtls_ssl_read with size=" & $size)
-  let ret = mbedtls.mbedtls_ssl_read(socket.sslHandle, data, size.cuint)
+  var ret = mbedtls.mbedtls_ssl_read(socket.sslHandle, data, size.cuint)
+  while ret == mbedtls.MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET:
+    socket.sslContext.storeSession(socket.sessionKey, socket.sslHandle)
+    ret = mbedtls.mbedtls_ssl_read(socket.sslHandle, data, size.cuint)
 
   # Handle return values
   if ret < 0:
@@ -951,7 +1343,7 @@ proc recv*(socket: MbedtlsSocket, data: pointer, size: int): int =
 
   # Show data received for debugging
   if ret > 0:
-    withDebug:
+    withDebug(4):
       var debugBytes = ""
       for i in 0..<min(ret.int, 40):
         let b = cast[ptr uint8](cast[int](data) + i)[]
@@ -964,13 +1356,20 @@ proc recv*(socket: MbedtlsSocket, data: pointer, size: int): int =
   debug("Successfully received " & $ret & " bytes")
   return ret
 
+proc recv*(socket: MbedtlsSocket, data: var openArray[char]): int =
+  ## Receives up to `data.len` bytes into `data`, see recv(socket, pointer, int)
+  if data.len == 0:
+    return 0
+  socket.recv(addr data[0], data.len)
+
 # Convenience functions for recv operations
 
 proc fillBufferSync(socket: MbedtlsSocket): int =
   ## Fills the socket's internal buffer with data from the TLS connection.
   ##
-  ## This is an internal helper function for buffered reading. It reads
-  ## up to SyncBufferSize bytes into the socket's buffer.
+  ## This is an internal helper function for buffered reading. It decrypts
+  ## straight into the free space of the socket's buffer, so it doesn't
+  ## allocate.
   ##
   ## Returns:
   ##   Number of bytes read into the buffer, or 0 if connection closed.
@@ -980,12 +1379,13 @@ proc fillBufferSync(socket: MbedtlsSocket): int =
   if socket.buffer.len > 0:
     return socket.buffer.len  # Already have data in buffer
 
-  var tempBuf = newString(SyncBufferSize)
+  let (space, size) = socket.buffer.prepareWrite()
 
-  debug("fillBufferSync: attempting to read up to " & $SyncBufferSize & " bytes")
-  let ret = mbedtls.mbedtls_ssl_read(socket.sslHandle,
-                                     cast[pointer](addr tempBuf[0]),
-                                     SyncBufferSize.cuint)
+  debug("fillBufferSync: attempting to read up to " & $size & " bytes")
+  var ret = mbedtls.mbedtls_ssl_read(socket.sslHandle, space, size.cuint)
+  while ret == mbedtls.MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET:
+    socket.sslContext.storeSession(socket.sessionKey, socket.sslHandle)
+    ret = mbedtls.mbedtls_ssl_read(socket.sslHandle, space, size.cuint)
 
   if ret == 0 or ret == mbedtls.MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY:
     debug("fillBufferSync: connection closed")
@@ -999,12 +1399,11 @@ proc fillBufferSync(socket: MbedtlsSocket): int =
     raise mbedtlsError(ret.int, "Failed to fill buffer")
 
   # Successfully read data
-  tempBuf.setLen(ret)
-  socket.buffer = tempBuf
+  socket.buffer.commit(ret)
   debug("fillBufferSync: read " & $ret & " bytes into buffer")
   return ret
 
-proc recvLine*(socket: MbedtlsSocket): string =
+proc recvLine*(socket: MbedtlsSocket; maxLength = 0): string =
   ## Reads a line from a TLS-encrypted socket connection.
   ##
   ## This function uses buffered I/O for efficiency, reading chunks of data
@@ -1013,12 +1412,15 @@ proc recvLine*(socket: MbedtlsSocket): string =
   ##
   ## Parameters:
   ##   socket: The TLS socket to read from
+  ##   maxLength: Longest line accepted, line ending excluded (0 = no limit).
+  ##              Reading stops as soon as the limit is exceeded.
   ##
   ## Returns:
   ##   The line read from the socket, with trailing CR and LF characters removed
   ##
   ## Raises:
   ##   MbedtlsError: If the socket is invalid or there's an error reading
+  ##   LineTooLongError: If the line is longer than maxLength
   debug("Reading a line from socket (buffered)...")
 
   # Verify socket pointer
@@ -1033,21 +1435,8 @@ proc recvLine*(socket: MbedtlsSocket): string =
 
   result = ""
 
-  while true:
-    # Check buffer for newline
-    let nlPos = socket.buffer.find('\n')
-    if nlPos >= 0:
-      # Found newline in buffer - extract line including the newline
-      result.add(socket.buffer[0..nlPos])
-      socket.buffer = socket.buffer[nlPos+1..^1]
-      debug("Found newline in buffer at position " & $nlPos)
-      break
-
-    # No newline in buffer - append what we have and get more
-    if socket.buffer.len > 0:
-      result.add(socket.buffer)
-      socket.buffer = ""
-
+  # Take buffered data up to the newline, refilling the buffer until one arrives
+  while not socket.buffer.takeLine(result, maxLength):
     let filled = socket.fillBufferSync()
     if filled == 0:
       # Connection closed or would block
@@ -1057,24 +1446,26 @@ proc recvLine*(socket: MbedtlsSocket): string =
   debug("Raw received line: " & $result.len & " bytes")
 
   # Remove trailing \r\n
-  if result.len > 0 and result[^1] == '\n':
-    result.setLen(result.len - 1)
-    if result.len > 0 and result[^1] == '\r':
-      result.setLen(result.len - 1)
+  finishLine(result, maxLength)
 
   debug("Processed line: " & result)
 
 proc close*(socket: MbedtlsSocket) =
   if socket.fd != -1:
     debug("Closing socket with fd=" & $socket.fd)
-    if socket.sslHandle != nil:
+    if socket.ktls:
+      debug("Sending TLS close notify")
+      sendCloseNotify(socket.fd)
+    elif socket.sslHandle != nil:
       debug("Sending TLS close notify")
       discard mbedtls.mbedtls_ssl_close_notify(socket.sslHandle)
-      socket.sslHandle = nil
-    # Release per-connection SSL session (GC will call destructor to free SSL context)
+    socket.sslHandle = nil
+    # Give the per-connection SSL session back for the next connection
     if socket.sslSession != nil:
       debug("Releasing per-connection SSL session")
+      socket.sslContext.releaseSession(socket.sslSession)
       socket.sslSession = nil
-    # Just close the socket directly
+    # Close the file descriptor, nothing else owns it
+    discard posix.close(socket.fd)
     socket.fd = -1
     debug("Socket closed")
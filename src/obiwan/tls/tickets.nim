@@ -0,0 +1,150 @@
+## TLS 1.3 session tickets for ObiWAN servers
+##
+## Servers hand out session tickets so returning clients can resume their
+## session instead of repeating the full handshake. Tickets are encrypted
+## with ChaCha20-Poly1305 under a key that rotates every `rotation` seconds.
+##
+## Instead of random keys, each key is derived from a shared secret and the
+## index of its rotation period (the epoch). Every process that knows the
+## secret computes the same keys at the same time, so the worker processes
+## of a multi-worker server accept each other's tickets without talking to
+## each other. The previous epoch's key stays valid, so a ticket survives at
+## least one rotation.
+
+import std/locks
+import std/times
+import ./mbedtls as mbedtls
+import ./socket
+import ../debug
+
+const
+  DefaultTicketRotation* = 12 * 60 * 60 ## Default key rotation interval in seconds (12 hours)
+  TicketKeyNameBytes = 4                # MBEDTLS_SSL_TICKET_KEY_NAME_BYTES
+  TicketKeyBytes = 32                   # ChaCha20-Poly1305 key size
+
+type
+  TicketKeysObj = object of RootObj
+    context: mbedtls.mbedtls_ssl_ticket_context
+    secret: string
+    rotation: int64   # Seconds per epoch
+    epoch: int64      # Epoch of the active key
+    lock: Lock        # Serializes rotation with ticket writes and parses
+
+  TicketKeys* = ref TicketKeysObj
+    ## Session ticket key state of a server context
+
+proc `=destroy`(keys: TicketKeysObj) =
+  if keys.rotation > 0:
+    mbedtls.mbedtls_ssl_ticket_free(unsafeAddr keys.context)
+    deinitLock(keys.lock)
+  `=destroy`(keys.secret)
+
+proc `=copy`(dest: var TicketKeysObj, src: TicketKeysObj) {.error.}
+
+proc sha256(parts: varargs[string]): array[32, byte] =
+  var input = ""
+  for part in parts:
+    input.add(part)
+  discard mbedtls.mbedtls_sha256(cast[pointer](cstring(input)), input.len.csize_t,
+                                 addr result[0], 0)
+
+proc epochBytes(epoch: int64): string =
+  result = newString(8)
+  for i in 0 ..< 8:
+    result[i] = char((epoch shr (8 * (7 - i))) and 0xff)
+
+proc currentEpoch(keys: TicketKeys): int64 =
+  epochTime().int64 div keys.rotation
+
+proc installKey(keys: TicketKeys, epoch: int64): cint =
+  ## Makes the key of `epoch` the active one. The previously active key is
+  ## kept for decryption only.
+  let e = epochBytes(epoch)
+  var name = sha256("obiwan ticket name", keys.secret, e)
+  var key = sha256("obiwan ticket key", keys.secret, e)
+  # Keys must outlive their rotation period, otherwise mbedTLS replaces
+  # them with random ones that the other workers don't know
+  result = mbedtls.mbedtls_ssl_ticket_rotate(addr keys.context,
+      addr name[0], TicketKeyNameBytes.csize_t,
+      addr key[0], TicketKeyBytes.csize_t,
+      uint32(keys.rotation * 2))
+  if result == 0:
+    keys.epoch = epoch
+
+proc rotateIfNeeded(keys: TicketKeys) =
+  let epoch = keys.currentEpoch()
+  if epoch != keys.epoch:
+    debug("Rotating session ticket key for epoch " & $epoch)
+    let ret = keys.installKey(epoch)
+    if ret != 0:
+      debug("Failed to rotate session ticket key: " & $ret)
+
+proc ticketWrite(p_ticket: pointer, session: ptr mbedtls.mbedtls_ssl_session,
+                 start: pointer, `end`: pointer, tlen: ptr csize_t,
+                 lifetime: ptr uint32): cint {.cdecl.} =
+  let keys = cast[TicketKeys](p_ticket)
+  withLock keys.lock:
+    keys.rotateIfNeeded()
+    result = mbedtls.mbedtls_ssl_ticket_write(addr keys.context, session,
+                                              start, `end`, tlen, lifetime)
+
+proc ticketParse(p_ticket: pointer, session: ptr mbedtls.mbedtls_ssl_session,
+                 buf: pointer, len: csize_t): cint {.cdecl.} =
+  let keys = cast[TicketKeys](p_ticket)
+  withLock keys.lock:
+    keys.rotateIfNeeded()
+    result = mbedtls.mbedtls_ssl_ticket_parse(addr keys.context, session, buf, len)
+
+proc installTicketKeys(context: MbedtlsSslContext, keys: TicketKeys) =
+  # The context keeps the key state alive, mbedTLS only gets a raw pointer
+  context.ticketKeys = keys
+  mbedtls.mbedtls_ssl_conf_session_tickets_cb(addr context.config,
+      cast[pointer](ticketWrite), cast[pointer](ticketParse), cast[pointer](keys))
+  mbedtls.mbedtls_ssl_conf_tls13_key_exchange_modes(addr context.config,
+      mbedtls.MBEDTLS_SSL_TLS1_3_KEY_EXCHANGE_MODE_ALL)
+
+proc enableSessionTickets*(context: MbedtlsSslContext, secret: string,
+                           rotation = DefaultTicketRotation) =
+  ## Enables TLS 1.3 session tickets on a server context.
+  ##
+  ## Parameters:
+  ##   context: The server context, after mbedtls_ssl_config_defaults()
+  ##   secret: Secret the ticket keys are derived from. Servers (or worker
+  ##           processes) using the same secret accept each other's tickets.
+  ##   rotation: Seconds between key rotations. Tickets stay valid for up to
+  ##             twice this long. 0 disables session tickets.
+  ##
+  ## Raises:
+  ##   MbedtlsError: If the ticket keys can't be set up
+  if rotation <= 0:
+    return
+  if secret.len == 0:
+    raise newException(MbedtlsError, "Session tickets need a non-empty secret")
+
+  let keys = TicketKeys(secret: secret, rotation: rotation.int64, epoch: -1)
+  initLock(keys.lock)
+  mbedtls.mbedtls_ssl_ticket_init(addr keys.context)
+
+  let ret = mbedtls.mbedtls_ssl_ticket_setup(addr keys.context,
+      threadRandom, nil,
+      mbedtls.MBEDTLS_CIPHER_CHACHA20_POLY1305, uint32(rotation * 2))
+  if ret != 0:
+    raise newException(MbedtlsError, "Failed to set up session tickets: " & $ret)
+
+  # Install the previous epoch's key first so tickets issued by workers that
+  # started earlier in this epoch's predecessor are still accepted
+  let epoch = keys.currentEpoch()
+  if keys.installKey(epoch - 1) != 0 or keys.installKey(epoch) != 0:
+    raise newException(MbedtlsError, "Failed to install session ticket keys")
+
+  context.installTicketKeys(keys)
+  debug("Session tickets enabled, key rotation every " & $rotation & " seconds")
+
+proc shareSessionTickets*(context, source: MbedtlsSslContext) =
+  ## Makes a server context issue and accept the session tickets of
+  ## `source`, with the same keys and rotation. Contexts replacing another
+  ## one on reload use it, so that clients keep resuming their sessions.
+  ## Nothing happens if `source` has no session tickets.
+  if source.ticketKeys.isNil:
+    return
+  context.installTicketKeys(TicketKeys(source.ticketKeys))
@@ -0,0 +1,645 @@
+## io_uring I/O backend of the asynchronous server (Linux)
+##
+## With asyncdispatch, every TLS record costs a readiness wait, a callback
+## future and a read() or write() of its own. With this backend the server's
+## connections do their I/O through one io_uring per thread instead:
+##
+## - The listening socket is served by a single multishot accept, so a burst
+##   of connections is accepted without a syscall each
+## - Every connection owns a receive and a send buffer, taken from a pool
+##   registered with the kernel where possible. mbedTLS reads records from
+##   and writes them into these buffers, and the recv/send operations that
+##   move them are queued on the ring rather than performed right away
+## - Everything queued while the dispatcher runs callbacks is submitted in
+##   one io_uring_enter() at the end of that pass
+## - Completions are signalled through an eventfd registered with the
+##   thread's async dispatcher, so the ring runs inside the normal event loop
+##   next to timers and the remaining asyncdispatch sockets
+##
+## The backend is compiled in with `-d:obiwanUring`, which needs liburing.
+## At runtime threadRing() returns nil when the kernel doesn't offer
+## io_uring (or a sandbox forbids it), and the server carries on with
+## asyncdispatch.
+
+import asyncdispatch
+import deques
+import posix
+import ./mbedtls as mbedtls
+import ./socket
+import ../debug
+
+const
+  UringSupported* = defined(linux) and defined(obiwanUring)
+    ## Whether the backend is compiled in (Linux, built with -d:obiwanUring)
+  UringBufferSize* = 32 * 1024
+    ## Size of a connection's receive and send buffers, two full TLS records
+  DefaultRegisteredBuffers* = 128
+    ## Buffers registered with the kernel per ring (4MB of locked memory).
+    ## Connections beyond that get heap buffers, used with plain recv/send.
+  UringEntries = 256 ## Submission queue size
+  UringCqEntries = 4096 ## Completion queue size
+  CloseLingerMs = 5000 ## Time output still buffered gets to leave after close()
+
+when UringSupported:
+  {.passL: "-luring".}
+  {.pragma: uring, importc, header: "<liburing.h>".}
+
+  const IORING_CQE_F_MORE = 2'u32
+
+  type
+    IoUringRing {.importc: "struct io_uring", header: "<liburing.h>".} = object
+    IoUringSqe {.importc: "struct io_uring_sqe", header: "<liburing.h>".} = object
+    IoUringCqe {.importc: "struct io_uring_cqe", header: "<liburing.h>".} = object
+      user_data: uint64
+      res: int32
+      flags: uint32
+    IoUringParams {.importc: "struct io_uring_params", header: "<liburing.h>".} = object
+      flags: uint32
+      cq_entries: uint32
+
+  var IORING_SETUP_CQSIZE {.uring.}: uint32
+  var EFD_NONBLOCK {.importc, header: "<sys/eventfd.h>".}: cint
+  var EFD_CLOEXEC {.importc, header: "<sys/eventfd.h>".}: cint
+
+  proc eventfd(initval: cuint; flags: cint): cint {.importc, header: "<sys/eventfd.h>".}
+  proc io_uring_queue_init_params(entries: cuint; ring: ptr IoUringRing;
+                                  params: ptr IoUringParams): cint {.uring.}
+  proc io_uring_register_eventfd(ring: ptr IoUringRing; fd: cint): cint {.uring.}
+  proc io_uring_register_buffers(ring: ptr IoUringRing; iovecs: ptr IOVec;
+                                 count: cuint): cint {.uring.}
+  proc io_uring_get_sqe(ring: ptr IoUringRing): ptr IoUringSqe {.uring.}
+  proc io_uring_submit(ring: ptr IoUringRing): cint {.uring.}
+  proc io_uring_peek_batch_cqe(ring: ptr IoUringRing; cqes: ptr ptr IoUringCqe;
+                               count: cuint): cuint {.uring.}
+  proc io_uring_cq_advance(ring: ptr IoUringRing; count: cuint) {.uring.}
+  proc io_uring_sqe_set_data64(sqe: ptr IoUringSqe; data: uint64) {.uring.}
+  proc io_uring_prep_multishot_accept(sqe: ptr IoUringSqe; fd: cint; address: pointer;
+                                      addrLen: ptr SockLen; flags: cint) {.uring.}
+  proc io_uring_prep_recv(sqe: ptr IoUringSqe; fd: cint; buf: pointer; len: csize_t;
+                          flags: cint) {.uring.}
+  proc io_uring_prep_send(sqe: ptr IoUringSqe; fd: cint; buf: pointer; len: csize_t;
+                          flags: cint) {.uring.}
+  proc io_uring_prep_read_fixed(sqe: ptr IoUringSqe; fd: cint; buf: pointer; len: cuint;
+                                offset: uint64; bufIndex: cint) {.uring.}
+  proc io_uring_prep_write_fixed(sqe: ptr IoUringSqe; fd: cint; buf: pointer; len: cuint;
+                                 offset: uint64; bufIndex: cint) {.uring.}
+  proc io_uring_prep_poll_add(sqe: ptr IoUringSqe; fd: cint; mask: cuint) {.uring.}
+  proc io_uring_prep_cancel64(sqe: ptr IoUringSqe; userData: uint64; flags: cint) {.uring.}
+
+  type
+    OpKind = enum
+      ## Stored in the low bits of an operation's user data, next to the
+      ## address of the connection or acceptor it belongs to
+      opNone, opRecv, opSend, opPoll, opAccept
+
+    IoBuffer = object
+      data: ptr UncheckedArray[byte]
+      index: int ## Registered buffer index, -1 for a heap buffer
+
+    Uring* = ref object
+      ## The io_uring of one thread, driven by that thread's async dispatcher
+      ring: IoUringRing
+      eventFd: cint
+      pool: pointer ## Registered buffers, nil if registration failed
+      free: seq[int] ## Registered buffers not in use
+      flushScheduled: bool
+
+    UringConn* = ref object
+      ## A connection whose reads and writes go through the ring. Kept alive
+      ## by the kernel's references to it while operations are in flight.
+      ring: Uring
+      fd: cint
+      recvBuf, sendBuf: IoBuffer
+      recvStart, recvLen: int ## Received bytes mbedTLS hasn't read yet
+      sendLen: int ## Bytes waiting in sendBuf, written front first
+      sendInFlight: int ## Bytes of sendBuf the current send covers, 0 if none
+      recvInFlight, pollInFlight: bool
+      recvEof: bool
+      error: cint ## First errno the kernel reported, 0 if none
+      inFlight: int ## Operations the kernel still holds
+      readWaiter, writeWaiter: Future[void]
+      uncorkPending: bool ## Turn TCP_CORK off once sendBuf has drained
+      closing, closed: bool
+
+    UringAcceptor* = ref object
+      ## A multishot accept on a listening socket. Never freed, the kernel
+      ## may complete accepts for it at any time.
+      ring: Uring
+      fd: cint
+      ready: Deque[cint] ## Accepted connections not taken yet
+      waiter: Future[cint]
+      accepted: bool ## At least one accept succeeded
+      stopped: bool ## stop() was called, the accept isn't rearmed
+      unsupported*: bool ## The kernel rejected multishot accept (before 5.19)
+
+  var threadUring {.threadvar.}: Uring
+  var threadUringFailed {.threadvar.}: bool
+
+  proc tag(target: pointer; kind: OpKind): uint64 {.inline.} =
+    cast[uint64](target) or kind.uint64
+
+  proc flush(ring: Uring) =
+    ## Submits everything queued since the last flush
+    ring.flushScheduled = false
+    let ret = io_uring_submit(addr ring.ring)
+    if ret < 0:
+      debug("io_uring_submit failed: " & $strerror(-ret))
+      # Usually a full completion queue, retry once it has been reaped
+      ring.flushScheduled = true
+      callSoon(proc () = ring.flush())
+
+  proc getSqe(ring: Uring): ptr IoUringSqe =
+    ## Returns a free submission entry. Entries are submitted together at
+    ## the end of the dispatcher's current pass, or right away when the
+    ## queue runs full.
+    result = io_uring_get_sqe(addr ring.ring)
+    if result.isNil:
+      discard io_uring_submit(addr ring.ring)
+      result = io_uring_get_sqe(addr ring.ring)
+      if result.isNil:
+        raise newException(OSError, "io_uring submission queue full")
+    if not ring.flushScheduled:
+      ring.flushScheduled = true
+      callSoon(proc () = ring.flush())
+
+  proc takeBuffer(ring: Uring): IoBuffer =
+    if ring.free.len > 0:
+      result.index = ring.free.pop()
+      result.data = cast[ptr UncheckedArray[byte]](
+        cast[uint](ring.pool) + uint(result.index * UringBufferSize))
+    else:
+      result.index = -1
+      result.data = cast[ptr UncheckedArray[byte]](alloc(UringBufferSize))
+
+  proc giveBack(ring: Uring; buffer: var IoBuffer) =
+    if buffer.data.isNil:
+      return
+    if buffer.index >= 0:
+      ring.free.add(buffer.index)
+    else:
+      dealloc(buffer.data)
+    buffer.data = nil
+
+  # Connections
+
+  proc fail(conn: UringConn; err: cint) {.inline.} =
+    if conn.error == 0:
+      conn.error = err
+
+  proc wakeReader(conn: UringConn) =
+    if not conn.readWaiter.isNil:
+      let waiter = conn.readWaiter
+      conn.readWaiter = nil
+      waiter.complete()
+
+  proc wakeWriter(conn: UringConn) =
+    if not conn.writeWaiter.isNil:
+      let waiter = conn.writeWaiter
+      conn.writeWaiter = nil
+      waiter.complete()
+
+  proc failWaiters(conn: UringConn) =
+    ## Fails the waits still pending on a closed connection, so that the
+    ## operation a deadline gave up on doesn't resume on its TLS state
+    for waiter in [conn.readWaiter, conn.writeWaiter]:
+      if not waiter.isNil:
+        waiter.fail(newException(OSError, "Connection closed"))
+    conn.readWaiter = nil
+    conn.writeWaiter = nil
+
+  proc opStarted(conn: UringConn) {.inline.} =
+    if conn.inFlight == 0:
+      GC_ref(conn)
+    inc conn.inFlight
+
+  proc opDone(conn: UringConn) =
+    dec conn.inFlight
+    if conn.inFlight == 0:
+      if conn.closed:
+        conn.ring.giveBack(conn.recvBuf)
+        conn.ring.giveBack(conn.sendBuf)
+      GC_unref(conn) # May free the connection, must come last
+
+  proc submitRecv(conn: UringConn) =
+    let sqe = conn.ring.getSqe()
+    if conn.recvBuf.index >= 0:
+      io_uring_prep_read_fixed(sqe, conn.fd, conn.recvBuf.data, UringBufferSize.cuint,
+                               0, conn.recvBuf.index.cint)
+    else:
+      io_uring_prep_recv(sqe, conn.fd, conn.recvBuf.data, UringBufferSize.csize_t, 0)
+    io_uring_sqe_set_data64(sqe, tag(cast[pointer](conn), opRecv))
+    conn.recvInFlight = true
+    conn.opStarted()
+
+  proc submitSend(conn: UringConn) =
+    let sqe = conn.ring.getSqe()
+    if conn.sendBuf.index >= 0:
+      io_uring_prep_write_fixed(sqe, conn.fd, conn.sendBuf.data, conn.sendLen.cuint,
+                                0, conn.sendBuf.index.cint)
+    else:
+      io_uring_prep_send(sqe, conn.fd, conn.sendBuf.data, conn.sendLen.csize_t,
+                         MSG_NOSIGNAL)
+    io_uring_sqe_set_data64(sqe, tag(cast[pointer](conn), opSend))
+    conn.sendInFlight = conn.sendLen
+    conn.opStarted()
+
+  proc submitPoll(conn: UringConn; events: cshort) =
+    let sqe = conn.ring.getSqe()
+    io_uring_prep_poll_add(sqe, conn.fd, events.cuint)
+    io_uring_sqe_set_data64(sqe, tag(cast[pointer](conn), opPoll))
+    conn.pollInFlight = true
+    conn.opStarted()
+
+  proc cancel(conn: UringConn; kind: OpKind) =
+    try:
+      let sqe = conn.ring.getSqe()
+      io_uring_prep_cancel64(sqe, tag(cast[pointer](conn), kind), 0)
+      io_uring_sqe_set_data64(sqe, 0) # Nothing to do when the cancel completes
+    except OSError:
+      debug("Could not cancel io_uring operation: " & getCurrentExceptionMsg())
+
+  proc finish(conn: UringConn) =
+    ## Closes the socket, cancelling whatever is still in flight. The
+    ## buffers go back to the ring once the kernel has let go of them.
+    if conn.closed:
+      return
+    conn.closed = true
+    if conn.recvInFlight: conn.cancel(opRecv)
+    if conn.sendInFlight > 0: conn.cancel(opSend)
+    if conn.pollInFlight: conn.cancel(opPoll)
+    # The ring holds its own references to the socket, it really closes
+    # once the cancelled operations have completed
+    discard posix.close(conn.fd)
+    conn.failWaiters()
+    if conn.inFlight == 0:
+      conn.ring.giveBack(conn.recvBuf)
+      conn.ring.giveBack(conn.sendBuf)
+
+  proc completed(conn: UringConn; kind: OpKind; res: int32) =
+    case kind
+    of opRecv:
+      conn.recvInFlight = false
+      if res > 0:
+        conn.recvStart = 0
+        conn.recvLen = res.int
+      elif res == 0:
+        conn.recvEof = true
+      else:
+        conn.fail(-res)
+      conn.wakeReader()
+    of opSend:
+      conn.sendInFlight = 0
+      if res > 0:
+        # Keep what the kernel didn't take, and what was added meanwhile
+        conn.sendLen -= res.int
+        if conn.sendLen > 0:
+          moveMem(addr conn.sendBuf.data[0], addr conn.sendBuf.data[res.int], conn.sendLen)
+      else:
+        conn.fail(if res == 0: EPIPE else: -res)
+        conn.sendLen = 0
+      if conn.sendLen > 0 and not conn.closed:
+        try:
+          conn.submitSend()
+        except OSError:
+          conn.fail(EIO)
+          conn.sendLen = 0
+      conn.wakeWriter() # Before finish(), the output did go out
+      if conn.sendLen == 0:
+        if conn.uncorkPending and not conn.closed:
+          conn.uncorkPending = false
+          setCork(conn.fd, false)
+        if conn.closing:
+          conn.finish()
+    of opPoll:
+      conn.pollInFlight = false
+      if res < 0:
+        conn.fail(-res)
+      conn.wakeWriter()
+    else:
+      discard
+    conn.opDone()
+
+  # Acceptors
+
+  proc arm(acceptor: UringAcceptor) =
+    let sqe = acceptor.ring.getSqe()
+    io_uring_prep_multishot_accept(sqe, acceptor.fd, nil, nil,
+                                   SOCK_NONBLOCK or SOCK_CLOEXEC)
+    io_uring_sqe_set_data64(sqe, tag(cast[pointer](acceptor), opAccept))
+
+  proc completed(acceptor: UringAcceptor; res: int32; flags: uint32) =
+    if res >= 0 and acceptor.stopped:
+      # Accepted before the cancel took effect, nobody will take it
+      discard posix.close(res.cint)
+    elif res >= 0:
+      acceptor.accepted = true
+      acceptor.ready.addLast(res.cint)
+    elif acceptor.stopped:
+      discard
+    elif -res == EINVAL and not acceptor.accepted:
+      acceptor.unsupported = true
+    else:
+      debug("io_uring accept failed: " & $strerror(-res))
+
+    if not acceptor.waiter.isNil:
+      let waiter = acceptor.waiter
+      if acceptor.ready.len > 0:
+        acceptor.waiter = nil
+        waiter.complete(acceptor.ready.popFirst())
+      elif acceptor.unsupported:
+        acceptor.waiter = nil
+        waiter.fail(newException(OSError, "Multishot accept is not supported"))
+
+    # The kernel ends a multishot accept on errors; wait a bit before
+    # rearming it, like the asyncdispatch accept loop does
+    if (flags and IORING_CQE_F_MORE) == 0 and not acceptor.unsupported and
+        not acceptor.stopped:
+      if res >= 0:
+        acceptor.arm()
+      else:
+        sleepAsync(500).addCallback(proc () = acceptor.arm())
+
+  # The ring
+
+  proc reap(ring: Uring) =
+    ## Handles every completion waiting in the queue
+    var cqes: array[64, ptr IoUringCqe]
+    while true:
+      let count = io_uring_peek_batch_cqe(addr ring.ring, addr cqes[0], cqes.len.cuint).int
+      if count == 0:
+        break
+      for i in 0 ..< count:
+        let data = cqes[i].user_data
+        let res = cqes[i].res
+        let flags = cqes[i].flags
+        let kind = OpKind(data and 7)
+        let target = cast[pointer](data and not 7'u64)
+        case kind
+        of opAccept:
+          let acceptor {.cursor.} = cast[UringAcceptor](target)
+          acceptor.completed(res, flags)
+        of opRecv, opSend, opPoll:
+          let conn {.cursor.} = cast[UringConn](target)
+          conn.completed(kind, res)
+        of opNone:
+          discard
+      io_uring_cq_advance(addr ring.ring, count.cuint)
+
+  proc registerPool(ring: Uring; count: int) =
+    ## Registers `count` buffers with the kernel, so recv and send don't
+    ## have to map the connection's pages for every operation
+    if count <= 0:
+      return
+    let size = count * UringBufferSize
+    let pool = mmap(nil, size, PROT_READ or PROT_WRITE, MAP_PRIVATE or MAP_ANONYMOUS, -1, 0)
+    if pool == MAP_FAILED:
+      debug("io_uring: could not allocate buffers: " & $strerror(errno))
+      return
+    var iovecs = newSeq[IOVec](count)
+    for i in 0 ..< count:
+      iovecs[i].iov_base = cast[pointer](cast[uint](pool) + uint(i * UringBufferSize))
+      iovecs[i].iov_len = typeof(iovecs[i].iov_len)(UringBufferSize)
+    let ret = io_uring_register_buffers(addr ring.ring, addr iovecs[0], count.cuint)
+    if ret < 0:
+      # Most likely RLIMIT_MEMLOCK, connections use heap buffers then
+      debug("io_uring: could not register buffers: " & $strerror(-ret))
+      discard munmap(pool, size)
+      return
+    ring.pool = pool
+    for i in countdown(count - 1, 0):
+      ring.free.add(i)
+
+  proc threadRing*(registeredBuffers = DefaultRegisteredBuffers): Uring =
+    ## Returns the calling thread's ring, setting it up on first use.
+    ##
+    ## Parameters:
+    ##   registeredBuffers: Connection buffers to register with the kernel
+    ##                      when the ring is created
+    ##
+    ## Returns:
+    ##   The ring, or nil if io_uring isn't available, in which case the
+    ##   caller should use asyncdispatch
+    if not threadUring.isNil or threadUringFailed:
+      return threadUring
+
+    let ring = Uring(eventFd: -1)
+    var params: IoUringParams
+    params.flags = IORING_SETUP_CQSIZE
+    params.cq_entries = UringCqEntries
+    var ret = io_uring_queue_init_params(UringEntries, addr ring.ring, addr params)
+    if ret < 0:
+      debug("io_uring unavailable: " & $strerror(-ret))
+      threadUringFailed = true
+      return nil
+
+    ring.eventFd = eventfd(0, EFD_NONBLOCK or EFD_CLOEXEC)
+    ret = if ring.eventFd < 0: -errno
+          else: io_uring_register_eventfd(addr ring.ring, ring.eventFd)
+    if ret < 0:
+      debug("io_uring: could not register eventfd: " & $strerror(-ret))
+      threadUringFailed = true
+      return nil
+    ring.registerPool(registeredBuffers)
+
+    # Completions raise the eventfd, which the dispatcher watches like any
+    # other descriptor
+    register(AsyncFD(ring.eventFd))
+    addRead(AsyncFD(ring.eventFd), proc (fd: AsyncFD): bool =
+      var counter: uint64
+      discard posix.read(ring.eventFd, addr counter, sizeof(counter))
+      ring.reap()
+      false)
+
+    debug("io_uring backend ready, " & $ring.free.len & " registered buffers")
+    threadUring = ring
+    result = ring
+
+  proc newConn*(ring: Uring; fd: cint): UringConn =
+    ## Moves the I/O of connected socket `fd` to the ring. The connection
+    ## owns `fd` from now on, close() closes it.
+    result = UringConn(ring: ring, fd: fd)
+    result.recvBuf = ring.takeBuffer()
+    result.sendBuf = ring.takeBuffer()
+
+  proc bioSend*(ctx: pointer; buf: pointer; len: uint): cint {.cdecl.} =
+    ## mbedTLS send callback. Appends to the connection's send buffer and
+    ## queues a send for it, so a record costs no syscall of its own.
+    let conn {.cursor.} = cast[UringConn](ctx)
+    if conn.error != 0 or conn.closed:
+      return mbedtls.MBEDTLS_ERR_NET_SEND_FAILED
+    let count = min(len.int, UringBufferSize - conn.sendLen)
+    if count == 0:
+      return mbedtls.MBEDTLS_ERR_SSL_WANT_WRITE
+    copyMem(addr conn.sendBuf.data[conn.sendLen], buf, count)
+    conn.sendLen += count
+    if conn.sendInFlight == 0:
+      try:
+        conn.submitSend()
+      except OSError:
+        conn.sendLen -= count # Not taken, nothing would ever send it
+        return mbedtls.MBEDTLS_ERR_NET_SEND_FAILED
+    count.cint
+
+  proc bioRecv*(ctx: pointer; buf: pointer; len: uint): cint {.cdecl.} =
+    ## mbedTLS receive callback. Serves what the last recv brought in, and
+    ## queues the next one once that is used up.
+    let conn {.cursor.} = cast[UringConn](ctx)
+    if conn.recvLen > 0:
+      let count = min(len.int, conn.recvLen)
+      copyMem(buf, addr conn.recvBuf.data[conn.recvStart], count)
+      conn.recvStart += count
+      conn.recvLen -= count
+      return count.cint
+    if conn.recvEof:
+      return 0
+    if conn.error != 0 or conn.closed:
+      return mbedtls.MBEDTLS_ERR_NET_RECV_FAILED
+    if not conn.recvInFlight:
+      try:
+        conn.submitRecv()
+      except OSError:
+        return mbedtls.MBEDTLS_ERR_NET_RECV_FAILED
+    mbedtls.MBEDTLS_ERR_SSL_WANT_READ
+
+  proc waitReadable*(conn: UringConn): Future[void] =
+    ## Completes once mbedTLS can read more, see bioRecv()
+    result = newFuture[void]("uring.waitReadable")
+    if conn.recvLen > 0 or conn.recvEof or conn.error != 0 or conn.closed:
+      result.complete()
+      return
+    if not conn.recvInFlight:
+      try:
+        conn.submitRecv()
+      except OSError as e:
+        result.fail(e)
+        return
+    conn.wakeReader() # Only one reader at a time, wake a stale one
+    conn.readWaiter = result
+
+  proc waitWritable*(conn: UringConn): Future[void] =
+    ## Completes once the send buffer has room again, or, with nothing of
+    ## ours queued (kernel TLS writing directly), once the socket has
+    result = newFuture[void]("uring.waitWritable")
+    if conn.error != 0 or conn.closed:
+      result.complete()
+      return
+    if conn.sendLen > 0 and conn.sendInFlight == 0:
+      # Only a send completing wakes the writer, so there has to be one
+      try:
+        conn.submitSend()
+      except OSError as e:
+        result.fail(e)
+        return
+    elif conn.sendLen == 0 and not conn.pollInFlight:
+      try:
+        conn.submitPoll(POLLOUT)
+      except OSError as e:
+        result.fail(e)
+        return
+    conn.wakeWriter()
+    conn.writeWaiter = result
+
+  proc pendingOutput*(conn: UringConn): int {.inline.} =
+    ## Bytes mbedTLS has written that haven't reached the socket yet
+    conn.sendLen
+
+  proc drain*(conn: UringConn) {.async.} =
+    ## Waits until everything written so far has reached the socket
+    while conn.sendLen > 0 and conn.error == 0 and not conn.closed:
+      await conn.waitWritable()
+
+  proc cork*(conn: UringConn) =
+    ## Turns TCP_CORK on, see MbedtlsAsyncSocket.cork()
+    conn.uncorkPending = false
+    setCork(conn.fd, true)
+
+  proc uncork*(conn: UringConn) =
+    ## Turns TCP_CORK off once the send buffer has drained, so the last
+    ## partial segment isn't pushed out before the data meant to fill it
+    if conn.sendLen == 0 or conn.closed:
+      conn.uncorkPending = false
+      if not conn.closed:
+        setCork(conn.fd, false)
+    else:
+      conn.uncorkPending = true
+
+  proc close*(conn: UringConn) =
+    ## Closes the connection once its buffered output has been sent, or
+    ## after CloseLingerMs if the peer doesn't take it
+    if conn.closing or conn.closed:
+      return
+    conn.closing = true
+    if conn.sendLen == 0 or conn.error != 0:
+      conn.finish()
+    else:
+      sleepAsync(CloseLingerMs).addCallback(proc () = conn.finish())
+
+  proc newAcceptor*(ring: Uring; fd: cint): UringAcceptor =
+    ## Starts a multishot accept on listening socket `fd`. Connections
+    ## arrive non-blocking and close-on-exec.
+    result = UringAcceptor(ring: ring, fd: fd, ready: initDeque[cint]())
+    GC_ref(result)
+    result.arm()
+
+  proc accept*(acceptor: UringAcceptor): Future[cint] =
+    ## Returns the next accepted connection.
+    ##
+    ## Raises:
+    ##   OSError: If the kernel doesn't support multishot accept, `unsupported`
+    ##            is set then and the caller should accept another way
+    result = newFuture[cint]("uring.accept")
+    if acceptor.ready.len > 0:
+      result.complete(acceptor.ready.popFirst())
+    elif acceptor.unsupported:
+      result.fail(newException(OSError, "Multishot accept is not supported"))
+    else:
+      acceptor.waiter = result
+
+  proc stop*(acceptor: UringAcceptor): seq[cint] =
+    ## Cancels the multishot accept. Closing the listening socket doesn't
+    ## end it, since the kernel holds its own reference to the socket.
+    ##
+    ## Returns:
+    ##   The connections accepted but not taken by accept() yet
+    acceptor.stopped = true
+    try:
+      let sqe = acceptor.ring.getSqe()
+      io_uring_prep_cancel64(sqe, tag(cast[pointer](acceptor), opAccept), 0)
+      io_uring_sqe_set_data64(sqe, 0) # Nothing to do when the cancel completes
+    except OSError:
+      debug("Could not cancel io_uring accept: " & getCurrentExceptionMsg())
+    while acceptor.ready.len > 0:
+      result.add(acceptor.ready.popFirst())
+
+else:
+  type
+    Uring* = ref object
+      ## Stand-in where the backend isn't compiled in
+    UringConn* = ref object
+    UringAcceptor* = ref object
+      unsupported*: bool
+
+  proc threadRing*(registeredBuffers = DefaultRegisteredBuffers): Uring =
+    ## Always nil, the server uses asyncdispatch
+    nil
+
+  proc newConn*(ring: Uring; fd: cint): UringConn = nil
+  proc bioSend*(ctx: pointer; buf: pointer; len: uint): cint {.cdecl.} =
+    mbedtls.MBEDTLS_ERR_NET_SEND_FAILED
+  proc bioRecv*(ctx: pointer; buf: pointer; len: uint): cint {.cdecl.} =
+    mbedtls.MBEDTLS_ERR_NET_RECV_FAILED
+  proc waitReadable*(conn: UringConn): Future[void] =
+    result = newFuture[void]("uring.waitReadable")
+    result.fail(newException(OSError, "io_uring backend not compiled in"))
+  proc waitWritable*(conn: UringConn): Future[void] =
+    waitReadable(conn)
+  proc pendingOutput*(conn: UringConn): int = 0
+  proc drain*(conn: UringConn) {.async.} = discard
+  proc cork*(conn: UringConn) = discard
+  proc uncork*(conn: UringConn) = discard
+  proc close*(conn: UringConn) = discard
+  proc newAcceptor*(ring: Uring; fd: cint): UringAcceptor = nil
+  proc accept*(acceptor: UringAcceptor): Future[cint] =
+    result = newFuture[cint]("uring.accept")
+    result.fail(newException(OSError, "io_uring backend not compiled in"))
+  proc stop*(acceptor: UringAcceptor): seq[cint] = @[]
@@ -0,0 +1,199 @@
+## Trust-On-First-Use store of known hosts and clients
+##
+## Gemini servers mostly use self-signed certificates, so clients trust the
+## certificate a host presents the first time and expect the same one
+## afterwards. Servers can do the same with client certificates. A
+## KnownHosts store remembers the fingerprint (see tls/socket.fingerprint)
+## trusted for each key: "host:port" for servers, any name without
+## whitespace for clients.
+##
+## The store is an append-only log of `<key> <fingerprint>` lines, the last
+## line for a key winning, and `<key> -` forgetting it. Opening it replays
+## the log into hash tables, so every check afterwards is a lookup in
+## memory, at any number of entries, and trusting a new key appends one
+## line. compact() rewrites the log with only the current entries.
+##
+## A KnownHosts store can be shared by the worker threads of the
+## synchronous server; every operation takes the store's lock.
+##
+## Example:
+##   ```nim
+##   let known = openKnownHosts(getHomeDir() / ".config/obiwan/known_hosts")
+##   let response = client.request("gemini://example.com/")
+##   case known.checkOrTrust(hostKey("example.com", 1965), response.certificate.fingerprint)
+##   of trustNew: echo "Trusting example.com from now on"
+##   of trustKnown: discard
+##   of trustChanged: echo "WARNING: the certificate of example.com changed"
+##   ```
+
+import std/locks
+import std/os
+import std/strutils
+import std/tables
+
+type
+  TrustResult* = enum
+    ## How a fingerprint compares to the trusted one
+    trustNew,    ## The key has no trusted fingerprint yet
+    trustKnown,  ## The fingerprint is the trusted one
+    trustChanged ## The key trusts another fingerprint
+
+  KnownHosts* = ref object
+    ## Fingerprints trusted by key, backed by an append-only log
+    path*: string                        ## File of the log
+    lock: Lock
+    log: File                            # Open for appending
+    entries: Table[string, string]       # Key -> fingerprint
+    owners: Table[string, string]        # Fingerprint -> key trusting it
+    logLines: int                        # Lines in the log, for compact()
+
+proc hostKey*(host: string; port = 1965): string =
+  ## The key of a server: its host name in lowercase and its port
+  host.toLowerAscii() & ":" & $port
+
+proc validKey(key: string): bool =
+  key.len > 0 and key.find(Whitespace) < 0
+
+proc setLocked(store: KnownHosts; key, fingerprint: string) =
+  let previous = store.entries.getOrDefault(key)
+  if previous.len > 0 and store.owners.getOrDefault(previous) == key:
+    store.owners.del(previous)
+  if fingerprint.len == 0:
+    store.entries.del(key)
+  else:
+    store.entries[key] = fingerprint
+    store.owners[fingerprint] = key
+
+proc replay(store: KnownHosts; line: string) =
+  ## Applies a line of the log; blank, comment and broken lines are skipped
+  let fields = line.splitWhitespace()
+  if fields.len != 2 or fields[0].startsWith('#'):
+    return
+  store.setLocked(fields[0], if fields[1] == "-": "" else: fields[1])
+  inc store.logLines
+
+proc openKnownHosts*(path: string): KnownHosts =
+  ## Opens a known hosts store, creating its log (and directory) if needed.
+  ##
+  ## Parameters:
+  ##   path: File of the append-only log
+  ##
+  ## Returns:
+  ##   The store, with the entries of the log loaded
+  ##
+  ## Raises:
+  ##   IOError: If the log can't be read or opened for appending
+  result = KnownHosts(path: path)
+  initLock(result.lock)
+  if fileExists(path):
+    for line in lines(path):
+      result.replay(line)
+  else:
+    let dir = parentDir(path)
+    if dir.len > 0:
+      createDir(dir)
+  result.log = open(path, fmAppend)
+
+proc append(store: KnownHosts; key, value: string) =
+  ## Writes a line to the log. Flushed at once, so that it survives a crash.
+  store.log.write(key & " " & value & "\n")
+  store.log.flushFile()
+  inc store.logLines
+
+proc len*(store: KnownHosts): int =
+  ## Returns the number of trusted keys
+  withLock store.lock:
+    result = store.entries.len
+
+proc lookup*(store: KnownHosts; key: string): string =
+  ## Returns the fingerprint `key` trusts, or "" if there is none
+  withLock store.lock:
+    result = store.entries.getOrDefault(key)
+
+proc owner*(store: KnownHosts; fingerprint: string): string =
+  ## Returns the key that last trusted `fingerprint`, or "" if none does.
+  ## Servers use it to recognize client certificates.
+  withLock store.lock:
+    result = store.owners.getOrDefault(fingerprint)
+
+proc check*(store: KnownHosts; key, fingerprint: string): TrustResult =
+  ## Compares a fingerprint with the one `key` trusts, without changing
+  ## the store.
+  withLock store.lock:
+    let trusted = store.entries.getOrDefault(key)
+    result = if trusted.len == 0: trustNew
+             elif trusted == fingerprint: trustKnown
+             else: trustChanged
+
+proc trust*(store: KnownHosts; key, fingerprint: string) =
+  ## Trusts `fingerprint` for `key` from now on, replacing the fingerprint
+  ## it trusted before.
+  ##
+  ## Raises:
+  ##   ValueError: If the key or fingerprint is empty or contains whitespace
+  if not validKey(key) or not validKey(fingerprint) or fingerprint == "-":
+    raise newException(ValueError, "Invalid known host entry: " & key & " " & fingerprint)
+  withLock store.lock:
+    if store.entries.getOrDefault(key) != fingerprint:
+      store.append(key, fingerprint)
+      store.setLocked(key, fingerprint)
+
+proc checkOrTrust*(store: KnownHosts; key, fingerprint: string): TrustResult =
+  ## The usual TOFU check: a key seen for the first time trusts the
+  ## fingerprint it comes with, a known key must come with the same one.
+  ## A changed fingerprint is reported and left for the caller to trust().
+  ##
+  ## Returns:
+  ##   trustNew if the fingerprint was trusted now, trustKnown if it was
+  ##   already, trustChanged if the key trusts another one
+  ##
+  ## Raises:
+  ##   ValueError: If the key or fingerprint is empty or contains whitespace
+  if not validKey(key) or not validKey(fingerprint) or fingerprint == "-":
+    raise newException(ValueError, "Invalid known host entry: " & key & " " & fingerprint)
+  withLock store.lock:
+    let trusted = store.entries.getOrDefault(key)
+    if trusted.len == 0:
+      store.append(key, fingerprint)
+      store.setLocked(key, fingerprint)
+      result = trustNew
+    elif trusted == fingerprint:
+      result = trustKnown
+    else:
+      result = trustChanged
+
+proc forget*(store: KnownHosts; key: string) =
+  ## Removes the fingerprint `key` trusts, if any
+  withLock store.lock:
+    if key in store.entries:
+      store.append(key, "-")
+      store.setLocked(key, "")
+
+proc compact*(store: KnownHosts) =
+  ## Rewrites the log with one line per trusted key, dropping the lines of
+  ## replaced and forgotten entries. The new log replaces the old one
+  ## atomically.
+  ##
+  ## Raises:
+  ##   IOError, OSError: If the new log can't be written
+  withLock store.lock:
+    if store.logLines == store.entries.len:
+      return
+    let temporary = store.path & ".tmp"
+    var output = open(temporary, fmWrite)
+    try:
+      for key, fingerprint in store.entries:
+        output.write(key & " " & fingerprint & "\n")
+    finally:
+      output.close()
+    store.log.close()
+    moveFile(temporary, store.path)
+    store.log = open(store.path, fmAppend)
+    store.logLines = store.entries.len
+
+proc close*(store: KnownHosts) =
+  ## Closes the log. The store can't be changed afterwards.
+  withLock store.lock:
+    if not store.log.isNil:
+      store.log.close()
+      store.log = nil
@@ -0,0 +1,331 @@
+## Listener handover to upgraded binaries
+##
+## A deploy replaces the running server without closing its listening
+## sockets. The old process forks and executes the binary on disk, the new
+## version, again with its own command line, passing it:
+##
+## - OBIWAN_LISTEN_FDS: The listening sockets, as comma-separated file
+##   descriptors left open across exec
+## - OBIWAN_SECRET_FD: The read end of a pipe holding the secret session
+##   ticket keys are derived from, so that tickets issued by the old process
+##   still resume. It doesn't go in the environment, which other processes
+##   of the same user can read in /proc/<pid>/environ.
+## - OBIWAN_READY_FD: The write end of a pipe the new process writes to once
+##   it accepts connections
+##
+## The new process takes the sockets over with takeHandover() and accepts on
+## them right away; connections are queued in the kernel meanwhile, none are
+## refused. Once it called notifyReady(), the old process stops accepting
+## and drains its open connections (see AsyncObiwanServer.stopAccepting). If
+## the new process exits or doesn't get ready in time, it is killed and the
+## old one keeps serving.
+##
+## The module also keeps the flags of the control signals the server reacts
+## to: SIGHUP reloads the configuration and certificates, SIGUSR2 upgrades
+## and SIGQUIT drains and exits.
+##
+## Example:
+##   ```nim
+##   var handover = takeHandover()
+##   if handover.listeners.len > 0:
+##     server.listenFd = handover.listeners[0]
+##   # ... once the server accepts connections
+##   handover.notifyReady()
+##   ```
+
+import std/posix
+import std/os
+import std/strutils
+import std/nativesockets
+import std/net
+import std/monotimes
+import std/times
+
+const
+  ListenFdsVar* = "OBIWAN_LISTEN_FDS"         ## Environment variable of the handed over sockets
+  ReadyFdVar* = "OBIWAN_READY_FD"             ## Environment variable of the readiness pipe
+  SecretFdVar* = "OBIWAN_SECRET_FD"           ## Environment variable of the session ticket secret pipe
+  MaxSecretLength = 4096                      # Longest secret read from the pipe
+  DefaultUpgradeTimeoutMs* = 30_000           ## Time a new process gets to become ready
+
+type
+  Handover* = object
+    ## What a process started by spawnUpgrade() inherited
+    listeners*: seq[cint]  ## Listening sockets to accept on, empty when started normally
+    sessionSecret*: string ## Session ticket secret of the previous process, or ""
+    readyFd: cint          # Readiness pipe, -1 once notified or when started normally
+
+  UpgradeState* = enum
+    ## Progress of a new process started by spawnUpgrade()
+    usPending, ## Starting, not accepting yet
+    usReady,   ## Accepting connections; the old process can stop
+    usFailed   ## Exited or didn't get ready in time, and was reaped
+
+  Upgrade* = object
+    ## A new process started by spawnUpgrade()
+    pid*: Pid              ## Process ID of the new process
+    state*: UpgradeState   ## Its progress, updated by refresh() and wait()
+    readFd: cint           # Read end of the readiness pipe
+    deadline: MonoTime
+
+  ControlSignal* = enum
+    ## Signals the server reacts to while serving
+    csReload,  ## SIGHUP: reload the configuration and certificates
+    csUpgrade, ## SIGUSR2: hand the listeners to a new binary
+    csDrain    ## SIGQUIT: stop accepting, finish open connections and exit
+
+var pendingSignals: array[ControlSignal, bool]
+
+proc setInheritable(fd: cint; inheritable: bool) =
+  ## Sets or clears FD_CLOEXEC on a descriptor
+  let flags = fcntl(fd, F_GETFD)
+  if flags >= 0:
+    discard fcntl(fd, F_SETFD, if inheritable: flags and not FD_CLOEXEC
+                               else: flags or FD_CLOEXEC)
+
+proc parseFd(value, variable: string): cint =
+  try:
+    result = parseInt(value.strip()).cint
+  except ValueError:
+    raise newException(ValueError, "Invalid descriptor in " & variable & ": " & value)
+  if result < 0 or fcntl(result, F_GETFD) < 0:
+    raise newException(ValueError, "Descriptor " & value & " in " & variable & " isn't open")
+
+proc readSecret(fd: cint): string =
+  ## Reads the session ticket secret from its pipe, up to its end
+  var buffer: array[256, char]
+  while result.len < MaxSecretLength:
+    let count = posix.read(fd, addr buffer[0], buffer.len)
+    if count > 0:
+      result.add(buffer.toOpenArray(0, count - 1))
+    elif count == 0 or errno != EINTR:
+      break
+  discard posix.close(fd)
+
+proc takeHandover*(): Handover =
+  ## Takes over what the previous process handed to this one, and removes
+  ## it from the environment so that processes started from this one don't
+  ## inherit it.
+  ##
+  ## Returns:
+  ##   The inherited listening sockets, session secret and readiness pipe;
+  ##   with no listeners when the process wasn't started by an upgrade
+  ##
+  ## Raises:
+  ##   ValueError: If a variable names a descriptor that isn't open
+  result.readyFd = -1
+  let listeners = getEnv(ListenFdsVar)
+  let ready = getEnv(ReadyFdVar)
+  let secret = getEnv(SecretFdVar)
+  delEnv(ListenFdsVar)
+  delEnv(ReadyFdVar)
+  delEnv(SecretFdVar)
+
+  if listeners.len > 0:
+    for value in listeners.split(','):
+      let fd = parseFd(value, ListenFdsVar)
+      setInheritable(fd, false)
+      result.listeners.add(fd)
+  if ready.len > 0:
+    result.readyFd = parseFd(ready, ReadyFdVar)
+    setInheritable(result.readyFd, false)
+  if secret.len > 0:
+    result.sessionSecret = readSecret(parseFd(secret, SecretFdVar))
+
+proc notifyReady*(handover: var Handover) =
+  ## Tells the previous process that this one accepts connections, so it
+  ## can stop. Does nothing when there is no previous process, or the second
+  ## time.
+  if handover.readyFd < 0:
+    return
+  var ready = 'R'
+  discard posix.write(handover.readyFd, addr ready, 1)
+  discard posix.close(handover.readyFd)
+  handover.readyFd = -1
+
+proc bindListener*(port: int; address = ""; ipv6 = false; reuseAddr = true;
+                   reusePort = false): cint =
+  ## Creates a listening socket for processes to share, bound the way
+  ## AsyncObiwanServer.serve() binds its own
+  ##
+  ## Parameters:
+  ##   port: The port to listen on
+  ##   address: Address to bind to ("" for all, "::" for IPv6)
+  ##   ipv6: Whether to use IPv6 when binding to all addresses
+  ##   reuseAddr: Whether to set SO_REUSEADDR
+  ##   reusePort: Whether to set SO_REUSEPORT, for several listeners on the port
+  ##
+  ## Returns:
+  ##   The file descriptor of the listening socket, closed on exec
+  ##
+  ## Raises:
+  ##   OSError: If the socket can't be bound
+  let useIPv6 = ipv6 or address == "::" or address.contains('[') or address.count(':') > 1
+  let socket = newSocket(if useIPv6: Domain.AF_INET6 else: Domain.AF_INET)
+  try:
+    if reuseAddr:
+      socket.setSockOpt(OptReuseAddr, true)
+    if reusePort:
+      socket.setSockOpt(OptReusePort, true)
+    let bindAddr = if address == "" or address == "0.0.0.0":
+                     if useIPv6: "::" else: "0.0.0.0"
+                   else:
+                     address
+    socket.bindAddr(Port(port), bindAddr)
+    socket.listen()
+  except OSError:
+    socket.close()
+    raise
+  socket.getFd().cint
+
+proc executable(): string =
+  ## The binary to start: the one the process was started as, which a
+  ## deploy replaced. /proc/self/exe would still name the old one.
+  result = paramStr(0)
+  if '/' notin result:
+    result = findExe(result)
+
+proc spawnUpgrade*(listeners: openArray[cint]; sessionSecret: string;
+                   timeoutMs = DefaultUpgradeTimeoutMs): Upgrade =
+  ## Starts the binary on disk with the same command line, handing it the
+  ## listening sockets. The caller keeps accepting on them until refresh() or
+  ## wait() report the new process ready.
+  ##
+  ## Parameters:
+  ##   listeners: Listening sockets for the new process to accept on
+  ##   sessionSecret: Secret the session ticket keys are derived from
+  ##   timeoutMs: Time the new process gets to become ready before it is killed
+  ##
+  ## Returns:
+  ##   The pending upgrade
+  ##
+  ## Raises:
+  ##   OSError: If the pipes or the process can't be created
+  var fds: array[2, cint]
+  if pipe(fds) != 0:
+    raiseOSError(osLastError(), "Failed to create the upgrade pipe")
+  setInheritable(fds[0], false)
+  setInheritable(fds[1], false)
+
+  # The secret fits in the pipe's buffer, so it's written and the write end
+  # closed before forking: the new process reads it up to the end
+  var secretFds: array[2, cint]
+  if pipe(secretFds) != 0:
+    let error = osLastError()
+    discard posix.close(fds[0])
+    discard posix.close(fds[1])
+    raiseOSError(error, "Failed to create the secret pipe")
+  setInheritable(secretFds[0], false)
+  setInheritable(secretFds[1], false)
+  let length = min(sessionSecret.len, MaxSecretLength) # All the new process reads
+  var written = 0
+  while written < length:
+    let count = posix.write(secretFds[1], unsafeAddr sessionSecret[written],
+                            length - written)
+    if count > 0:
+      written += count
+    elif errno != EINTR:
+      break
+  discard posix.close(secretFds[1])
+
+  # Prepared before forking, the child only calls async-signal-safe functions
+  let path = executable()
+  var fdList: seq[string]
+  for fd in listeners:
+    fdList.add($fd)
+  var arguments = @[path]
+  arguments.add(commandLineParams())
+  var environment: seq[string]
+  for name, value in envPairs():
+    if name notin [ListenFdsVar, ReadyFdVar, SecretFdVar]:
+      environment.add(name & "=" & value)
+  environment.add(ListenFdsVar & "=" & fdList.join(","))
+  environment.add(ReadyFdVar & "=" & $fds[1])
+  environment.add(SecretFdVar & "=" & $secretFds[0])
+  let argv = allocCStringArray(arguments)
+  let envp = allocCStringArray(environment)
+  defer:
+    deallocCStringArray(argv)
+    deallocCStringArray(envp)
+
+  let pid = fork()
+  if pid < 0:
+    let error = osLastError()
+    discard posix.close(fds[0])
+    discard posix.close(fds[1])
+    discard posix.close(secretFds[0])
+    raiseOSError(error, "Failed to fork the upgraded server")
+
+  if pid == 0:
+    for fd in listeners:
+      setInheritable(fd, true)
+    setInheritable(fds[1], true)
+    setInheritable(secretFds[0], true)
+    discard execve(path.cstring, argv, envp)
+    exitnow(127)
+
+  discard posix.close(fds[1])
+  discard posix.close(secretFds[0])
+  result = Upgrade(pid: pid, state: usPending, readFd: fds[0],
+                   deadline: getMonoTime() + initDuration(milliseconds = timeoutMs))
+
+proc fail(upgrade: var Upgrade) =
+  ## Kills and reaps a new process that didn't get ready
+  discard kill(upgrade.pid, SIGKILL)
+  var status: cint
+  discard waitpid(upgrade.pid, status, 0)
+  discard posix.close(upgrade.readFd)
+  upgrade.state = usFailed
+
+proc poll(upgrade: var Upgrade; timeoutMs: int) =
+  ## Waits up to `timeoutMs` for the new process to report ready
+  if upgrade.state != usPending:
+    return
+  var pollFd = TPollfd(fd: upgrade.readFd, events: POLLIN)
+  let ready = posix.poll(addr pollFd, 1, timeoutMs.cint)
+  if ready > 0:
+    var marker: char
+    if posix.read(upgrade.readFd, addr marker, 1) == 1:
+      discard posix.close(upgrade.readFd)
+      upgrade.state = usReady
+    else:
+      # The pipe closed without a byte: the process exited or failed to exec
+      upgrade.fail()
+  elif getMonoTime() >= upgrade.deadline:
+    upgrade.fail()
+
+proc refresh*(upgrade: var Upgrade; timeoutMs = 0): UpgradeState =
+  ## Updates the state of the new process, waiting up to `timeoutMs` for it
+  ## to report ready; call it periodically while serving
+  upgrade.poll(timeoutMs)
+  upgrade.state
+
+proc wait*(upgrade: var Upgrade): UpgradeState =
+  ## Blocks until the new process is ready or failed
+  while upgrade.state == usPending:
+    let left = (upgrade.deadline - getMonoTime()).inMilliseconds
+    upgrade.poll(max(left, 0).int)
+  upgrade.state
+
+proc controlSignalHandler(sig: cint) {.noconv.} =
+  if sig == SIGHUP:
+    pendingSignals[csReload] = true
+  elif sig == SIGUSR2:
+    pendingSignals[csUpgrade] = true
+  elif sig == SIGQUIT:
+    pendingSignals[csDrain] = true
+
+proc installControlSignals*(signals: set[ControlSignal] = {csReload, csUpgrade, csDrain}) =
+  ## Records the control signals in `signals` for takeSignal(), instead of
+  ## their default action of terminating the process
+  if csReload in signals:
+    discard signal(SIGHUP, controlSignalHandler)
+  if csUpgrade in signals:
+    discard signal(SIGUSR2, controlSignalHandler)
+  if csDrain in signals:
+    discard signal(SIGQUIT, controlSignalHandler)
+
+proc takeSignal*(signal: ControlSignal): bool =
+  ## Returns whether `signal` was received since the last call
+  result = pendingSignals[signal]
+  pendingSignals[signal] = false
@@ -130,4 +130,216 @@ proc parseGeminiUrl*(urlStr: string): Url =
   
   # Apply Gemini-specific defaults if needed
   if result.scheme == "" and result.hostname != "":
-    result.scheme = "gemini"
\ No newline at end of file
+    result.scheme = "gemini"
+# Request line parsing for the server
+#
+# parseRequestLine() and normalizePath() take a request apart in one pass
+# each, recording positions instead of copying, so the server can validate
+# a request and resolve its path before allocating anything for it.
+
+const GeminiScheme = "gemini"
+
+type
+  RequestLineStatus* = enum
+    ## Outcome of parseRequestLine()
+    rlValid,     ## An absolute gemini:// URL
+    rlTooLong,   ## Longer than the limit
+    rlNotGemini, ## An absolute URL of another scheme, that is a proxy request
+    rlMalformed  ## Not an absolute URL, or with an empty host, a bad port,
+                 ## userinfo, a fragment, spaces or control characters
+
+  RequestTarget* = object
+    ## Parts of a request line, as positions in it. Parts that are absent
+    ## are empty slices.
+    host*: Slice[int]     ## Hostname, brackets included for IPv6 addresses
+    portText*: Slice[int] ## Port as written
+    port*: int            ## Port number, 1965 if the URL has none
+    path*: Slice[int]     ## Path, still percent-encoded
+    query*: Slice[int]    ## Query, without its '?'
+    hasQuery*: bool       ## Whether the URL has a '?', possibly with an empty query
+
+proc isUrlChar(c: char): bool {.inline.} =
+  ## Whether `c` may appear in a request URL, which excludes spaces and
+  ## control characters but allows UTF-8 for IRIs
+  c > ' ' and c != '\x7f'
+
+proc parseRequestLine*(line: openArray[char]; target: var RequestTarget;
+                       maxLength = 1024): RequestLineStatus =
+  ## Validates a Gemini request line and finds its parts, without allocating.
+  ##
+  ## The scheme is matched case-insensitively. A missing port defaults to
+  ## 1965. Only the syntax is checked: whether the host is one the server
+  ## answers for is up to the caller.
+  ##
+  ## Parameters:
+  ##   line: The request line, without its CR LF
+  ##   target: Receives the positions of the parts of the URL in `line`
+  ##   maxLength: Longest URL accepted (1024 bytes in the Gemini specification)
+  ##
+  ## Returns:
+  ##   rlValid if `target` describes the URL, otherwise why it was rejected
+  ##
+  ## Example:
+  ##   ```nim
+  ##   let line = "gemini://example.com/docs/?q"
+  ##   var target: RequestTarget
+  ##   if parseRequestLine(line, target) == rlValid:
+  ##     echo line[target.path] # "/docs/"
+  ##   ```
+  target = RequestTarget(host: 0 .. -1, portText: 0 .. -1, port: 1965,
+                         path: 0 .. -1, query: 0 .. -1)
+  if line.len > maxLength:
+    return rlTooLong
+
+  # Scheme, followed by "://"
+  var i = 0
+  while i < line.len and line[i] in {'a'..'z', 'A'..'Z', '0'..'9', '+', '-', '.'}:
+    inc i
+  if i == 0 or line[0] notin {'a'..'z', 'A'..'Z'} or i + 2 >= line.len or
+      line[i] != ':' or line[i + 1] != '/' or line[i + 2] != '/':
+    return rlMalformed
+  var isGemini = i == GeminiScheme.len
+  for k in 0 ..< min(i, GeminiScheme.len):
+    if line[k].toLowerAscii() != GeminiScheme[k]:
+      isGemini = false
+  if not isGemini:
+    return rlNotGemini
+  i += 3
+
+  # Host, an IPv6 address in brackets or anything up to the port or path
+  let hostStart = i
+  if i < line.len and line[i] == '[':
+    inc i
+    while i < line.len and line[i] != ']':
+      if line[i] notin {'0'..'9', 'a'..'f', 'A'..'F', ':', '.'}:
+        return rlMalformed
+      inc i
+    if i == line.len or i == hostStart + 1:
+      return rlMalformed
+    inc i
+  else:
+    while i < line.len and line[i] notin {':', '/', '?', '#'}:
+      if line[i] == '@' or not isUrlChar(line[i]):
+        return rlMalformed # Gemini URLs carry no userinfo
+      inc i
+  if i == hostStart:
+    return rlMalformed
+  target.host = hostStart ..< i
+
+  # Port, empty meaning the default
+  if i < line.len and line[i] == ':':
+    inc i
+    let portStart = i
+    var port = 0
+    while i < line.len and line[i] in {'0'..'9'}:
+      port = port * 10 + (line[i].ord - '0'.ord)
+      if port > 65535:
+        return rlMalformed
+      inc i
+    if i > portStart:
+      if port == 0:
+        return rlMalformed
+      target.port = port
+      target.portText = portStart ..< i
+  if i < line.len and line[i] notin {'/', '?', '#'}:
+    return rlMalformed
+
+  # Path and query, up to a fragment, which requests must not have
+  let pathStart = i
+  while i < line.len and line[i] notin {'?', '#'}:
+    if not isUrlChar(line[i]):
+      return rlMalformed
+    inc i
+  target.path = pathStart ..< i
+  if i < line.len and line[i] == '?':
+    inc i
+    let queryStart = i
+    while i < line.len and line[i] != '#':
+      if not isUrlChar(line[i]):
+        return rlMalformed
+      inc i
+    target.hasQuery = true
+    target.query = queryStart ..< i
+  if i < line.len:
+    return rlMalformed
+  rlValid
+
+proc toUrl*(target: RequestTarget; line: string): Url =
+  ## Builds the Url of a request line parseRequestLine() accepted, the way
+  ## parseUrl() would, with a lowercase scheme
+  result = Url(scheme: "gemini", hostname: line[target.host],
+               port: line[target.portText], path: line[target.path])
+  if target.query.len > 0:
+    result.query = wb.parseSearch(line[target.query])
+
+proc hexValue(c: char): int {.inline.} =
+  case c
+  of '0'..'9': c.ord - '0'.ord
+  of 'a'..'f': c.ord - 'a'.ord + 10
+  of 'A'..'F': c.ord - 'A'.ord + 10
+  else: -1
+
+proc normalizePath*(path: openArray[char]; buffer: var string): bool =
+  ## Decodes a percent-encoded request path and resolves its `.` and `..`
+  ## segments into `buffer`, in one pass.
+  ##
+  ## Decoding comes first, so `%2F` separates segments and `%2E%2E` goes up
+  ## a level, like decodeURIComponent() followed by splitting the path.
+  ## Empty segments are dropped. Incomplete escapes are kept as they are.
+  ## `buffer` keeps its capacity, so reusing it makes this allocation free.
+  ##
+  ## Parameters:
+  ##   path: The path of a request, as found by parseRequestLine()
+  ##   buffer: Receives the path with a single leading slash and no
+  ##           trailing one, "/" for the root
+  ##
+  ## Returns:
+  ##   false if the path leads above the root, leaving `buffer` undefined
+  buffer.setLen(0)
+  buffer.add('/')
+  var segmentStart = 1 # Start of the segment being decoded into buffer
+
+  template endSegment(): bool =
+    ## Handles the decoded segment at the end of buffer, false to give up
+    var keep = true
+    let segmentLen = buffer.len - segmentStart
+    if segmentLen == 0:
+      discard
+    elif segmentLen == 1 and buffer[segmentStart] == '.':
+      buffer.setLen(segmentStart)
+    elif segmentLen == 2 and buffer[segmentStart] == '.' and
+        buffer[segmentStart + 1] == '.':
+      if segmentStart == 1:
+        keep = false # Above the root
+      else:
+        # Drop the previous segment along with this one
+        var j = segmentStart - 2
+        while buffer[j] != '/':
+          dec j
+        buffer.setLen(j + 1)
+        segmentStart = j + 1
+    else:
+      buffer.add('/')
+      segmentStart = buffer.len
+    keep
+
+  var i = 0
+  while i < path.len:
+    var c = path[i]
+    if c == '%' and i + 2 < path.len and hexValue(path[i + 1]) >= 0 and
+        hexValue(path[i + 2]) >= 0:
+      c = char(hexValue(path[i + 1]) * 16 + hexValue(path[i + 2]))
+      i += 2
+    inc i
+    if c == '/':
+      if not endSegment():
+        return false
+    else:
+      buffer.add(c)
+  if not endSegment():
+    return false
+
+  # Without the slash ending the last segment
+  if buffer.len > 1:
+    buffer.setLen(buffer.len - 1)
+  true
@@ -0,0 +1,213 @@
+## ObiWAN Worker Processes Module
+##
+## This module runs a server in several forked worker processes so that TLS
+## handshakes and encryption are spread across CPU cores. Each worker builds
+## its own server (and with it its own MbedtlsSslContext and CTR_DRBG) after
+## the fork. Each worker slot accepts on its own SO_REUSEPORT listener, so
+## the kernel balances incoming connections between them. The parent binds
+## these listeners, one per slot, so that they outlive the workers and can be
+## handed to an upgraded binary (see upgrade.nim).
+##
+## The parent process only supervises: it restarts workers that exit
+## unexpectedly and forwards SIGINT/SIGTERM to all of them on shutdown. On
+## SIGHUP it calls its reload hook and forwards the signal for the workers to
+## reload too; on SIGUSR2 it calls its upgrade hook and, once the new binary
+## is ready, sends SIGQUIT to the workers so they drain and exit.
+##
+## Nothing that owns file descriptors or random state (TLS contexts, the
+## asyncdispatch dispatcher) may be created before runWorkers() is called,
+## since every worker would inherit and share it.
+
+import std/posix
+import std/os
+import std/monotimes
+import std/times
+
+import ./upgrade
+
+const
+  MaxWorkers* = 256   ## Upper bound on the number of worker processes
+  RestartDelay = 1000 # Milliseconds to wait before restarting a worker that crashed on startup
+  UpgradePollMs = 200 # Interval between checks of a pending upgrade and of the workers
+
+var
+  workerPids: array[MaxWorkers, Pid]
+  workerCount: int
+  shuttingDown: bool
+  reloadPending: bool
+  upgradePending: bool
+  currentSlot = -1
+
+proc forwardSignal(sig: cint) {.noconv.} =
+  ## Signal handler in the parent: stops all workers
+  shuttingDown = true
+  for i in 0 ..< workerCount:
+    if workerPids[i] > 0:
+      discard kill(workerPids[i], sig)
+
+proc controlSignal(sig: cint) {.noconv.} =
+  ## Signal handler in the parent: records a reload or upgrade for the
+  ## supervision loop
+  if sig == SIGHUP:
+    reloadPending = true
+  else:
+    upgradePending = true
+
+proc installInterrupting(sig: cint; handler: proc (sig: cint) {.noconv.}) =
+  ## Installs a handler that interrupts waitpid() instead of restarting it
+  var action: Sigaction
+  action.sa_handler = handler
+  discard sigemptyset(action.sa_mask)
+  action.sa_flags = 0
+  discard sigaction(sig, action, nil)
+
+proc workerIndex*(): int =
+  ## Returns the slot of the calling worker process, from 0, or -1 outside
+  ## of runWorkers()
+  currentSlot
+
+proc spawnWorker(slot: int; worker: proc () {.closure.}) =
+  let pid = fork()
+  if pid < 0:
+    raise newException(OSError, "Failed to fork worker: " & osErrorMsg(osLastError()))
+
+  if pid == 0:
+    # Child: restore default signal handling and run the server. A SIGHUP or
+    # SIGQUIT forwarded before the server installs its own handlers would
+    # otherwise kill the worker, so they're ignored until then
+    discard signal(SIGINT, SIG_DFL)
+    discard signal(SIGTERM, SIG_DFL)
+    discard signal(SIGHUP, SIG_IGN)
+    discard signal(SIGUSR2, SIG_IGN) # Upgrades are the parent's business
+    discard signal(SIGQUIT, SIG_IGN)
+    currentSlot = slot
+    try:
+      worker()
+      quit(QuitSuccess)
+    except CatchableError:
+      echo "Worker ", getpid(), " failed: ", getCurrentExceptionMsg()
+      quit(QuitFailure)
+
+  workerPids[slot] = pid
+
+proc workerSlot(pid: Pid): int =
+  for i in 0 ..< workerCount:
+    if workerPids[i] == pid:
+      return i
+  return -1
+
+proc effectiveWorkerCount*(workers: int): int =
+  ## Returns the number of worker processes to start for a `workers` setting
+  ##
+  ## Parameters:
+  ##   workers: The configured number of workers, 0 for one per CPU core
+  ##
+  ## Returns:
+  ##   The number of workers, between 1 and MaxWorkers
+  result = if workers <= 0: countProcessors() else: workers
+  result = clamp(result, 1, MaxWorkers)
+
+proc runWorkers*(count: int; worker: proc () {.closure.};
+                 reload: proc () {.closure.} = nil;
+                 upgrade: proc (pending: var Upgrade): bool {.closure.} = nil) =
+  ## Runs `worker` in `count` forked processes and supervises them
+  ##
+  ## This blocks until all workers have exited after a SIGINT or SIGTERM, or
+  ## after a successful upgrade. Workers that exit on their own are
+  ## restarted; if a worker dies within a second of starting, the restart is
+  ## delayed so a broken configuration doesn't turn into a fork loop.
+  ##
+  ## Parameters:
+  ##   count: Number of worker processes (1 to MaxWorkers)
+  ##   worker: Procedure run in each worker; it should create its own server
+  ##           with reusePort enabled, or accept on the listener of its
+  ##           workerIndex(), and serve until it is stopped
+  ##   reload: Called in the parent on SIGHUP, before the signal is forwarded
+  ##           to the workers, for example to reload the configuration
+  ##           restarted workers start with
+  ##   upgrade: Called in the parent on SIGUSR2 to start a new binary, see
+  ##            spawnUpgrade(); returns whether it started. Workers keep being
+  ##            supervised while it starts, and get SIGQUIT to drain once it
+  ##            is ready
+  ##
+  ## Raises:
+  ##   OSError: If a worker process can't be forked
+  ##
+  ## Example:
+  ##   ```nim
+  ##   runWorkers(4, proc () =
+  ##     let server = newAsyncObiwanServer(reusePort = true,
+  ##                                       certFile = "cert.pem", keyFile = "privkey.pem")
+  ##     waitFor server.serve(1965, handleRequest))
+  ##   ```
+  workerCount = clamp(count, 1, MaxWorkers)
+  shuttingDown = false
+
+  reloadPending = false
+  upgradePending = false
+
+  discard signal(SIGINT, forwardSignal)
+  discard signal(SIGTERM, forwardSignal)
+  discard signal(SIGQUIT, forwardSignal)
+  installInterrupting(SIGHUP, controlSignal)
+  installInterrupting(SIGUSR2, controlSignal)
+
+  var startedAt: array[MaxWorkers, MonoTime]
+  for slot in 0 ..< workerCount:
+    startedAt[slot] = getMonoTime()
+    spawnWorker(slot, worker)
+
+  var running = workerCount
+  var upgrading = false
+  var pending: Upgrade
+  while running > 0:
+    if reloadPending and not shuttingDown:
+      reloadPending = false
+      if not reload.isNil:
+        reload()
+      for i in 0 ..< workerCount:
+        if workerPids[i] > 0:
+          discard kill(workerPids[i], SIGHUP)
+    if upgradePending and not shuttingDown:
+      upgradePending = false
+      if not upgrade.isNil and not upgrading:
+        upgrading = upgrade(pending)
+    if upgrading:
+      case pending.refresh(UpgradePollMs)
+      of usPending:
+        discard
+      of usReady:
+        upgrading = false
+        echo "Upgraded server took over, draining workers"
+        forwardSignal(SIGQUIT)
+      of usFailed:
+        upgrading = false
+        echo "Upgraded server failed to start, still serving"
+
+    # While an upgrade is pending, workers are reaped between its checks
+    var status: cint
+    let pid = waitpid(-1, status, if upgrading: WNOHANG else: 0)
+    if pid == 0:
+      continue # No worker exited
+    if pid < 0:
+      if errno == EINTR:
+        continue # Interrupted by a signal, handled above
+      break # ECHILD: no workers left
+
+    let slot = workerSlot(pid)
+    if slot < 0:
+      continue
+    workerPids[slot] = 0
+
+    if shuttingDown:
+      dec running
+      continue
+
+    echo "Worker ", pid, " exited with status ", status, ", restarting"
+    if getMonoTime() - startedAt[slot] < initDuration(milliseconds = RestartDelay):
+      sleep(RestartDelay)
+    if shuttingDown:
+      dec running
+      continue
+    startedAt[slot] = getMonoTime()
+    spawnWorker(slot, worker)
@@ -0,0 +1,54 @@
+## Micro-benchmark of the server's request line handling
+##
+## Times parseRequestLine() and normalizePath() against the parseUrl() and
+## sanitizePath() they replaced, on a mix of request lines, and prints the
+## nanoseconds per request of each. Build with `nimble benchparse`.
+
+import std/monotimes
+import std/strformat
+import std/times
+
+import ../src/obiwan/url
+import ../src/obiwan/fs
+import legacy_path
+
+const
+  Rounds = 200_000 ## Passes over the request lines
+  DocRoot = "/srv/gemini"
+  Lines = [
+    "gemini://example.com/",
+    "gemini://example.com/index.gmi",
+    "gemini://example.com:1965/docs/protocol/../specification.gmi",
+    "gemini://example.com/search?query=gemini%20protocol&page=2",
+    "gemini://[2001:db8::1]/users/~someone/journal/2024/entry%20one.gmi",
+  ]
+
+template measure(label: string; body: untyped) =
+  block:
+    let start = getMonoTime()
+    for _ in 0 ..< Rounds:
+      for line {.inject.} in Lines:
+        body
+    let elapsed = (getMonoTime() - start).inNanoseconds
+    echo &"{label:<40} {elapsed.float / float(Rounds * Lines.len):8.1f} ns/request"
+
+var sink = 0 # Keeps the optimizer from dropping the results
+
+measure "parseUrl + legacy sanitizePath":
+  let url = parseUrl(line)
+  sink += legacySanitize(DocRoot, url.path).len
+
+measure "parseRequestLine + normalizePath":
+  var target: RequestTarget
+  var buffer {.global.} = newStringOfCap(1024)
+  if parseRequestLine(line, target) == rlValid and
+      normalizePath(line.toOpenArray(target.path.a, target.path.b), buffer):
+    sink += buffer.len
+
+measure "parseRequestLine + toUrl + sanitizePath":
+  var target: RequestTarget
+  if parseRequestLine(line, target) == rlValid:
+    let url = target.toUrl(line)
+    sink += sanitizePath(DocRoot, url.path).len
+
+echo "(", sink, ")"
@@ -0,0 +1,37 @@
+## The request path handling obiwan/url.nim replaced
+##
+## Kept for test_request_line.nim to check the new parser against, and
+## for bench_request_line.nim to measure it against.
+
+import std/os
+import std/strutils
+import ../src/obiwan/url
+
+proc legacyPathParts(reqPath: string): seq[string] =
+  ## Decodes a request path and resolves its `.` and `..` segments, nil
+  ## if the path leads above the root
+  var path = decodeURIComponent(reqPath)
+  if path.startsWith("/"):
+    path = path[1..^1]
+  for part in path.split('/'):
+    if part == "..":
+      if result.len > 0:
+        discard result.pop()
+      else:
+        raise newException(ValueError, "Path traversal detected")
+    elif part == "." or part == "":
+      continue
+    else:
+      result.add(part)
+
+proc legacyNormalize*(reqPath: string): string =
+  ## What fs.normalizeRequestPath() returned before normalizePath()
+  "/" & legacyPathParts(reqPath).join("/")
+
+proc legacySanitize*(basePath, reqPath: string): string =
+  ## What fs.sanitizePath() returned before normalizePath()
+  result = basePath
+  for part in legacyPathParts(reqPath):
+    result = result / part
+  if not result.startsWith(basePath):
+    raise newException(ValueError, "Path traversal detected")
@@ -22,6 +22,7 @@ import osproc
 const
   TestPort = 1967     # Use non-standard port for testing
   MaxUrlLength = 1024 # Maximum URL length per Gemini spec
+  LargeFileSize = 256 * 1024 # Body of /large-file, long enough for kTLS and several records
 
 # Get certificate paths from environment or use defaults
 let
@@ -224,6 +225,17 @@ TLS Version: TLS 1.3 (assumed)
     request.respond(ServerUnavailable, "Server temporarily unavailable")
     return
 
+  # File streamed with respondFile, through kTLS where the kernel supports it
+  elif path == "/large-file":
+    let file = getTempDir() / "obiwan_large_file_test.txt"
+    if not fileExists(file):
+      var content = newString(LargeFileSize)
+      for i in 0 ..< LargeFileSize:
+        content[i] = char(ord('a') + i mod 26)
+      writeFile(file, content)
+    request.respondFile("text/plain", file)
+    return
+
   # By default, return not found
   else:
     request.respond(NotFound, "Resource not found")
@@ -257,6 +269,7 @@ when isMainModule:
       certFile = TestCertFile,
       keyFile = TestKeyFile
     )
+    server.ktls = true # Falls back to mbedTLS where kTLS is unavailable
 
     # Get command line arguments
     var useIPv6 = false
@@ -0,0 +1,68 @@
+## Test for the obiwan/accesslog.nim module
+##
+## Tests the logfmt line format, batched writes through the background
+## writer, and dropping entries when the buffer is full.
+
+import std/unittest
+import std/os
+import std/times
+import std/strutils
+
+import ../src/obiwan/accesslog
+
+const LogPath = "test_access.log"
+
+proc sampleEntry(url = "gemini://example.com/"): AccessLogEntry =
+  AccessLogEntry(peer: "192.0.2.7", url: url, status: 20, bytesSent: 1832,
+                 handshake: initDuration(microseconds = 4120),
+                 total: initDuration(microseconds = 5030))
+
+suite "ObiWAN Access Log Tests":
+  setup:
+    removeFile(LogPath)
+
+  teardown:
+    removeFile(LogPath)
+
+  test "Entry format":
+    let line = formatEntry(sampleEntry(), timestamps = false)
+    check line == "peer=192.0.2.7 status=20 bytes=1832 handshake_ms=4.12 " &
+                  "total_ms=5.03 cert=- url=\"gemini://example.com/\"\n"
+
+  test "Timestamps and certificate fingerprints":
+    var entry = sampleEntry()
+    entry.fingerprint = "ab12"
+    let line = formatEntry(entry)
+    check line.startsWith("time=")
+    check " cert=ab12 " in line
+
+  test "URLs are quoted and escaped":
+    let line = formatEntry(sampleEntry("gemini://x/\"a\"\tb"), timestamps = false)
+    check line.endsWith("url=\"gemini://x/\\\"a\\\"\\x09b\"\n")
+
+  test "Entries are written to the log file":
+    let log = newAccessLog(LogPath, timestamps = false)
+    for i in 0 ..< 10:
+      check log.log(sampleEntry("gemini://example.com/" & $i))
+    log.close()
+
+    let lines = readFile(LogPath).strip().splitLines()
+    check lines.len == 10
+    check lines[0].endsWith("url=\"gemini://example.com/0\"")
+    check lines[9].endsWith("url=\"gemini://example.com/9\"")
+
+  test "Full buffer drops entries instead of blocking":
+    let log = newAccessLog(LogPath, bufferSize = 1024, timestamps = false)
+    var queued = 0
+    var dropped = 0
+    for i in 0 ..< 1000:
+      if log.log(sampleEntry()):
+        inc queued
+      else:
+        inc dropped
+    log.close()
+
+    check dropped > 0
+    let content = readFile(LogPath)
+    check content.count("status=20") == queued
+    check "dropped=" in content
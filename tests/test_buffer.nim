@@ -0,0 +1,81 @@
+## Test for the obiwan/tls/buffer.nim module
+##
+## Tests taking lines and raw reads from the sockets' read buffer, including
+## lines split across reads and the line length limit.
+
+import std/unittest
+
+import ../src/obiwan/tls/buffer
+
+proc receive(buffer: var ReadBuffer; data: string) =
+  ## Writes `data` into the buffer the way a socket read does
+  let (space, size) = buffer.prepareWrite()
+  doAssert data.len <= size
+  if data.len > 0:
+    copyMem(space, unsafeAddr data[0], data.len)
+  buffer.commit(data.len)
+
+suite "ObiWAN Read Buffer Tests":
+  test "Lines and the data after them":
+    var buffer: ReadBuffer
+    buffer.receive("20 text/gemini\r\n# Hello")
+
+    var line = ""
+    check buffer.takeLine(line, 0)
+    finishLine(line, 0)
+    check line == "20 text/gemini"
+
+    var body = newString(16)
+    check buffer.read(addr body[0], body.len) == 7
+    body.setLen(7)
+    check body == "# Hello"
+    check buffer.len == 0
+
+  test "Lines split across reads":
+    var buffer: ReadBuffer
+    var line = ""
+    buffer.receive("gemini://exam")
+    check not buffer.takeLine(line, 0)
+    buffer.receive("ple.com/\r")
+    check not buffer.takeLine(line, 0)
+    buffer.receive("\nnext")
+    check buffer.takeLine(line, 0)
+    finishLine(line, 0)
+    check line == "gemini://example.com/"
+    check buffer.len == 4
+
+  test "Reads consume the front of the buffer":
+    var buffer: ReadBuffer
+    buffer.receive("abcdef")
+    var part = newString(2)
+    check buffer.read(addr part[0], 2) == 2
+    check part == "ab"
+    check buffer.len == 4
+
+    # The free space is reused once everything has been consumed
+    var rest = newString(4)
+    check buffer.read(addr rest[0], 4) == 4
+    check rest == "cdef"
+    check buffer.prepareWrite().size == ReadBufferSize
+
+  test "Line length limit":
+    var buffer: ReadBuffer
+    var line = ""
+    # Reading stops before the line ending arrives
+    buffer.receive("gemini://example.com/")
+    expect LineTooLongError:
+      discard buffer.takeLine(line, 10)
+
+    # A CR waiting for its LF doesn't count against the limit
+    buffer.clear()
+    line = ""
+    buffer.receive("0123456789\r")
+    check not buffer.takeLine(line, 10)
+    buffer.receive("\n")
+    check buffer.takeLine(line, 10)
+    finishLine(line, 10)
+    check line == "0123456789"
+
+    line = "0123456789a"
+    expect LineTooLongError:
+      finishLine(line, 10)
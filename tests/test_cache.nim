@@ -0,0 +1,177 @@
+## Test for the obiwan/cache.nim module
+##
+## Tests LRU eviction, size limits, mtime and inotify invalidation, and the
+## cache-aware file request resolution in obiwan/fs.nim.
+
+import std/unittest
+import std/os
+import std/times
+import std/strutils
+
+import ../src/obiwan/cache
+import ../src/obiwan/fs
+
+var tempDir: string
+var contentDir: string
+
+proc touch(path: string, content: string) =
+  ## Rewrites a file and moves its mtime forward, so the change is visible
+  ## even on filesystems with coarse timestamps
+  let before = getLastModificationTime(path)
+  writeFile(path, content)
+  setLastModificationTime(path, before + initDuration(seconds = 2))
+
+suite "ObiWAN Content Cache Tests":
+  setup:
+    tempDir = getCurrentDir() / "test_cache_dir"
+    removeDir(tempDir)
+    createDir(tempDir)
+
+    contentDir = tempDir / "content"
+    createDir(contentDir)
+    writeFile(contentDir / "index.gmi", "# Index\n")
+    writeFile(contentDir / "page.gmi", "# Page\n")
+    createDir(contentDir / "listing")
+    writeFile(contentDir / "listing" / "a.txt", "a")
+
+  teardown:
+    removeDir(tempDir)
+
+  test "Put and get":
+    let cache = newContentCache(useInotify = false)
+    let source = contentDir / "page.gmi"
+    cache.put(source, "# Page\n", "text/gemini", source,
+              getLastModificationTime(source))
+
+    var entry: CachedContent
+    check cache.get(source, entry)
+    check entry.content == "# Page\n"
+    check entry.mimeType == "text/gemini"
+    check cache.hits == 1
+
+    check not cache.get(contentDir / "missing.gmi", entry)
+    check cache.misses == 1
+
+  test "Trailing separators share an entry":
+    let cache = newContentCache(useInotify = false)
+    let dir = contentDir / "listing"
+    cache.put(dir & "/", "listing", "text/gemini", dir,
+              getLastModificationTime(dir), isDirectory = true)
+
+    var entry: CachedContent
+    check cache.get(dir, entry)
+    check cache.len == 1
+
+  test "Least recently used entries are evicted first":
+    let cache = newContentCache(maxEntries = 2, useInotify = false)
+    let source = contentDir / "page.gmi"
+    let mtime = getLastModificationTime(source)
+    cache.put("/a", "a", "text/plain", source, mtime)
+    cache.put("/b", "b", "text/plain", source, mtime)
+
+    var entry: CachedContent
+    check cache.get("/a", entry) # /b is now the least recently used
+    cache.put("/c", "c", "text/plain", source, mtime)
+
+    check cache.len == 2
+    check cache.get("/a", entry)
+    check not cache.get("/b", entry)
+    check cache.get("/c", entry)
+
+  test "Total size is bounded":
+    let cache = newContentCache(maxBytes = 4096, useInotify = false)
+    let source = contentDir / "page.gmi"
+    let mtime = getLastModificationTime(source)
+    for i in 0 ..< 10:
+      cache.put("/" & $i, repeat('x', 1000), "text/plain", source, mtime)
+      check cache.size <= 4096
+
+    var entry: CachedContent
+    check cache.get("/9", entry)
+    check not cache.get("/0", entry)
+
+    # Entries larger than the whole cache are not stored
+    cache.put("/huge", repeat('x', 8192), "text/plain", source, mtime)
+    check not cache.get("/huge", entry)
+
+  test "Modified files are revalidated by mtime":
+    let cache = newContentCache(revalidateMs = 0, useInotify = false)
+    let source = contentDir / "page.gmi"
+    cache.put(source, "# Page\n", "text/gemini", source,
+              getLastModificationTime(source))
+
+    var entry: CachedContent
+    check cache.get(source, entry)
+
+    touch(source, "# Changed\n")
+    check not cache.get(source, entry)
+
+    removeFile(source)
+    cache.put(source, "# Page\n", "text/gemini", source,
+              getLastModificationTime(contentDir / "index.gmi"))
+    check not cache.get(source, entry)
+
+  when defined(linux):
+    test "Modified files are invalidated through inotify":
+      # A long revalidation interval makes sure inotify does the work
+      let cache = newContentCache(revalidateMs = 3_600_000)
+      defer: cache.close()
+
+      let target = resolveFileRequest(contentDir, "/page.gmi", cache)
+      check target.success
+      check target.content == "# Page\n"
+      check cache.len == 1
+
+      writeFile(contentDir / "page.gmi", "# Changed\n")
+      check resolveFileRequest(contentDir, "/page.gmi", cache).content == "# Changed\n"
+
+  test "File requests are served from the cache":
+    let cache = newContentCache(revalidateMs = 0, useInotify = false)
+
+    let first = resolveFileRequest(contentDir, "/page.gmi", cache)
+    check first.success
+    check first.path == ""
+    check first.content == "# Page\n"
+    check first.mimeType == "text/gemini"
+
+    let second = resolveFileRequest(contentDir, "/page.gmi", cache)
+    check second.content == "# Page\n"
+    check cache.hits == 1
+
+    # Index pages and listings are cached as well
+    check resolveFileRequest(contentDir, "/", cache).content == "# Index\n"
+    check resolveFileRequest(contentDir, "/listing", cache).content.contains("a.txt")
+    check resolveFileRequest(contentDir, "/listing/", cache).content.contains("a.txt")
+    check cache.hits == 2
+
+  test "New files show up in cached listings":
+    let cache = newContentCache(revalidateMs = 0, useInotify = false)
+    check not resolveFileRequest(contentDir, "/listing/", cache).content.contains("b.txt")
+
+    let dir = contentDir / "listing"
+    let before = getLastModificationTime(dir)
+    writeFile(dir / "b.txt", "b")
+    setLastModificationTime(dir, before + initDuration(seconds = 2))
+    check resolveFileRequest(contentDir, "/listing/", cache).content.contains("b.txt")
+
+  test "Large files are streamed, not cached":
+    let cache = newContentCache(maxFileSize = 16, useInotify = false)
+    writeFile(contentDir / "large.txt", repeat('x', 64))
+
+    let target = resolveFileRequest(contentDir, "/large.txt", cache)
+    check target.success
+    check target.path == contentDir / "large.txt"
+    check target.content == ""
+    check cache.len == 0
+
+  test "Errors are not cached":
+    let cache = newContentCache(useInotify = false)
+    check resolveFileRequest(contentDir, "/missing.gmi", cache).errorMsg == "File not found"
+    check resolveFileRequest(contentDir, "/../etc/passwd", cache).errorMsg ==
+      "Security violation: Path traversal attempt"
+    check cache.len == 0
+
+  test "A nil cache disables caching":
+    let target = resolveFileRequest(contentDir, "/page.gmi", nil)
+    check target.success
+    check target.path == contentDir / "page.gmi"
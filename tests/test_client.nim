@@ -12,6 +12,7 @@ import osproc
 import strutils
 import strformat
 import asyncdispatch
+import tables
 
 # The path is provided via the --path:src command line option
 
@@ -19,6 +20,7 @@ import asyncdispatch
 import obiwan
 import obiwan/common
 import obiwan/debug
+import obiwan/tls/socket
 
 # Set lower verbosity level for tests
 setVerbosityLevel(2) # Only show warnings and errors
@@ -194,6 +196,45 @@ suite "ObiWAN Client Tests":
 
     waitFor testAsync()
 
+  # Batches of requests sharing the client's settings
+  test "Fetching Many URLs":
+    proc testFetchMany() {.async.} =
+      let client = newAsyncObiwanClient()
+      let base = fmt"gemini://{IPv4Localhost}:{TestPort}"
+      var urls: seq[string]
+      for i in 1 .. 5:
+        urls.add(base & "/")
+      urls.add(base & "/server-error")
+      urls.add(fmt"gemini://{IPv4Localhost}:1/") # Nothing listens there
+
+      var seen: seq[string]
+      let results = client.fetchMany(urls, concurrency = 3, perHost = 2)
+      while true:
+        let (hasResult, item) = await results.read()
+        if not hasResult:
+          break
+        seen.add(item.url)
+        if item.url == base & "/":
+          check item.error == ""
+          check item.response.status == Success
+          check item.body.len > 0
+        elif item.url == base & "/server-error":
+          check item.response.status == TempError
+          check item.body == ""
+        else:
+          check item.response.isNil
+          check item.error.len > 0
+      check seen.len == urls.len
+      for url in urls:
+        check url in seen
+
+      # The client itself wasn't used
+      let response = await client.request(base & "/")
+      check response.status == Success
+      client.close()
+
+    waitFor testFetchMany()
+
   # Multiple requests (connection reuse)
   test "Multiple Requests":
     # Test making multiple requests with the same client
@@ -209,6 +250,81 @@ suite "ObiWAN Client Tests":
 
     client.close()
 
+  # Test the streaming body readers
+  test "Streaming Body":
+    let client = newObiwanClient()
+
+    try:
+      let url = fmt"gemini://{IPv4Localhost}:{TestPort}/"
+      let expected = client.request(url).body()
+
+      # Small chunks so the body spans several of them
+      var streamed = ""
+      var chunks = 0
+      for chunk in client.request(url).bodyChunks(chunkSize = 8):
+        check chunk.len <= 8
+        streamed.add(chunk)
+        inc chunks
+      check streamed == expected
+      check chunks > 1
+
+      let path = getTempDir() / "obiwan_download_test.gmi"
+      defer: removeFile(path)
+      check client.request(url).downloadTo(path) == expected.len.int64
+      check readFile(path) == expected
+      expect IOError:
+        discard client.request(url).downloadTo(getTempDir() / "missing" / "download.gmi")
+
+      client.close()
+    except CatchableError as e:
+      error("Error streaming body: " & e.msg)
+      fail()
+
+  # Large files go through kTLS and sendfile() where available
+  test "Large File":
+    let client = newObiwanClient()
+
+    try:
+      let url = fmt"gemini://{IPv4Localhost}:{TestPort}/large-file"
+      let response = client.request(url)
+      check response.status == Success
+      let body = response.body()
+      check body.len == 256 * 1024
+      var intact = true
+      for i in 0 ..< body.len:
+        if body[i] != char(ord('a') + i mod 26):
+          intact = false
+          break
+      check intact
+
+      client.close()
+    except CatchableError as e:
+      error("Error fetching large file: " & e.msg)
+      fail()
+
+  # Session tickets
+  test "Session Tickets":
+    let server = newObiwanServer(certFile = TestCertFile, keyFile = TestKeyFile,
+                                 sessionId = "test secret")
+    check MbedtlsSslContext(server.sslContext).ticketKeys != nil
+
+    let noTickets = newObiwanServer(certFile = TestCertFile, keyFile = TestKeyFile,
+                                    ticketRotation = 0)
+    check MbedtlsSslContext(noTickets.sslContext).ticketKeys == nil
+
+    # Clients start without saved sessions and keep one per host:port
+    let client = newObiwanClient()
+    let context = MbedtlsSslContext(client.sslContext)
+    check context.sessions.len == 0
+    let url = fmt"gemini://{IPv4Localhost}:{TestPort}/"
+    check client.request(url).status == Success
+    client.close()
+    check context.sessions.hasKey(fmt"{IPv4Localhost}:{TestPort}")
+    # The next connection offers the saved session
+    check client.request(url).status == Success
+    client.close()
+    check context.sessions.len == 1
+
 when isMainModule:
   try:
     # Run tests with exception handling to ensure server cleanup
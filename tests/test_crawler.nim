@@ -0,0 +1,181 @@
+## Test for the obiwan/crawler.nim module
+##
+## Tests URL canonicalization and resolution, link extraction from bodies
+## fed in pieces, robots.txt rules, the visited set, mirror paths, and
+## resuming a crawl from its checkpoint, within its seed hosts and page
+## limit.
+
+import std/unittest
+import std/asyncdispatch
+import std/os
+import std/strutils
+
+import ../src/obiwan
+import ../src/obiwan/crawler
+
+var tempDir: string
+
+suite "ObiWAN Crawler Tests":
+  setup:
+    tempDir = getCurrentDir() / "test_crawler_dir"
+    removeDir(tempDir)
+
+  teardown:
+    removeDir(tempDir)
+
+  test "Canonical URLs":
+    check canonicalUrl("gemini://Example.COM/a/b") == "gemini://example.com/a/b"
+    check canonicalUrl("gemini://example.com:1965/") == "gemini://example.com/"
+    check canonicalUrl("gemini://example.com") == "gemini://example.com/"
+    check canonicalUrl("gemini://example.com:1966/x") == "gemini://example.com:1966/x"
+    check canonicalUrl("gemini://example.com/a/./b/../c") == "gemini://example.com/a/c"
+    check canonicalUrl("gemini://example.com/a/..") == "gemini://example.com/"
+    check canonicalUrl("gemini://example.com/../..") == "gemini://example.com/"
+    check canonicalUrl("gemini://example.com/p?q=1#part") == "gemini://example.com/p?q=1"
+    check canonicalUrl("https://example.com/") == ""
+    check canonicalUrl("/relative") == ""
+    check hostOf("gemini://example.com/") == "example.com:1965"
+    check hostOf("gemini://example.com:1966/") == "example.com:1966"
+
+  test "Links are resolved against the page":
+    let base = "gemini://example.com/dir/page.gmi"
+    check resolveLink(base, "other.gmi") == "gemini://example.com/dir/other.gmi"
+    check resolveLink(base, "../up.gmi") == "gemini://example.com/up.gmi"
+    check resolveLink(base, "/root.gmi") == "gemini://example.com/root.gmi"
+    check resolveLink(base, "?query") == "gemini://example.com/dir/page.gmi?query"
+    check resolveLink(base, "#section") == base
+    check resolveLink(base, "//other.org/x") == "gemini://other.org/x"
+    check resolveLink(base, "GEMINI://Other.org:1965/") == "gemini://other.org/"
+    check resolveLink(base, "https://example.com/") == ""
+    check resolveLink(base, "mailto:someone@example.com") == ""
+    check resolveLink("gemini://example.com", "page") == "gemini://example.com/page"
+
+  test "Links are extracted from bodies fed in pieces":
+    let body = "# Title\n" &
+               "=> /one.gmi One\n" &
+               "=>two.gmi\n" &
+               "```\n" &
+               "=> /preformatted.gmi Not a link\n" &
+               "```\n" &
+               "=>\t gemini://other.org/ Tab\r\n" &
+               "=> https://example.com/ Web\n" &
+               "=> /last.gmi"
+    let expected = @["gemini://example.com/one.gmi", "gemini://example.com/two.gmi",
+                     "gemini://other.org/", "gemini://example.com/last.gmi"]
+    check extractLinks("gemini://example.com/", body) == expected
+    # Every split of the body finds the same links
+    for size in [1, 2, 3, 7, 16]:
+      var extractor = initLinkExtractor("gemini://example.com/")
+      var offset = 0
+      while offset < body.len:
+        let stop = min(offset + size, body.len)
+        extractor.feed(body.toOpenArray(offset, stop - 1))
+        offset = stop
+      extractor.finish()
+      check extractor.links == expected
+
+  test "robots.txt rules":
+    let text = "# Rules\n" &
+               "User-agent: webproxy\n" &
+               "Disallow: /\n" &
+               "\n" &
+               "User-agent: archiver\n" &
+               "User-agent: indexer\n" &
+               "Disallow: /private/ # Kept to itself\n" &
+               "Disallow: /tmp\n" &
+               "Disallow:\n" &
+               "\n" &
+               "User-agent: researcher\n" &
+               "Disallow: /research/\n"
+    let rules = parseRobots(text)
+    check rules.disallow == @["/private/", "/tmp"]
+    check rules.allows("/")
+    check rules.allows("/public/page.gmi")
+    check not rules.allows("/private/page.gmi")
+    check not rules.allows("/tmp.gmi")
+    check not parseRobots(text, ["webproxy"]).allows("/anything")
+    check parseRobots(text, ["other"]).disallow.len == 0
+    check parseRobots("").allows("/")
+
+  test "Visited set":
+    var visited: VisitedSet
+    check "gemini://example.com/" notin visited
+    const Count = 10_000
+    for i in 0 ..< Count:
+      check not visited.containsOrIncl("gemini://example.com/" & $i)
+    for i in 0 ..< Count:
+      check visited.containsOrIncl("gemini://example.com/" & $i)
+    check visited.len == Count
+    check "gemini://example.com/0" in visited
+    check "gemini://example.com/x" notin visited
+
+    createDir(tempDir)
+    visited.save(tempDir / "visited")
+    check getFileSize(tempDir / "visited") == Count * 8
+    let loaded = loadVisited(tempDir / "visited")
+    check loaded.len == Count
+    for i in 0 ..< Count:
+      check ("gemini://example.com/" & $i) in loaded
+
+  test "Mirror paths":
+    let dir = "mirror"
+    check mirrorPath(dir, "gemini://example.com/") == dir / "example.com" / "index.gmi"
+    check mirrorPath(dir, "gemini://example.com/a/") == dir / "example.com" / "a" / "index.gmi"
+    check mirrorPath(dir, "gemini://example.com/a/b.gmi") == dir / "example.com" / "a" / "b.gmi"
+    check mirrorPath(dir, "gemini://example.com:1966/x") == dir / "example.com_1966" / "x"
+    check mirrorPath(dir, "gemini://example.com/s?a/b") == dir / "example.com" / "s?a%2Fb"
+    check mirrorPath(dir, "gemini://example.com/%2E%2E/x") == dir / "example.com" / "%2E%2E" / "x"
+
+  test "Checkpoints resume the frontier":
+    let client = newAsyncObiwanClient()
+    var crawler = newCrawler(client, CrawlOptions(outputDir: tempDir))
+    check crawler.options.concurrency == DefaultCrawlConcurrency
+    check crawler.addSeed("gemini://example.com/")
+    check crawler.addSeed("gemini://other.org/page")
+    check not crawler.addSeed("gemini://EXAMPLE.com:1965/") # Seen already
+    check not crawler.addSeed("https://example.com/")
+    check crawler.stats.queued == 2
+    crawler.saveCheckpoint()
+    crawler.close()
+    check fileExists(tempDir / "crawl.log")
+
+    crawler = newCrawler(client, CrawlOptions(outputDir: tempDir))
+    check crawler.stats.queued == 2
+    check not crawler.addSeed("gemini://other.org/page")
+    check crawler.addSeed("gemini://other.org/new")
+    crawler.close()
+
+  test "Checkpoints keep the seed hosts and the page count":
+    let client = newAsyncObiwanClient()
+    var crawler = newCrawler(client, CrawlOptions(outputDir: tempDir))
+    crawler.addSeed("gemini://example.com/")
+    crawler.saveCheckpoint()
+    crawler.close()
+    let state = tempDir / ".crawl" / "state"
+    check readFile(state) == "pages 0\nseed example.com:1965\n"
+
+    # Resumed without seeds, the crawl keeps its scope
+    crawler = newCrawler(client, CrawlOptions(outputDir: tempDir))
+    crawler.saveCheckpoint()
+    crawler.close()
+    check readFile(state) == "pages 0\nseed example.com:1965\n"
+
+    # Pages fetched by earlier runs count towards maxPages
+    writeFile(state, "pages 5\nseed example.com:1965\n")
+    crawler = newCrawler(client, CrawlOptions(outputDir: tempDir, maxPages: 5))
+    waitFor crawler.run()
+    check crawler.stats.fetched == 0
+    check readFile(tempDir / ".crawl" / "frontier").strip() == "0 gemini://example.com/"
+    check readFile(state).startsWith("pages 5\n")
+    crawler.close()
+
+  test "Stopped crawls leave a checkpoint":
+    let client = newAsyncObiwanClient()
+    let crawler = newCrawler(client, CrawlOptions(outputDir: tempDir))
+    crawler.addSeed("gemini://example.com/")
+    crawler.stop()
+    waitFor crawler.run()
+    check crawler.stats.fetched == 0
+    check fileExists(tempDir / ".crawl" / "frontier")
+    check readFile(tempDir / ".crawl" / "frontier").strip() == "0 gemini://example.com/"
+    crawler.close()
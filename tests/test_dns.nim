@@ -0,0 +1,47 @@
+## Test for the obiwan/dns.nim module
+##
+## Tests the address cache used by dial(): IP addresses bypass it, host
+## names are resolved once and reused until their entry expires.
+
+import std/unittest
+import std/asyncdispatch
+import std/nativesockets
+
+import ../src/obiwan/dns
+
+suite "ObiWAN Address Cache Tests":
+  setup:
+    clearDnsCache()
+    dnsCacheTtlMs = DefaultDnsCacheTtlMs
+
+  test "IP addresses are returned as they are":
+    check resolve("127.0.0.1") == @[ResolvedAddress(address: "127.0.0.1",
+                                                    domain: Domain.AF_INET)]
+    check resolve("::1") == @[ResolvedAddress(address: "::1",
+                                              domain: Domain.AF_INET6)]
+
+  test "Host names are resolved and cached":
+    let first = resolve("localhost")
+    check first.len > 0
+    for target in first:
+      check target.address in ["127.0.0.1", "::1"]
+    check resolve("localhost") == first
+
+  test "Disabled cache still resolves":
+    dnsCacheTtlMs = 0
+    check resolve("localhost").len > 0
+    check resolve("localhost").len > 0
+
+  test "Unknown hosts raise OSError":
+    expect OSError:
+      discard resolve("no-such-host.invalid")
+
+  test "Async lookups run on a thread and fill the cache":
+    check waitFor(resolveAsync("127.0.0.1")) == resolve("127.0.0.1")
+    let lookups = @[resolveAsync("localhost"), resolveAsync("localhost")]
+    let results = waitFor all(lookups)
+    check results[0].len > 0
+    check results[1] == results[0]
+    check resolve("localhost") == results[0] # Answered from the cache
+    expect OSError:
+      discard waitFor resolveAsync("no-such-host.invalid")
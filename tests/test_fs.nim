@@ -119,6 +119,34 @@ This is a test index page for the ObiWAN filesystem tests.
     # Put index back for other tests
     writeFile(contentDir / "index.gmi", indexContent)
   
+  test "File request resolution - files are streamed by path":
+    let result = resolveFileRequest(contentDir, "/test.txt")
+    check result.success
+    check result.path == contentDir / "test.txt"
+    check result.content == ""
+    check result.mimeType == "text/plain"
+    check result.size == len("This is a plain text file for testing.")
+
+    # Directories with an index resolve to the index file
+    let index = resolveFileRequest(contentDir, "/subdir/")
+    check index.success
+    check index.path == contentDir / "subdir" / "index.gmi"
+
+    # Listings are generated content without a path
+    removeFile(contentDir / "index.gmi")
+    let listing = resolveFileRequest(contentDir, "/")
+    check listing.success
+    check listing.path == ""
+    check listing.content.contains("# Directory listing for /")
+    check listing.size == listing.content.len
+    writeFile(contentDir / "index.gmi", indexContent)
+
+    let missing = resolveFileRequest(contentDir, "/nonexistent.txt")
+    check missing.error == feNotFound
+    check missing.errorMsg == "File not found"
+    check resolveFileRequest(contentDir, "/../outside.txt").error == feTraversal
+    check resolveFileRequest(contentDir, "/test.txt").error == feNone
+
   test "File request handling - file not found":
     let result = handleFileRequest(contentDir, "/nonexistent.txt")
     check not result.success
@@ -0,0 +1,275 @@
+## Test for the obiwan/gateway.nim module
+##
+## Tests route matching, the SCGI and FastCGI encodings, and requests to
+## fake backends on Unix sockets: responses streamed back, FastCGI
+## connections kept and replaced, and the concurrency limit.
+
+import std/unittest
+import std/asyncdispatch
+import std/asyncnet
+import std/net
+import std/os
+import std/strutils
+import std/tables
+
+import ../src/obiwan/gateway
+
+type
+  FakeBackend = ref object
+    ## A backend answering with its PATH_INFO after `delayMs`
+    server: AsyncSocket
+    path: string
+    scgi: bool
+    delayMs: int
+    hangUp: bool     # Close FastCGI connections even when asked to keep them
+    accepted: int    # Connections accepted
+    active: int      # Requests being answered
+    peak: int        # Most requests answered at once
+    params: seq[Table[string, string]]
+
+proc readExactly(socket: AsyncSocket; size: int): Future[string] {.async.} =
+  while result.len < size:
+    let part = await socket.recv(size - result.len)
+    if part.len == 0:
+      raise newException(IOError, "Connection closed")
+    result.add(part)
+
+proc decodePairs(data: string): Table[string, string] =
+  ## FastCGI name-value pairs
+  var i = 0
+  proc length(): int =
+    if data[i].ord < 128:
+      result = data[i].ord
+      i += 1
+    else:
+      result = ((data[i].ord and 0x7f) shl 24) or (data[i + 1].ord shl 16) or
+               (data[i + 2].ord shl 8) or data[i + 3].ord
+      i += 4
+  while i < data.len:
+    let nameLength = length()
+    let valueLength = length()
+    result[data[i ..< i + nameLength]] = data[i + nameLength ..< i + nameLength + valueLength]
+    i += nameLength + valueLength
+
+proc record(kind: int; content: string): string =
+  result = $char(1) & char(kind) & char(0) & char(1) &
+           char(content.len shr 8) & char(content.len and 0xff) & char(0) & char(0)
+  result.add(content)
+
+proc answer(fake: FakeBackend; params: Table[string, string]): Future[string] {.async.} =
+  fake.params.add(params)
+  inc fake.active
+  fake.peak = max(fake.peak, fake.active)
+  if fake.delayMs > 0:
+    await sleepAsync(fake.delayMs)
+  dec fake.active
+  return "20 text/gemini\r\npath=" & params.getOrDefault("PATH_INFO")
+
+proc serveFastCgi(fake: FakeBackend; client: AsyncSocket) {.async.} =
+  try:
+    while true:
+      var pairs = ""
+      var keep = false
+      while true:
+        let header = await client.readExactly(8)
+        let length = (header[4].ord shl 8) or header[5].ord
+        let content = await client.readExactly(length + header[6].ord)
+        case header[1].ord
+        of 1: keep = (content[2].ord and 1) != 0
+        of 4: pairs.add(content[0 ..< length])
+        of 5:
+          if length == 0: break
+        else: discard
+      let response = await fake.answer(decodePairs(pairs))
+      # The header line arrives split over two records
+      await client.send(record(6, response[0 .. 5]) & record(6, response[6 .. ^1]) &
+                        record(7, "logged") & record(6, "") &
+                        record(3, "\0\0\0\0\0\0\0\0"))
+      if not keep or fake.hangUp:
+        break
+  except CatchableError:
+    discard
+  client.close()
+
+proc serveScgi(fake: FakeBackend; client: AsyncSocket) {.async.} =
+  try:
+    var length = ""
+    while true:
+      let c = await client.readExactly(1)
+      if c == ":": break
+      length.add(c)
+    let netstring = await client.readExactly(parseInt(length) + 1)
+    let fields = netstring[0 .. ^3].split('\0')
+    var params: Table[string, string]
+    for i in countup(0, fields.len - 2, 2):
+      params[fields[i]] = fields[i + 1]
+    let response = await fake.answer(params)
+    for c in response:
+      await client.send($c) # A byte at a time
+  except CatchableError:
+    discard
+  client.close()
+
+proc acceptLoop(fake: FakeBackend) {.async.} =
+  try:
+    while true:
+      let client = await fake.server.accept()
+      inc fake.accepted
+      if fake.scgi:
+        asyncCheck fake.serveScgi(client)
+      else:
+        asyncCheck fake.serveFastCgi(client)
+  except CatchableError:
+    discard
+
+proc newFakeBackend(name: string; scgi = false): FakeBackend =
+  let path = getTempDir() / ("obiwan_gateway_" & name & ".sock")
+  removeFile(path)
+  let server = newAsyncSocket(AF_UNIX, SOCK_STREAM, IPPROTO_IP, buffered = false)
+  server.bindUnix(path)
+  server.listen()
+  result = FakeBackend(server: server, path: path, scgi: scgi)
+  asyncCheck result.acceptLoop()
+
+proc collect(backend: Backend; pathInfo: string): Future[string] {.async.} =
+  var output = ""
+  proc sink(data: pointer; size: int) {.async.} =
+    let start = output.len
+    output.setLen(start + size)
+    copyMem(addr output[start], data, size)
+  await backend.query(@[("PATH_INFO", pathInfo)], sink)
+  return output
+
+suite "ObiWAN Gateway Tests":
+  test "Gateways serve their route and the paths below it":
+    let backend = newBackend("/nonexistent.sock")
+    let app = newGateway("/app/", backend)
+    let api = newGateway("/app/api", backend)
+    let gateways = [app, api]
+    check app.route == "/app"
+    check findGateway(gateways, "/app") == app
+    check findGateway(gateways, "/app/page") == app
+    check findGateway(gateways, "/app/api/v1") == api
+    check findGateway(gateways, "/app/apis") == app
+    check findGateway(gateways, "/apple").isNil
+    check findGateway(gateways, "/").isNil
+    check findGateway([newGateway("/", backend)], "/anything").route == ""
+    expect ValueError:
+      discard newGateway("app", backend)
+
+  test "Gateways route on the normalized path":
+    let backend = newBackend("/nonexistent.sock")
+    let gateways = [newGateway("/app", backend)]
+    check gatewayPath("/app/page") == "/app/page"
+    check gatewayPath("/app/dir/") == "/app/dir/"
+    check gatewayPath("/") == "/"
+    check gatewayPath("/app/../secret") == "/secret"
+    check gatewayPath("/app/%2e%2e/x") == "/x"
+    check gatewayPath("//app") == "/app"
+    check gatewayPath("/app/a%20b") == "/app/a b"
+    check gatewayPath("/../x") == ""
+    check findGateway(gateways, gatewayPath("/app/../secret")).isNil
+    check findGateway(gateways, gatewayPath("/app/%2e%2e/x")).isNil
+    check findGateway(gateways, gatewayPath("//app")) == gateways[0]
+
+  test "SCGI encoding":
+    let message = encodeScgi([("SCRIPT_NAME", "/app"), ("QUERY_STRING", "")])
+    let colon = message.find(':')
+    check message.endsWith(",")
+    check parseInt(message[0 ..< colon]) == message.len - colon - 2
+    check message[colon + 1 .. ^2].split('\0') ==
+      @["CONTENT_LENGTH", "0", "SCGI", "1", "SCRIPT_NAME", "/app", "QUERY_STRING", "", ""]
+
+  test "FastCGI encoding":
+    let long = 'x'.repeat(300)
+    let message = encodeFastCgi([("PATH_INFO", "/a"), ("LONG", long)])
+    # BEGIN_REQUEST as a responder keeping the connection
+    check message[1].ord == 1
+    check message[9].ord == 1 # Role
+    check message[10].ord == 1 # FCGI_KEEP_CONN
+    # PARAMS, the empty PARAMS, the empty STDIN
+    var offset = 16
+    var pairs = ""
+    var kinds: seq[int]
+    while offset < message.len:
+      let length = (message[offset + 4].ord shl 8) or message[offset + 5].ord
+      kinds.add(message[offset + 1].ord)
+      if message[offset + 1].ord == 4:
+        pairs.add(message[offset + 8 ..< offset + 8 + length])
+      offset += 8 + length
+    check offset == message.len
+    check kinds == @[4, 4, 5]
+    let params = decodePairs(pairs)
+    check params["PATH_INFO"] == "/a"
+    check params["LONG"] == long
+    check encodeFastCgi([], keepConnection = false)[10].ord == 0
+
+  test "Response headers":
+    check headerStatus("20 text/gemini") == 20
+    check headerStatus("51 Not found") == 51
+    check headerStatus("20") == 20
+    check headerStatus("2") == -1
+    check headerStatus("200 OK") == -1
+    check headerStatus("HTTP/1.1 200 OK") == -1
+    check headerStatus("70 Out of range") == -1
+    check headerStatus("20 " & 'x'.repeat(1100)) == -1
+
+  test "SCGI requests":
+    let fake = newFakeBackend("scgi", scgi = true)
+    let backend = newBackend(fake.path, gpScgi)
+    check waitFor(backend.collect("/one")) == "20 text/gemini\r\npath=/one"
+    check waitFor(backend.collect("/two")) == "20 text/gemini\r\npath=/two"
+    check fake.accepted == 2 # A connection each
+    check fake.params[0]["CONTENT_LENGTH"] == "0"
+    check fake.params[0]["SCGI"] == "1"
+    check backend.idleConnections == 0
+
+  test "FastCGI connections are kept and reused":
+    let fake = newFakeBackend("fastcgi")
+    let backend = newBackend(fake.path, gpFastCgi)
+    for i in 1 .. 3:
+      check waitFor(backend.collect("/" & $i)) == "20 text/gemini\r\npath=/" & $i
+    check fake.accepted == 1
+    check backend.connectionsOpened == 1
+    check backend.idleConnections == 1
+    backend.close()
+    check backend.idleConnections == 0
+
+  test "Connections the backend closed are replaced":
+    let fake = newFakeBackend("hangup")
+    fake.hangUp = true
+    let backend = newBackend(fake.path, gpFastCgi)
+    check waitFor(backend.collect("/first")) == "20 text/gemini\r\npath=/first"
+    waitFor sleepAsync(20) # Let the hang up arrive
+    check waitFor(backend.collect("/second")) == "20 text/gemini\r\npath=/second"
+    check fake.accepted == 2
+
+  test "Backends get at most maxConcurrency requests at once":
+    let fake = newFakeBackend("limit")
+    fake.delayMs = 30
+    let backend = newBackend(fake.path, gpFastCgi, maxConcurrency = 2)
+    var queries: seq[Future[string]]
+    for i in 1 .. 6:
+      queries.add(backend.collect("/" & $i))
+    let outputs = waitFor all(queries)
+    for i, output in outputs:
+      check output == "20 text/gemini\r\npath=/" & $(i + 1)
+    check fake.peak == 2
+    check fake.accepted == 2 # Waiting requests took over the kept connections
+
+  test "Requests waiting too long for a slot fail":
+    let fake = newFakeBackend("busy")
+    fake.delayMs = 150
+    let backend = newBackend(fake.path, gpFastCgi, maxConcurrency = 1, timeoutMs = 250)
+    let first = backend.collect("/1")
+    let second = backend.collect("/2")
+    let third = backend.collect("/3")
+    check waitFor(first) == "20 text/gemini\r\npath=/1"
+    check waitFor(second) == "20 text/gemini\r\npath=/2"
+    expect GatewayError:
+      discard waitFor third
+
+  test "Unreachable backends":
+    let backend = newBackend(getTempDir() / "obiwan_gateway_missing.sock")
+    expect GatewayError:
+      discard waitFor backend.collect("/")
@@ -0,0 +1,100 @@
+## Test for the obiwan/metrics.nim module
+##
+## Tests the counters, the latency histograms and their quantiles, and the
+## Prometheus text output.
+
+import std/unittest
+import std/times
+import std/monotimes
+import std/strutils
+import std/posix
+
+import ../src/obiwan/metrics
+import ../src/obiwan/tls/mbedtls
+
+proc sample(output, name: string): float =
+  ## Returns the value of the sample line starting with `name`
+  for line in output.splitLines():
+    if line.startsWith(name & " "):
+      return parseFloat(line[name.len + 1 .. ^1])
+  raise newException(KeyError, name & " not found")
+
+suite "ObiWAN Metrics Tests":
+  test "Nil metrics are ignored":
+    let metrics: Metrics = nil
+    metrics.connectionOpened()
+    metrics.observe(phHandshake, initDuration(milliseconds = 1))
+    metrics.requestServed(20, 10, 100)
+    check render(metrics) == ""
+
+  test "Counters":
+    let metrics = newMetrics()
+    defer: metrics.close()
+
+    metrics.connectionOpened()
+    metrics.connectionOpened()
+    metrics.connectionClosed(getMonoTime())
+    metrics.connectionRejected()
+    metrics.requestServed(20, 30, 1000)
+    metrics.requestServed(20, 30, 500)
+    metrics.requestServed(51, 20, 17)
+    metrics.handshakeFailed(hfClosed)
+
+    let output = render(metrics)
+    check output.sample("obiwan_connections_total") == 3
+    check output.sample("obiwan_connections_active") == 1
+    check output.sample("obiwan_connections_rejected_total") == 1
+    check output.sample("obiwan_requests_total{status=\"20\"}") == 2
+    check output.sample("obiwan_requests_total{status=\"51\"}") == 1
+    check output.sample("obiwan_received_bytes_total") == 80
+    check output.sample("obiwan_sent_bytes_total") == 1517
+    check output.sample("obiwan_handshake_failures_total{reason=\"closed\"}") == 1
+    check output.sample("obiwan_handshake_failures_total{reason=\"timeout\"}") == 0
+
+  test "Histogram buckets and quantiles":
+    let metrics = newMetrics()
+    defer: metrics.close()
+
+    # 1..1000 milliseconds, one observation each
+    for ms in 1 .. 1000:
+      metrics.observe(phHandler, initDuration(milliseconds = ms))
+
+    let output = render(metrics)
+    check output.sample("obiwan_phase_duration_seconds_count{phase=\"handler\"}") == 1000
+    check output.sample("obiwan_phase_duration_seconds_bucket{phase=\"handler\",le=\"+Inf\"}") == 1000
+    check abs(output.sample("obiwan_phase_duration_seconds_sum{phase=\"handler\"}") - 500.5) < 0.001
+
+    # Bucket counts are within the histogram's resolution of the exact ones
+    let under100ms = output.sample("obiwan_phase_duration_seconds_bucket{phase=\"handler\",le=\"0.1\"}")
+    check under100ms <= 100
+    check under100ms >= 85
+
+    # Quantiles are within about 12% of the exact values
+    let p50 = output.sample("obiwan_phase_quantile_seconds{phase=\"handler\",quantile=\"0.5\"}")
+    let p99 = output.sample("obiwan_phase_quantile_seconds{phase=\"handler\",quantile=\"0.99\"}")
+    check abs(p50 - 0.5) / 0.5 < 0.12
+    check abs(p99 - 0.99) / 0.99 < 0.12
+
+    # Other phases stay empty
+    check output.sample("obiwan_phase_duration_seconds_count{phase=\"handshake\"}") == 0
+
+  test "Counters are shared with forked processes":
+    let metrics = newMetrics()
+    defer: metrics.close()
+
+    let pid = fork()
+    if pid == 0:
+      for i in 0 ..< 100:
+        metrics.requestServed(20, 1, 1)
+      quit(QuitSuccess)
+    var status: cint
+    discard waitpid(pid, status, 0)
+
+    check render(metrics).sample("obiwan_requests_total{status=\"20\"}") == 100
+
+  test "Handshake failure reasons":
+    check handshakeFailureReason(MBEDTLS_ERR_SSL_TIMEOUT) == hfTimeout
+    # What a blocking socket reports once its receive timeout expired
+    check handshakeFailureReason(MBEDTLS_ERR_SSL_WANT_READ) == hfTimeout
+    check handshakeFailureReason(MBEDTLS_ERR_SSL_CONN_EOF) == hfClosed
+    check handshakeFailureReason(MBEDTLS_ERR_SSL_BAD_PROTOCOL_VERSION) == hfNegotiation
@@ -0,0 +1,133 @@
+## Test for the obiwan/pack.nim module
+##
+## Tests building content packs from a docroot, mapping them and resolving
+## requests against them without touching the docroot.
+
+import std/unittest
+import std/os
+import std/strutils
+
+when not defined(skipMbedTLS):
+  {.warning: "Setting skipMbedTLS to avoid linking issues in test".}
+  {.define: skipMbedTLS.}
+
+import ../src/obiwan/fs
+import ../src/obiwan/pack
+
+var tempDir: string
+var contentDir: string
+var packPath: string
+
+proc body(target: FileTarget): string =
+  ## Copies a packed body out of the mapping
+  result = newString(target.size.int)
+  if target.size > 0:
+    copyMem(addr result[0], target.data, target.size.int)
+
+suite "ObiWAN Content Pack Tests":
+  setup:
+    tempDir = getCurrentDir() / "test_pack_dir"
+    removeDir(tempDir)
+    createDir(tempDir)
+
+    contentDir = tempDir / "content"
+    createDir(contentDir)
+    writeFile(contentDir / "index.gmi", "# Packed Index\n")
+    writeFile(contentDir / "test.txt", "Plain text")
+    writeFile(contentDir / "empty.txt", "")
+    writeFile(contentDir / ".hidden", "secret")
+    createDir(contentDir / "subdir")
+    writeFile(contentDir / "subdir" / "index.gmi", "# Subdirectory Index\n")
+    createDir(contentDir / "listed")
+    writeFile(contentDir / "listed" / "photo.png", "\x89PNG")
+    packPath = tempDir / "content.pack"
+
+  teardown:
+    try:
+      removeDir(tempDir)
+    except:
+      echo "Warning: Failed to remove temporary directories"
+
+  test "Request paths are normalized":
+    check normalizeRequestPath("/") == "/"
+    check normalizeRequestPath("") == "/"
+    check normalizeRequestPath("/subdir/") == "/subdir"
+    check normalizeRequestPath("/a/./b/../c") == "/a/c"
+    check normalizeRequestPath("/%66ile.txt") == "/file.txt"
+    expect(FileSecurityError):
+      discard normalizeRequestPath("/../outside")
+
+  test "Building and serving a pack":
+    # Root, index.gmi, test.txt, empty.txt, two directories and their files
+    check buildPack(contentDir, packPath) == 8
+    check not fileExists(packPath & ".tmp")
+
+    let pack = openPack(packPath)
+    defer: pack.close()
+    check pack.len == 8
+
+    let file = resolvePackRequest(pack, "/test.txt")
+    check file.success
+    check file.mimeType == "text/plain"
+    check file.path == ""
+    check file.body == "Plain text"
+
+    let image = resolvePackRequest(pack, "/listed/photo.png")
+    check image.success
+    check image.mimeType == "image/png"
+    check image.body == "\x89PNG"
+
+    let empty = resolvePackRequest(pack, "/empty.txt")
+    check empty.success
+    check empty.size == 0
+    check not empty.data.isNil
+
+  test "Directories serve their index or listing":
+    discard buildPack(contentDir, packPath)
+    let pack = openPack(packPath)
+    defer: pack.close()
+
+    # A directory and its index.gmi share one body
+    let root = resolvePackRequest(pack, "/")
+    check root.success
+    check root.mimeType == "text/gemini"
+    check root.body == "# Packed Index\n"
+    check root.data == resolvePackRequest(pack, "/index.gmi").data
+    check resolvePackRequest(pack, "/subdir/").body == "# Subdirectory Index\n"
+
+    let listing = resolvePackRequest(pack, "/listed")
+    check listing.success
+    check listing.mimeType == "text/gemini"
+    check listing.body == generateDirectoryListing(contentDir / "listed", "/listed")
+
+  test "Missing, hidden and unsafe paths":
+    discard buildPack(contentDir, packPath)
+    let pack = openPack(packPath)
+    defer: pack.close()
+
+    check resolvePackRequest(pack, "/missing.gmi").errorMsg == "File not found"
+    check resolvePackRequest(pack, "/.hidden").errorMsg == "File not found"
+    check resolvePackRequest(pack, "/subdir/../../etc/passwd").errorMsg ==
+      "Security violation: Path traversal attempt"
+
+  test "The pack doesn't depend on the docroot":
+    discard buildPack(contentDir, packPath)
+    removeDir(contentDir)
+    let pack = openPack(packPath)
+    defer: pack.close()
+    check resolvePackRequest(pack, "/test.txt").body == "Plain text"
+
+  test "Invalid packs are rejected":
+    writeFile(packPath, "not a content pack at all")
+    expect(PackError):
+      discard openPack(packPath)
+
+    # A valid header whose tables run past the end of the file
+    discard buildPack(contentDir, packPath)
+    let data = readFile(packPath)
+    writeFile(packPath, data[0 ..< 40])
+    expect(PackError):
+      discard openPack(packPath)
+
+    expect(OSError):
+      discard openPack(tempDir / "missing.pack")
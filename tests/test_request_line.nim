@@ -0,0 +1,173 @@
+## Test for the request line parser of obiwan/url.nim
+##
+## Tests parseRequestLine() and normalizePath() on known request lines,
+## then fuzzes them: random lines must never crash the parser, and random
+## well-formed ones must come out the way parseUrl() and the path handling
+## they replaced (legacy_path.nim) would take them apart.
+
+import std/unittest
+import std/random
+import std/strutils
+
+import ../src/obiwan/url
+import legacy_path
+
+const Iterations = 20_000 ## Lines or paths per fuzz test
+
+proc parse(line: string; target: var RequestTarget): RequestLineStatus =
+  parseRequestLine(line, target)
+
+proc status(line: string): RequestLineStatus =
+  var target: RequestTarget
+  parseRequestLine(line, target)
+
+proc normalized(path: string): string =
+  if not normalizePath(path, result):
+    result = "<above root>"
+
+proc randomPick(rng: var Rand; parts: openArray[string]; count: int): string =
+  for _ in 0 ..< count:
+    result.add(rng.sample(parts))
+
+suite "Request Line Parser Tests":
+  test "Parts of valid request lines":
+    var target: RequestTarget
+    let line = "gemini://example.com:1966/docs/a%20b.gmi?q=1&r"
+    check parse(line, target) == rlValid
+    check line[target.host] == "example.com"
+    check line[target.portText] == "1966"
+    check target.port == 1966
+    check line[target.path] == "/docs/a%20b.gmi"
+    check target.hasQuery
+    check line[target.query] == "q=1&r"
+
+    # No port or path, and an empty query
+    let bare = "GEMINI://example.com?"
+    check parse(bare, target) == rlValid
+    check target.port == 1965
+    check target.portText.len == 0
+    check target.path.len == 0
+    check target.hasQuery
+    check target.query.len == 0
+
+    # IPv6 hosts keep their brackets, like parseUrl()
+    let ipv6 = "gemini://[2001:db8::1]:1965/"
+    check parse(ipv6, target) == rlValid
+    check ipv6[target.host] == "[2001:db8::1]"
+    check ipv6[target.path] == "/"
+    check not target.hasQuery
+
+    # An empty port means the default one
+    check parse("gemini://example.com:/", target) == rlValid
+    check target.port == 1965
+
+  test "Invalid request lines":
+    check status("http://example.com/") == rlNotGemini
+    check status("gopher://example.com:70/") == rlNotGemini
+    check status("") == rlMalformed
+    check status("/index.gmi") == rlMalformed
+    check status("example.com/") == rlMalformed
+    check status("gemini:/example.com/") == rlMalformed
+    check status("gemini:///path") == rlMalformed
+    check status("gemini://user@example.com/") == rlMalformed
+    check status("gemini://example.com/#top") == rlMalformed
+    check status("gemini://example.com/a b") == rlMalformed
+    check status("gemini://example.com/\tb") == rlMalformed
+    check status("gemini://example.com:0/") == rlMalformed
+    check status("gemini://example.com:65536/") == rlMalformed
+    check status("gemini://example.com:19x5/") == rlMalformed
+    check status("gemini://[::1/") == rlMalformed
+    check status("gemini://[]/") == rlMalformed
+    check status("gemini://[::1]x/") == rlMalformed
+
+  test "The length limit":
+    let path = "/" & 'a'.repeat(1024 - "gemini://h/".len)
+    check status("gemini://h" & path) == rlValid
+    check status("gemini://h" & path & "a") == rlTooLong
+    var target: RequestTarget
+    check parseRequestLine("gemini://h/abc", target, maxLength = 10) == rlTooLong
+
+  test "Urls built from request lines":
+    let line = "gemini://example.com:1966/search?query=test&page=1"
+    var target: RequestTarget
+    check parse(line, target) == rlValid
+    let url = target.toUrl(line)
+    check url.scheme == "gemini"
+    check url.hostname == "example.com"
+    check url.port == "1966"
+    check url.path == "/search"
+    check url.query["query"] == "test"
+    check url.query["page"] == "1"
+
+  test "Path normalization":
+    check normalized("") == "/"
+    check normalized("/") == "/"
+    check normalized("//a///b//") == "/a/b"
+    check normalized("/a/./b/../c") == "/a/c"
+    check normalized("/a/b/..") == "/a"
+    check normalized("/%66ile.txt") == "/file.txt"
+    check normalized("/a%2Fb") == "/a/b"
+    check normalized("/a/%2e%2E/b") == "/b"
+    check normalized("/100%") == "/100%"
+    check normalized("/%zz%4") == "/%zz%4"
+    check normalized("/..") == "<above root>"
+    check normalized("/a/../../b") == "<above root>"
+    check normalized("/%2e%2e/etc/passwd") == "<above root>"
+
+  test "Buffers are reused":
+    var buffer = newStringOfCap(64)
+    check normalizePath("/a/b/c.gmi", buffer)
+    let data = buffer[0].addr
+    check normalizePath("/other/../page.gmi", buffer)
+    check buffer == "/page.gmi"
+    check buffer[0].addr == data
+
+suite "Request Line Fuzz Tests":
+  test "Random lines never crash the parser":
+    var rng = initRand(1965)
+    var target: RequestTarget
+    for _ in 0 ..< Iterations:
+      var line = newString(rng.rand(40))
+      for c in line.mitems:
+        c = char(rng.rand(255))
+      if rng.rand(1) == 0:
+        line = "gemini://" & line
+      if parse(line, target) == rlValid:
+        check target.host.len > 0
+        check target.path.b < line.len
+        check target.query.b < line.len
+        discard target.toUrl(line)
+      var buffer: string
+      discard normalizePath(line, buffer)
+
+  test "Random URLs parse like parseUrl()":
+    var rng = initRand(42)
+    let hostParts = ["a", "z", "0", "9", "-", ".", "example", "com"]
+    let pathParts = ["/", "a", "b.gmi", "~", "_", "-"] # Decoding is tested below
+    let queryParts = ["q", "=", "&", "1", "x"]
+    var target: RequestTarget
+    for _ in 0 ..< Iterations:
+      var line = "gemini://" & rng.randomPick(hostParts, 1 + rng.rand(4))
+      if rng.rand(2) == 0:
+        line.add(":" & $rng.rand(1 .. 65535))
+      line.add("/" & rng.randomPick(pathParts, rng.rand(8)))
+      if rng.rand(2) == 0:
+        line.add("?" & rng.randomPick(queryParts, rng.rand(6)))
+
+      check parse(line, target) == rlValid
+      let expected = parseUrl(line)
+      let url = target.toUrl(line)
+      check url.hostname == expected.hostname
+      check url.port == expected.port
+      check url.path == expected.path
+      check $url.query == $expected.query
+
+  test "Random paths normalize like sanitizePath() did":
+    var rng = initRand(7)
+    let parts = ["/", "//", ".", "..", "a", "bc", "%2F", "%2e", "%2E%2e",
+                 "%41", "%c3%a9", "~", "-"]
+    for _ in 0 ..< Iterations:
+      let path = rng.randomPick(parts, rng.rand(10))
+      let expected = try: legacyNormalize(path)
+                     except ValueError: "<above root>"
+      check normalized(path) == expected
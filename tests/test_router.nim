@@ -0,0 +1,91 @@
+## Test for the obiwan/router.nim module
+##
+## Tests matchers built by the router macro: exact and prefix routes, which
+## of several overlapping routes wins, and certificate requirements.
+
+import std/unittest
+
+import ../src/obiwan/common
+import ../src/obiwan/router
+
+type
+  Endpoint = enum
+    epNone, epRoot, epAuth, epApi, epApiUsers, epApiStatus, epDocs
+
+router matchEndpoint, Endpoint:
+  exact "/", epRoot
+  exact "/auth", epAuth, certAccepted
+  prefix "/api/", epApi, certPresent
+  prefix "/api/users/", epApiUsers, certAccepted
+  exact "/api/status", epApiStatus
+  prefix "/docs", epDocs
+
+type TestRequest = RequestBase[int]
+
+proc withCertificate(verification: int): TestRequest =
+  TestRequest(certificate: cast[X509Certificate](1), verification: verification)
+
+suite "ObiWAN Router Tests":
+  test "Exact routes":
+    let root = matchEndpoint("/")
+    check root.found
+    check root.endpoint == epRoot
+    check root.certificate == certNone
+    check root.rest == 1
+
+    let auth = matchEndpoint("/auth")
+    check auth.found
+    check auth.endpoint == epAuth
+    check auth.certificate == certAccepted
+
+    # Exact routes match nothing longer or shorter
+    check not matchEndpoint("/auth/").found
+    check not matchEndpoint("/aut").found
+    check not matchEndpoint("").found
+
+  test "Prefix routes":
+    let api = matchEndpoint("/api/v1/items")
+    check api.found
+    check api.endpoint == epApi
+    check api.certificate == certPresent
+    check "/api/v1/items"[api.rest .. ^1] == "v1/items"
+    check matchEndpoint("/api/").endpoint == epApi
+    check not matchEndpoint("/api").found
+
+    # Prefixes need not end at a slash
+    check matchEndpoint("/docs").endpoint == epDocs
+    check matchEndpoint("/docs.gmi").endpoint == epDocs
+
+  test "The most specific route wins":
+    let users = matchEndpoint("/api/users/42")
+    check users.endpoint == epApiUsers
+    check users.certificate == certAccepted
+    check "/api/users/42"[users.rest .. ^1] == "42"
+
+    # An exact route over the prefix it's in, and that prefix around it
+    check matchEndpoint("/api/status").endpoint == epApiStatus
+    check matchEndpoint("/api/status/").endpoint == epApi
+    check matchEndpoint("/api/users").endpoint == epApi
+
+  test "Unmatched paths":
+    let missing = matchEndpoint("/index.gmi")
+    check not missing.found
+    check missing.certificate == certNone
+
+  test "Certificate requirements":
+    let anonymous = TestRequest()
+    let trusted = withCertificate(0)
+    let selfSigned = withCertificate(1) # Only MBEDTLS_X509_BADCERT_NOT_TRUSTED
+    let expired = withCertificate(1 or 2)
+
+    check anonymous.checkCertificate(certNone) == Success
+    check anonymous.checkCertificate(certPresent) == CertificateRequired
+    check anonymous.checkCertificate(certAccepted) == CertificateRequired
+
+    check expired.checkCertificate(certPresent) == Success
+    check expired.checkCertificate(certAccepted) == CertificateNotValid
+    check trusted.checkCertificate(certAccepted) == Success
+    check selfSigned.checkCertificate(certAccepted) == Success
+
+    check certificateMeta(CertificateRequired) == "CLIENT CERTIFICATE REQUIRED"
+    check certificateMeta(CertificateNotValid) == "CERTIFICATE NOT VALID"
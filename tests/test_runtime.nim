@@ -0,0 +1,138 @@
+## Test for the obiwan/tls/runtime.nim module
+##
+## Tests the per-thread random number generators, including reseeding in
+## forked processes, the shared identity cache, TLS record sizing, the
+## cipher suite order and session pooling.
+
+import std/unittest
+import std/os
+import std/posix
+
+import ../src/obiwan/tls/runtime
+import ../src/obiwan/tls/socket
+
+const
+  ServerCertFile = "tests/certs/server/cert.pem"
+  ServerKeyFile = "tests/certs/server/key.pem"
+
+proc randomBlock(): array[32, byte] =
+  ## Draws 32 bytes from the calling thread's DRBG
+  doAssert threadRandom(nil, addr result[0], result.len.csize_t) == 0
+
+suite "ObiWAN Crypto Runtime Tests":
+  test "Random blocks differ":
+    check randomBlock() != randomBlock()
+
+  test "Forked processes don't repeat the parent's random stream":
+    discard randomBlock() # Seed the DRBG before forking
+    var fds: array[2, cint]
+    check pipe(fds) == 0
+
+    let pid = fork()
+    if pid == 0:
+      var child = randomBlock()
+      discard write(fds[1], addr child[0], child.len)
+      quit(QuitSuccess)
+    var fromChild: array[32, byte]
+    check read(fds[0], addr fromChild[0], fromChild.len) == fromChild.len
+    var status: cint
+    discard waitpid(pid, status, 0)
+    discard close(fds[0])
+    discard close(fds[1])
+
+    check fromChild != randomBlock()
+
+  test "Crypto stays initialized once every context is gone":
+    block:
+      let context = newContext(isServer = true)
+      context.useIdentity(ServerCertFile, ServerKeyFile)
+    # The identity parsed for the freed context still works in a new one
+    let context = newContext(isServer = true)
+    context.useIdentity(ServerCertFile, ServerKeyFile)
+    check randomBlock() != randomBlock()
+
+  test "Identities are parsed once":
+    let first = loadIdentity(ServerCertFile, ServerKeyFile)
+    check not first.identity.isNil
+    check loadIdentity(ServerCertFile, ServerKeyFile).identity == first.identity
+
+  test "Identities are parsed again when their files change":
+    let certFile = getTempDir() / "obiwan_identity_cert.pem"
+    let keyFile = getTempDir() / "obiwan_identity_key.pem"
+    defer:
+      removeFile(certFile)
+      removeFile(keyFile)
+    copyFile(ServerCertFile, certFile)
+    copyFile(ServerKeyFile, keyFile)
+    let first = loadIdentity(certFile, keyFile)
+    # Rewritten within the same second, with the same size
+    os.sleep(20)
+    writeFile(certFile, readFile(ServerCertFile))
+    let second = loadIdentity(certFile, keyFile)
+    check second.identity != first.identity
+
+  test "Missing identity files raise MbedtlsError":
+    expect MbedtlsError:
+      discard loadIdentity("tests/certs/missing.pem", ServerKeyFile)
+
+  test "Adaptive records grow once a transfer is bulk":
+    # Every build allows full 16KB records, it's the size connections pick
+    # that changes
+    check recordLimit(0, 0) == AdaptiveRecordSize
+    check recordLimit(0, AdaptiveRampBytes - 1) == AdaptiveRecordSize
+    check recordLimit(0, AdaptiveRampBytes) == MaxRecordSize
+    check recordLimit(4096, 0) == 4096
+    check recordLimit(4096, 10 * AdaptiveRampBytes) == 4096
+
+  test "Record sizes are validated":
+    let client = newContext()
+    client.setRecordSize(1000)
+    check client.recordSize == 1000
+    client.setRecordSize(0)
+    check client.recordSize == 0
+
+    let server = newContext(isServer = true)
+    server.setRecordSize(MaxRecordSize)
+    check server.recordSize == MaxRecordSize
+    expect MbedtlsError:
+      server.setRecordSize(MinRecordSize - 1)
+    expect MbedtlsError:
+      server.setRecordSize(MaxRecordSize + 1)
+
+  test "Cipher suite lists":
+    check parseCipherSuites("auto") == defaultCipherSuites()
+    check parseCipherSuites("") == defaultCipherSuites()
+    check parseCipherSuites(" ChaCha20-Poly1305, aes128-gcm,aes128-gcm") ==
+          @[csChaCha20, csAes128Gcm]
+    expect ValueError:
+      discard parseCipherSuites("rc4")
+
+    if hasHardwareAes():
+      check defaultCipherSuites()[0] == csAes128Gcm
+    else:
+      check defaultCipherSuites()[0] == csChaCha20
+
+  test "Only suites the build supports are offered":
+    let context = newContext()
+    context.setCipherSuites([csAes256Gcm, csChaCha20])
+    check context.cipherSuites.len > 0
+    for suite in context.cipherSuites:
+      check suite.isAvailable
+    check csChaCha20 in context.cipherSuites
+
+  test "Sessions are pooled and reused":
+    let context = newContext(isServer = true)
+    context.poolSize = 1
+    let first = context.acquireSession()
+    let second = context.acquireSession()
+    check first != second
+
+    # One fits the pool, the other is freed
+    context.releaseSession(first)
+    context.releaseSession(second)
+    check context.acquireSession() == first
+    check context.acquireSession() notin [first, second]
+
+    context.poolSize = 0
+    context.releaseSession(first)
+    check context.acquireSession() != first
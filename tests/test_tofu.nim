@@ -0,0 +1,123 @@
+## Test for the obiwan/tofu.nim module
+##
+## Tests trusting, checking and forgetting fingerprints, replaying the log
+## when a store is reopened, compaction, and lookups in a large store.
+
+import std/unittest
+import std/os
+import std/strutils
+import std/monotimes
+import std/times
+
+import ../src/obiwan/tofu
+
+var tempDir: string
+var path: string
+
+proc fakeFingerprint(i: int): string =
+  ## A fingerprint shaped like tls/socket.fingerprint() returns them
+  let hex = toHex(i, 64).toLowerAscii()
+  for j in countup(0, 62, 2):
+    if j > 0:
+      result.add(':')
+    result.add(hex[j .. j + 1])
+
+suite "ObiWAN TOFU Store Tests":
+  setup:
+    tempDir = getCurrentDir() / "test_tofu_dir"
+    removeDir(tempDir)
+    path = tempDir / "known" / "hosts"
+
+  teardown:
+    removeDir(tempDir)
+
+  test "Trust on first use":
+    let known = openKnownHosts(path)
+    let key = hostKey("Example.COM", 1965)
+    check key == "example.com:1965"
+    check known.check(key, fakeFingerprint(1)) == trustNew
+    check known.len == 0 # check() changes nothing
+
+    check known.checkOrTrust(key, fakeFingerprint(1)) == trustNew
+    check known.checkOrTrust(key, fakeFingerprint(1)) == trustKnown
+    check known.checkOrTrust(key, fakeFingerprint(2)) == trustChanged
+    check known.lookup(key) == fakeFingerprint(1) # A change isn't trusted by itself
+
+    known.trust(key, fakeFingerprint(2))
+    check known.check(key, fakeFingerprint(2)) == trustKnown
+    check known.owner(fakeFingerprint(2)) == key
+    check known.owner(fakeFingerprint(1)) == ""
+    check known.len == 1
+    known.close()
+
+  test "Invalid entries":
+    let known = openKnownHosts(path)
+    expect ValueError:
+      known.trust("", fakeFingerprint(1))
+    expect ValueError:
+      known.trust("two words", fakeFingerprint(1))
+    expect ValueError:
+      discard known.checkOrTrust("host:1965", "-")
+    check known.len == 0
+    known.close()
+
+  test "The log is replayed on open":
+    var known = openKnownHosts(path)
+    known.trust("a:1965", fakeFingerprint(1))
+    known.trust("b:1965", fakeFingerprint(2))
+    known.trust("a:1965", fakeFingerprint(3))
+    known.trust("alice", fakeFingerprint(4))
+    known.forget("b:1965")
+    known.close()
+    check readFile(path).countLines() == 6 # Five lines and the final newline
+
+    known = openKnownHosts(path)
+    check known.len == 2
+    check known.lookup("a:1965") == fakeFingerprint(3)
+    check known.lookup("b:1965") == ""
+    check known.owner(fakeFingerprint(4)) == "alice"
+    known.close()
+
+  test "Comments and broken lines are skipped":
+    createDir(parentDir(path))
+    writeFile(path, "# Known hosts\n\na:1965 " & fakeFingerprint(1) &
+              "\nbroken\nb:1965 " & fakeFingerprint(2) & " extra\n")
+    let known = openKnownHosts(path)
+    check known.len == 1
+    check known.lookup("a:1965") == fakeFingerprint(1)
+    known.close()
+
+  test "Compaction keeps only current entries":
+    let known = openKnownHosts(path)
+    for i in 1 .. 10:
+      known.trust("host:1965", fakeFingerprint(i))
+    known.trust("other:1965", fakeFingerprint(42))
+    known.compact()
+    check readFile(path).strip().splitLines().len == 2
+    known.trust("third:1965", fakeFingerprint(43)) # Still appends after compacting
+    known.close()
+
+    let reopened = openKnownHosts(path)
+    check reopened.len == 3
+    check reopened.lookup("host:1965") == fakeFingerprint(10)
+    reopened.close()
+
+  test "Large stores":
+    const Entries = 200_000
+    var known = openKnownHosts(path)
+    for i in 0 ..< Entries:
+      known.trust("host" & $i & ":1965", fakeFingerprint(i))
+    known.close()
+
+    let start = getMonoTime()
+    known = openKnownHosts(path)
+    let loaded = getMonoTime() - start
+    check known.len == Entries
+
+    let lookups = getMonoTime()
+    for i in 0 ..< Entries:
+      check known.check("host" & $i & ":1965", fakeFingerprint(i)) == trustKnown
+    let perLookup = (getMonoTime() - lookups).inNanoseconds div Entries
+    echo "  Loaded ", Entries, " entries in ", loaded.inMilliseconds, " ms, ",
+         perLookup, " ns per check"
+    known.close()
@@ -0,0 +1,143 @@
+## Test for the obiwan/upgrade.nim module and certificate reloads
+##
+## Tests taking over a handover from the environment and the secret pipe,
+## the readiness pipe, shared listeners, switching a server to new
+## certificates, and serving on an adopted listener until stopAccepting()
+## drains it, with the access log written out once it's closed.
+
+import std/unittest
+import std/asyncdispatch
+import std/os
+import std/posix
+import std/nativesockets
+import std/strutils
+
+import ../src/obiwan
+import ../src/obiwan/upgrade
+
+const
+  TestPort = 1968 # Use non-standard port for testing
+  AccessLogPath = "test_upgrade_access.log"
+
+let
+  TestCertFile = if existsEnv("SERVER_CERT_FILE"): getEnv(
+      "SERVER_CERT_FILE") else: "tests/certs/server/cert.pem"
+  TestKeyFile = if existsEnv("SERVER_KEY_FILE"): getEnv(
+      "SERVER_KEY_FILE") else: "tests/certs/server/key.pem"
+
+proc localPort(fd: cint): int =
+  ## The port a listening socket is bound to
+  getLocalAddr(SocketHandle(fd), Domain.AF_INET)[1].int
+
+proc handleRequest(request: AsyncRequest) {.async.} =
+  await request.respond(Success, "text/gemini", "# Handed over")
+
+suite "ObiWAN Upgrade Tests":
+  teardown:
+    delEnv(ListenFdsVar)
+    delEnv(ReadyFdVar)
+    delEnv(SecretFdVar)
+
+  test "Processes started normally inherit nothing":
+    var handover = takeHandover()
+    check handover.listeners.len == 0
+    check handover.sessionSecret == ""
+    handover.notifyReady() # Nothing to notify
+
+  test "Handover from the environment":
+    let first = bindListener(0, "127.0.0.1")
+    let second = bindListener(0, "127.0.0.1")
+    var secretFds: array[2, cint]
+    check pipe(secretFds) == 0
+    var secret = "secret"
+    check posix.write(secretFds[1], addr secret[0], secret.len) == secret.len
+    discard posix.close(secretFds[1])
+    putEnv(ListenFdsVar, $first & "," & $second)
+    putEnv(SecretFdVar, $secretFds[0])
+    let handover = takeHandover()
+    check handover.listeners == @[first, second]
+    check handover.sessionSecret == "secret"
+    check fcntl(secretFds[0], F_GETFD) < 0 # Read and closed
+    check getEnv(ListenFdsVar) == "" # Not passed on to other processes
+    check getEnv(SecretFdVar) == ""
+    check (fcntl(first, F_GETFD) and FD_CLOEXEC) != 0
+    discard posix.close(first)
+    discard posix.close(second)
+
+    putEnv(ListenFdsVar, "not a descriptor")
+    expect ValueError:
+      discard takeHandover()
+    putEnv(ListenFdsVar, "100000")
+    expect ValueError:
+      discard takeHandover()
+
+  test "Readiness is reported through the pipe":
+    var fds: array[2, cint]
+    check pipe(fds) == 0
+    putEnv(ReadyFdVar, $fds[1])
+    var handover = takeHandover()
+    handover.notifyReady()
+    handover.notifyReady() # Only once
+    var marker: char
+    check posix.read(fds[0], addr marker, 1) == 1
+    check posix.read(fds[0], addr marker, 1) == 0 # Write end closed
+    discard posix.close(fds[0])
+
+  test "Listeners share a port with SO_REUSEPORT":
+    let first = bindListener(0, "127.0.0.1", reusePort = true)
+    let port = localPort(first)
+    check port > 0
+    let second = bindListener(port, "127.0.0.1", reusePort = true)
+    check localPort(second) == port
+    expect OSError:
+      discard bindListener(port, "127.0.0.1")
+    discard posix.close(first)
+    discard posix.close(second)
+
+  test "Certificate reloads keep the context settings":
+    let server = newAsyncObiwanServer(certFile = TestCertFile, keyFile = TestKeyFile,
+                                      sessionId = "secret")
+    server.recordSize = 4096
+    server.cipherSuites = [csAes128Gcm]
+    let before = MbedtlsSslContext(server.sslContext)
+    server.reloadCertificates(TestCertFile, TestKeyFile)
+    check MbedtlsSslContext(server.sslContext) != before
+    check server.recordSize == 4096
+    check server.cipherSuites == @[csAes128Gcm]
+
+    let current = server.sslContext
+    expect ObiwanError:
+      server.reloadCertificates("missing-cert.pem", "missing-key.pem")
+    check server.sslContext == current # Still serving with the current one
+
+  test "Serving on an adopted listener until drained":
+    let server = newAsyncObiwanServer(certFile = TestCertFile, keyFile = TestKeyFile)
+    server.accessLog = newAccessLog(AccessLogPath, timestamps = false)
+    server.listenFd = bindListener(TestPort, "127.0.0.1")
+    server.drainTimeoutMs = 5000
+    let serving = server.serve(0, handleRequest)
+    check not serving.finished
+
+    proc fetch() {.async.} =
+      let client = newAsyncObiwanClient()
+      let response = await client.request("gemini://127.0.0.1:" & $TestPort & "/")
+      check response.status == Success
+      check (await response.body) == "# Handed over"
+      client.close()
+
+    # Connections accepted before and after a certificate reload
+    waitFor fetch()
+    server.reloadCertificates(TestCertFile, TestKeyFile)
+    waitFor fetch()
+
+    server.stopAccepting()
+    waitFor serving
+    check server.listenFd == -1
+    check server.connections == 0
+
+    # Closing the log writes out what the drained requests left buffered
+    server.accessLog.close()
+    let entries = readFile(AccessLogPath).strip().splitLines()
+    removeFile(AccessLogPath)
+    check entries.len == 2
+    check entries[1].startsWith("peer=127.0.0.1 status=20 ")
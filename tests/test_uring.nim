@@ -0,0 +1,86 @@
+## Test for the obiwan/tls/uring.nim module
+##
+## Checks that the io_uring backend moves data between mbedTLS's callbacks
+## and a socket, or reports itself unavailable so the server falls back to
+## asyncdispatch. Build with OBIWAN_URING=1 to test the backend itself.
+
+import std/unittest
+import asyncdispatch
+import posix
+
+import ../src/obiwan/tls/mbedtls as mbedtls
+import ../src/obiwan/tls/uring
+
+suite "io_uring Backend Tests":
+  test "No ring without the backend":
+    when not UringSupported:
+      check threadRing().isNil
+    else:
+      skip()
+
+  when UringSupported:
+    test "Records pass through the ring":
+      let ring = threadRing()
+      if ring.isNil:
+        skip() # The kernel or sandbox doesn't allow io_uring
+      else:
+        var fds: array[2, cint]
+        check socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0
+        let conn = ring.newConn(fds[0])
+        defer:
+          conn.close()
+          discard posix.close(fds[1])
+
+        # Sends are queued, and reach the peer once the ring has run
+        var message = "hello ring"
+        check bioSend(cast[pointer](conn), addr message[0], message.len.uint) ==
+          message.len.cint
+        check conn.pendingOutput == message.len
+        waitFor conn.drain()
+        check conn.pendingOutput == 0
+        var received = newString(32)
+        check posix.read(fds[1], addr received[0], received.len) == message.len
+
+        # Reads ask for more first, then return what the recv brought in
+        var reply = "reply"
+        var buffer = newString(32)
+        check bioRecv(cast[pointer](conn), addr buffer[0], buffer.len.uint) ==
+          mbedtls.MBEDTLS_ERR_SSL_WANT_READ
+        check posix.write(fds[1], addr reply[0], reply.len) == reply.len
+        waitFor conn.waitReadable()
+        check bioRecv(cast[pointer](conn), addr buffer[0], 2) == 2
+        check bioRecv(cast[pointer](conn), addr buffer[2], buffer.len.uint - 2) == 3
+        buffer.setLen(5)
+        check buffer == reply
+
+    test "Closing after the peer hung up":
+      let ring = threadRing()
+      if ring.isNil:
+        skip()
+      else:
+        var fds: array[2, cint]
+        check socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0
+        let conn = ring.newConn(fds[0])
+        discard posix.close(fds[1])
+        var buffer = newString(16)
+        discard bioRecv(cast[pointer](conn), addr buffer[0], buffer.len.uint)
+        waitFor conn.waitReadable()
+        check bioRecv(cast[pointer](conn), addr buffer[0], buffer.len.uint) == 0
+        conn.close()
+
+    test "Waits pending when the connection closes fail":
+      let ring = threadRing()
+      if ring.isNil:
+        skip()
+      else:
+        var fds: array[2, cint]
+        check socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0
+        let conn = ring.newConn(fds[0])
+        var buffer = newString(16)
+        check bioRecv(cast[pointer](conn), addr buffer[0], buffer.len.uint) ==
+          mbedtls.MBEDTLS_ERR_SSL_WANT_READ
+        let waiting = conn.waitReadable()
+        check not waiting.finished
+        conn.close() # Nothing buffered, so it closes right away
+        check waiting.failed
+        discard posix.close(fds[1])